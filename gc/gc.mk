@@ -8,8 +8,13 @@
 
 
 LIBGC_SOURCES := \
-	gc_lock.cc 
+	gc_lock.cc \
+	gc_reclaimer.cc \
+	scalable_gc_lock.cc \
+	shared_rcu_table.cc
 
-$(eval $(call library,gc,$(LIBGC_SOURCES),arch utils urcu))
+$(eval $(call library,gc,$(LIBGC_SOURCES),arch utils urcu cityhash))
+
+$(eval $(call program,gc_bench,gc jsoncpp boost_program_options boost_system))
 
 $(eval $(call include_sub_make,gc_testing,testing,gc_testing.mk))
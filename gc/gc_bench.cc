@@ -0,0 +1,389 @@
+/* gc_bench.cc
+   Copyright (c) 2015 Datacratic Inc.  All rights reserved.
+
+   Contention and throughput benchmark for the GcLock variants.
+
+   Sweeps thread counts, read/write mixes and critical section lengths and
+   prints, as JSON, the throughput and latency percentiles of each operation
+   along with the rate at which epochs advance and how the deferred work
+   queue grows.
+*/
+
+#include "soa/gc/gc_lock.h"
+#include "soa/gc/scalable_gc_lock.h"
+#include "soa/jsoncpp/json.h"
+#include "jml/arch/tick_counter.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+#include "jml/utils/string_functions.h"
+#include <boost/program_options/cmdline.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <fstream>
+
+namespace po = boost::program_options;
+
+using namespace std;
+using namespace Datacratic;
+
+
+/*****************************************************************************/
+/* OPERATIONS                                                                */
+/*****************************************************************************/
+
+enum Op {
+    OP_SHARED,        ///< lockShared() / unlockShared()
+    OP_SPECULATIVE,   ///< lockSpeculative() / unlockSpeculative()
+    OP_EXCLUSIVE,     ///< lockExclusive() / unlockExclusive()
+    OP_DEFER,         ///< replace a published object and deferDelete it
+    NUM_OPS
+};
+
+static const char * opNames[NUM_OPS] = {
+    "shared", "speculative", "exclusive", "defer"
+};
+
+Op parseOp(const string & name)
+{
+    for (unsigned i = 0;  i < NUM_OPS;  ++i)
+        if (name == opNames[i]) return (Op)i;
+    throw ML::Exception("unknown operation '%s'", name.c_str());
+}
+
+/** Queue depth of the deferred work of each lock flavour. */
+size_t pendingDeferred(GcLock & lock)
+{
+    return lock.deferredQueueDepth();
+}
+
+size_t pendingDeferred(ScalableGcLock & lock)
+{
+    return lock.numPending();
+}
+
+
+/*****************************************************************************/
+/* BENCHMARK                                                                 */
+/*****************************************************************************/
+
+struct Config {
+    int numThreads;
+    double readRatio;     ///< Proportion of operations that are reads
+    Op readOp;            ///< OP_SHARED or OP_SPECULATIVE
+    Op writeOp;           ///< OP_EXCLUSIVE or OP_DEFER
+    int csLength;         ///< Iterations of busy work within the CS
+    double duration;      ///< Seconds to run each configuration for
+    int sampleEvery;      ///< Record the latency of one op out of this many
+
+    Json::Value toJson() const
+    {
+        Json::Value result;
+        result["threads"] = numThreads;
+        result["readRatio"] = readRatio;
+        result["readOp"] = opNames[readOp];
+        result["writeOp"] = opNames[writeOp];
+        result["csLength"] = csLength;
+        result["duration"] = duration;
+        return result;
+    }
+};
+
+/** Objects published by the writers and read by the readers. */
+enum { NUM_OBJECTS = 64 };
+
+struct ThreadResult {
+    ThreadResult()
+        : ops(NUM_OPS, 0), samples(NUM_OPS)
+    {
+    }
+
+    vector<uint64_t> ops;
+    vector<vector<uint64_t> > samples;  ///< latencies in ticks
+};
+
+Json::Value opStats(uint64_t ops, vector<uint64_t> & samples,
+                    double elapsed)
+{
+    Json::Value result;
+    result["count"] = (Json::UInt)ops;
+    result["opsPerSec"] = ops / elapsed;
+
+    if (samples.empty()) return result;
+
+    std::sort(samples.begin(), samples.end());
+
+    auto percentile = [&] (double p)
+        {
+            size_t i = std::min<size_t>(p * samples.size(), samples.size() - 1);
+            return samples[i] / ML::ticks_per_second * 1e9;
+        };
+
+    Json::Value & latency = result["latencyNs"];
+    latency["p50"] = percentile(0.5);
+    latency["p90"] = percentile(0.9);
+    latency["p99"] = percentile(0.99);
+    latency["p999"] = percentile(0.999);
+    latency["max"] = percentile(1.0);
+    latency["samples"] = (Json::UInt)samples.size();
+
+    return result;
+}
+
+template<typename Lock>
+Json::Value runConfig(const Config & config)
+{
+    Lock lock;
+
+    std::atomic<uint64_t *> objects[NUM_OBJECTS];
+    for (unsigned i = 0;  i < NUM_OBJECTS;  ++i)
+        objects[i] = new uint64_t(i);
+
+    std::atomic<bool> started(false), finished(false);
+    vector<ThreadResult> results(config.numThreads);
+
+    auto busyWork = [&] (uint64_t seed)
+        {
+            uint64_t sum = 0;
+            for (int i = 0;  i < config.csLength;  ++i)
+                sum += *objects[(seed + i) % NUM_OBJECTS].load();
+            return sum;
+        };
+
+    auto runThread = [&] (int threadNum)
+        {
+            ThreadResult & result = results[threadNum];
+            uint64_t rng = threadNum * 2654435761ULL + 1;
+            uint64_t sink = 0;
+            uint32_t readThreshold = config.readRatio * 0xFFFFFFFFULL;
+
+            lock.getEntry();
+            while (!started) ;
+
+            for (uint64_t n = 0;  !finished;  ++n) {
+                rng = rng * 6364136223846793005ULL + 1442695040888963407ULL;
+                uint32_t r = rng >> 32;
+                Op op = r <= readThreshold ? config.readOp : config.writeOp;
+
+                bool sample = n % config.sampleEvery == 0;
+                uint64_t before = sample ? ML::ticks() : 0;
+
+                switch (op) {
+                case OP_SHARED: {
+                    typename Lock::SharedGuard guard(lock);
+                    sink += busyWork(r);
+                    break;
+                }
+                case OP_SPECULATIVE: {
+                    typename Lock::SpeculativeGuard guard(lock);
+                    sink += busyWork(r);
+                    break;
+                }
+                case OP_EXCLUSIVE: {
+                    // Can't go exclusive from within a speculative section
+                    lock.forceUnlock();
+                    typename Lock::ExclusiveGuard guard(lock);
+                    sink += busyWork(r);
+                    break;
+                }
+                case OP_DEFER: {
+                    uint64_t * newObject = new uint64_t(r);
+                    uint64_t * oldObject
+                        = objects[r % NUM_OBJECTS].exchange(newObject);
+                    lock.deferDelete(oldObject);
+                    break;
+                }
+                default:
+                    throw ML::Exception("invalid op");
+                }
+
+                if (sample)
+                    result.samples[op].push_back(ML::ticks() - before);
+                ++result.ops[op];
+            }
+
+            lock.forceUnlock();
+
+            // Make sure that the compiler can't optimize the work away
+            if (sink == 1) cerr << "";
+        };
+
+    vector<thread> threads;
+    for (unsigned i = 0;  i < config.numThreads;  ++i)
+        threads.emplace_back(runThread, i);
+
+    // Monitor the epoch and the deferred queue while the threads run
+    uint64_t startEpoch = lock.currentEpoch();
+    size_t startPending = pendingDeferred(lock);
+    size_t maxPending = startPending;
+
+    ML::Timer timer;
+    started = true;
+
+    while (timer.elapsed_wall() < config.duration) {
+        ::usleep(10000);
+        maxPending = std::max(maxPending, pendingDeferred(lock));
+    }
+
+    finished = true;
+    double elapsed = timer.elapsed_wall();
+
+    for (auto & t: threads)
+        t.join();
+
+    uint64_t endEpoch = lock.currentEpoch();
+    size_t endPending = pendingDeferred(lock);
+
+    Json::Value result = config.toJson();
+
+    for (unsigned op = 0;  op < NUM_OPS;  ++op) {
+        uint64_t ops = 0;
+        vector<uint64_t> samples;
+        for (auto & r: results) {
+            ops += r.ops[op];
+            samples.insert(samples.end(),
+                           r.samples[op].begin(), r.samples[op].end());
+        }
+        if (ops)
+            result["ops"][opNames[op]] = opStats(ops, samples, elapsed);
+    }
+
+    // Epochs can wrap around for GcLock; the difference is still right.
+    uint32_t epochs = endEpoch - startEpoch;
+    result["epochsPerSec"] = epochs / elapsed;
+
+    Json::Value & deferred = result["deferredQueue"];
+    deferred["start"] = (Json::UInt)startPending;
+    deferred["end"] = (Json::UInt)endPending;
+    deferred["max"] = (Json::UInt)maxPending;
+    deferred["growthPerSec"]
+        = ((double)endPending - (double)startPending) / elapsed;
+
+    lock.deferBarrier();
+    for (unsigned i = 0;  i < NUM_OBJECTS;  ++i)
+        delete objects[i].load();
+
+    return result;
+}
+
+template<typename T>
+vector<T> parseList(const string & str, T (*parse) (const string &))
+{
+    vector<T> result;
+    for (const string & s: ML::split(str, ','))
+        result.push_back(parse(s));
+    return result;
+}
+
+int parseInt(const string & s) { return std::stoi(s); }
+double parseDouble(const string & s) { return std::stod(s); }
+string parseString(const string & s) { return s; }
+
+int main(int argc, char ** argv)
+{
+    string locks = "gclock,scalable";
+    string threads = "1,2,4,8";
+    string readRatios = "1.0,0.99,0.9";
+    string readOps = "shared,speculative";
+    string writeOps = "defer,exclusive";
+    string csLengths = "0,16,256";
+    double duration = 1.0;
+    int sampleEvery = 16;
+    string outputFile;
+
+    po::options_description desc("Main options");
+    desc.add_options()
+        ("locks,l", po::value(&locks),
+         "Lock types to benchmark (gclock, scalable)")
+        ("threads,t", po::value(&threads),
+         "Comma separated list of thread counts")
+        ("read-ratios,r", po::value(&readRatios),
+         "Comma separated list of proportions of read operations")
+        ("read-ops", po::value(&readOps),
+         "Read operations to use (shared, speculative)")
+        ("write-ops", po::value(&writeOps),
+         "Write operations to use (defer, exclusive)")
+        ("cs-lengths,c", po::value(&csLengths),
+         "Comma separated list of critical section lengths")
+        ("duration,d", po::value(&duration),
+         "Seconds to run each configuration for")
+        ("sample-every", po::value(&sampleEvery),
+         "Record the latency of one operation out of this many")
+        ("output,o", po::value(&outputFile),
+         "File to write the JSON results to (default: stdout)")
+        ("help,h", "Produce help message");
+
+    po::variables_map vm;
+    bool showHelp = false;
+
+    try {
+        po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+        po::notify(vm);
+    } catch (const std::exception & exc) {
+        cerr << "command line parsing error: " << exc.what() << endl;
+        showHelp = true;
+    }
+
+    if (showHelp || vm.count("help")) {
+        cerr << "usage: gc_bench [options]" << endl << desc << endl;
+        return showHelp ? 1 : 0;
+    }
+
+    Json::Value results(Json::arrayValue);
+
+    vector<string> lockTypes = parseList(locks, parseString);
+    vector<int> threadCounts = parseList(threads, parseInt);
+    vector<double> ratios = parseList(readRatios, parseDouble);
+    vector<string> readOpNames = parseList(readOps, parseString);
+    vector<string> writeOpNames = parseList(writeOps, parseString);
+    vector<int> lengths = parseList(csLengths, parseInt);
+
+    Config config;
+    config.duration = duration;
+    config.sampleEvery = std::max(sampleEvery, 1);
+
+    for (const string & lockType: lockTypes)
+    for (int numThreads: threadCounts)
+    for (double readRatio: ratios)
+    for (const string & readOp: readOpNames)
+    for (const string & writeOp: writeOpNames)
+    for (int csLength: lengths) {
+
+        // Without writes, every write op would give the same result
+        if (readRatio >= 1.0 && writeOp != writeOpNames.front())
+            continue;
+
+        config.numThreads = numThreads;
+        config.readRatio = readRatio;
+        config.readOp = parseOp(readOp);
+        config.writeOp = parseOp(writeOp);
+        config.csLength = csLength;
+
+        cerr << ML::format("%-8s threads %3d read ratio %.3f %s/%s "
+                           "cs length %d\n",
+                           lockType.c_str(), numThreads, readRatio,
+                           readOp.c_str(), writeOp.c_str(), csLength);
+
+        Json::Value result;
+        if (lockType == "gclock")
+            result = runConfig<GcLock>(config);
+        else if (lockType == "scalable")
+            result = runConfig<ScalableGcLock>(config);
+        else throw ML::Exception("unknown lock type '%s'", lockType.c_str());
+
+        result["lock"] = lockType;
+        results.append(result);
+    }
+
+    if (outputFile.empty())
+        cout << results.toStyledString();
+    else {
+        ofstream stream(outputFile.c_str());
+        stream << results.toStyledString();
+    }
+}
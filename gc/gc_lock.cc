@@ -4,6 +4,7 @@
 */
 
 #include "soa/gc/gc_lock.h"
+#include "soa/gc/gc_reclaimer.h"
 #include "jml/arch/tick_counter.h"
 #include "jml/arch/spinlock.h"
 #include "jml/arch/futex.h"
@@ -154,6 +155,26 @@ struct GcLockBase::DeferredList {
         deferred3.swap(other.deferred3);
     }
 
+    /// Moves all of the entries of other at the end of this list
+    void append(DeferredList & other)
+    {
+        if (size() == 0) {
+            swap(other);
+            return;
+        }
+
+        deferred1.insert(deferred1.end(),
+                         other.deferred1.begin(), other.deferred1.end());
+        deferred2.insert(deferred2.end(),
+                         other.deferred2.begin(), other.deferred2.end());
+        deferred3.insert(deferred3.end(),
+                         other.deferred3.begin(), other.deferred3.end());
+
+        other.deferred1.clear();
+        other.deferred2.clear();
+        other.deferred3.clear();
+    }
+
     std::vector<DeferredEntry1> deferred1;
     std::vector<DeferredEntry2> deferred2;
     std::vector<DeferredEntry3> deferred3;
@@ -222,16 +243,58 @@ struct GcLockBase::DeferredList {
     }
 };
 
+/// Deferred work that a thread has yet to publish
+struct GcLockBase::DeferBuffer {
+    DeferBuffer(ThreadGcInfoEntry * entry)
+        : epoch(0), entry(entry), prev(0), next(0)
+    {
+    }
+
+    /** Only ever contended when another thread publishes all the buffers
+        (deferBarrier() and destruction) so it's cheap for the owner.
+    */
+    ML::Spinlock lock;
+
+    int32_t epoch;               ///< Epoch the buffered work is deferred to
+    DeferredList entries;        ///< Buffered work
+
+    ThreadGcInfoEntry * entry;   ///< Thread entry that owns the buffer
+    DeferBuffer * prev;          ///< Links in Deferred::buffers
+    DeferBuffer * next;
+};
+
 struct GcLockBase::Deferred {
+    Deferred()
+        : buffers(0), numPending(0)
+    {
+    }
+
     mutable ML::Spinlock lock;
     std::map<int32_t, DeferredList *> entries;
     std::vector<DeferredList *> spares;
+    DeferBuffer * buffers;       ///< Every thread's defer buffer
+    volatile size_t numPending;  ///< Number of entries in entries
 
     bool empty() const
     {
         boost::lock_guard<ML::Spinlock> guard(lock);
         return entries.empty();
     }
+
+    void addBuffer(DeferBuffer * buffer)
+    {
+        buffer->next = buffers;
+        if (buffers) buffers->prev = buffer;
+        buffers = buffer;
+    }
+
+    void removeBuffer(DeferBuffer * buffer)
+    {
+        if (buffer->prev) buffer->prev->next = buffer->next;
+        else buffers = buffer->next;
+        if (buffer->next) buffer->next->prev = buffer->prev;
+        buffer->prev = buffer->next = 0;
+    }
 };
 
 std::string
@@ -329,6 +392,7 @@ print() const
 
 GcLockBase::
 GcLockBase()
+    : deferBatchSize(0), reclaimer(0)
 {
     deferred = new Deferred();
 }
@@ -336,6 +400,24 @@ GcLockBase()
 GcLockBase::
 ~GcLockBase()
 {
+    // The derived class may already have released our data so we can't run
+    // anything at this point.
+    if (reclaimer)
+        reclaimer->removeLock(*this, false /* runPending */);
+
+    {
+        boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+        flushAllDeferBuffers();
+
+        // Threads that are still alive must not touch the buffers anymore.
+        while (deferred->buffers) {
+            DeferBuffer * buffer = deferred->buffers;
+            deferred->removeBuffer(buffer);
+            buffer->entry->deferBuffer = 0;
+            delete buffer;
+        }
+    }
+
     if (!deferred->empty()) {
         dump();
     }
@@ -375,15 +457,13 @@ updateData(Data & oldValue, Data & newValue, RunDefer runDefer)
         // anything that was waiting for it to be visible and run any
         // deferred handlers.
         futex_wake(data->visibleEpoch);
-        if (runDefer) {
-            runDefers();
-        }
+        scheduleDefers(runDefer);
     }
 
     return true;
 }
 
-void
+size_t
 GcLockBase::
 runDefers()
 {
@@ -393,10 +473,70 @@ runDefers()
         toRun = checkDefers();
     }
 
+    size_t numRun = 0;
     for (unsigned i = 0;  i < toRun.size();  ++i) {
+        numRun += toRun[i]->size();
         toRun[i]->runAll();
         delete toRun[i];
     }
+
+    return numRun;
+}
+
+void
+GcLockBase::
+scheduleDefers(RunDefer runDefer)
+{
+    GcReclaimer * r = runningReclaimer();
+    if (r)
+        r->notify(*this);
+    else if (runDefer)
+        runDefers();
+}
+
+bool
+GcLockBase::
+hasRunnableDefers() const
+{
+    boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+    return !deferred->entries.empty()
+        && compareEpochs(deferred->entries.begin()->first,
+                         data->visibleEpoch) <= 0;
+}
+
+size_t
+GcLockBase::
+deferredQueueDepth() const
+{
+    return deferred->numPending;
+}
+
+int
+GcLockBase::
+deferredEpochLag() const
+{
+    boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+    if (deferred->entries.empty()) return 0;
+
+    int32_t current = data->epoch;
+    int32_t oldest = deferred->entries.begin()->first;
+    if (compareEpochs(current, oldest) <= 0) return 0;
+    return current - oldest;
+}
+
+void
+GcLockBase::
+setReclaimer(GcReclaimer * newReclaimer)
+{
+    reclaimer = newReclaimer;
+}
+
+GcReclaimer *
+GcLockBase::
+runningReclaimer() const
+{
+    GcReclaimer * r = reclaimer;
+    return r && r->isRunning() ? r : 0;
 }
 
 std::vector<GcLockBase::DeferredList *>
@@ -421,6 +561,7 @@ checkDefers()
 
             ExcAssert(it->second);
             result.push_back(it->second);
+            deferred->numPending -= it->second->size();
             //it->second->runAll();
             auto toDelete = it;
             it = boost::next(it);
@@ -491,23 +632,29 @@ exitCS(ThreadGcInfoEntry * entry, RunDefer runDefer /* = true */)
     // Fast path
     if (__sync_fetch_and_add(data->in + entry->inEpoch, -1) > 1) {
         entry->inEpoch = -1;
-        return;
     }
+    else {
+        // Slow path; an epoch may have come to an end
 
-        
-    // Slow path; an epoch may have come to an end
-    
-    Data current = *data;
+        Data current = *data;
 
-    for (;;) {
-        Data newValue = current;
+        for (;;) {
+            Data newValue = current;
 
-        //newValue.addIn(entry->inEpoch, -1);
+            //newValue.addIn(entry->inEpoch, -1);
 
-        if (updateData(current, newValue, runDefer)) break;
+            if (updateData(current, newValue, runDefer)) break;
+        }
+
+        entry->inEpoch = -1;
     }
 
-    entry->inEpoch = -1;
+    // Whatever was deferred within the critical section is published in a
+    // single batch on the way out.
+    if (entry->deferBuffer) {
+        if (flushDeferBuffer(*entry->deferBuffer))
+            scheduleDefers(runDefer);
+    }
 }
 
 void
@@ -680,6 +827,12 @@ deferBarrier()
 
     ThreadGcInfoEntry & entry = getEntry();
 
+    // Work buffered by other threads has been registered as well.
+    {
+        boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+        flushAllDeferBuffers();
+    }
+
     visibleBarrier();
 
     // Do it twice to make sure that everything is cycled over two different
@@ -698,6 +851,7 @@ deferBarrier()
         int lock = 0;
         
         defer(futex_unlock, &lock);
+        flushDeferred();
         
         ML::atomic_add(lock, -1);
         
@@ -710,8 +864,9 @@ deferBarrier()
     runDefers();
 }
 
-/** Helper function to call an arbitrary boost::function passed through with a void * */
-static void callFn(void * arg)
+void
+GcLockBase::
+callFn(void * arg)
 {
     boost::function<void ()> * fn
         = reinterpret_cast<boost::function<void ()> *>(arg);
@@ -757,55 +912,63 @@ doDefer(void (fn) (Args...), Args... args)
     if (current.inCurrent() == 0) --newestVisibleEpoch;
 
 #if 1
-    // Nothing is in a critical section; we can run it inline
-    if (current.inCurrent() + current.inOld() == 0) {
+    // Nothing is in a critical section; we can run it inline unless the
+    // work belongs to a running background reclaimer.
+    if (current.inCurrent() + current.inOld() == 0 && !runningReclaimer()) {
         fn(std::forward<Args>(args)...);
         return;
     }
 #endif
 
+    if (deferBatchSize) {
+        bufferDefer(newestVisibleEpoch, fn, std::forward<Args>(args)...);
+        return;
+    }
+
     for (int i = 0; i == 0; ++i) {
-        // Lock the deferred structure
-        boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+        bool runnable = false;
+        {
+            // Lock the deferred structure
+            boost::lock_guard<ML::Spinlock> guard(deferred->lock);
 
 #if 1
-        // Get back to current again
-        current = *data;
-
-        // Find the oldest live epoch
-        int oldestLiveEpoch = -1;
-        if (current.inOld() > 0)
-            oldestLiveEpoch = current.epoch - 1;
-        else if (current.inCurrent() > 0)
-            oldestLiveEpoch = current.epoch;
-    
-        if (oldestLiveEpoch == -1 || 
-                compareEpochs(oldestLiveEpoch, newestVisibleEpoch) > 0)
-        {
-            // Nothing in a critical section so we can run it now and exit
-            break;
-        }
-    
-        // Nothing is in a critical section; we can run it inline
-        if (current.inCurrent() + current.inOld() == 0)
-            break;
+            // Get back to current again
+            current = *data;
+
+            // Find the oldest live epoch
+            int oldestLiveEpoch = -1;
+            if (current.inOld() > 0)
+                oldestLiveEpoch = current.epoch - 1;
+            else if (current.inCurrent() > 0)
+                oldestLiveEpoch = current.epoch;
+
+            // Nothing in a critical section so we can run it now
+            runnable = oldestLiveEpoch == -1
+                || compareEpochs(oldestLiveEpoch, newestVisibleEpoch) > 0;
+            if (runnable && !runningReclaimer())
+                break;
 #endif
 
-        // OK, get the deferred list
-        auto epochIt
-            = deferred->entries.insert
-            (make_pair(newestVisibleEpoch, (DeferredList *)0)).first;
-        if (epochIt->second == 0) {
-            // Create a new list
-            epochIt->second = new DeferredList();
+            // OK, get the deferred list
+            auto epochIt
+                = deferred->entries.insert
+                (make_pair(newestVisibleEpoch, (DeferredList *)0)).first;
+            if (epochIt->second == 0) {
+                // Create a new list
+                epochIt->second = new DeferredList();
+            }
+
+            DeferredList & list = *epochIt->second;
+            list.addDeferred(newestVisibleEpoch, fn, std::forward<Args>(args)...);
+            ++deferred->numPending;
+
+            // TODO: we only need to do this if the newestVisibleEpoch has
+            // changed since we last calculated it...
+            //checkDefers();
         }
-        
-        DeferredList & list = *epochIt->second;
-        list.addDeferred(newestVisibleEpoch, fn, std::forward<Args>(args)...);
 
-        // TODO: we only need to do this if the newestVisibleEpoch has
-        // changed since we last calculated it...
-        //checkDefers();
+        if (runnable)
+            scheduleDefers(RD_NO);
 
         return;
     }
@@ -815,6 +978,142 @@ doDefer(void (fn) (Args...), Args... args)
     return;
 }
 
+template<typename... Args>
+void
+GcLockBase::
+bufferDefer(int32_t epoch, void (fn) (Args...), Args... args)
+{
+    ThreadGcInfoEntry & entry = getEntry();
+
+    if (!entry.deferBuffer) {
+        entry.deferBuffer = new DeferBuffer(&entry);
+
+        boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+        deferred->addBuffer(entry.deferBuffer);
+    }
+
+    DeferBuffer & buffer = *entry.deferBuffer;
+
+    bool runnable = false;
+
+    for (;;) {
+        size_t size;
+        bool added = false;
+        {
+            boost::lock_guard<ML::Spinlock> guard(buffer.lock);
+
+            size = buffer.entries.size();
+            if (size == 0)
+                buffer.epoch = epoch;
+
+            // Deferring to a later epoch than required is always safe, so
+            // older work can join a newer batch but not the other way
+            // around.
+            if (compareEpochs(epoch, buffer.epoch) <= 0) {
+                buffer.entries.addDeferred(
+                        buffer.epoch, fn, std::forward<Args>(args)...);
+                added = true;
+                if (++size < deferBatchSize) break;
+            }
+        }
+
+        // Either the batch is full or the epoch moved on past it
+        if (flushDeferBuffer(buffer))
+            runnable = true;
+
+        if (added) break;
+
+        // The epoch moved on; the next batch starts with our work.
+    }
+
+    // A batch published on the way may already be runnable
+    if (runnable) scheduleDefers(RD_YES);
+}
+
+bool
+GcLockBase::
+flushDeferBuffer(DeferBuffer & buffer)
+{
+    DeferredList toPublish;
+    int32_t epoch;
+
+    {
+        boost::lock_guard<ML::Spinlock> guard(buffer.lock);
+        if (buffer.entries.size() == 0) return false;
+        toPublish.swap(buffer.entries);
+        epoch = buffer.epoch;
+    }
+
+    boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+    publishDeferred(epoch, toPublish);
+
+    // The epoch may already have stopped being visible while the work was
+    // sitting in the buffer.
+    return compareEpochs(epoch, data->visibleEpoch) <= 0;
+}
+
+void
+GcLockBase::
+flushAllDeferBuffers()
+{
+    for (DeferBuffer * buffer = deferred->buffers;  buffer;
+         buffer = buffer->next)
+    {
+        boost::lock_guard<ML::Spinlock> guard(buffer->lock);
+        if (buffer->entries.size() == 0) continue;
+        publishDeferred(buffer->epoch, buffer->entries);
+    }
+}
+
+void
+GcLockBase::
+releaseDeferBuffer(ThreadGcInfoEntry & entry)
+{
+    DeferBuffer * buffer = entry.deferBuffer;
+    entry.deferBuffer = 0;
+
+    boost::lock_guard<ML::Spinlock> guard(deferred->lock);
+    {
+        boost::lock_guard<ML::Spinlock> guard(buffer->lock);
+        if (buffer->entries.size())
+            publishDeferred(buffer->epoch, buffer->entries);
+    }
+    deferred->removeBuffer(buffer);
+    delete buffer;
+}
+
+void
+GcLockBase::
+publishDeferred(int32_t epoch, DeferredList & list)
+{
+    auto epochIt
+        = deferred->entries.insert
+        (make_pair(epoch, (DeferredList *)0)).first;
+    if (epochIt->second == 0)
+        epochIt->second = new DeferredList();
+
+    deferred->numPending += list.size();
+    epochIt->second->append(list);
+}
+
+void
+GcLockBase::
+setDeferBatchSize(size_t batchSize)
+{
+    deferBatchSize = batchSize;
+}
+
+void
+GcLockBase::
+flushDeferred(GcInfo::PerThreadInfo * info)
+{
+    ThreadGcInfoEntry & entry = getEntry(info);
+    if (!entry.deferBuffer) return;
+
+    if (flushDeferBuffer(*entry.deferBuffer))
+        scheduleDefers(RD_YES);
+}
+
 void
 GcLockBase::
 defer(void (work) (void *), void * arg)
@@ -854,6 +1153,15 @@ dump()
             cerr << " " << it->first << " (" << it->second->size()
                  << " entries)";
         }
+
+        size_t numBuffered = 0;
+        for (DeferBuffer * buffer = deferred->buffers;  buffer;
+             buffer = buffer->next) {
+            boost::lock_guard<ML::Spinlock> guard(buffer->lock);
+            numBuffered += buffer->entries.size();
+        }
+        if (numBuffered)
+            cerr << " buffered: " << numBuffered << " entries";
     }
     cerr << endl;
 }
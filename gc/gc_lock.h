@@ -51,6 +51,8 @@ namespace Datacratic {
 
 extern int32_t SpeculativeThreshold;
 
+struct GcReclaimer;
+
 /*****************************************************************************/
 /* GC LOCK BASE                                                              */
 /*****************************************************************************/
@@ -68,12 +70,15 @@ public:
         RD_YES = 1      ///< Potentially run deferred work on this call
     };
 
+    /// Per-thread buffer of deferred work (hidden structure)
+    struct DeferBuffer;
+
     /// A thread's bookkeeping info about each GC area
     struct ThreadGcInfoEntry {
         ThreadGcInfoEntry()
             : inEpoch(-1), readLocked(0), writeLocked(0),
               specLocked(0), specUnlocked(0),
-              owner(0)
+              owner(0), deferBuffer(0)
         {
         }
 
@@ -90,7 +95,12 @@ public:
                 unlockShared(RD_YES);
                 specUnlocked = 0;
             }
-           
+
+            /* Publish anything this thread still has buffered so that it
+             * doesn't die with the thread.
+             */
+            if (deferBuffer)
+                owner->releaseDeferBuffer(*this);
         } 
 
 
@@ -103,6 +113,9 @@ public:
 
         GcLockBase *owner;
 
+        /// Deferred work buffered by this thread; see setDeferBatchSize()
+        DeferBuffer *deferBuffer;
+
         void init(const GcLockBase * const self) {
             if (!owner) 
                 owner = const_cast<GcLockBase *>(self);
@@ -537,6 +550,11 @@ public:
         delete arg;
     }
 
+    /** Call and then delete the boost::function<void ()> passed through
+        arg, for deferring one as a WorkFn1.
+    */
+    static void callFn(void * arg);
+
     template<typename T>
     void deferDelete(T * toDelete)
     {
@@ -554,6 +572,48 @@ public:
         this->defer(bound);
     }
 
+    /** Enables batching of deferred work.
+
+        When the batch size is non-zero, work passed to defer() is first
+        buffered in the calling thread's ThreadGcInfoEntry and only
+        published to the shared deferred structure (which requires taking
+        its lock) once batchSize entries have accumulated, when the thread
+        exits its critical section or when the epoch moves on.  This trades
+        a small delay in reclamation for far less contention between
+        threads that retire many objects.
+
+        A value of 0 (the default) publishes every entry immediately.
+    */
+    void setDeferBatchSize(size_t batchSize);
+
+    size_t getDeferBatchSize() const
+    {
+        return deferBatchSize;
+    }
+
+    /** Publishes any deferred work buffered by the calling thread so that
+        it can be run once its epoch is no longer visible.
+    */
+    void flushDeferred(GcInfo::PerThreadInfo * info = 0);
+
+    /** Number of deferred entries that have been published and are waiting
+        for their epoch to stop being visible.
+    */
+    size_t deferredQueueDepth() const;
+
+    /** Number of epochs between the current epoch and the oldest epoch that
+        still has deferred work pending.  0 if nothing is pending.
+    */
+    int deferredEpochLag() const;
+
+    /** Background reclaimer that runs the deferred work of this lock, if
+        any.  See GcReclaimer::addLock().
+    */
+    GcReclaimer * getReclaimer() const
+    {
+        return reclaimer;
+    }
+
     void dump();
 
 protected:
@@ -567,6 +627,54 @@ private:
 
     Deferred * deferred;   ///< Deferred workloads (hidden structure)
 
+    size_t deferBatchSize; ///< Entries buffered per thread; 0 = no buffering
+
+    /** When set and running, deferred work is never run by the threads
+        using the lock and is left to the reclaimer's thread instead.
+    */
+    GcReclaimer * reclaimer;
+
+    friend struct GcReclaimer;
+
+    void setReclaimer(GcReclaimer * reclaimer);
+
+    /** The reclaimer if its thread is running, otherwise null so that the
+        work is run by the lock's users as if there were none.
+    */
+    GcReclaimer * runningReclaimer() const;
+
+    /** Runs the deferred work or hands it to the reclaimer if there is
+        one.
+    */
+    void scheduleDefers(RunDefer runDefer);
+
+    /** Returns true if some of the published deferred work can be run. */
+    bool hasRunnableDefers() const;
+
+    /** Appends the defer call to the calling thread's buffer, publishing the
+        buffer if it's full or belongs to an older epoch.
+    */
+    template<typename... Args>
+    void bufferDefer(int32_t epoch, void (fn) (Args...), Args... args);
+
+    /** Moves the content of the buffer to the shared deferred structure.
+        Returns true if some of the published work is already runnable.
+    */
+    bool flushDeferBuffer(DeferBuffer & buffer);
+
+    /** Publishes the buffers of every thread.  Must be called with deferred
+        locked.
+    */
+    void flushAllDeferBuffers();
+
+    /** Publishes and frees the buffer of a thread that is going away. */
+    void releaseDeferBuffer(ThreadGcInfoEntry & entry);
+
+    /** Adds the list to the deferred work for the given epoch.  Must be
+        called with deferred locked.
+    */
+    void publishDeferred(int32_t epoch, DeferredList & list);
+
     /** Update with the new value after first checking that the current
         value is the same as the old value.  Returns true if it
         succeeded; otherwise oldValue is updated with the new old
@@ -579,8 +687,10 @@ private:
     */
     bool updateData(Data & oldValue, Data & newValue, RunDefer runDefer);
 
-    /** Executes any available deferred work. */
-    void runDefers();
+    /** Executes any available deferred work.  Returns the number of
+        entries that were run.
+    */
+    size_t runDefers();
 
     /** Check what deferred updates need to be run and do them.  Must be
         called with deferred locked.
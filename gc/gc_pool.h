@@ -0,0 +1,391 @@
+/* gc_pool.h                                                       -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Object pool that recycles objects retired through a GcLock.
+*/
+
+#ifndef __mmap__gc_pool_h__
+#define __mmap__gc_pool_h__
+
+#include "gc_lock.h"
+#include "jml/arch/spinlock.h"
+#include "jml/arch/thread_specific.h"
+#include <algorithm>
+#include <vector>
+#include <new>
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* GC POOL                                                                   */
+/*****************************************************************************/
+
+/** Pool of T objects for RCU style updates.
+
+    Instead of deferDelete()-ing the objects it retires and new-ing their
+    replacement, a writer can deferRecycle() them: once no critical section
+    can see an object anymore, it's destroyed and its memory is made ready
+    to be reused by the writer's next create().  If the deferred work runs
+    on the writer's own thread, the memory goes onto its free list;
+    otherwise, as when a reader or a reclaimer runs it, it goes onto the
+    global list that the writer refills from.
+
+    Each thread has its own free list which it can use without any
+    synchronization.  When a thread's list grows past maxPerThread, half of
+    it is moved to a global overflow list; when it's empty, create() takes
+    a batch from the global list before falling back to operator new.
+    Memory beyond maxGlobal entries on the global list goes back to the
+    allocator.
+
+    Blocks come from operator new so objects created by the pool can be
+    deleted normally.  Objects created with new T can be recycled as long
+    as T doesn't override operator new and is at least as big as a
+    pointer.
+
+    The Lock type can be any of the GcLock variants.
+*/
+
+template<typename T, typename Lock = GcLock>
+struct GcPool : public boost::noncopyable {
+
+    struct Stats {
+        Stats()
+            : hits(0), misses(0), recycled(0), released(0), cached(0)
+        {
+        }
+
+        uint64_t hits;       ///< create() calls served from a free list
+        uint64_t misses;     ///< create() calls that went to operator new
+        uint64_t recycled;   ///< Objects whose memory went to a free list
+        uint64_t released;   ///< Blocks given back to the allocator
+        size_t cached;       ///< Blocks currently on the free lists
+
+        double hitRate() const
+        {
+            uint64_t total = hits + misses;
+            return total ? double(hits) / total : 0.0;
+        }
+    };
+
+    GcPool(Lock & lock, size_t maxPerThread = 256, size_t maxGlobal = 4096)
+        : lock(lock),
+          maxPerThread(std::max<size_t>(maxPerThread, 2)),
+          maxGlobal(maxGlobal),
+          globalHead(0), globalSize(0)
+    {
+    }
+
+    /** Can't be called from within a critical section since it first waits
+        for the objects that are still waiting to be recycled.
+    */
+    ~GcPool()
+    {
+        lock.deferBarrier();
+
+        boost::lock_guard<ML::Spinlock> guard(globalLock);
+        freeList(globalHead);
+
+        // The entries of live threads are detached so that they won't call
+        // back into us when their thread exits.
+        for (ThreadEntry * entry: entries) {
+            freeList(entry->head);
+            entry->head = 0;
+            entry->size = 0;
+            entry->owner = 0;
+        }
+    }
+
+    Lock & getLock() const
+    {
+        return lock;
+    }
+
+    /** Constructs a T with the given arguments, reusing the memory of a
+        recycled object when one is available.
+    */
+    template<typename... Args>
+    T * create(Args&&... args)
+    {
+        ThreadEntry & entry = getEntry();
+
+        void * mem = entry.pop();
+        if (!mem && refill(entry))
+            mem = entry.pop();
+
+        if (mem) ++entry.hits;
+        else {
+            ++entry.misses;
+            mem = ::operator new(BlockSize);
+        }
+
+        try {
+            return new (mem) T(std::forward<Args>(args)...);
+        } catch (...) {
+            push(entry, mem);
+            throw;
+        }
+    }
+
+    /** Recycles the object once no critical section can see it anymore. */
+    void deferRecycle(T * toRecycle)
+    {
+        if (!toRecycle) return;
+
+        // The entry only identifies the thread; it's never dereferenced
+        // by the deferred work as its thread may have exited.
+        lock.defer(doDeferredRecycle, this, toRecycle, &getEntry());
+    }
+
+    /** Recycles an object right away.  The object must not be visible to
+        any other thread.
+    */
+    void recycle(T * toRecycle)
+    {
+        if (!toRecycle) return;
+        toRecycle->~T();
+
+        ThreadEntry & entry = getEntry();
+        ++entry.recycled;
+        push(entry, toRecycle);
+    }
+
+    /** Counters of every thread that used the pool.  The counters of live
+        threads are read without synchronization so they may lag slightly.
+    */
+    Stats stats() const
+    {
+        boost::lock_guard<ML::Spinlock> guard(globalLock);
+
+        Stats result = exited;
+        for (const ThreadEntry * entry: entries) {
+            result.hits += entry->hits;
+            result.misses += entry->misses;
+            result.recycled += entry->recycled;
+            result.released += entry->released;
+            result.cached += entry->size;
+        }
+        result.cached += globalSize;
+
+        return result;
+    }
+
+private:
+
+    struct FreeNode {
+        FreeNode * next;
+    };
+
+    /// A thread's free list and counters
+    struct ThreadEntry {
+        ThreadEntry()
+            : owner(0), head(0), size(0),
+              hits(0), misses(0), recycled(0), released(0)
+        {
+        }
+
+        ~ThreadEntry()
+        {
+            if (owner)
+                owner->releaseEntry(*this);
+        }
+
+        GcPool * owner;
+        FreeNode * head;
+        size_t size;
+
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t recycled;
+        uint64_t released;
+
+        void init(const GcPool * const self)
+        {
+            if (owner) return;
+            owner = const_cast<GcPool *>(self);
+            owner->registerEntry(*this);
+        }
+
+        void * pop()
+        {
+            FreeNode * node = head;
+            if (!node) return 0;
+            head = node->next;
+            --size;
+            return node;
+        }
+    };
+
+    /// Free blocks hold the free list's link
+    static constexpr size_t BlockSize
+        = sizeof(T) < sizeof(FreeNode) ? sizeof(FreeNode) : sizeof(T);
+
+    typedef ML::ThreadSpecificInstanceInfo<ThreadEntry, GcPool> ThreadInfo;
+
+    Lock & lock;
+    size_t maxPerThread;
+    size_t maxGlobal;
+
+    /// Protects the global list, the registry of entries and exited
+    mutable ML::Spinlock globalLock;
+    FreeNode * globalHead;
+    size_t globalSize;
+
+    std::vector<ThreadEntry *> entries;
+
+    /// Counters of the threads that have exited
+    Stats exited;
+
+    ThreadInfo threadInfo;
+
+    ThreadEntry & getEntry(typename ThreadInfo::PerThreadInfo * info = 0)
+    {
+        ThreadEntry * entry = threadInfo.get(info);
+        entry->init(this);
+        return *entry;
+    }
+
+    static void doDeferredRecycle(void * pool, void * toRecycle,
+                                  void * retiredBy)
+    {
+        GcPool * self = static_cast<GcPool *>(pool);
+        T * obj = static_cast<T *>(toRecycle);
+        obj->~T();
+
+        ThreadEntry & entry = self->getEntry();
+        ++entry.recycled;
+        if (&entry == retiredBy)
+            self->push(entry, obj);
+        else self->pushGlobal(entry, obj);
+    }
+
+    static void freeList(FreeNode * node)
+    {
+        while (node) {
+            FreeNode * next = node->next;
+            ::operator delete(node);
+            node = next;
+        }
+    }
+
+    void push(ThreadEntry & entry, void * mem)
+    {
+        FreeNode * node = reinterpret_cast<FreeNode *>(mem);
+        node->next = entry.head;
+        entry.head = node;
+
+        if (++entry.size > maxPerThread)
+            spill(entry, entry.size - maxPerThread / 2);
+    }
+
+    /** Puts a block on the global list, or gives it back to the allocator
+        if the list is full.
+    */
+    void pushGlobal(ThreadEntry & entry, void * mem)
+    {
+        FreeNode * node = reinterpret_cast<FreeNode *>(mem);
+        {
+            boost::lock_guard<ML::Spinlock> guard(globalLock);
+            if (globalSize < maxGlobal) {
+                node->next = globalHead;
+                globalHead = node;
+                ++globalSize;
+                return;
+            }
+        }
+
+        ::operator delete(node);
+        ++entry.released;
+    }
+
+    /** Moves count blocks of the entry to the global list. */
+    void spill(ThreadEntry & entry, size_t count)
+    {
+        if (!count) return;
+
+        FreeNode * first = entry.head;
+        FreeNode * last = first;
+        for (size_t i = 1;  i < count;  ++i)
+            last = last->next;
+
+        entry.head = last->next;
+        entry.size -= count;
+        last->next = 0;
+
+        // Whatever doesn't fit on the global list goes back to the allocator
+        FreeNode * toFree = first;
+        size_t numFree = count;
+        {
+            boost::lock_guard<ML::Spinlock> guard(globalLock);
+            size_t room = maxGlobal - std::min(globalSize, maxGlobal);
+            size_t numGlobal = std::min(count, room);
+            if (numGlobal) {
+                FreeNode * lastGlobal = first;
+                for (size_t i = 1;  i < numGlobal;  ++i)
+                    lastGlobal = lastGlobal->next;
+
+                toFree = lastGlobal->next;
+                numFree = count - numGlobal;
+
+                lastGlobal->next = globalHead;
+                globalHead = first;
+                globalSize += numGlobal;
+            }
+        }
+
+        freeList(toFree);
+        entry.released += numFree;
+    }
+
+    /** Moves a batch of blocks from the global list to the entry.  Returns
+        false if the global list was empty.
+    */
+    bool refill(ThreadEntry & entry)
+    {
+        boost::lock_guard<ML::Spinlock> guard(globalLock);
+        if (!globalHead) return false;
+
+        size_t count = std::min(globalSize, maxPerThread / 2);
+        FreeNode * first = globalHead;
+        FreeNode * last = first;
+        for (size_t i = 1;  i < count;  ++i)
+            last = last->next;
+
+        globalHead = last->next;
+        globalSize -= count;
+
+        last->next = entry.head;
+        entry.head = first;
+        entry.size += count;
+        return true;
+    }
+
+    void registerEntry(ThreadEntry & entry)
+    {
+        boost::lock_guard<ML::Spinlock> guard(globalLock);
+        entries.push_back(&entry);
+    }
+
+    /** Called when a thread exits: its blocks go to the global list and its
+        counters are kept in exited.
+    */
+    void releaseEntry(ThreadEntry & entry)
+    {
+        spill(entry, entry.size);
+
+        boost::lock_guard<ML::Spinlock> guard(globalLock);
+        exited.hits += entry.hits;
+        exited.misses += entry.misses;
+        exited.recycled += entry.recycled;
+        exited.released += entry.released;
+
+        auto it = std::find(entries.begin(), entries.end(), &entry);
+        if (it != entries.end())
+            entries.erase(it);
+        entry.owner = 0;
+    }
+};
+
+} // namespace Datacratic
+
+#endif /* __mmap__gc_pool_h__ */
@@ -0,0 +1,208 @@
+/* gc_reclaimer.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Background thread that runs the deferred work of GcLocks.
+*/
+
+#include "soa/gc/gc_reclaimer.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/futex.h"
+#include "jml/utils/exc_assert.h"
+
+#include <algorithm>
+
+using namespace std;
+using namespace ML;
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* GC RECLAIMER                                                              */
+/*****************************************************************************/
+
+GcReclaimer::
+GcReclaimer(const Config & config)
+    : config_(config),
+      shutdown_(1),
+      wakeupSeq(0), sleeping(0),
+      wakeups(0), runs(0), entriesRun(0)
+{
+}
+
+GcReclaimer::
+~GcReclaimer()
+{
+    shutdown();
+
+    std::vector<GcLockBase *> toDetach;
+    {
+        boost::lock_guard<ML::Spinlock> guard(locksLock);
+        toDetach = locks;
+    }
+
+    for (GcLockBase * lock: toDetach)
+        removeLock(*lock);
+}
+
+void
+GcReclaimer::
+start()
+{
+    ExcAssert(shutdown_);
+    shutdown_ = 0;
+    thread = std::thread([=] () { this->runThread(); });
+}
+
+void
+GcReclaimer::
+shutdown()
+{
+    if (shutdown_) return;
+
+    shutdown_ = 1;
+    ML::atomic_inc(wakeupSeq);
+    futex_wake(wakeupSeq);
+
+    thread.join();
+}
+
+void
+GcReclaimer::
+addLock(GcLockBase & lock)
+{
+    ExcAssert(!lock.getReclaimer());
+
+    {
+        boost::lock_guard<ML::Spinlock> guard(locksLock);
+        locks.push_back(&lock);
+    }
+
+    lock.setReclaimer(this);
+}
+
+void
+GcReclaimer::
+removeLock(GcLockBase & lock, bool runPending)
+{
+    ExcAssertEqual(lock.getReclaimer(), this);
+
+    {
+        boost::lock_guard<ML::Spinlock> guard(locksLock);
+        auto it = std::find(locks.begin(), locks.end(), &lock);
+        ExcAssert(it != locks.end());
+        locks.erase(it);
+    }
+
+    // Wait for a pass that may have picked the lock up before it was
+    // removed.
+    { std::lock_guard<std::mutex> guard(runLock); }
+
+    lock.setReclaimer(0);
+    if (runPending)
+        lock.runDefers();
+}
+
+void
+GcReclaimer::
+notify(GcLockBase & lock)
+{
+    switch (config_.wakeup) {
+    case WAKE_EAGER:
+        break;
+    case WAKE_BATCHED:
+        if (lock.deferredQueueDepth() < config_.batchSize) return;
+        break;
+    case WAKE_PERIODIC:
+        return;
+    }
+
+    // Only pay for the syscall if the thread is actually sleeping.
+    int old = 1;
+    if (sleeping && ML::cmp_xchg(sleeping, old, 0)) {
+        ML::atomic_inc(wakeupSeq);
+        futex_wake(wakeupSeq);
+        ML::atomic_inc(wakeups);
+    }
+}
+
+size_t
+GcReclaimer::
+runAll()
+{
+    std::lock_guard<std::mutex> runGuard(runLock);
+
+    // The work runs without locksLock so that attaching or detaching a
+    // lock doesn't spin on it.
+    std::vector<GcLockBase *> toRun;
+    {
+        boost::lock_guard<ML::Spinlock> guard(locksLock);
+        toRun = locks;
+    }
+
+    size_t result = 0;
+    for (GcLockBase * lock: toRun)
+        result += lock->runDefers();
+
+    ML::atomic_inc(runs);
+    ML::atomic_add(entriesRun, result);
+    return result;
+}
+
+bool
+GcReclaimer::
+hasRunnable() const
+{
+    boost::lock_guard<ML::Spinlock> guard(locksLock);
+
+    for (GcLockBase * lock: locks) {
+        if (lock->hasRunnableDefers())
+            return true;
+    }
+    return false;
+}
+
+void
+GcReclaimer::
+runThread()
+{
+    while (!shutdown_) {
+        runAll();
+
+        int seq = wakeupSeq;
+
+        // Announce that we're going to sleep before checking for work so
+        // that a notify() racing with us either sees the flag or has
+        // published its work before we look.
+        sleeping = 1;
+        ML::memory_barrier();
+
+        if (!shutdown_ && !hasRunnable())
+            futex_wait(wakeupSeq, seq, config_.maxDelay);
+
+        sleeping = 0;
+    }
+
+    // Don't leave runnable work behind.
+    runAll();
+}
+
+GcReclaimer::Stats
+GcReclaimer::
+getStats() const
+{
+    Stats stats;
+    stats.wakeups = wakeups;
+    stats.runs = runs;
+    stats.entriesRun = entriesRun;
+
+    boost::lock_guard<ML::Spinlock> guard(locksLock);
+    for (GcLockBase * lock: locks) {
+        stats.queueDepth += lock->deferredQueueDepth();
+        stats.epochLag = std::max(stats.epochLag, lock->deferredEpochLag());
+    }
+
+    return stats;
+}
+
+} // namespace Datacratic
@@ -0,0 +1,149 @@
+/* gc_reclaimer.h                                                  -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Background thread that runs the deferred work of GcLocks.
+*/
+
+#ifndef __mmap__gc_reclaimer_h__
+#define __mmap__gc_reclaimer_h__
+
+#include "gc_lock.h"
+#include "jml/arch/spinlock.h"
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* GC RECLAIMER                                                              */
+/*****************************************************************************/
+
+/** Runs the deferred work of one or more GcLocks on a dedicated thread.
+
+    Without a reclaimer, deferred work is run by whichever thread happens to
+    move the visible epoch forward which, with RD_NO callers, ends up being a
+    random thread that didn't ask for it.  Once a lock is attached to a
+    running reclaimer, none of its users will run deferred work anymore;
+    they only notify the reclaimer which runs everything that is no longer
+    visible.  While the reclaimer's thread isn't running, the users of the
+    lock run the work as if it weren't attached.
+
+    How eagerly the reclaimer thread is woken up is controlled by the
+    wakeup policy:
+
+    - WAKE_EAGER: the thread is woken up as soon as work becomes runnable.
+    - WAKE_BATCHED: the thread is woken up once batchSize entries are
+      pending.
+    - WAKE_PERIODIC: the thread is never woken up explicitly.
+
+    In all cases the thread wakes up on its own after maxDelay seconds so
+    work can never be delayed for longer than that.
+
+    Locks must be attached and detached while nothing is deferring work
+    through them.
+*/
+
+struct GcReclaimer : public boost::noncopyable {
+
+    enum WakeupPolicy {
+        WAKE_EAGER,
+        WAKE_BATCHED,
+        WAKE_PERIODIC
+    };
+
+    struct Config {
+        Config()
+            : batchSize(1024), wakeup(WAKE_BATCHED), maxDelay(0.01)
+        {
+        }
+
+        size_t batchSize;        ///< Pending entries that trigger a wakeup
+        WakeupPolicy wakeup;     ///< When to wake up the thread
+        double maxDelay;         ///< Maximum time between two runs
+    };
+
+    struct Stats {
+        Stats()
+            : queueDepth(0), epochLag(0),
+              wakeups(0), runs(0), entriesRun(0)
+        {
+        }
+
+        size_t queueDepth;       ///< Deferred entries not yet run
+        int epochLag;            ///< Worst epoch lag of the attached locks
+        uint64_t wakeups;        ///< Explicit wakeups of the thread
+        uint64_t runs;           ///< Passes over the attached locks
+        uint64_t entriesRun;     ///< Deferred entries run by the thread
+    };
+
+    GcReclaimer(const Config & config = Config());
+    ~GcReclaimer();
+
+    void start();
+    void shutdown();
+
+    /** Whether the thread is running.  Until it is started and once it is
+        shut down, the attached locks run their deferred work themselves.
+    */
+    bool isRunning() const
+    {
+        return !shutdown_;
+    }
+
+    /** Hands the deferred work of the lock over to the reclaimer. */
+    void addLock(GcLockBase & lock);
+
+    /** Gives the deferred work of the lock back to its users, first running
+        whatever can be run if runPending is true.
+    */
+    void removeLock(GcLockBase & lock, bool runPending = true);
+
+    /** Called by an attached lock when some of its deferred work may have
+        become runnable.
+    */
+    void notify(GcLockBase & lock);
+
+    Stats getStats() const;
+
+    const Config & config() const
+    {
+        return config_;
+    }
+
+private:
+    void runThread();
+
+    /** Runs the work of every attached lock and returns the number of
+        entries that were run.  The deferred work can't attach or detach
+        locks.
+    */
+    size_t runAll();
+
+    bool hasRunnable() const;
+
+    Config config_;
+
+    mutable ML::Spinlock locksLock;
+    std::vector<GcLockBase *> locks;
+
+    /// Held for each pass of runAll(), so that removeLock() can wait for it
+    std::mutex runLock;
+
+    std::thread thread;
+    volatile int shutdown_;
+
+    /// Futex that the thread sleeps on
+    volatile int wakeupSeq;
+    /// Non-zero when the thread is about to go to sleep
+    volatile int sleeping;
+
+    uint64_t wakeups;
+    uint64_t runs;
+    uint64_t entriesRun;
+};
+
+} // namespace Datacratic
+
+#endif /* __mmap__gc_reclaimer_h__ */
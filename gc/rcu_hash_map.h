@@ -0,0 +1,368 @@
+/* rcu_hash_map.h                                                  -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Read-mostly concurrent hash map protected by a GcLock.
+*/
+
+#ifndef __mmap__rcu_hash_map_h__
+#define __mmap__rcu_hash_map_h__
+
+#include "gc_lock.h"
+#include "jml/utils/exc_assert.h"
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <new>
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* RCU HASH MAP                                                              */
+/*****************************************************************************/
+
+/** Hash map where lookups never block and never write to shared memory
+    (beyond what the lock's critical section requires) and where updates
+    only copy the bucket that they modify.
+
+    The map is an array of buckets, each of which is an immutable array of
+    (hash, node) pairs.  A node holds a single key/value pair and is
+    immutable as well.  Writers build a new version of the bucket they
+    modify, publish it with a single pointer store and hand the old bucket
+    (and replaced node, if any) to the lock's deferDelete machinery.  When
+    the load factor is exceeded, the bucket array is doubled; since buckets
+    only hold pointers to nodes, this never copies keys or values.
+
+    Writers are serialized with a mutex, which keeps the cost of an update
+    proportional to the size of a bucket rather than the size of the map.
+
+    Lookups must happen within a shared critical section of the lock.  The
+    find() and get() functions take care of it; findLocked() and
+    forEachLocked() expect the caller to hold it, which allows several
+    lookups to share a single critical section.
+
+    The Lock type can be any of the GcLock variants.
+*/
+
+template<typename Key,
+         typename Value,
+         typename Hash = std::hash<Key>,
+         typename Equal = std::equal_to<Key>,
+         typename Lock = GcLock>
+struct RcuHashMap : public boost::noncopyable {
+
+    RcuHashMap(Lock & lock,
+               size_t initialBuckets = 64,
+               double maxLoadFactor = 1.0)
+        : lock(lock), maxLoadFactor(maxLoadFactor), size_(0)
+    {
+        size_t numBuckets = 1;
+        while (numBuckets < initialBuckets)
+            numBuckets *= 2;
+        table = allocTable(numBuckets);
+    }
+
+    ~RcuHashMap()
+    {
+        Table * t = table.load();
+        for (size_t i = 0;  i < t->numBuckets;  ++i) {
+            Bucket * bucket = t->buckets[i].load();
+            if (!bucket) continue;
+            for (size_t j = 0;  j < bucket->size;  ++j)
+                delete bucket->slots[j].node;
+        }
+        freeTable(t);
+    }
+
+    /** Number of entries in the map. */
+    size_t size() const
+    {
+        return size_;
+    }
+
+    /** Number of buckets of the current table. */
+    size_t numBuckets() const
+    {
+        typename Lock::SharedGuard guard(lock);
+        return table.load(std::memory_order_acquire)->numBuckets;
+    }
+
+    /** Returns a pointer to the value of the key or null if it's not in the
+        map.  The pointer is only valid until the caller exits its critical
+        section.
+    */
+    const Value * findLocked(const Key & key) const
+    {
+        size_t hash = hasher(key);
+        const Table * t = table.load(std::memory_order_acquire);
+        const Bucket * bucket
+            = t->buckets[hash & t->mask].load(std::memory_order_acquire);
+        if (!bucket) return 0;
+
+        for (size_t i = 0;  i < bucket->size;  ++i) {
+            const Slot & slot = bucket->slots[i];
+            if (slot.hash == hash && equal(slot.node->key, key))
+                return &slot.node->value;
+        }
+        return 0;
+    }
+
+    /** Copies the value of the key in result.  Returns false if the key is
+        not in the map.
+    */
+    bool find(const Key & key, Value & result) const
+    {
+        typename Lock::SharedGuard guard(lock);
+        const Value * value = findLocked(key);
+        if (!value) return false;
+        result = *value;
+        return true;
+    }
+
+    /** Calls fn with the value of the key from within a critical section,
+        which avoids copying it.  Returns false if the key is not in the
+        map.
+    */
+    template<typename Fn>
+    bool get(const Key & key, Fn fn) const
+    {
+        typename Lock::SharedGuard guard(lock);
+        const Value * value = findLocked(key);
+        if (!value) return false;
+        fn(*value);
+        return true;
+    }
+
+    bool contains(const Key & key) const
+    {
+        typename Lock::SharedGuard guard(lock);
+        return findLocked(key);
+    }
+
+    /** Calls fn(key, value) for every entry of the map.  The caller must be
+        in a critical section.
+    */
+    template<typename Fn>
+    void forEachLocked(Fn fn) const
+    {
+        const Table * t = table.load(std::memory_order_acquire);
+        for (size_t i = 0;  i < t->numBuckets;  ++i) {
+            const Bucket * bucket
+                = t->buckets[i].load(std::memory_order_acquire);
+            if (!bucket) continue;
+            for (size_t j = 0;  j < bucket->size;  ++j)
+                fn(bucket->slots[j].node->key, bucket->slots[j].node->value);
+        }
+    }
+
+    /** Adds the key to the map.  Returns false and leaves the map untouched
+        if the key was already there.
+    */
+    bool insert(const Key & key, const Value & value)
+    {
+        return doWrite(key, &value, false /* replace */);
+    }
+
+    /** Adds the key to the map or replaces its value.  Returns true if the
+        key was added.
+    */
+    bool set(const Key & key, const Value & value)
+    {
+        return doWrite(key, &value, true /* replace */);
+    }
+
+    /** Removes the key from the map.  Returns false if it wasn't there. */
+    bool erase(const Key & key)
+    {
+        return doWrite(key, 0, true);
+    }
+
+    /** Removes every entry of the map. */
+    void clear()
+    {
+        std::lock_guard<std::mutex> guard(writeLock);
+
+        Table * t = table.load();
+        for (size_t i = 0;  i < t->numBuckets;  ++i) {
+            Bucket * bucket = t->buckets[i].exchange(0);
+            if (!bucket) continue;
+            for (size_t j = 0;  j < bucket->size;  ++j)
+                lock.deferDelete(bucket->slots[j].node);
+            lock.defer(freeBucket, bucket);
+        }
+        size_ = 0;
+    }
+
+private:
+    struct Node {
+        Node(const Key & key, const Value & value)
+            : key(key), value(value)
+        {
+        }
+
+        const Key key;
+        const Value value;
+    };
+
+    struct Slot {
+        size_t hash;
+        const Node * node;
+    };
+
+    /// Immutable once published
+    struct Bucket {
+        size_t size;
+        Slot slots[1];
+    };
+
+    struct Table {
+        size_t numBuckets;
+        size_t mask;
+        std::atomic<Bucket *> buckets[1];
+    };
+
+    Lock & lock;
+    Hash hasher;
+    Equal equal;
+    double maxLoadFactor;
+
+    std::atomic<Table *> table;
+    std::atomic<size_t> size_;
+
+    /// Serializes the writers
+    std::mutex writeLock;
+
+    static Bucket * allocBucket(size_t size)
+    {
+        void * mem = ::operator new(sizeof(Bucket)
+                                    + (std::max<size_t>(size, 1) - 1)
+                                    * sizeof(Slot));
+        Bucket * bucket = reinterpret_cast<Bucket *>(mem);
+        bucket->size = size;
+        return bucket;
+    }
+
+    static void freeBucket(Bucket * bucket)
+    {
+        ::operator delete(bucket);
+    }
+
+    static Table * allocTable(size_t numBuckets)
+    {
+        void * mem = ::operator new(sizeof(Table)
+                                    + (numBuckets - 1)
+                                    * sizeof(std::atomic<Bucket *>));
+        Table * t = reinterpret_cast<Table *>(mem);
+        t->numBuckets = numBuckets;
+        t->mask = numBuckets - 1;
+        for (size_t i = 0;  i < numBuckets;  ++i)
+            new (&t->buckets[i]) std::atomic<Bucket *>(0);
+        return t;
+    }
+
+    /** Frees the table along with its buckets but not the nodes, which are
+        shared with the table that replaced it.
+    */
+    static void freeTable(Table * t)
+    {
+        for (size_t i = 0;  i < t->numBuckets;  ++i)
+            freeBucket(t->buckets[i].load());
+        ::operator delete(t);
+    }
+
+    /** Inserts, replaces (value != 0) or erases (value == 0) the key. */
+    bool doWrite(const Key & key, const Value * value, bool replace)
+    {
+        std::lock_guard<std::mutex> guard(writeLock);
+
+        size_t hash = hasher(key);
+        Table * t = table.load();
+        std::atomic<Bucket *> & bucketPtr = t->buckets[hash & t->mask];
+        Bucket * oldBucket = bucketPtr.load();
+        size_t oldSize = oldBucket ? oldBucket->size : 0;
+
+        size_t found = oldSize;  // index of the key in the bucket
+        for (size_t i = 0;  i < oldSize && found == oldSize;  ++i) {
+            const Slot & slot = oldBucket->slots[i];
+            if (slot.hash == hash && equal(slot.node->key, key))
+                found = i;
+        }
+        bool isNew = found == oldSize;
+
+        if (isNew && !value) return false;     // erasing missing key
+        if (!isNew && !replace) return false;  // inserting existing key
+
+        const Node * oldNode = isNew ? 0 : oldBucket->slots[found].node;
+
+        // Copy on write of the bucket
+        size_t newSize = oldSize + isNew - (value == 0);
+        Bucket * newBucket = 0;
+        if (newSize) {
+            newBucket = allocBucket(newSize);
+            size_t j = 0;
+            for (size_t i = 0;  i < oldSize;  ++i) {
+                if (i == found) continue;
+                newBucket->slots[j++] = oldBucket->slots[i];
+            }
+            if (value) {
+                Slot & slot = newBucket->slots[j++];
+                slot.hash = hash;
+                slot.node = new Node(key, *value);
+            }
+            ExcAssertEqual(j, newSize);
+        }
+
+        bucketPtr.store(newBucket, std::memory_order_release);
+
+        if (oldBucket) lock.defer(freeBucket, oldBucket);
+        if (oldNode) lock.deferDelete(const_cast<Node *>(oldNode));
+
+        if (isNew) ++size_;
+        else if (!value) --size_;
+
+        if (size_ > maxLoadFactor * t->numBuckets)
+            grow(t);
+
+        return isNew;
+    }
+
+    /** Doubles the number of buckets.  Must be called by a writer. */
+    void grow(Table * oldTable)
+    {
+        size_t numBuckets = oldTable->numBuckets * 2;
+        Table * newTable = allocTable(numBuckets);
+
+        // Each old bucket splits in exactly two new buckets: i and i + old.
+        for (size_t i = 0;  i < oldTable->numBuckets;  ++i) {
+            Bucket * bucket = oldTable->buckets[i].load();
+            if (!bucket) continue;
+
+            size_t numHigh = 0;
+            for (size_t j = 0;  j < bucket->size;  ++j)
+                if (bucket->slots[j].hash & oldTable->numBuckets) ++numHigh;
+            size_t numLow = bucket->size - numHigh;
+
+            Bucket * low = numLow ? allocBucket(numLow) : 0;
+            Bucket * high = numHigh ? allocBucket(numHigh) : 0;
+
+            size_t l = 0, h = 0;
+            for (size_t j = 0;  j < bucket->size;  ++j) {
+                const Slot & slot = bucket->slots[j];
+                if (slot.hash & oldTable->numBuckets)
+                    high->slots[h++] = slot;
+                else low->slots[l++] = slot;
+            }
+
+            newTable->buckets[i].store(low, std::memory_order_relaxed);
+            newTable->buckets[i + oldTable->numBuckets]
+                .store(high, std::memory_order_relaxed);
+        }
+
+        table.store(newTable, std::memory_order_release);
+        lock.defer(freeTable, oldTable);
+    }
+};
+
+} // namespace Datacratic
+
+#endif /* __mmap__rcu_hash_map_h__ */
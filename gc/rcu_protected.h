@@ -9,6 +9,7 @@
 #define __mmap__rcu_protected_h__
 
 #include "gc_lock.h"
+#include "gc_pool.h"
 #include "jml/utils/unnamed_bool.h"
 #include "jml/arch/atomic_ops.h"
 
@@ -111,22 +112,33 @@ template<typename T>
 struct RcuProtected {
     T * val;
     GcLock * lock;
+    GcPool<T> * pool;   ///< Creates and recycles the values if not null
 
     template<typename... Args>
     RcuProtected(GcLock & lock, Args&&... args)
-        : val(new T(std::forward<Args>(args)...)), lock(&lock)
+        : val(new T(std::forward<Args>(args)...)), lock(&lock), pool(0)
     {
         //ExcAssert(this->lock);
     }
 
     RcuProtected(T * val, GcLock & lock)
-        : val(val), lock(&lock)
+        : val(val), lock(&lock), pool(0)
     {
         //ExcAssert(this->lock);
     }
 
+    /** Values are created out of the pool and retired values are recycled
+        into it instead of being deleted.
+    */
+    template<typename... Args>
+    RcuProtected(GcPool<T> & pool, Args&&... args)
+        : val(pool.create(std::forward<Args>(args)...)),
+          lock(&pool.getLock()), pool(&pool)
+    {
+    }
+
     RcuProtected(RcuProtected && other)
-        : val(other.val), lock(other.lock)
+        : val(other.val), lock(other.lock), pool(other.pool)
     {
         //ExcAssert(this->lock);
         other.val = 0;
@@ -135,17 +147,20 @@ struct RcuProtected {
     RcuProtected & operator = (RcuProtected && other)
     {
         auto toDelete = val;
+        auto toDeletePool = pool;
         val = other.val;
         lock = other.lock;
+        pool = other.pool;
         other.val = 0;
-        lock->deferDelete(toDelete);
+        if (toDeletePool) toDeletePool->deferRecycle(toDelete);
+        else lock->deferDelete(toDelete);
         //ExcAssert(lock);
         return *this;
     }
 
     ~RcuProtected()
     {
-        lock->deferDelete(val);
+        retire(val);
         val = 0;
     }
 
@@ -179,14 +194,44 @@ struct RcuProtected {
         T * toDelete = ML::atomic_xchg(val, newVal);
         if (toDelete) {
             ExcAssertNotEqual(toDelete, val);
-            if (defer) lock->deferDelete(toDelete);
+            if (defer) retire(toDelete);
             else {
                 lock->visibleBarrier();
-                delete toDelete;
+                if (pool) pool->recycle(toDelete);
+                else delete toDelete;
             }
         }
     }
 
+    /** Replaces the value with a new one constructed from the arguments,
+        using the pool if there is one.
+    */
+    template<typename... Args>
+    void emplace(Args&&... args)
+    {
+        replace(create(std::forward<Args>(args)...));
+    }
+
+    /** Replaces the value with a copy of it modified by fn.  Only safe
+        when there is a single writer; use cmp_xchg() otherwise.
+    */
+    template<typename Fn>
+    void update(Fn fn)
+    {
+        if (!val)
+            throw ML::Exception("updating null RcuProtected");
+
+        T * newVal = create(*val);
+        try {
+            fn(*newVal);
+        } catch (...) {
+            if (pool) pool->recycle(newVal);
+            else delete newVal;
+            throw;
+        }
+        replace(newVal);
+    }
+
     std::unique_ptr<T> replaceCustomCleanup(T * newVal)
     {
         return std::unique_ptr<T>(ML::atomic_xchg(val, newVal));
@@ -222,6 +267,19 @@ struct RcuProtected {
     }
 
 private:
+    template<typename... Args>
+    T * create(Args&&... args)
+    {
+        if (pool) return pool->create(std::forward<Args>(args)...);
+        return new T(std::forward<Args>(args)...);
+    }
+
+    void retire(T * toRetire)
+    {
+        if (pool) pool->deferRecycle(toRetire);
+        else lock->deferDelete(toRetire);
+    }
+
     // Don't allow copy semantics (use RcuProtectedCopyable for that).  Just
     // move semantics are OK.
     RcuProtected();
@@ -0,0 +1,494 @@
+/* scalable_gc_lock.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Implementation of the GcLock with per-thread reader slots.
+*/
+
+#include "soa/gc/scalable_gc_lock.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/futex.h"
+#include "jml/arch/format.h"
+#include "jml/utils/exc_check.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <iostream>
+
+using namespace std;
+using namespace ML;
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* SCALABLE GC LOCK                                                          */
+/*****************************************************************************/
+
+/// A deferred call to a function of up to 3 pointer arguments
+struct ScalableGcLock::DeferredEntry {
+    DeferredEntry(void (fn) (void *), void * arg)
+        : arity(1)
+    {
+        fn1 = fn;
+        args[0] = arg;
+    }
+
+    DeferredEntry(void (fn) (void *, void *), void * arg1, void * arg2)
+        : arity(2)
+    {
+        fn2 = fn;
+        args[0] = arg1;
+        args[1] = arg2;
+    }
+
+    DeferredEntry(void (fn) (void *, void *, void *),
+                  void * arg1, void * arg2, void * arg3)
+        : arity(3)
+    {
+        fn3 = fn;
+        args[0] = arg1;
+        args[1] = arg2;
+        args[2] = arg3;
+    }
+
+    void run() const
+    {
+        try {
+            switch (arity) {
+            case 1: fn1(args[0]); break;
+            case 2: fn2(args[0], args[1]); break;
+            case 3: fn3(args[0], args[1], args[2]); break;
+            }
+        } catch (...) {
+        }
+    }
+
+    int arity;
+    union {
+        void (*fn1) (void *);
+        void (*fn2) (void *, void *);
+        void (*fn3) (void *, void *, void *);
+    };
+    void * args[3];
+};
+
+namespace {
+
+/// Deferred work retired during a single epoch
+struct Limbo {
+    Limbo()
+        : epoch(0)
+    {
+    }
+
+    uint64_t epoch;
+    std::vector<ScalableGcLock::DeferredEntry> entries;
+};
+
+enum {
+    CACHE_LINE = 64,
+    NUM_LIMBOS = 3     ///< Work can be pending for 3 consecutive epochs
+};
+
+} // file scope
+
+struct ScalableGcLock::Slot {
+    Slot()
+        : epoch(0), inUse(0), numDeferred(0)
+    {
+    }
+
+    /// Epoch announced by the thread while in a CS; 0 when quiescent.
+    volatile uint64_t epoch;
+
+    /// Everything below is only touched by the write side.
+    JML_ALIGNED(CACHE_LINE) int inUse;
+
+    ML::Spinlock limboLock;
+    Limbo limbo[NUM_LIMBOS];
+
+    /// defer() calls since the thread last tried to reclaim.
+    size_t numDeferred;
+
+    size_t numPending() const
+    {
+        size_t result = 0;
+        for (unsigned i = 0;  i < NUM_LIMBOS;  ++i)
+            result += limbo[i].entries.size();
+        return result;
+    }
+
+    /** Removes the work that is safe to run once the global epoch reaches
+        the given value.  Must be called with limboLock held.
+    */
+    void takeSafe(uint64_t currentEpoch, std::vector<DeferredEntry> & result)
+    {
+        for (unsigned i = 0;  i < NUM_LIMBOS;  ++i) {
+            Limbo & l = limbo[i];
+            if (l.entries.empty() || l.epoch + 2 > currentEpoch) continue;
+
+            if (result.empty()) result.swap(l.entries);
+            else {
+                result.insert(result.end(),
+                              l.entries.begin(), l.entries.end());
+                l.entries.clear();
+            }
+        }
+    }
+
+    static Slot * create()
+    {
+        void * mem;
+        int res = posix_memalign(&mem, CACHE_LINE, sizeof(Slot));
+        if (res != 0)
+            throw ML::Exception(res, "posix_memalign");
+        return new (mem) Slot();
+    }
+
+    static void destroy(Slot * slot)
+    {
+        slot->~Slot();
+        free(slot);
+    }
+};
+
+static void runAll(const std::vector<ScalableGcLock::DeferredEntry> & toRun)
+{
+    for (unsigned i = 0;  i < toRun.size();  ++i)
+        toRun[i].run();
+}
+
+std::string
+ScalableGcLock::ThreadEntry::
+print() const
+{
+    return ML::format("readLocked: %d, writeLocked: %d, epoch: %lld",
+                      readLocked, writeLocked,
+                      (long long)(slot ? slot->epoch : 0));
+}
+
+ScalableGcLock::
+ScalableGcLock()
+    : globalEpoch(2),  // So that epoch - 2 can't underflow
+      exclusive(0),
+      reclaimInterval(64)
+{
+}
+
+ScalableGcLock::
+~ScalableGcLock()
+{
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+
+    size_t pending = 0;
+    for (unsigned i = 0;  i < slots.size();  ++i) {
+        pending += slots[i]->numPending();
+        if (!slots[i]->inUse)
+            Slot::destroy(slots[i]);
+    }
+
+    if (pending)
+        cerr << "destroying ScalableGcLock with " << pending
+             << " deferred entries" << endl;
+
+    // Slots still owned by a live thread are leaked rather than risking a
+    // use after free when that thread exits.
+}
+
+ScalableGcLock::Slot &
+ScalableGcLock::
+getSlot(ThreadEntry & entry)
+{
+    if (entry.slot) return *entry.slot;
+
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+
+    for (unsigned i = 0;  i < slots.size();  ++i) {
+        if (slots[i]->inUse) continue;
+        slots[i]->inUse = 1;
+        entry.slot = slots[i];
+        return *entry.slot;
+    }
+
+    entry.slot = Slot::create();
+    entry.slot->inUse = 1;
+    slots.push_back(entry.slot);
+    return *entry.slot;
+}
+
+void
+ScalableGcLock::
+releaseSlot(ThreadEntry & entry)
+{
+    Slot * slot = entry.slot;
+    entry.slot = 0;
+
+    ExcAssertEqual(slot->epoch, 0);
+
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+    slot->inUse = 0;
+}
+
+void
+ScalableGcLock::
+enterCS(ThreadEntry & entry, RunDefer runDefer)
+{
+    Slot & slot = getSlot(entry);
+    ExcAssertEqual(slot.epoch, 0);
+
+    for (;;) {
+        slot.epoch = globalEpoch;
+
+        // Our announcement must be visible before we read the exclusive
+        // flag or anything protected by the lock.
+        ML::memory_barrier();
+
+        if (JML_LIKELY(!exclusive)) break;
+
+        // Back off until the exclusive section is over
+        slot.epoch = 0;
+        ML::memory_barrier();
+        futex_wait(exclusive, 1);
+    }
+}
+
+void
+ScalableGcLock::
+exitCS(ThreadEntry & entry, RunDefer runDefer)
+{
+    Slot & slot = *entry.slot;
+    if (slot.epoch == 0)
+        throw ML::Exception("not in a CS");
+
+    // Release semantics are enough on x86; a compiler barrier stops the
+    // reads of the CS from being moved after the store.
+    __asm__ __volatile__ ("" : : : "memory");
+    slot.epoch = 0;
+
+    if (runDefer && slot.numDeferred) {
+        tryAdvance();
+        reclaim(slot);
+    }
+}
+
+void
+ScalableGcLock::
+enterCSExclusive(ThreadEntry & entry)
+{
+    Slot & slot = getSlot(entry);
+    ExcAssertEqual(slot.epoch, 0);
+
+    for (;;) {
+        int old = 0;
+        if (ML::cmp_xchg(exclusive, old, 1)) break;
+        futex_wait(exclusive, 1);
+    }
+
+    ML::memory_barrier();
+
+    // New readers will now back off; wait for the current ones to leave.
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+    for (unsigned i = 0;  i < slots.size();  ++i) {
+        while (slots[i]->epoch != 0)
+            sched_yield();
+    }
+}
+
+void
+ScalableGcLock::
+exitCSExclusive(ThreadEntry & entry)
+{
+    ML::memory_barrier();
+
+    int old = 1;
+    if (!ML::cmp_xchg(exclusive, old, 0))
+        throw ML::Exception("error exiting exclusive mode");
+
+    futex_wake(exclusive);
+}
+
+uint64_t
+ScalableGcLock::
+tryAdvance()
+{
+    uint64_t epoch = globalEpoch;
+    ML::memory_barrier();
+
+    {
+        boost::lock_guard<ML::Spinlock> guard(slotsLock);
+        for (unsigned i = 0;  i < slots.size();  ++i) {
+            uint64_t slotEpoch = slots[i]->epoch;
+            if (slotEpoch != 0 && slotEpoch != epoch)
+                return epoch;  // straggler still in a previous epoch
+        }
+    }
+
+    // Someone else may have beaten us to it which is just as good.
+    uint64_t old = epoch;
+    if (ML::cmp_xchg(globalEpoch, old, epoch + 1))
+        return epoch + 1;
+    return old;
+}
+
+void
+ScalableGcLock::
+reclaim(Slot & slot)
+{
+    std::vector<DeferredEntry> toRun;
+    {
+        boost::lock_guard<ML::Spinlock> guard(slot.limboLock);
+        slot.takeSafe(globalEpoch, toRun);
+        slot.numDeferred = slot.numPending();
+    }
+
+    runAll(toRun);
+}
+
+void
+ScalableGcLock::
+doDefer(const DeferredEntry & work)
+{
+    ThreadEntry & entry = getEntry();
+    Slot & slot = getSlot(entry);
+
+    // Whatever was unlinked before this call must be visible to everyone
+    // before we sample the epoch.
+    ML::memory_barrier();
+    uint64_t epoch = globalEpoch;
+
+    std::vector<DeferredEntry> toRun;
+    bool tryReclaim;
+    {
+        boost::lock_guard<ML::Spinlock> guard(slot.limboLock);
+
+        Limbo & limbo = slot.limbo[epoch % NUM_LIMBOS];
+        if (limbo.epoch != epoch) {
+            // Whatever is there is at least 3 epochs old and thus safe
+            toRun.swap(limbo.entries);
+            limbo.epoch = epoch;
+        }
+        limbo.entries.push_back(work);
+
+        tryReclaim = ++slot.numDeferred >= reclaimInterval;
+    }
+
+    runAll(toRun);
+
+    // Readers never advance the epoch so writers have to drive it.  We
+    // can't do it from within a CS as we'd be waiting on ourselves.
+    if (tryReclaim && !entry.isLockedShared()) {
+        tryAdvance();
+        reclaim(slot);
+    }
+}
+
+void
+ScalableGcLock::
+visibleBarrier()
+{
+    ML::memory_barrier();
+
+    ThreadEntry & entry = getEntry();
+    if (entry.isLockedShared())
+        throw ML::Exception("visibleBarrier called in critical section will "
+                            "deadlock");
+
+    // Once the epoch has moved twice, every reader that was in a critical
+    // section when we started has had to leave it.
+    uint64_t target = globalEpoch + 2;
+
+    for (unsigned i = 0;  tryAdvance() < target;  ++i) {
+        if (i > 16) sched_yield();
+    }
+}
+
+void
+ScalableGcLock::
+deferBarrier()
+{
+    visibleBarrier();
+
+    std::vector<Slot *> allSlots;
+    {
+        boost::lock_guard<ML::Spinlock> guard(slotsLock);
+        allSlots = slots;
+    }
+
+    // Slots are never freed while the lock is alive so this is safe.
+    for (unsigned i = 0;  i < allSlots.size();  ++i)
+        reclaim(*allSlots[i]);
+}
+
+void
+ScalableGcLock::
+defer(boost::function<void ()> work)
+{
+    defer(GcLockBase::callFn, new boost::function<void ()>(work));
+}
+
+void
+ScalableGcLock::
+defer(void (work) (void *), void * arg)
+{
+    doDefer(DeferredEntry(work, arg));
+}
+
+void
+ScalableGcLock::
+defer(void (work) (void *, void *), void * arg1, void * arg2)
+{
+    doDefer(DeferredEntry(work, arg1, arg2));
+}
+
+void
+ScalableGcLock::
+defer(void (work) (void *, void *, void *),
+      void * arg1, void * arg2, void * arg3)
+{
+    doDefer(DeferredEntry(work, arg1, arg2, arg3));
+}
+
+size_t
+ScalableGcLock::
+numReaders() const
+{
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+
+    size_t result = 0;
+    for (unsigned i = 0;  i < slots.size();  ++i)
+        if (slots[i]->epoch) ++result;
+    return result;
+}
+
+size_t
+ScalableGcLock::
+numPending() const
+{
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+
+    size_t result = 0;
+    for (unsigned i = 0;  i < slots.size();  ++i) {
+        boost::lock_guard<ML::Spinlock> guard(slots[i]->limboLock);
+        result += slots[i]->numPending();
+    }
+    return result;
+}
+
+void
+ScalableGcLock::
+dump()
+{
+    boost::lock_guard<ML::Spinlock> guard(slotsLock);
+
+    cerr << "epoch " << globalEpoch << " excl " << exclusive
+         << " slots " << slots.size() << ":";
+    for (unsigned i = 0;  i < slots.size();  ++i) {
+        Slot & slot = *slots[i];
+        boost::lock_guard<ML::Spinlock> guard(slot.limboLock);
+        cerr << " [" << (slot.inUse ? "" : "free ") << slot.epoch
+             << " (" << slot.numPending() << " deferred)]";
+    }
+    cerr << endl;
+}
+
+} // namespace Datacratic
@@ -0,0 +1,413 @@
+/* scalable_gc_lock.h                                              -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   GcLock variant whose read side doesn't touch any shared cache line.
+*/
+
+#ifndef __mmap__scalable_gc_lock_h__
+#define __mmap__scalable_gc_lock_h__
+
+#include "gc_lock.h"
+#include "jml/arch/spinlock.h"
+#include <vector>
+#include <string>
+
+/** GcLockBase keeps the number of readers of each epoch in a single 16 byte
+    word that every enterCS() and exitCS() has to CAS. Under heavy read
+    contention that cache line bounces between every core of the machine and
+    the read side cost grows with the number of cores.
+
+    ScalableGcLock offers the same interface but each thread announces the
+    epoch it's reading in its own cache line padded slot. Entering and exiting
+    a critical section is then a store and a fence on memory that is local to
+    the thread. The price is paid on the write side: advancing the epoch
+    requires scanning the slot of every thread that ever used the lock.
+
+    Deferred work is kept in per-thread limbo lists indexed by the epoch it
+    was retired in. Work retired in epoch e is run once the global epoch has
+    reached e + 2 since, by then, every reader that could have seen it has
+    left its critical section.
+
+    The interface mirrors GcLockBase (lockShared, unlockShared, defer, guards,
+    barriers...) so code that is templated on the lock type can use either.
+    Note that this lock can't be shared between processes.
+*/
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* SCALABLE GC LOCK                                                          */
+/*****************************************************************************/
+
+struct ScalableGcLock : public boost::noncopyable {
+
+    typedef GcLockBase::RunDefer RunDefer;
+    static const RunDefer RD_NO = GcLockBase::RD_NO;
+    static const RunDefer RD_YES = GcLockBase::RD_YES;
+
+    /// Per-thread announcement slot (hidden structure)
+    struct Slot;
+
+    /// Work passed to defer() (hidden structure)
+    struct DeferredEntry;
+
+    /// A thread's bookkeeping info about the lock
+    struct ThreadEntry {
+        ThreadEntry()
+            : readLocked(0), writeLocked(0),
+              specLocked(0), specUnlocked(0),
+              owner(0), slot(0)
+        {
+        }
+
+        ~ThreadEntry()
+        {
+            if (!specLocked && !specUnlocked && (readLocked || writeLocked))
+                ExcCheck(false, "Thread died but GcLock is still locked");
+
+            else if (!specLocked && specUnlocked) {
+                unlockShared(RD_YES);
+                specUnlocked = 0;
+            }
+
+            if (slot)
+                owner->releaseSlot(*this);
+        }
+
+        int readLocked;
+        int writeLocked;
+
+        int specLocked;
+        int specUnlocked;
+
+        ScalableGcLock * owner;
+        Slot * slot;
+
+        void init(const ScalableGcLock * const self)
+        {
+            if (!owner)
+                owner = const_cast<ScalableGcLock *>(self);
+        }
+
+        void lockShared(RunDefer runDefer)
+        {
+            if (!readLocked && !writeLocked)
+                owner->enterCS(*this, runDefer);
+
+            ++readLocked;
+        }
+
+        void unlockShared(RunDefer runDefer)
+        {
+            if (readLocked <= 0)
+                throw ML::Exception("Bad read lock nesting");
+
+            --readLocked;
+            if (!readLocked && !writeLocked)
+                owner->exitCS(*this, runDefer);
+        }
+
+        bool isLockedShared() const
+        {
+            return readLocked + writeLocked;
+        }
+
+        void lockExclusive()
+        {
+            if (!writeLocked)
+                owner->enterCSExclusive(*this);
+
+            ++writeLocked;
+        }
+
+        void unlockExclusive()
+        {
+            if (writeLocked <= 0)
+                throw ML::Exception("Bad write lock nesting");
+
+            --writeLocked;
+            if (!writeLocked)
+                owner->exitCSExclusive(*this);
+        }
+
+        void lockSpeculative(RunDefer runDefer)
+        {
+            if (!specLocked && !specUnlocked)
+                lockShared(runDefer);
+
+            ++specLocked;
+        }
+
+        void unlockSpeculative(RunDefer runDefer)
+        {
+            if (!specLocked)
+                throw ML::Exception("Bad speculative lock nesting");
+
+            --specLocked;
+            if (!specLocked) {
+                if (++specUnlocked == SpeculativeThreshold) {
+                    unlockShared(runDefer);
+                    specUnlocked = 0;
+                }
+            }
+        }
+
+        void forceUnlock(RunDefer runDefer)
+        {
+            ExcCheckEqual(specLocked, 0, "Bad forceUnlock call");
+
+            if (specUnlocked) {
+                unlockShared(runDefer);
+                specUnlocked = 0;
+            }
+        }
+
+        std::string print() const;
+    };
+
+    typedef ML::ThreadSpecificInstanceInfo<ThreadEntry, ScalableGcLock>
+        GcInfo;
+    typedef typename GcInfo::PerThreadInfo ThreadGcInfo;
+
+    ScalableGcLock();
+    ~ScalableGcLock();
+
+    JML_ALWAYS_INLINE ThreadEntry &
+    getEntry(GcInfo::PerThreadInfo * info = 0) const
+    {
+        ThreadEntry *entry = gcInfo.get(info);
+        entry->init(this);
+        return *entry;
+    }
+
+    /** Current value of the global epoch. */
+    uint64_t currentEpoch() const
+    {
+        return globalEpoch;
+    }
+
+    void lockShared(GcInfo::PerThreadInfo * info = 0,
+                    RunDefer runDefer = RD_YES)
+    {
+        getEntry(info).lockShared(runDefer);
+    }
+
+    void unlockShared(GcInfo::PerThreadInfo * info = 0,
+                      RunDefer runDefer = RD_YES)
+    {
+        getEntry(info).unlockShared(runDefer);
+    }
+
+    /** See GcLockBase::lockSpeculative(). */
+    void lockSpeculative(GcInfo::PerThreadInfo * info = 0,
+                         RunDefer runDefer = RD_YES)
+    {
+        getEntry(info).lockSpeculative(runDefer);
+    }
+
+    void unlockSpeculative(GcInfo::PerThreadInfo * info = 0,
+                           RunDefer runDefer = RD_YES)
+    {
+        getEntry(info).unlockSpeculative(runDefer);
+    }
+
+    void forceUnlock(GcInfo::PerThreadInfo * info = 0,
+                     RunDefer runDefer = RD_YES)
+    {
+        getEntry(info).forceUnlock(runDefer);
+    }
+
+    int isLockedShared(GcInfo::PerThreadInfo * info = 0) const
+    {
+        return getEntry(info).isLockedShared();
+    }
+
+    void lockExclusive(GcInfo::PerThreadInfo * info = 0)
+    {
+        getEntry(info).lockExclusive();
+    }
+
+    void unlockExclusive(GcInfo::PerThreadInfo * info = 0)
+    {
+        getEntry(info).unlockExclusive();
+    }
+
+    int isLockedExclusive(GcInfo::PerThreadInfo * info = 0) const
+    {
+        return getEntry(info).writeLocked;
+    }
+
+    struct SharedGuard {
+        SharedGuard(ScalableGcLock & lock,
+                    RunDefer runDefer = RD_YES,
+                    GcLockBase::DoLock doLock = GcLockBase::DO_LOCK)
+            : lock_(lock),
+              runDefer_(runDefer),
+              doLock_(doLock)
+        {
+            if (doLock_)
+                lock_.lockShared(0, runDefer_);
+        }
+
+        ~SharedGuard()
+        {
+            if (doLock_)
+                lock_.unlockShared(0, runDefer_);
+        }
+
+        void lock()
+        {
+            if (doLock_)
+                return;
+            lock_.lockShared(0, runDefer_);
+            doLock_ = GcLockBase::DO_LOCK;
+        }
+
+        void unlock()
+        {
+            if (!doLock_)
+                return;
+            lock_.unlockShared(0, runDefer_);
+            doLock_ = GcLockBase::DONT_LOCK;
+        }
+
+        ScalableGcLock & lock_;
+        const RunDefer runDefer_;
+        GcLockBase::DoLock doLock_;
+    };
+
+    struct ExclusiveGuard {
+        ExclusiveGuard(ScalableGcLock & lock)
+            : lock(lock)
+        {
+            lock.lockExclusive();
+        }
+
+        ~ExclusiveGuard()
+        {
+            lock.unlockExclusive();
+        }
+
+        ScalableGcLock & lock;
+    };
+
+    struct SpeculativeGuard {
+        SpeculativeGuard(ScalableGcLock & lock,
+                         RunDefer runDefer = RD_YES)
+            : lock(lock),
+              runDefer_(runDefer)
+        {
+            lock.lockSpeculative(0, runDefer_);
+        }
+
+        ~SpeculativeGuard()
+        {
+            lock.unlockSpeculative(0, runDefer_);
+        }
+
+        ScalableGcLock & lock;
+        const RunDefer runDefer_;
+    };
+
+    /** Wait until everything that's currently visible is no longer
+        accessible.  Can't be called from within a critical section.
+    */
+    void visibleBarrier();
+
+    /** Wait until all the deferred work registered so far has been run.
+        Can't be called from within a critical section.
+    */
+    void deferBarrier();
+
+    void defer(boost::function<void ()> work);
+
+    void defer(void (work) (void *), void * arg);
+    void defer(void (work) (void *, void *), void * arg1, void * arg2);
+    void defer(void (work) (void *, void *, void *),
+               void * arg1, void * arg2, void * arg3);
+
+    template<typename T>
+    void defer(void (*work) (T *), T * arg)
+    {
+        defer((GcLockBase::WorkFn1 *)work, (void *)arg);
+    }
+
+    template<typename T>
+    static void doDelete(T * arg)
+    {
+        delete arg;
+    }
+
+    template<typename T>
+    void deferDelete(T * toDelete)
+    {
+        if (!toDelete) return;
+        defer(doDelete<T>, toDelete);
+    }
+
+    template<typename Fn, typename... Args>
+    void deferBind(Fn fn, Args... args)
+    {
+        boost::function<void ()> bound = boost::bind<void>(fn, args...);
+        this->defer(bound);
+    }
+
+    /** Number of defer() calls a thread makes between attempts at advancing
+        the epoch and running its own deferred work.
+    */
+    void setReclaimInterval(size_t interval)
+    {
+        reclaimInterval = interval;
+    }
+
+    /** Number of threads currently in a critical section. */
+    size_t numReaders() const;
+
+    /** Number of deferred entries not yet run. */
+    size_t numPending() const;
+
+    void dump();
+
+private:
+    GcInfo gcInfo;
+
+    /// Global epoch; on its own cache line since it's read by every reader.
+    JML_ALIGNED(64) volatile uint64_t globalEpoch;
+
+    /// 1 when a thread holds (or is acquiring) the lock exclusively.
+    JML_ALIGNED(64) volatile int exclusive;
+
+    /// Registry of every thread's slot.  Only touched by the write side.
+    JML_ALIGNED(64) mutable ML::Spinlock slotsLock;
+    std::vector<Slot *> slots;
+
+    size_t reclaimInterval;
+
+    void enterCS(ThreadEntry & entry, RunDefer runDefer);
+    void exitCS(ThreadEntry & entry, RunDefer runDefer);
+    void enterCSExclusive(ThreadEntry & entry);
+    void exitCSExclusive(ThreadEntry & entry);
+
+    /** Returns the slot of the thread, allocating one if needed. */
+    Slot & getSlot(ThreadEntry & entry);
+
+    /** Hands the slot of a dying thread back for reuse; its pending work
+        will be run by whoever picks it up or by the next deferBarrier().
+    */
+    void releaseSlot(ThreadEntry & entry);
+
+    /** Moves the global epoch forward if every reader in a critical section
+        has observed the current epoch.  Returns the resulting epoch.
+    */
+    uint64_t tryAdvance();
+
+    /** Runs the work of the slot that can no longer be visible. */
+    void reclaim(Slot & slot);
+
+    void doDefer(const DeferredEntry & entry);
+};
+
+} // namespace Datacratic
+
+#endif /* __mmap__scalable_gc_lock_h__ */
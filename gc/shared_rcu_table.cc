@@ -0,0 +1,482 @@
+/* shared_rcu_table.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Read-only key/value table shared between processes through shm.
+*/
+
+#include "soa/gc/shared_rcu_table.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/format.h"
+#include "jml/utils/exc_check.h"
+#include "city.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <memory>
+
+using namespace std;
+using namespace ML;
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* FILE LAYOUT                                                               */
+/*****************************************************************************/
+
+namespace {
+
+const uint64_t ControlMagic = 0x6c7274636c726372ULL;
+const uint64_t VersionMagic = 0x6e6f7673726c7263ULL;
+
+// We want to mmap the file so it has to be the size of a page.
+const size_t ControlFileSize = 1ULL << 12;
+
+/** Header of a version's file.  It's followed by the slots of the table and
+    then by the key and value bytes.
+*/
+struct VersionHeader {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t numEntries;
+    uint64_t numSlots;      ///< Always a power of 2
+    uint64_t dataOffset;
+    uint64_t fileSize;
+};
+
+/** Slot of the open addressing table.  An offset of 0 marks an empty slot
+    since the data always comes after the header.
+*/
+struct Slot {
+    uint64_t hash;
+    uint64_t offset;        ///< Offset of the key from the start of the file
+    uint32_t keyLength;
+    uint32_t valueLength;   ///< The value follows the key
+};
+
+uint64_t hashKey(const char * key, size_t keyLength)
+{
+    // Has to be the same in every process so std::hash won't do.
+    return CityHash64(key, keyLength);
+}
+
+} // file scope
+
+struct SharedRcuTable::Control {
+    uint64_t magic;
+    volatile uint64_t version;
+};
+
+struct SharedRcuTable::Mapping {
+    Mapping()
+        : version(0), addr(0), size(0), header(0), slots(0)
+    {
+    }
+
+    uint64_t version;
+    void * addr;
+    size_t size;
+    const VersionHeader * header;
+    const Slot * slots;
+
+    const char * at(uint64_t offset) const
+    {
+        return reinterpret_cast<const char *>(addr) + offset;
+    }
+
+    static void unmap(Mapping * mapping)
+    {
+        munmap(mapping->addr, mapping->size);
+        delete mapping;
+    }
+};
+
+
+/*****************************************************************************/
+/* BUILDER                                                                   */
+/*****************************************************************************/
+
+void
+SharedRcuTable::Builder::
+add(const char * key, size_t keyLength,
+    const char * value, size_t valueLength)
+{
+    ExcCheckLessEqual(keyLength, (uint32_t)-1, "key is too long");
+    ExcCheckLessEqual(valueLength, (uint32_t)-1, "value is too long");
+
+    Entry entry;
+    entry.hash = hashKey(key, keyLength);
+    entry.offset = data.size();
+    entry.keyLength = keyLength;
+    entry.valueLength = valueLength;
+    entries.push_back(entry);
+
+    data.insert(data.end(), key, key + keyLength);
+    data.insert(data.end(), value, value + valueLength);
+}
+
+void
+SharedRcuTable::Builder::
+clear()
+{
+    entries.clear();
+    data.clear();
+}
+
+
+/*****************************************************************************/
+/* SHARED RCU TABLE                                                          */
+/*****************************************************************************/
+
+SharedRcuTable::
+SharedRcuTable(GcCreate, const string & name)
+    : name("rcu_table." + name),
+      writer(true),
+      lock(GC_CREATE, "rcu_table." + name),
+      controlFd(-1), control(0), current(0)
+{
+    doOpen(true);
+}
+
+SharedRcuTable::
+SharedRcuTable(GcOpen, const string & name)
+    : name("rcu_table." + name),
+      writer(false),
+      lock(GC_OPEN, "rcu_table." + name),
+      controlFd(-1), control(0), current(0)
+{
+    doOpen(false);
+}
+
+SharedRcuTable::
+~SharedRcuTable()
+{
+    // Release the mappings that were retired by remap().
+    lock.deferBarrier();
+
+    if (current)
+        Mapping::unmap(current);
+
+    munmap(control, ControlFileSize);
+    close(controlFd);
+}
+
+void
+SharedRcuTable::
+doOpen(bool create)
+{
+    if (create) {
+        controlFd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        ExcCheckErrno(controlFd >= 0, "shm_open failed");
+
+        int res = ftruncate(controlFd, ControlFileSize);
+        ExcCheckErrno(!res, "failed to resize the file.");
+    }
+    else {
+        controlFd = shm_open(name.c_str(), O_RDONLY, 0);
+        ExcCheckErrno(controlFd >= 0, "shm_open failed");
+
+        struct stat stats;
+        int res = fstat(controlFd, &stats);
+        ExcCheckErrno(!res, "failed to get the file size");
+        ExcCheckEqual((size_t)stats.st_size, ControlFileSize,
+                "table was not initialized by its writer");
+    }
+
+    int prot = create ? PROT_READ | PROT_WRITE : PROT_READ;
+    void * addr = mmap(0, ControlFileSize, prot, MAP_SHARED, controlFd, 0);
+    ExcCheckErrno(addr != MAP_FAILED, "failed to map the shm file");
+    control = reinterpret_cast<Control *>(addr);
+
+    if (create) {
+        control->version = 0;
+        ML::memory_barrier();
+        control->magic = ControlMagic;
+    }
+    else ExcCheckEqual(control->magic, ControlMagic, "invalid table file");
+}
+
+string
+SharedRcuTable::
+versionName(uint64_t version) const
+{
+    return ML::format("%s.%lld", name.c_str(), (long long)version);
+}
+
+uint64_t
+SharedRcuTable::
+version() const
+{
+    return control->version;
+}
+
+size_t
+SharedRcuTable::
+size() const
+{
+    GcLockBase::SharedGuard guard(lock);
+    return view().size();
+}
+
+SharedRcuTable::View
+SharedRcuTable::
+view() const
+{
+    return View(currentMapping());
+}
+
+const SharedRcuTable::Mapping *
+SharedRcuTable::
+currentMapping() const
+{
+    uint64_t version = control->version;
+    const Mapping * mapping = current.load(std::memory_order_acquire);
+    if (JML_LIKELY(mapping && mapping->version == version))
+        return mapping;
+    return remap(version);
+}
+
+const SharedRcuTable::Mapping *
+SharedRcuTable::
+remap(uint64_t version) const
+{
+    std::lock_guard<std::mutex> guard(remapLock);
+
+    Mapping * old = current.load();
+    if (!version || (old && old->version >= version))
+        return old;
+
+    // The writer doesn't unlink this version's file before we leave our
+    // critical section so it's guaranteed to still be there.
+    string file = versionName(version);
+    int fd = shm_open(file.c_str(), O_RDONLY, 0);
+    ExcCheckErrno(fd >= 0, "shm_open failed");
+
+    struct stat stats;
+    int res = fstat(fd, &stats);
+    ExcCheckErrno(!res, "failed to get the file size");
+
+    void * addr = mmap(0, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ExcCheckErrno(addr != MAP_FAILED, "failed to map the shm file");
+    close(fd);
+
+    std::unique_ptr<Mapping> mapping(new Mapping());
+    mapping->version = version;
+    mapping->addr = addr;
+    mapping->size = stats.st_size;
+    mapping->header = reinterpret_cast<const VersionHeader *>(addr);
+    mapping->slots = reinterpret_cast<const Slot *>(mapping->header + 1);
+
+    const VersionHeader & header = *mapping->header;
+    ExcCheckEqual(header.magic, VersionMagic, "invalid table version file");
+    ExcCheckEqual(header.version, version, "unexpected table version");
+    ExcCheckEqual(header.fileSize, mapping->size, "truncated version file");
+
+    current.store(mapping.get(), std::memory_order_release);
+
+    // Other threads may still be reading the old version.
+    if (old)
+        lock.defer(Mapping::unmap, old);
+
+    return mapping.release();
+}
+
+uint64_t
+SharedRcuTable::View::
+version() const
+{
+    return mapping ? mapping->version : 0;
+}
+
+size_t
+SharedRcuTable::View::
+size() const
+{
+    return mapping ? mapping->header->numEntries : 0;
+}
+
+const char *
+SharedRcuTable::View::
+find(const char * key, size_t keyLength, size_t & valueLength) const
+{
+    if (!mapping) return 0;
+
+    uint64_t hash = hashKey(key, keyLength);
+    uint64_t mask = mapping->header->numSlots - 1;
+
+    for (uint64_t i = hash & mask;;  i = (i + 1) & mask) {
+        const Slot & slot = mapping->slots[i];
+        if (!slot.offset) return 0;
+        if (slot.hash != hash || slot.keyLength != keyLength) continue;
+
+        const char * slotKey = mapping->at(slot.offset);
+        if (memcmp(slotKey, key, keyLength) != 0) continue;
+
+        valueLength = slot.valueLength;
+        return slotKey + keyLength;
+    }
+}
+
+bool
+SharedRcuTable::
+find(const string & key, string & result) const
+{
+    GcLockBase::SharedGuard guard(lock);
+    size_t valueLength;
+    const char * value = view().find(key, valueLength);
+    if (!value) return false;
+    result.assign(value, valueLength);
+    return true;
+}
+
+bool
+SharedRcuTable::
+contains(const string & key) const
+{
+    GcLockBase::SharedGuard guard(lock);
+    size_t valueLength;
+    return view().find(key, valueLength);
+}
+
+uint64_t
+SharedRcuTable::
+publish(const Builder & builder)
+{
+    ExcCheck(writer, "only the creator of the table can publish");
+    ExcCheck(!lock.isLockedShared(), "can't publish from a critical section");
+
+    std::lock_guard<std::mutex> guard(publishLock);
+
+    uint64_t oldVersion = control->version;
+    uint64_t newVersion = oldVersion + 1;
+
+    writeVersion(newVersion, builder);
+
+    ML::memory_barrier();
+    control->version = newVersion;
+
+    // Switch our own readers right away.
+    {
+        GcLockBase::SharedGuard guard(lock);
+        remap(newVersion);
+    }
+
+    // Once no one can see the old version anymore, no one will try to map
+    // it so its file can go.  Processes that still have it mapped keep
+    // their pages until they unmap it.
+    if (oldVersion) {
+        lock.visibleBarrier();
+        shm_unlink(versionName(oldVersion).c_str());
+    }
+
+    return newVersion;
+}
+
+void
+SharedRcuTable::
+writeVersion(uint64_t version, const Builder & builder)
+{
+    const vector<Builder::Entry> & entries = builder.entries;
+
+    uint64_t numSlots = 16;
+    while (numSlots < entries.size() * 2)
+        numSlots *= 2;
+    uint64_t mask = numSlots - 1;
+
+    // Lay out the table first so that keys that were added more than once
+    // only make it to the file once.
+    const size_t EMPTY = -1;
+    vector<size_t> table(numSlots, EMPTY);
+    uint64_t numEntries = 0;
+    uint64_t dataSize = 0;
+
+    for (size_t i = 0;  i < entries.size();  ++i) {
+        const Builder::Entry & entry = entries[i];
+        const char * key = builder.data.data() + entry.offset;
+
+        for (uint64_t j = entry.hash & mask;;  j = (j + 1) & mask) {
+            if (table[j] == EMPTY) {
+                table[j] = i;
+                ++numEntries;
+                dataSize += entry.keyLength + entry.valueLength;
+                break;
+            }
+
+            const Builder::Entry & other = entries[table[j]];
+            if (other.hash == entry.hash
+                    && other.keyLength == entry.keyLength
+                    && memcmp(builder.data.data() + other.offset, key,
+                              entry.keyLength) == 0) {
+                dataSize -= other.keyLength + other.valueLength;
+                dataSize += entry.keyLength + entry.valueLength;
+                table[j] = i;
+                break;
+            }
+        }
+    }
+
+    uint64_t dataOffset = sizeof(VersionHeader) + numSlots * sizeof(Slot);
+    uint64_t fileSize = dataOffset + dataSize;
+
+    // An unpublished file may have been left behind by a writer that died
+    // so we don't bother with O_EXCL.
+    string file = versionName(version);
+    int fd = shm_open(file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ExcCheckErrno(fd >= 0, "shm_open failed");
+
+    int res = ftruncate(fd, fileSize);
+    ExcCheckErrno(!res, "failed to resize the file.");
+
+    void * addr = mmap(0, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ExcCheckErrno(addr != MAP_FAILED, "failed to map the shm file");
+    close(fd);
+
+    char * base = reinterpret_cast<char *>(addr);
+    VersionHeader * header = reinterpret_cast<VersionHeader *>(addr);
+    Slot * slots = reinterpret_cast<Slot *>(header + 1);
+
+    // ftruncate zero fills so empty slots are already marked as such.
+    uint64_t offset = dataOffset;
+    for (uint64_t i = 0;  i < numSlots;  ++i) {
+        if (table[i] == EMPTY) continue;
+
+        const Builder::Entry & entry = entries[table[i]];
+        size_t length = entry.keyLength + entry.valueLength;
+
+        Slot & slot = slots[i];
+        slot.hash = entry.hash;
+        slot.offset = offset;
+        slot.keyLength = entry.keyLength;
+        slot.valueLength = entry.valueLength;
+
+        memcpy(base + offset, builder.data.data() + entry.offset, length);
+        offset += length;
+    }
+    ExcAssertEqual(offset, fileSize);
+
+    header->version = version;
+    header->numEntries = numEntries;
+    header->numSlots = numSlots;
+    header->dataOffset = dataOffset;
+    header->fileSize = fileSize;
+    header->magic = VersionMagic;
+
+    munmap(addr, fileSize);
+}
+
+void
+SharedRcuTable::
+unlink()
+{
+    uint64_t version = control->version;
+    if (version)
+        shm_unlink(versionName(version).c_str());
+
+    shm_unlink(name.c_str());
+    lock.unlink();
+}
+
+} // namespace Datacratic
@@ -0,0 +1,223 @@
+/* shared_rcu_table.h                                              -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Read-only key/value table shared between processes through shm.
+*/
+
+#ifndef __mmap__shared_rcu_table_h__
+#define __mmap__shared_rcu_table_h__
+
+#include "gc_lock.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Datacratic {
+
+
+/*****************************************************************************/
+/* SHARED RCU TABLE                                                          */
+/*****************************************************************************/
+
+/** Key/value table that lives in shared memory and that can be read by any
+    number of processes while a single writer process publishes new versions
+    of it.
+
+    Each version is a flat open addressing table followed by the bytes of
+    the keys and values, all stored in its own shm file.  Readers map the
+    current version and do lookups directly in the mapping: there's no IPC,
+    no copy and no deserialization involved, and every process shares the
+    same physical pages.
+
+    Versions are immutable once published.  The writer builds the next
+    version in a new file, points the control file at it and then waits on
+    a SharedGcLock visible barrier before unlinking the previous version.
+    Readers that still have the previous version mapped keep using it until
+    their critical sections end, at which point the mapping is released
+    through the lock's deferred work.
+
+    Lookups must happen within a shared critical section of getLock().  The
+    find(), get() and contains() functions take care of it.  To make
+    several lookups in the same version of the table, take a View with
+    view() once the critical section is entered and look up through it:
+    the View keeps using the version it was taken on even if another one
+    is published in the meantime.
+*/
+
+struct SharedRcuTable : public boost::noncopyable {
+
+    /// Version currently mapped by this process (hidden structure)
+    struct Mapping;
+
+    /// Shared control block pointing at the current version (hidden)
+    struct Control;
+
+    /** Accumulates the entries of the next version of the table.  When the
+        same key is added more than once, the last value wins.
+    */
+    struct Builder {
+        void add(const char * key, size_t keyLength,
+                 const char * value, size_t valueLength);
+
+        void add(const std::string & key, const std::string & value)
+        {
+            add(key.data(), key.size(), value.data(), value.size());
+        }
+
+        /** Number of entries that were added, including duplicates. */
+        size_t size() const
+        {
+            return entries.size();
+        }
+
+        void clear();
+
+    private:
+        friend struct SharedRcuTable;
+
+        struct Entry {
+            uint64_t hash;
+            uint64_t offset;        ///< Offset of the key in data
+            uint32_t keyLength;
+            uint32_t valueLength;   ///< The value follows the key in data
+        };
+
+        std::vector<Entry> entries;
+        std::vector<char> data;
+    };
+
+    /** Creates the table and becomes its writer. */
+    SharedRcuTable(GcCreate, const std::string & name);
+
+    /** Opens a table created by another process (or object) to read it. */
+    SharedRcuTable(GcOpen, const std::string & name);
+
+    ~SharedRcuTable();
+
+    /** Makes the content of the builder the new version of the table and
+        returns the number of that version.  Only the writer can publish and
+        since this waits until no reader can see the previous version
+        anymore, it can't be called from within a critical section.
+    */
+    uint64_t publish(const Builder & builder);
+
+    /** Number of the current version of the table; 0 if nothing was
+        published yet.
+    */
+    uint64_t version() const;
+
+    /** Number of entries in the current version of the table. */
+    size_t size() const;
+
+    /** One version of the table, for the lookups of a critical section.
+        It's only valid until the critical section it was taken in ends.
+    */
+    struct View {
+        /** Returns a pointer to the value of the key or null if it's not
+            in the table.  The pointer is valid as long as the view.
+        */
+        const char * find(const char * key, size_t keyLength,
+                          size_t & valueLength) const;
+
+        const char * find(const std::string & key,
+                          size_t & valueLength) const
+        {
+            return find(key.data(), key.size(), valueLength);
+        }
+
+        /** Number of the version; 0 if nothing was published yet. */
+        uint64_t version() const;
+
+        /** Number of entries in the version. */
+        size_t size() const;
+
+    private:
+        friend struct SharedRcuTable;
+
+        explicit View(const Mapping * mapping)
+            : mapping(mapping)
+        {
+        }
+
+        const Mapping * mapping;    ///< Null if nothing was published yet
+    };
+
+    /** Returns the current version of the table, mapping it first if it's
+        new to this process.  Must be called within a critical section of
+        getLock(), typically right after entering it.
+    */
+    View view() const;
+
+    /** Copies the value of the key in result.  Returns false if the key is
+        not in the table.
+    */
+    bool find(const std::string & key, std::string & result) const;
+
+    /** Calls fn(value, valueLength) with the value of the key from within a
+        critical section, which avoids copying it.  Returns false if the key
+        is not in the table.
+    */
+    template<typename Fn>
+    bool get(const std::string & key, Fn fn) const
+    {
+        GcLockBase::SharedGuard guard(lock);
+        size_t valueLength;
+        const char * value = view().find(key, valueLength);
+        if (!value) return false;
+        fn(value, valueLength);
+        return true;
+    }
+
+    bool contains(const std::string & key) const;
+
+    /** Lock that protects the mapped versions of the table. */
+    SharedGcLock & getLock() const
+    {
+        return lock;
+    }
+
+    /** Permanently deletes the shm files of the table and of its lock. */
+    void unlink();
+
+private:
+    std::string name;
+    bool writer;
+
+    mutable SharedGcLock lock;
+
+    int controlFd;
+    Control * control;
+
+    /// Version mapped by this process; replaced when a newer one appears.
+    mutable std::atomic<Mapping *> current;
+
+    /// Serializes the threads that map a new version
+    mutable std::mutex remapLock;
+
+    /// Serializes the threads that publish
+    std::mutex publishLock;
+
+    /** Opens and maps the control file. */
+    void doOpen(bool create);
+
+    std::string versionName(uint64_t version) const;
+
+    /** Returns the version that a new view must use; only valid within a
+        critical section.
+    */
+    const Mapping * currentMapping() const;
+
+    /** Slow path of currentMapping(): maps the given version (or a newer one
+        if another thread beat us to it) and schedules the release of the
+        previous mapping.
+    */
+    const Mapping * remap(uint64_t version) const;
+
+    /** Writes the version's shm file from the content of the builder. */
+    void writeVersion(uint64_t version, const Builder & builder);
+};
+
+} // namespace Datacratic
+
+#endif /* __mmap__shared_rcu_table_h__ */
@@ -0,0 +1,214 @@
+/* gc_pool_test.cc
+   Copyright (c) 2015 Datacratic Inc.  All rights reserved.
+
+   Tests for the GcLock object pool.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "soa/gc/gc_pool.h"
+#include "soa/gc/rcu_protected.h"
+#include "soa/gc/scalable_gc_lock.h"
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <iostream>
+
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+std::atomic<int> numLive(0);
+
+struct Object {
+    Object(int value = 0)
+        : value(value)
+    {
+        ++numLive;
+    }
+
+    Object(const Object & other)
+        : value(other.value)
+    {
+        ++numLive;
+    }
+
+    ~Object()
+    {
+        --numLive;
+    }
+
+    int value;
+    std::string padding;
+};
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_basics )
+{
+    GcLock lock;
+
+    {
+        GcPool<Object> pool(lock, 4, 8);
+
+        Object * obj = pool.create(1);
+        BOOST_CHECK_EQUAL(obj->value, 1);
+        BOOST_CHECK_EQUAL(numLive.load(), 1);
+        BOOST_CHECK_EQUAL(pool.stats().misses, 1);
+
+        pool.recycle(obj);
+        BOOST_CHECK_EQUAL(numLive.load(), 0);
+        BOOST_CHECK_EQUAL(pool.stats().cached, 1);
+
+        // The memory is reused straight away.
+        Object * obj2 = pool.create(2);
+        BOOST_CHECK_EQUAL(obj2, obj);
+        BOOST_CHECK_EQUAL(obj2->value, 2);
+
+        GcPool<Object>::Stats stats = pool.stats();
+        BOOST_CHECK_EQUAL(stats.hits, 1);
+        BOOST_CHECK_EQUAL(stats.misses, 1);
+        BOOST_CHECK_EQUAL(stats.recycled, 1);
+        BOOST_CHECK_EQUAL(stats.hitRate(), 0.5);
+
+        // Deferred recycling only happens once the object is invisible.
+        lock.lockShared();
+        pool.deferRecycle(obj2);
+        BOOST_CHECK_EQUAL(numLive.load(), 1);
+        lock.unlockShared();
+
+        lock.deferBarrier();
+        BOOST_CHECK_EQUAL(numLive.load(), 0);
+        BOOST_CHECK_EQUAL(pool.stats().recycled, 2);
+
+        // Past the thread and global limits, blocks go back to the
+        // allocator.
+        vector<Object *> objects;
+        for (unsigned i = 0;  i < 32;  ++i)
+            objects.push_back(pool.create(i));
+        for (Object * obj: objects)
+            pool.recycle(obj);
+
+        stats = pool.stats();
+        BOOST_CHECK_LE(stats.cached, 4 + 8);
+        BOOST_CHECK_EQUAL(stats.cached + stats.released, 32);
+    }
+
+    BOOST_CHECK_EQUAL(numLive.load(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_rcu_protected )
+{
+    GcLock lock;
+    GcPool<Object> pool(lock);
+
+    {
+        RcuProtected<Object> protectedObj(pool, 0);
+
+        for (unsigned i = 1;  i <= 1000;  ++i) {
+            protectedObj.update([] (Object & obj) { ++obj.value; });
+            lock.deferBarrier();
+        }
+
+        BOOST_CHECK_EQUAL(protectedObj()->value, 1000);
+
+        protectedObj.emplace(42);
+        BOOST_CHECK_EQUAL(protectedObj()->value, 42);
+    }
+
+    lock.deferBarrier();
+    BOOST_CHECK_EQUAL(numLive.load(), 0);
+
+    // Apart from the first few, every update reused a retired object.
+    GcPool<Object>::Stats stats = pool.stats();
+    cerr << "hits " << stats.hits << " misses " << stats.misses << endl;
+    BOOST_CHECK_EQUAL(stats.hits + stats.misses, 1002);
+    BOOST_CHECK_LE(stats.misses, 3);
+}
+
+template<typename Lock>
+void testConcurrentUpdates()
+{
+    enum {
+        NUM_WRITERS = 2,
+        NUM_READERS = 4,
+        NUM_UPDATES = 100000
+    };
+
+    Lock lock;
+
+    {
+        GcPool<Object, Lock> pool(lock);
+        std::atomic<Object *> values[NUM_WRITERS];
+        for (unsigned i = 0;  i < NUM_WRITERS;  ++i)
+            values[i] = pool.create(0);
+
+        std::atomic<bool> finished(false);
+        std::atomic<int> errors(0);
+
+        auto runWriter = [&] (int writer)
+            {
+                for (unsigned i = 1;  i <= NUM_UPDATES;  ++i) {
+                    Object * old = values[writer].exchange(pool.create(i));
+                    if (old->value != i - 1) ++errors;
+                    pool.deferRecycle(old);
+                }
+            };
+
+        auto runReader = [&] ()
+            {
+                while (!finished) {
+                    typename Lock::SharedGuard guard(lock);
+                    for (unsigned i = 0;  i < NUM_WRITERS;  ++i) {
+                        Object * obj = values[i].load();
+                        int value = obj->value;
+                        if (value < 0 || value > NUM_UPDATES) ++errors;
+                    }
+                }
+            };
+
+        vector<thread> readers, writers;
+        for (unsigned i = 0;  i < NUM_READERS;  ++i)
+            readers.emplace_back(runReader);
+        for (unsigned i = 0;  i < NUM_WRITERS;  ++i)
+            writers.emplace_back(runWriter, i);
+
+        for (auto & t: writers) t.join();
+        finished = true;
+        for (auto & t: readers) t.join();
+
+        BOOST_CHECK_EQUAL(errors.load(), 0);
+
+        for (unsigned i = 0;  i < NUM_WRITERS;  ++i)
+            pool.deferRecycle(values[i].load());
+
+        lock.deferBarrier();
+
+        typename GcPool<Object, Lock>::Stats stats = pool.stats();
+        cerr << "hit rate " << stats.hitRate()
+             << " released " << stats.released << endl;
+        BOOST_CHECK_EQUAL(stats.recycled, NUM_WRITERS * (NUM_UPDATES + 1));
+
+        // The readers run most of the deferred work, but the memory still
+        // comes back to the writers.
+        BOOST_CHECK_GT(stats.hitRate(), 0.5);
+    }
+
+    BOOST_CHECK_EQUAL(numLive.load(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_concurrent_updates )
+{
+    testConcurrentUpdates<GcLock>();
+}
+
+BOOST_AUTO_TEST_CASE( test_concurrent_updates_scalable )
+{
+    testConcurrentUpdates<ScalableGcLock>();
+}
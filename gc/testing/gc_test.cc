@@ -9,6 +9,8 @@
 #define BOOST_TEST_DYN_LINK
 
 #include "soa/gc/gc_lock.h"
+#include "soa/gc/scalable_gc_lock.h"
+#include "soa/gc/gc_reclaimer.h"
 #include "jml/utils/string_functions.h"
 #include "jml/utils/exc_assert.h"
 #include "jml/utils/guard.h"
@@ -64,6 +66,108 @@ BOOST_AUTO_TEST_CASE ( test_gc )
     BOOST_CHECK(deferred);
 }
 
+BOOST_AUTO_TEST_CASE ( test_gc_batched_defer )
+{
+    GcLock gc;
+    gc.setDeferBatchSize(4);
+
+    int numRun = 0;
+    auto incFn = [] (int * count) { ML::atomic_inc(*count); };
+
+    gc.lockShared();
+
+    // Still under the batch size so nothing should have been published
+    for (unsigned i = 0;  i < 3;  ++i)
+        gc.defer(+incFn, &numRun);
+    BOOST_CHECK_EQUAL(numRun, 0);
+
+    // Leaving the critical section publishes the batch and runs it
+    gc.unlockShared();
+    BOOST_CHECK_EQUAL(numRun, 3);
+
+    // Work buffered by another thread is flushed by a defer barrier
+    numRun = 0;
+    gc.lockShared();
+
+    boost::thread thread([&] () {
+                gc.lockShared();
+                gc.defer(+incFn, &numRun);
+                gc.unlockShared();
+                gc.defer(+incFn, &numRun);
+            });
+    thread.join();
+
+    gc.unlockShared();
+    gc.deferBarrier();
+    BOOST_CHECK_EQUAL(numRun, 2);
+}
+
+BOOST_AUTO_TEST_CASE ( test_gc_reclaimer )
+{
+    GcReclaimer::Config config;
+    config.wakeup = GcReclaimer::WAKE_EAGER;
+
+    GcReclaimer reclaimer(config);
+    reclaimer.start();
+
+    GcLock gc;
+    reclaimer.addLock(gc);
+
+    std::atomic<int> numRun(0);
+    std::atomic<bool> runInline(false);
+    auto mainThread = boost::this_thread::get_id();
+
+    auto fn = [&] ()
+        {
+            if (boost::this_thread::get_id() == mainThread)
+                runInline = true;
+            ++numRun;
+        };
+
+    // Nothing is in a critical section but the work still goes to the
+    // reclaimer thread.
+    gc.defer(fn);
+
+    gc.lockShared();
+    for (unsigned i = 0;  i < 10;  ++i)
+        gc.defer(fn);
+    gc.unlockShared();
+
+    for (unsigned i = 0;  i < 1000 && numRun != 11;  ++i)
+        usleep(1000);
+
+    BOOST_CHECK_EQUAL(numRun.load(), 11);
+    BOOST_CHECK(!runInline);
+
+    GcReclaimer::Stats stats = reclaimer.getStats();
+    BOOST_CHECK_EQUAL(stats.queueDepth, 0);
+    BOOST_CHECK_EQUAL(stats.entriesRun, 11);
+
+    reclaimer.removeLock(gc);
+}
+
+BOOST_AUTO_TEST_CASE ( test_gc_reclaimer_not_running )
+{
+    // Without its thread, the reclaimer leaves the work to the lock's users
+    // and a barrier doesn't wait forever.
+    GcReclaimer reclaimer;
+
+    GcLock gc;
+    reclaimer.addLock(gc);
+
+    int numRun = 0;
+    gc.defer([&] () { ++numRun; });
+    BOOST_CHECK_EQUAL(numRun, 1);
+
+    gc.lockShared();
+    gc.defer([&] () { ++numRun; });
+    gc.unlockShared();
+    gc.deferBarrier();
+    BOOST_CHECK_EQUAL(numRun, 2);
+
+    reclaimer.removeLock(gc);
+}
+
 BOOST_AUTO_TEST_CASE(test_mutual_exclusion)
 {
     cerr << "testing mutual exclusion" << endl;
@@ -614,6 +718,34 @@ BOOST_AUTO_TEST_CASE ( test_gc_deferred_contention )
 
 #if 1
 
+BOOST_AUTO_TEST_CASE ( test_gc_batched_deferred_contention )
+{
+    cerr << "testing contended batched deferred GcLock" << endl;
+
+    int nthreads = 8;
+    int nblocks = 2;
+
+    TestBase<GcLock> test(nthreads, nblocks);
+    test.gc.setDeferBatchSize(32);
+    test.run(boost::bind(&TestBase<GcLock>::allocThreadDefer, &test, _1));
+}
+
+BOOST_AUTO_TEST_CASE ( test_gc_reclaimer_deferred_contention )
+{
+    cerr << "testing contended deferred GcLock with a reclaimer" << endl;
+
+    int nthreads = 8;
+    int nblocks = 2;
+
+    GcReclaimer reclaimer;
+    reclaimer.start();
+
+    TestBase<GcLock> test(nthreads, nblocks);
+    reclaimer.addLock(test.gc);
+    test.run(boost::bind(&TestBase<GcLock>::allocThreadDefer, &test, _1));
+    reclaimer.removeLock(test.gc);
+}
+
 BOOST_AUTO_TEST_CASE ( test_gc_sync )
 {
     cerr << "testing synchronized GcLock" << endl;
@@ -648,6 +780,97 @@ BOOST_AUTO_TEST_CASE ( test_gc_deferred )
 }
 
 
+BOOST_AUTO_TEST_CASE ( test_scalable_gc )
+{
+    ScalableGcLock gc;
+    gc.lockShared();
+
+    BOOST_CHECK(gc.isLockedShared());
+    BOOST_CHECK_EQUAL(gc.numReaders(), 1);
+
+    bool deferred = false;
+    gc.defer([&] () { deferred = true; memory_barrier(); });
+
+    // We're still in the critical section so it can't have run
+    BOOST_CHECK(!deferred);
+    BOOST_CHECK_EQUAL(gc.numPending(), 1);
+
+    gc.unlockShared();
+    BOOST_CHECK(!gc.isLockedShared());
+    BOOST_CHECK_EQUAL(gc.numReaders(), 0);
+
+    gc.deferBarrier();
+    BOOST_CHECK(deferred);
+    BOOST_CHECK_EQUAL(gc.numPending(), 0);
+}
+
+BOOST_AUTO_TEST_CASE ( test_scalable_gc_sync_many_threads )
+{
+    cerr << "testing synchronized ScalableGcLock with many threads" << endl;
+
+    int nthreads = 8;
+    int nblocks = 2;
+
+    TestBase<ScalableGcLock> test(nthreads, nblocks);
+    test.run(boost::bind(&TestBase<ScalableGcLock>::allocThreadSync,
+                         &test, _1));
+}
+
+BOOST_AUTO_TEST_CASE ( test_scalable_gc_deferred_contention )
+{
+    cerr << "testing contended deferred ScalableGcLock" << endl;
+
+    int nthreads = 8;
+    int nSpinThreads = 16;
+    int nblocks = 2;
+
+    TestBase<ScalableGcLock> test(nthreads, nblocks, nSpinThreads);
+    test.run(boost::bind(&TestBase<ScalableGcLock>::allocThreadDefer,
+                         &test, _1));
+}
+
+BOOST_AUTO_TEST_CASE ( test_scalable_gc_exclusion )
+{
+    ScalableGcLock lock;
+    volatile bool finished = false;
+    volatile int numExclusive = 0;
+    volatile int numShared = 0;
+    int errors = 0;
+
+    auto sharedThread = [&] ()
+        {
+            while (!finished) {
+                ScalableGcLock::SharedGuard guard(lock);
+                ML::atomic_inc(numShared);
+                if (numExclusive > 0)
+                    ML::atomic_inc(errors);
+                ML::atomic_dec(numShared);
+            }
+        };
+
+    auto exclusiveThread = [&] ()
+        {
+            while (!finished) {
+                ScalableGcLock::ExclusiveGuard guard(lock);
+                ML::atomic_inc(numExclusive);
+                if (numExclusive > 1 || numShared > 0)
+                    ML::atomic_inc(errors);
+                ML::atomic_dec(numExclusive);
+            }
+        };
+
+    boost::thread_group tg;
+    for (unsigned i = 0;  i < 4;  ++i)
+        tg.create_thread(sharedThread);
+    for (unsigned i = 0;  i < 2;  ++i)
+        tg.create_thread(exclusiveThread);
+    sleep(1);
+    finished = true;
+    tg.join_all();
+
+    BOOST_CHECK_EQUAL(errors, 0);
+}
+
 struct SharedGcLockProxy : public SharedGcLock {
     static const char* name;
     SharedGcLockProxy() :
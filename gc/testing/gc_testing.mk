@@ -8,4 +8,8 @@
 
 $(eval $(call test,gc_test,gc,boost))
 $(eval $(call test,rcu_protected_test,gc,boost timed))
+$(eval $(call test,gc_pool_test,gc,boost))
 
+$(eval $(call test,rcu_hash_map_test,gc,boost))
+$(eval $(call test,rcu_hash_map_bench,gc,boost manual))
+$(eval $(call test,shared_rcu_table_test,gc,boost))
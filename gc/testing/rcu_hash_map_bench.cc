@@ -0,0 +1,145 @@
+/* rcu_hash_map_bench.cc
+   Copyright (c) 2015 Datacratic Inc.  All rights reserved.
+
+   Compares the RCU hash map with an std::unordered_map behind a mutex on a
+   read-mostly workload.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "soa/gc/rcu_hash_map.h"
+#include "soa/gc/scalable_gc_lock.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+#include <boost/test/unit_test.hpp>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <iostream>
+
+
+using namespace std;
+using namespace Datacratic;
+
+
+/* Adapters giving both maps the same interface. */
+
+template<typename Lock>
+struct RcuMap {
+    RcuMap()
+        : map(lock, 1024)
+    {
+    }
+
+    bool find(uint64_t key, uint64_t & value)
+    {
+        return map.find(key, value);
+    }
+
+    void set(uint64_t key, uint64_t value)
+    {
+        map.set(key, value);
+    }
+
+    Lock lock;
+    RcuHashMap<uint64_t, uint64_t, std::hash<uint64_t>,
+               std::equal_to<uint64_t>, Lock> map;
+};
+
+struct MutexMap {
+    bool find(uint64_t key, uint64_t & value)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = map.find(key);
+        if (it == map.end()) return false;
+        value = it->second;
+        return true;
+    }
+
+    void set(uint64_t key, uint64_t value)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        map[key] = value;
+    }
+
+    std::mutex lock;
+    std::unordered_map<uint64_t, uint64_t> map;
+};
+
+/** Runs nReaders threads doing lookups and one writer thread doing updates
+    as fast as it can for the given time.
+*/
+template<typename Map>
+void runBench(const string & name, int nReaders, size_t numKeys,
+              double runTime = 1.0)
+{
+    Map map;
+    for (uint64_t i = 0;  i < numKeys;  ++i)
+        map.set(i, i);
+
+    std::atomic<bool> shutdown(false);
+    std::atomic<uint64_t> numReads(0), numWrites(0), numMisses(0);
+
+    auto readerThread = [&] (int thread)
+        {
+            uint64_t reads = 0, misses = 0, value;
+            uint64_t key = thread * 7919;
+            while (!shutdown) {
+                for (unsigned i = 0;  i < 1000;  ++i, ++reads) {
+                    key = (key * 6364136223846793005ULL + 1) % numKeys;
+                    if (!map.find(key, value)) ++misses;
+                }
+            }
+            numReads += reads;
+            numMisses += misses;
+        };
+
+    auto writerThread = [&] ()
+        {
+            uint64_t writes = 0;
+            for (uint64_t i = 0;  !shutdown;  ++i, ++writes)
+                map.set(i % numKeys, i);
+            numWrites += writes;
+        };
+
+    ML::Timer timer;
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0;  i < nReaders;  ++i)
+        threads.emplace_back(readerThread, i);
+    threads.emplace_back(writerThread);
+
+    ::usleep(runTime * 1000000);
+    shutdown = true;
+
+    for (auto & t: threads)
+        t.join();
+
+    double elapsed = timer.elapsed_wall();
+
+    cerr << ML::format("%-24s readers %2d keys %8zd: %8.2fM reads/s "
+                       "%8.2fM writes/s (%lld misses)",
+                       name.c_str(), nReaders, numKeys,
+                       numReads / elapsed / 1000000.0,
+                       numWrites / elapsed / 1000000.0,
+                       (long long)numMisses.load())
+         << endl;
+
+    BOOST_CHECK_EQUAL(numMisses.load(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( bench_rcu_hash_map )
+{
+    int maxThreads = std::thread::hardware_concurrency();
+
+    for (size_t numKeys: { 1000, 1000000 }) {
+        for (int nReaders = 1;  nReaders <= maxThreads;  nReaders *= 2) {
+            runBench<MutexMap>("mutex unordered_map", nReaders, numKeys);
+            runBench<RcuMap<GcLock> >("rcu map GcLock", nReaders, numKeys);
+            runBench<RcuMap<ScalableGcLock> >("rcu map ScalableGcLock",
+                                              nReaders, numKeys);
+        }
+    }
+}
@@ -0,0 +1,149 @@
+/* rcu_hash_map_test.cc
+   Copyright (c) 2015 Datacratic Inc.  All rights reserved.
+
+   Tests for the RCU hash map.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "soa/gc/rcu_hash_map.h"
+#include "soa/gc/scalable_gc_lock.h"
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <iostream>
+
+
+using namespace std;
+using namespace Datacratic;
+
+
+BOOST_AUTO_TEST_CASE( test_basics )
+{
+    GcLock lock;
+    RcuHashMap<string, int> map(lock, 4);
+
+    BOOST_CHECK_EQUAL(map.size(), 0);
+    BOOST_CHECK(!map.contains("hello"));
+
+    BOOST_CHECK(map.insert("hello", 1));
+    BOOST_CHECK(!map.insert("hello", 2));
+    BOOST_CHECK_EQUAL(map.size(), 1);
+
+    int value = 0;
+    BOOST_CHECK(map.find("hello", value));
+    BOOST_CHECK_EQUAL(value, 1);
+
+    BOOST_CHECK(!map.set("hello", 3));
+    BOOST_CHECK(map.find("hello", value));
+    BOOST_CHECK_EQUAL(value, 3);
+
+    BOOST_CHECK(map.get("hello", [&] (int v) { value = v * 2; }));
+    BOOST_CHECK_EQUAL(value, 6);
+
+    BOOST_CHECK(map.erase("hello"));
+    BOOST_CHECK(!map.erase("hello"));
+    BOOST_CHECK(!map.contains("hello"));
+    BOOST_CHECK_EQUAL(map.size(), 0);
+
+    // Force a few resizes
+    for (unsigned i = 0;  i < 1000;  ++i)
+        BOOST_CHECK(map.insert(to_string(i), i));
+    BOOST_CHECK_EQUAL(map.size(), 1000);
+    BOOST_CHECK_GE(map.numBuckets(), 1000);
+
+    for (unsigned i = 0;  i < 1000;  ++i) {
+        BOOST_CHECK(map.find(to_string(i), value));
+        BOOST_CHECK_EQUAL(value, i);
+    }
+
+    size_t numSeen = 0;
+    {
+        GcLock::SharedGuard guard(lock);
+        map.forEachLocked([&] (const string & key, int value)
+                          {
+                              BOOST_CHECK_EQUAL(key, to_string(value));
+                              ++numSeen;
+                          });
+    }
+    BOOST_CHECK_EQUAL(numSeen, 1000);
+
+    map.clear();
+    BOOST_CHECK_EQUAL(map.size(), 0);
+    BOOST_CHECK(!map.contains("1"));
+
+    lock.deferBarrier();
+}
+
+/* Writers keep replacing the value of every key by one that encodes the key
+   while readers check that they never see a torn or freed value.
+*/
+template<typename Lock>
+void testConcurrentAccess()
+{
+    Lock lock;
+    RcuHashMap<int, string, std::hash<int>, std::equal_to<int>, Lock>
+        map(lock, 1);
+
+    int numKeys = 10000;
+    std::atomic<bool> shutdown(false);
+    std::atomic<int> errors(0);
+    std::atomic<uint64_t> numReads(0);
+
+    auto valueFor = [] (int key) { return "value" + to_string(key); };
+
+    auto writerThread = [&] (int thread)
+        {
+            for (unsigned i = 0;  !shutdown;  ++i) {
+                int key = (i * 7 + thread) % numKeys;
+                if (i % 5 == 0)
+                    map.erase(key);
+                else map.set(key, valueFor(key));
+            }
+        };
+
+    auto readerThread = [&] ()
+        {
+            uint64_t reads = 0;
+            for (unsigned i = 0;  !shutdown;  ++i, ++reads) {
+                int key = i % numKeys;
+                map.get(key, [&] (const string & value)
+                        {
+                            if (value != valueFor(key))
+                                ++errors;
+                        });
+            }
+            numReads += reads;
+        };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0;  i < 2;  ++i)
+        threads.emplace_back(writerThread, i);
+    for (unsigned i = 0;  i < 4;  ++i)
+        threads.emplace_back(readerThread);
+
+    ::sleep(1);
+    shutdown = true;
+
+    for (auto & t: threads)
+        t.join();
+
+    cerr << "reads: " << numReads << " size: " << map.size()
+         << " buckets: " << map.numBuckets() << endl;
+
+    BOOST_CHECK_EQUAL(errors.load(), 0);
+
+    lock.deferBarrier();
+}
+
+BOOST_AUTO_TEST_CASE( test_concurrent_access )
+{
+    testConcurrentAccess<GcLock>();
+}
+
+BOOST_AUTO_TEST_CASE( test_concurrent_access_scalable )
+{
+    testConcurrentAccess<ScalableGcLock>();
+}
@@ -0,0 +1,162 @@
+/* shared_rcu_table_test.cc
+   Copyright (c) 2015 Datacratic Inc.  All rights reserved.
+
+   Tests for the shared memory RCU table.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "soa/gc/shared_rcu_table.h"
+#include "jml/arch/format.h"
+#include "jml/arch/exception_handler.h"
+#include <boost/test/unit_test.hpp>
+#include <thread>
+#include <atomic>
+#include <string>
+#include <iostream>
+
+
+using namespace std;
+using namespace Datacratic;
+
+
+BOOST_AUTO_TEST_CASE( test_basics )
+{
+    SharedRcuTable writer(GC_CREATE, "shared_rcu_table_test.basics");
+    SharedRcuTable reader(GC_OPEN, "shared_rcu_table_test.basics");
+
+    BOOST_CHECK_EQUAL(reader.version(), 0);
+    BOOST_CHECK_EQUAL(reader.size(), 0);
+    BOOST_CHECK(!reader.contains("hello"));
+
+    SharedRcuTable::Builder builder;
+    builder.add("hello", "world");
+    builder.add("", "empty key");
+    builder.add("empty value", "");
+    builder.add("hello", "again");
+
+    BOOST_CHECK_EQUAL(writer.publish(builder), 1);
+    BOOST_CHECK_EQUAL(reader.version(), 1);
+    BOOST_CHECK_EQUAL(reader.size(), 3);
+
+    string value;
+    BOOST_CHECK(reader.find("hello", value));
+    BOOST_CHECK_EQUAL(value, "again");
+    BOOST_CHECK(reader.find("", value));
+    BOOST_CHECK_EQUAL(value, "empty key");
+    BOOST_CHECK(reader.find("empty value", value));
+    BOOST_CHECK_EQUAL(value, "");
+    BOOST_CHECK(!reader.find("missing", value));
+
+    // The writer can read its own table.
+    BOOST_CHECK(writer.find("hello", value));
+    BOOST_CHECK_EQUAL(value, "again");
+
+    bool called = false;
+    BOOST_CHECK(reader.get("hello", [&] (const char * data, size_t length)
+                {
+                    called = true;
+                    BOOST_CHECK_EQUAL(string(data, length), "again");
+                }));
+    BOOST_CHECK(called);
+
+    // New versions replace the whole content of the table.
+    builder.clear();
+    for (unsigned i = 0;  i < 1000;  ++i)
+        builder.add(ML::format("key%d", i), ML::format("value%d", i));
+
+    BOOST_CHECK_EQUAL(writer.publish(builder), 2);
+    BOOST_CHECK_EQUAL(reader.size(), 1000);
+    BOOST_CHECK(!reader.contains("hello"));
+
+    for (unsigned i = 0;  i < 1000;  ++i) {
+        BOOST_CHECK(reader.find(ML::format("key%d", i), value));
+        BOOST_CHECK_EQUAL(value, ML::format("value%d", i));
+    }
+
+    // Only the creator of the table can publish.
+    {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(reader.publish(builder), ML::Exception);
+    }
+
+    writer.unlink();
+}
+
+/** Every version maps each key to the version number so a reader that sees
+    two different values within the same critical section has seen a torn
+    version.
+*/
+BOOST_AUTO_TEST_CASE( test_concurrent_readers )
+{
+    enum {
+        NUM_KEYS = 100,
+        NUM_VERSIONS = 50,
+        NUM_READERS = 4
+    };
+
+    const string name = "shared_rcu_table_test.concurrent";
+    SharedRcuTable writer(GC_CREATE, name);
+
+    auto publish = [&] (int version)
+        {
+            SharedRcuTable::Builder builder;
+            for (unsigned i = 0;  i < NUM_KEYS;  ++i)
+                builder.add(ML::format("key%d", i), to_string(version));
+            writer.publish(builder);
+        };
+
+    publish(1);
+
+    std::atomic<bool> finished(false);
+    std::atomic<int> errors(0);
+    std::atomic<uint64_t> lookups(0);
+
+    // Each reader opens its own table like a separate process would.
+    auto runReader = [&] ()
+        {
+            SharedRcuTable reader(GC_OPEN, name);
+            int lastVersion = 0;
+
+            while (!finished) {
+                GcLockBase::SharedGuard guard(reader.getLock());
+                SharedRcuTable::View view = reader.view();
+
+                size_t length;
+                const char * value = view.find("key0", length);
+                if (!value) { ++errors;  continue; }
+                int version = stoi(string(value, length));
+
+                if ((uint64_t)version != view.version()) ++errors;
+                if (version < lastVersion) ++errors;
+                lastVersion = version;
+
+                for (unsigned i = 1;  i < NUM_KEYS;  ++i) {
+                    value = view.find(ML::format("key%d", i), length);
+                    if (!value || string(value, length) != to_string(version))
+                        ++errors;
+                }
+
+                ++lookups;
+            }
+        };
+
+    vector<thread> readers;
+    for (unsigned i = 0;  i < NUM_READERS;  ++i)
+        readers.emplace_back(runReader);
+
+    for (unsigned version = 2;  version <= NUM_VERSIONS;  ++version)
+        publish(version);
+
+    finished = true;
+    for (auto & t: readers)
+        t.join();
+
+    cerr << "lookups: " << lookups << endl;
+
+    BOOST_CHECK_EQUAL(errors.load(), 0);
+    BOOST_CHECK_EQUAL(writer.version(), NUM_VERSIONS);
+
+    writer.unlink();
+}
@@ -91,6 +91,8 @@ init()
     messages.onEvent = [=](std::vector<std::string> && message) {
         handleListenerMessage(message);
     };
+    // Drain bursts of messages without going back to epoll for each one
+    messages.setBatchLimits(256, 0.0005);
 
     messageLoop.addSource("Logger::messages", messages);
 }
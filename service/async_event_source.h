@@ -11,6 +11,8 @@
 
 #include <boost/thread/thread.hpp>
 #include <functional>
+#include <stdint.h>
+#include <time.h>
 #include "jml/arch/exception.h"
 #include <thread>
 
@@ -18,6 +20,16 @@ namespace Datacratic {
 
 struct MessageLoop;
 
+/** Time of the monotonic clock in nanoseconds; cheap enough to be read on
+    every event.
+*/
+inline uint64_t monotonicNanos()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 /*****************************************************************************/
 /* ASYNC EVENT SOURCE                                                        */
 /*****************************************************************************/
@@ -89,6 +101,18 @@ struct AsyncEventSource {
     */
     virtual bool processOne() = 0;
 
+    /** Return the monotonicNanos() time at which the source's fd was
+        signalled for the events that are about to be processed and forget
+        it, so that each signal is only reported once.  Returns 0 if the
+        source doesn't keep track of it or wasn't signalled since the last
+        call.  Used by the MessageLoop to measure the wakeup lag of its
+        sources.
+    */
+    virtual uint64_t takeSignalTime()
+    {
+        return 0;
+    }
+
     /** Return whether the callbacks need to be called from a single thread
         or not.
     */
@@ -78,7 +78,7 @@ setFd(int newFd)
         this->handleFdEvent(event);
     };
     registerFdCallback(newFd, handleFdEventCb);
-    addFd(newFd, readBufferSize_ > 0, true);
+    addFdEdgeTriggered(newFd, readBufferSize_ > 0, true);
     fd_ = newFd;
     closing_ = false;
     enableQueue();
@@ -148,10 +148,11 @@ handleReadReady()
             }
             else {
                 handleClosing(true, true);
+                break;
             }
         }
         else {
-            if (errno == EWOULDBLOCK) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
                 break;
             }
             else if (errno == EBADF || errno == EINVAL) {
@@ -281,11 +282,10 @@ void
 AsyncWriterSource::
 handleQueueNotification()
 {
+    /* when the fd isn't writable, the writes resume on its next EPOLLOUT
+       event */
     if (fd_ != -1) {
         flush();
-        if (fd_ != -1 && !writeReady_) {
-            modifyFd(fd_, readBufferSize_ > 0, true);
-        }
     }
 }
 
@@ -381,15 +381,21 @@ handleFdEvent(const ::epoll_event & event)
         handleWriteReady();
     }
     if (fd_ != -1 && (event.events & EPOLLIN) != 0) {
-        handleReadReady();
+        try {
+            handleReadReady();
+        }
+        catch (...) {
+            /* the fd may not have been drained, in which case it would not
+               be reported again: re-arming it has epoll check it again */
+            if (fd_ != -1) {
+                performAddFd(fd_, readBufferSize_ > 0, true, true, false, true);
+            }
+            throw;
+        }
     }
     if (fd_ != -1 && (event.events & EPOLLHUP) != 0) {
         handleClosing(true, true);
     }
-
-    if (fd_ != -1) {
-        modifyFd(fd_, readBufferSize_ > 0, !writeReady_);
-    }
 }
 
 void
@@ -450,7 +456,8 @@ unregisterFdCallback(int fd, bool delayed,
 
 void
 AsyncWriterSource::
-performAddFd(int fd, bool readerFd, bool writerFd, bool modify, bool oneshot)
+performAddFd(int fd, bool readerFd, bool writerFd, bool modify, bool oneshot,
+             bool edgeTriggered)
 {
     if (epollFd_ == -1)
         return;
@@ -468,6 +475,9 @@ performAddFd(int fd, bool readerFd, bool writerFd, bool modify, bool oneshot)
     if (writerFd) {
         event.events |= EPOLLOUT;
     }
+    if (edgeTriggered) {
+        event.events |= EPOLLET;
+    }
 
     EpollCallback & cb = fdCallbacks_.at(fd);
     event.data.ptr = &cb;
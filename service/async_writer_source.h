@@ -57,7 +57,13 @@ struct AsyncWriteResult {
 /* A base class enabling the asynchronous and buffered writing of data to a
  * file descriptor. This class currently implements two separate concerns (a
  * read-write "Epoller" and a write queue) and might need to be split at some
- * point. */
+ * point.
+ *
+ * The "main" file descriptor is registered once in edge-triggered mode: it
+ * is read until EAGAIN whenever it becomes readable and written until the
+ * queue is empty or until EAGAIN, after which the next EPOLLOUT edge resumes
+ * the writes, so that no epoll_ctl call is needed per event or per queued
+ * message. */
 
 struct AsyncWriterSource : public AsyncEventSource
 {
@@ -184,6 +190,12 @@ protected:
     void modifyFdOneShot(int fd, bool readerFd, bool writerFd)
     { performAddFd(fd, readerFd, writerFd, true, true); }
 
+    /* same as addFd, with the EPOLLET flag: the callback must read and/or
+       write until EAGAIN, as it won't be invoked again before the state of
+       the fd changes */
+    void addFdEdgeTriggered(int fd, bool readerFd, bool writerFd)
+    { performAddFd(fd, readerFd, writerFd, false, false, true); }
+
     /* remove a file descriptor from the internal epoll queue */
     void removeFd(int fd);
 
@@ -228,7 +240,7 @@ private:
     };
 
     void performAddFd(int fd, bool readerFd, bool writerFd,
-                      bool modify, bool oneshot);
+                      bool modify, bool oneshot, bool edgeTriggered = false);
 
     /* epoll operations */
     void closeEpollFd();
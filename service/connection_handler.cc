@@ -10,6 +10,8 @@
 #include "jml/arch/backtrace.h"
 #include "jml/utils/guard.h"
 #include "soa/service//endpoint.h"
+#include <algorithm>
+#include <memory>
 
 
 using namespace std;
@@ -112,6 +114,26 @@ setTransport(TransportBase * transport)
     transport_ = transport;
 }
 
+void
+ConnectionHandler::
+doAsyncForThis(const boost::function<void ()> & callback, const char * name)
+{
+    // Nothing holds on to the handler any more: it's going away
+    std::shared_ptr<ConnectionHandler> self = self_.lock();
+    if (!self)
+        return;
+
+    uint64_t generation = generation_;
+    transport().doAsync([self, generation, callback] ()
+                        {
+                            // Released and reset since, maybe reused
+                            if (self->generation_ != generation)
+                                return;
+                            callback();
+                        },
+                        name);
+}
+
 void
 ConnectionHandler::
 addActivity(const std::string & activity)
@@ -161,6 +183,31 @@ doError(const std::string & error)
     closeWhenHandlerFinished();
 }
 
+size_t
+PassiveConnectionHandler::
+handleData(const char * data, size_t size)
+{
+    handleData(string(data, size));
+    return size;
+}
+
+void
+PassiveConnectionHandler::
+handleData(const std::string & data)
+{
+    throw Exception("%s overrides neither version of handleData()",
+                    ML::type_name(*this).c_str());
+}
+
+void
+PassiveConnectionHandler::
+handleReadBuffer()
+{
+    ReadBuffer & buf = transport().readBuffer();
+    size_t consumed = handleData(buf.data(), buf.size());
+    buf.consume(consumed);
+}
+
 void
 PassiveConnectionHandler::
 handleInput()
@@ -171,7 +218,8 @@ handleInput()
 
     size_t chunk_size = 8192;
 
-    string buf;
+    // Reused for every read of the connection
+    ReadBuffer & buf = transport().readBuffer();
     size_t done = 0;
 
     ssize_t bytes_read = 0;
@@ -179,15 +227,14 @@ handleInput()
     bool disconnected = false;
 
     do {
-        if (buf.length() - done < chunk_size)
-            buf.resize(done + chunk_size);
+        char * dest = buf.reserve(chunk_size);
 
         errno = 0;
 
         //cerr << "receiving " << chunk_size << " on top of "
-        //     << buf.length() << " already there" << endl;
+        //     << buf.size() << " already there" << endl;
 
-        bytes_read = recv(&buf[done], chunk_size, MSG_DONTWAIT);
+        bytes_read = recv(dest, chunk_size, MSG_DONTWAIT);
 
         //int err = errno;
 
@@ -206,22 +253,18 @@ handleInput()
             if (errno == EINTR) continue; // interrupted
             if (errno == EAGAIN || errno == EWOULDBLOCK) break; // no data
 
-            if (done) handleData(buf);
+            if (done) handleReadBuffer();
             doError("read on " + get_endpoint()->name() + ": " + string(strerror(errno)));
             return;
         }
         if (bytes_read > chunk_size)
             throw Exception("too many bytes read");
+        buf.commit(bytes_read);
         done += bytes_read;
     } while (bytes_read > 0);
 
     try {
-        if (done > buf.length())
-            throw Exception("buffer is too long");
-
-        buf.resize(done);
-
-        if (done) handleData(buf);
+        if (done) handleReadBuffer();
     } catch (...) {
         if (disconnected) {
             handleDisconnect();
@@ -261,19 +304,44 @@ handleOutput()
     //cerr << "output: elapsed = " << format("%.1fms", elapsed * 1000)
     //     << endl;
 
-    const string & str = toWrite.front().data;
+    const WriteEntry & front = toWrite.front();
 
-    //cerr << "writing " << str << endl;
+    //cerr << "writing " << front.data << front.body << endl;
 
-    int len = str.length();
+    int len = front.data.length() + front.body.length();
 
     if (done < 0 || (done >= len && len != 0))
         throw Exception("invalid done");
 
-    /* Send data */
+    /* Gather what's left of the queued entries, so that several of them
+       (such as pipelined responses) go out in a single call. */
+    enum { MAX_GATHER = 64 };
+    iovec iov[MAX_GATHER];
+    int iovcnt = 0;
+    int skip = done;
+    for (auto it = toWrite.begin();
+         it != toWrite.end() && iovcnt + 2 <= MAX_GATHER;  ++it) {
+        const string * parts[2] = { &it->data, &it->body };
+        for (const string * part: parts) {
+            int partLength = part->length();
+            if (skip >= partLength) {
+                skip -= partLength;
+                continue;
+            }
+            iov[iovcnt].iov_base = (void *)(part->c_str() + skip);
+            iov[iovcnt].iov_len = partLength - skip;
+            ++iovcnt;
+            skip = 0;
+        }
+
+        // Nothing can go out after a close or a recycle
+        if (it->next != NEXT_CONTINUE)
+            break;
+    }
+
     ssize_t written
         = ConnectionHandler::
-        send(str.c_str() + done, len - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+        sendv(iov, iovcnt, MSG_NOSIGNAL | MSG_DONTWAIT);
 
     if (written == -1 && errno == EWOULDBLOCK) {
         //cerr << "write would block" << endl;
@@ -286,22 +354,28 @@ handleOutput()
     }
             
     done += written;
-        
-    if (done == len) {
-        //cerr << "SEND FINISHED " << str << endl;
 
-        WriteEntry entry = toWrite.front();
-        if (entry.onWriteFinished)
-            entry.onWriteFinished();
+    // Finish each of the entries that were completely written
+    while (!toWrite.empty()) {
+        len = toWrite.front().data.length() + toWrite.front().body.length();
+        if (done < len)
+            break;
+
+        //cerr << "SEND FINISHED " << toWrite.front().data << endl;
 
+        // Taken off the queue first, so that the callback can send more
+        WriteEntry entry = std::move(toWrite.front());
         toWrite.pop_front();
-        done = 0;
-        
+        done -= len;
+
         if (toWrite.empty())
             stopWriting();
 
+        if (entry.onWriteFinished)
+            entry.onWriteFinished();
+
         if (entry.next == NEXT_CONTINUE)
-            return;
+            continue;
 
         if (!toWrite.empty())
             throw Exception("CLOSE or RECYCLE with data to write");
@@ -313,6 +387,7 @@ handleOutput()
             recycleWhenHandlerFinished();
         }
         else throw Exception("invalid next action");
+        return;
     }
 }
 
@@ -321,28 +396,46 @@ PassiveConnectionHandler::
 send(const std::string & str,
      NextAction next,
      OnWriteFinished onWriteFinished)
+{
+    send(str, string(), next, onWriteFinished);
+}
+
+void
+PassiveConnectionHandler::
+send(std::string header, std::string body,
+     NextAction next,
+     OnWriteFinished onWriteFinished)
 {
     // If we're not in the right thread, then set the send up to be
     // asynchronous.
     if (!transport().lockedByThisThread()) {
-        doAsync([=] () { this->send(str, next, onWriteFinished); },
-                "deferredSend");
+        // Shared so that the buffers aren't copied along with the callback
+        auto buffers = std::make_shared<std::pair<string, string> >
+            (std::move(header), std::move(body));
+        doAsyncForThis([=] ()
+                       {
+                           this->send(std::move(buffers->first),
+                                      std::move(buffers->second),
+                                      next, onWriteFinished);
+                       },
+                       "deferredSend");
         return;
     }
 
-    //cerr << "message being sent<" << str << "> on handle" << transport().getHandle() <<  endl;
+    //cerr << "message being sent<" << header << body << "> on handle" << transport().getHandle() <<  endl;
     transport().assertLockedByThisThread();
 
     WriteEntry entry;
     entry.date = Date::now();
-    entry.data = str;
+    entry.data = std::move(header);
+    entry.body = std::move(body);
     entry.next = next;
     entry.onWriteFinished = onWriteFinished;
 
-    //if (str.find("POST") != 0)
-    //    cerr << "SEND " << str << endl;
+    //if (entry.data.find("POST") != 0)
+    //    cerr << "SEND " << entry.data << endl;
 
-    toWrite.push_back(entry);
+    toWrite.push_back(std::move(entry));
 
     if (toWrite.size() == 1) {
         done = 0;
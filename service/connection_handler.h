@@ -28,7 +28,7 @@ struct ConnectionHandler {
     static uint32_t created, destroyed;
 
     ConnectionHandler()
-        : transport_(0), magic(0x1234)
+        : transport_(0), generation_(0), magic(0x1234)
     {
         ML::atomic_add(created, 1);
     }
@@ -99,6 +99,12 @@ struct ConnectionHandler {
         return transport().send(buf, len, flags);
     }
 
+    /** Pass on a gathering send request to the transport. */
+    ssize_t sendv(const iovec * iov, int iovcnt, int flags)
+    {
+        return transport().sendv(iov, iovcnt, flags);
+    }
+
     /** Pass on a recv request to the transport. */
     ssize_t recv(char * buf, size_t buf_size, int flags)
     {
@@ -213,11 +219,41 @@ struct ConnectionHandler {
         transport().doAsync(callback, name);
     }
 
+    /** Same as doAsync(), for a callback that works on this handler.  The
+        handler is kept alive until the callback has run, and the callback
+        is dropped if the handler was cleared of its transport in the
+        meantime, as it may by then be handling another connection.
+    */
+    void doAsyncForThis(const boost::function<void ()> & callback,
+                        const char * name);
+
+    /** Number of times the handler was cleared of its transport. */
+    uint64_t generation() const
+    {
+        return generation_;
+    }
+
+protected:
+    /** Forget the transport once disassociated from it, so that the
+        handler can be associated with another one.
+    */
+    void clearTransport()
+    {
+        transport_ = 0;
+        self_.reset();
+        ML::atomic_inc(generation_);
+    }
+
 private:
     void setTransport(TransportBase * transport);
     TransportBase * transport_;
     friend class TransportBase;
 
+    /* The shared pointer that the transport holds, for doAsyncForThis() */
+    std::weak_ptr<ConnectionHandler> self_;
+
+    uint64_t generation_;
+
     /** Pass on a close peer request. */
     int closePeer()
     {
@@ -256,6 +292,7 @@ struct PassiveConnectionHandler: public ConnectionHandler {
     struct WriteEntry {
         Date date;
         std::string data;
+        std::string body;  // written after data by the same call
         OnWriteFinished onWriteFinished;
         NextAction next;
     };
@@ -268,9 +305,31 @@ struct PassiveConnectionHandler: public ConnectionHandler {
     void send(const std::string & str,
               NextAction action = NEXT_CONTINUE,
               OnWriteFinished onWriteFinished = OnWriteFinished());
+
+    /** Send a header followed by a body with gathering writes, so that
+        they don't need to be joined first.  Both are moved into the
+        queue rather than copied.
+    */
+    void send(std::string header, std::string body,
+              NextAction action = NEXT_CONTINUE,
+              OnWriteFinished onWriteFinished = OnWriteFinished());
     
-    /** Function called out to when we got some data */
-    virtual void handleData(const std::string & data) = 0;
+    /** Function called out to when we got some data.  The data is a view
+        of the connection's read buffer that is only valid during the
+        call.  Returns how many bytes were used; the rest stays in the
+        buffer and is passed again, followed by whatever is read next, on
+        the following call.
+
+        The default copies all of the data into a string for
+        handleData(const std::string &).
+    */
+    virtual size_t handleData(const char * data, size_t size);
+
+    /** Function called out to when we got some data, for the handlers
+        that consume all of it as a string.  One of the two versions must
+        be overridden.
+    */
+    virtual void handleData(const std::string & data);
     
     /** Function called out to when we got an error from the socket. */
     virtual void handleError(const std::string & message) = 0;
@@ -286,6 +345,12 @@ struct PassiveConnectionHandler: public ConnectionHandler {
     virtual void handleTimeout(Date time, size_t cookie);
 
     friend class TransportBase;
+
+protected:
+    /** Pass the transport's read buffer to handleData() and drop what it
+        consumed from it.
+    */
+    void handleReadBuffer();
 };
 
 } // namespace Datacratic
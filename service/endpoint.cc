@@ -38,19 +38,62 @@ namespace Datacratic {
 /* ENDPOINT BASE                                                             */
 /*****************************************************************************/
 
+struct EndpointBase::PollingThread {
+    PollingThread(EndpointBase * endpoint, int threadNum);
+
+    EndpointBase * endpoint;
+    int threadNum;
+
+    /* The endpoint itself for thread 0 */
+    Epoller * poller;
+    std::unique_ptr<Epoller> ownPoller;
+    std::shared_ptr<EpollData> wakeupData;
+
+    /* Only contended by the functions that look at every connection */
+    mutable std::mutex transportsLock;
+    TransportMapping transports;
+    std::map<std::string, int> numTransportsByHost;
+
+    /* Held while accepting, so that the listening socket can't be removed
+       meanwhile */
+    std::mutex acceptLock;
+    EpollData * accepting;
+};
+
+EndpointBase::PollingThread::
+PollingThread(EndpointBase * endpoint, int threadNum)
+    : endpoint(endpoint), threadNum(threadNum), poller(endpoint),
+      accepting(nullptr)
+{
+    if (threadNum == 0)
+        return;
+
+    ownPoller.reset(new Epoller());
+    ownPoller->init(16384, 0, endpoint->pollerBackend_);
+    poller = ownPoller.get();
+
+    // Every thread needs to see the shutdown
+    wakeupData = make_shared<EpollData>(EpollData::EpollDataType::WAKEUP,
+                                        endpoint->wakeup.fd(), this);
+    poller->addFd(wakeupData->fd, wakeupData.get());
+    poller->handleEvent = [=] (epoll_event & event) {
+        return endpoint->handleEpollEvent(event);
+    };
+}
+
+__thread EndpointBase::PollingThread *
+EndpointBase::currentPollingThread = nullptr;
+
 EndpointBase::
 EndpointBase(const std::string & name)
     : idle(1), modifyIdle(true),
       name_(name),
       threadsActive_(0),
       numTransports(0), shutdown_(false), disallowTimers_(false),
-      realTimePolling_(false)
+      realTimePolling_(false), pollPerThread_(false),
+      pollerBackend_(Epoller::EPOLL)
 {
-    Epoller::init(16384);
-    auto wakeupData = make_shared<EpollData>(EpollData::EpollDataType::WAKEUP,
-                                             wakeup.fd());
-    epollDataSet.insert(wakeupData);
-    Epoller::addFd(wakeupData->fd, wakeupData.get());
+    initPoller();
     Epoller::handleEvent = [&] (epoll_event & event) {
         return this->handleEpollEvent(event);
     };
@@ -62,6 +105,32 @@ EndpointBase::
     shutdown();
 }
 
+void
+EndpointBase::
+initPoller()
+{
+    Epoller::init(16384, 0, pollerBackend_);
+    epollDataSet.clear();
+    auto wakeupData = make_shared<EpollData>(EpollData::EpollDataType::WAKEUP,
+                                             wakeup.fd());
+    epollDataSet.insert(wakeupData);
+    Epoller::addFd(wakeupData->fd, wakeupData.get());
+}
+
+void
+EndpointBase::
+setPollerBackend(Epoller::Backend backend)
+{
+    if (eventThreads || epollDataSet.size() > 1)
+        throw ML::Exception("the poller backend must be set before the "
+                            "endpoint is used");
+    if (backend == pollerBackend_)
+        return;
+
+    pollerBackend_ = backend;
+    initPoller();
+}
+
 void
 EndpointBase::
 addPeriodic(double timePeriodSeconds, OnTimer toRun)
@@ -109,12 +178,22 @@ spinup(int num_threads, bool synchronous)
 
     totalSleepTime.resize(num_threads, 1.0);
 
+    pollingThreads.clear();
+    if (pollPerThread_) {
+        ExcCheckGreater(num_threads, 0,
+                        "polling per thread requires event threads");
+        for (unsigned i = 0;  i < num_threads;  ++i)
+            pollingThreads.emplace_back(new PollingThread(this, i));
+    }
+
     for (unsigned i = 0;  i < num_threads;  ++i) {
         boost::thread * thread
             = eventThreads->create_thread
             ([=] ()
              {
-                 this->runEventThread(i, num_threads);
+                 if (this->pollPerThread_)
+                     this->runPollingThread(i);
+                 else this->runEventThread(i, num_threads);
              });
         eventThreadList.push_back(thread);
     }
@@ -166,6 +245,12 @@ shutdown()
         }
     }
 
+    for (const auto & thread: pollingThreads) {
+        std::lock_guard<std::mutex> guard(thread->transportsLock);
+        for (const auto & it: thread->transports)
+            it.first->closeAsync();
+    }
+
     disallowTimers_ = true;
     ML::memory_barrier();
     {
@@ -221,6 +306,7 @@ shutdown()
         eventThreads.reset();
     }
     eventThreadList.clear();
+    pollingThreads.clear();
 
     // Now undo the signal
     wakeup.read();
@@ -231,13 +317,44 @@ void
 EndpointBase::
 useThisThread()
 {
+    ExcCheck(!pollPerThread_, "useThisThread() when polling per thread");
     runEventThread(-1, -1);
 }
 
+EndpointBase::PollingThread *
+EndpointBase::
+currentThread() const
+{
+    PollingThread * thread = currentPollingThread;
+    return thread && thread->endpoint == this ? thread : nullptr;
+}
+
 void
 EndpointBase::
 notifyNewTransport(const std::shared_ptr<TransportBase> & transport)
 {
+    if (transport->getHandle() < 0)
+        throw Exception("notifyNewTransport: fd %d out of range",
+                        transport->getHandle());
+
+    // Transports opened by a thread with its own epoll set stay there
+    if (PollingThread * thread = currentThread()) {
+        auto epollData
+            = make_shared<EpollData>(EpollData::EpollDataType::TRANSPORT,
+                                     transport->epollFd_, thread);
+        epollData->transport = transport;
+        {
+            std::lock_guard<std::mutex> guard(thread->transportsLock);
+            if (!thread->transports.insert({transport, epollData}).second)
+                throw ML::Exception("active set already contains connection");
+            ++thread->numTransportsByHost[transport->getPeerName()];
+        }
+        thread->poller->addFdOneShot(epollData->fd, epollData.get());
+
+        countNewTransport(transport);
+        return;
+    }
+
     Guard guard(lock);
 
     //cerr << "new transport " << transport << endl;
@@ -250,28 +367,78 @@ notifyNewTransport(const std::shared_ptr<TransportBase> & transport)
     epollData->transport = transport;
     transportMapping.insert({transport, epollData});
 
-    int fd = transport->getHandle();
-    if (fd < 0)
-        throw Exception("notifyNewTransport: fd %d out of range");
-
     startPolling(epollData);
 
-    ML::atomic_inc(numTransports);
-    if (numTransports == 1 && modifyIdle)
-        idle.acquire();
-    futex_wake(numTransports);
-
     int & ntr = numTransportsByHost[transport->getPeerName()];
     ++ntr;
 
     //cerr << "host " << transport->getPeerName() << " has "
     //     << ntr << " connections" << endl;
 
+    countNewTransport(transport);
+}
+
+void
+EndpointBase::
+countNewTransport(const std::shared_ptr<TransportBase> & transport)
+{
+    // The threads polling their own set don't hold the lock
+    if (__sync_add_and_fetch(&numTransports, 1) == 1 && modifyIdle)
+        idle.acquire();
+    futex_wake(numTransports);
 
     if (onTransportOpen)
         onTransportOpen(transport.get());
 }
 
+void
+EndpointBase::
+uncountTransport()
+{
+    int remaining = __sync_add_and_fetch(&numTransports, -1);
+    futex_wake(numTransports);
+    if (remaining == 0 && modifyIdle)
+        idle.release();
+}
+
+void
+EndpointBase::
+startAccepting(int threadNum, int fd, OnAcceptReady onAcceptReady)
+{
+    ExcCheckLess(threadNum, numPollingThreads(), "no such polling thread");
+    PollingThread & thread = *pollingThreads[threadNum];
+
+    auto acceptData
+        = make_shared<EpollData>(EpollData::EpollDataType::ACCEPT, fd,
+                                 &thread);
+    acceptData->onAcceptReady = std::move(onAcceptReady);
+    {
+        // Pending events may still point to it after stopAccepting()
+        MutexGuard guard(dataSetLock);
+        epollDataSet.insert(acceptData);
+    }
+
+    std::lock_guard<std::mutex> guard(thread.acceptLock);
+    ExcCheck(!thread.accepting, "thread is already accepting");
+    thread.accepting = acceptData.get();
+    thread.poller->addFdOneShot(fd, acceptData.get());
+}
+
+void
+EndpointBase::
+stopAccepting(int threadNum)
+{
+    ExcCheckLess(threadNum, numPollingThreads(), "no such polling thread");
+    PollingThread & thread = *pollingThreads[threadNum];
+
+    std::lock_guard<std::mutex> guard(thread.acceptLock);
+    if (!thread.accepting)
+        return;
+    thread.poller->removeFd(thread.accepting->fd);
+    thread.accepting->onAcceptReady = nullptr;
+    thread.accepting = nullptr;
+}
+
 void
 EndpointBase::
 startPolling(const shared_ptr<EpollData> & epollData)
@@ -296,7 +463,9 @@ void
 EndpointBase::
 restartPolling(EpollData * epollDataPtr)
 {
-    restartFdOneShot(epollDataPtr->fd, epollDataPtr);
+    Epoller * poller
+        = epollDataPtr->thread ? epollDataPtr->thread->poller : this;
+    poller->restartFdOneShot(epollDataPtr->fd, epollDataPtr);
 }
 
 void
@@ -313,6 +482,31 @@ notifyCloseTransport(const std::shared_ptr<TransportBase> & transport)
     if (onTransportClose)
         onTransportClose(transport.get());
 
+    // Transports are closed by the thread that polls them
+    if (PollingThread * thread = currentThread()) {
+        std::shared_ptr<EpollData> epollData;
+        {
+            std::lock_guard<std::mutex> guard(thread->transportsLock);
+            auto it = thread->transports.find(transport);
+            if (it != thread->transports.end()) {
+                epollData = it->second;
+                thread->transports.erase(it);
+                int & ntr
+                    = thread->numTransportsByHost[transport->getPeerName()];
+                if (--ntr <= 0)
+                    thread->numTransportsByHost.erase(transport->getPeerName());
+            }
+        }
+
+        if (epollData) {
+            thread->poller->removeFd(epollData->fd);
+            transport->zombie_ = true;
+            transport->closePeer();
+            uncountTransport();
+            return;
+        }
+    }
+
     Guard guard(lock);
     if (!transportMapping.count(transport)) {
         cerr << "closed transport " << transport << " with fd "
@@ -334,13 +528,10 @@ notifyCloseTransport(const std::shared_ptr<TransportBase> & transport)
     transport->closePeer();
 
     int & ntr = numTransportsByHost[transport->getPeerName()];
-    ML::atomic_dec(numTransports);
-    futex_wake(numTransports);
     --ntr;
     if (ntr <= 0)
         numTransportsByHost.erase(transport->getPeerName());
-    if (numTransports == 0 && modifyIdle)
-        idle.release();
+    uncountTransport();
 }
 
 void
@@ -375,6 +566,18 @@ sleepUntilIdle() const
                 << transport->isZombie() << endl;
         }
 
+        for (const auto & thread: pollingThreads) {
+            std::lock_guard<std::mutex> guard(thread->transportsLock);
+            cerr << thread->transports.size() << " transports in thread "
+                 << thread->threadNum << endl;
+            for (auto & it: thread->transports) {
+                auto transport = it.first;
+                transport->dumpActivities();
+                cerr << "transport " << transport->status() << " zombie "
+                     << transport->isZombie() << endl;
+            }
+        }
+
         dumpState();
     }
 }
@@ -403,7 +606,13 @@ EndpointBase::
 numConnectionsByHost() const
 {
     Guard guard(lock);
-    return numTransportsByHost;
+    std::map<std::string, int> result = numTransportsByHost;
+    for (const auto & thread: pollingThreads) {
+        std::lock_guard<std::mutex> guard(thread->transportsLock);
+        for (const auto & it: thread->numTransportsByHost)
+            result[it.first] += it.second;
+    }
+    return result;
 }
 
 Epoller::HandleEventResult
@@ -443,6 +652,16 @@ handleEpollEvent(epoll_event & event)
         }
         break;
     }
+    case EpollData::EpollDataType::ACCEPT: {
+        PollingThread * thread = epollDataPtr->thread;
+        std::lock_guard<std::mutex> guard(thread->acceptLock);
+        // stopAccepting() was called since the event was returned
+        if (thread->accepting != epollDataPtr)
+            break;
+        epollDataPtr->onAcceptReady(epollDataPtr->fd);
+        this->restartPolling(epollDataPtr);
+        break;
+    }
     case EpollData::EpollDataType::WAKEUP:
         // wakeup for shutdown
         return Epoller::SHUTDOWN;
@@ -491,12 +710,23 @@ handleTimerEvent(int fd, OnTimer toRun)
     }
 }
 
+void
+EndpointBase::
+placeEventThread(int threadNum)
+{
+    // Pin ourselves before the loop allocates anything so that it's
+    // node-local; the polling thread state was built by spinup()
+    placement_.tryApply(threadNum);
+}
+
 void
 EndpointBase::
 runEventThread(int threadNum, int numThreads)
 {
     prctl(PR_SET_NAME,"EptCtrl",0,0,0);
 
+    placeEventThread(threadNum);
+
     bool debug = false;
     //debug = name() == "Backchannel";
     //debug = threadNum == 7;
@@ -654,4 +884,47 @@ runEventThread(int threadNum, int numThreads)
     futex_wake(threadsActive_);
 }
 
+void
+EndpointBase::
+runPollingThread(int threadNum)
+{
+    prctl(PR_SET_NAME,"EptCtrl",0,0,0);
+
+    placeEventThread(threadNum);
+
+    PollingThread & thread = *pollingThreads[threadNum];
+    Epoller & poller = *thread.poller;
+    currentPollingThread = &thread;
+
+    ML::atomic_inc(threadsActive_);
+    futex_wake(threadsActive_);
+
+    // The other threads don't share the set, so there is no timeslice
+    // and the thread can sleep until it has something to do
+    Date sleepStart;
+    Epoller::OnEvent beforeSleep = [&] ()
+        {
+            sleepStart = Date::now();
+        };
+
+    Epoller::OnEvent afterSleep = [&] ()
+        {
+            totalSleepTime[threadNum] += Date::now().secondsSince(sleepStart);
+        };
+
+    while (!shutdown_) {
+        int numHandled;
+        if (realTimePolling_)
+            numHandled = poller.handleEvents(0, 16, poller.handleEvent);
+        else numHandled = poller.handleEvents(100000, 16, poller.handleEvent,
+                                              beforeSleep, afterSleep);
+        if (numHandled == -1) break;
+    }
+
+    currentPollingThread = nullptr;
+
+    ML::atomic_dec(threadsActive_);
+    futex_wake(threadsActive_);
+}
+
 } // namespace Datacratic
@@ -21,6 +21,7 @@
 #include "transport.h"
 #include "connection_handler.h"
 #include "soa/service/epoller.h"
+#include "soa/service/thread_placement.h"
 #include <map>
 #include <mutex>
 
@@ -113,30 +114,74 @@ struct EndpointBase : public Epoller {
     /** Set this endpoint up to handle events in realtime. */
     void makeRealTime(int priority = 1);
 
+    /** Set where the event threads run; event thread i is placed as thread
+        i of the policy and the accept thread of a passive endpoint can run
+        on any of its CPUs.  Must be called before spinup().
+    */
+    void setThreadPlacement(const ThreadPlacement & placement)
+    {
+        placement.validate();
+        placement_ = placement;
+    }
+
+    const ThreadPlacement & threadPlacement() const { return placement_; }
+
     /** Helps reduce latency jitter caused by the polling loop at the cost of
         busy looping the CPU (100% usage).
     */
     void realTimePolling(bool value) { realTimePolling_ = value; }
 
+    /** Give each event thread its own epoll set instead of having them all
+        share the endpoint's.  The transports opened by an event thread,
+        such as those accepted on the listening socket of that thread by a
+        passive endpoint, are then polled and tracked by that thread only,
+        so that serving them never takes a lock shared with the other
+        threads.  Transports opened from any other thread, as well as
+        periodic jobs, are handled by event thread 0.  Must be called
+        before spinup(), which must start at least one thread.
+    */
+    void pollPerThread(bool value) { pollPerThread_ = value; }
+
+    bool pollsPerThread() const { return pollPerThread_; }
+
+    /** Select the mechanism that the endpoint's epoll sets, including those
+        of pollPerThread(), use to wait for events (see Epoller::Backend).
+        IO_URING falls back to EPOLL on kernels that don't support it.
+        Must be called before anything is added to the endpoint: before
+        spinup(), init() and addPeriodic().
+    */
+    void setPollerBackend(Epoller::Backend backend);
+
+    Epoller::Backend pollerBackend() const { return pollerBackend_; }
+
     /** Spin up the threads as part of the initialization.  NOTE: make sure that this is
         only called once; normally it will be done as part of init().  Calling directly is
         only for advanced use where init() is not called.
     */
     virtual void spinup(int num_threads, bool synchronous);
 
+    /** Function called when a listening socket is ready to accept. */
+    typedef std::function<void (int fd)> OnAcceptReady;
+
+    /** State of an event thread with its own epoll set. */
+    struct PollingThread;
+
     /* internal storage */
     struct EpollData {
         enum EpollDataType {
             INVALID,
             TRANSPORT,
             TIMER,
-            WAKEUP
+            WAKEUP,
+            ACCEPT
         };
 
-        EpollData(EpollData::EpollDataType fdType, int fd)
-            : fdType(fdType), fd(fd), transport(nullptr)
+        EpollData(EpollData::EpollDataType fdType, int fd,
+                  PollingThread * thread = nullptr)
+            : fdType(fdType), fd(fd), thread(thread), transport(nullptr)
         {
-            if (fdType != TRANSPORT && fdType != TIMER && fdType != WAKEUP) {
+            if (fdType != TRANSPORT && fdType != TIMER && fdType != WAKEUP
+                && fdType != ACCEPT) {
                 throw ML::Exception("no such fd type");
             }
         }
@@ -144,8 +189,13 @@ struct EndpointBase : public Epoller {
         EpollDataType fdType;
         int fd;
 
+        /* Event thread with the epoll set of the fd, or null for the
+           endpoint's own */
+        PollingThread * thread;
+
         std::shared_ptr<TransportBase> transport; /* TRANSPORT */
         OnTimer onTimer;                          /* TIMER */
+        OnAcceptReady onAcceptReady;              /* ACCEPT */
     };
 
 protected:
@@ -189,6 +239,24 @@ protected:
     typedef std::set<std::shared_ptr<EpollData>, SPLess> EpollDataSet;
     EpollDataSet epollDataSet;
 
+    /** Number of event threads that have an epoll set of their own, which
+        is 0 unless pollPerThread() was set.
+    */
+    int numPollingThreads() const { return pollingThreads.size(); }
+
+    /** Poll the given listening socket in the epoll set of the given
+        event thread, which calls onAcceptReady each time the socket has
+        connections to accept.  The connections accepted there belong to
+        that thread.
+    */
+    void startAccepting(int threadNum, int fd, OnAcceptReady onAcceptReady);
+
+    /** Stop polling the listening socket of the given event thread.  Once
+        this returns, onAcceptReady isn't running and won't be called
+        again, so the socket can be closed.
+    */
+    void stopAccepting(int threadNum);
+
     /** Tell the endpoint that a connection has been opened. */
     virtual void
     notifyNewTransport(const std::shared_ptr<TransportBase> & transport);
@@ -257,6 +325,30 @@ private:
     // Turns the polling loop into a busy loop with no sleeps.
     bool realTimePolling_;
 
+    ThreadPlacement placement_;
+
+    /** Pin the calling event thread according to placement_ */
+    void placeEventThread(int threadNum);
+
+    bool pollPerThread_;
+
+    Epoller::Backend pollerBackend_;
+
+    /* (Re)initialize our own epoll set with the wakeup fd */
+    void initPoller();
+
+    std::vector<std::unique_ptr<PollingThread> > pollingThreads;
+
+    /** Event thread with its own epoll set that is running in the current
+        thread, if any.
+    */
+    static __thread PollingThread * currentPollingThread;
+
+    /** Return the event thread of this endpoint that is running in the
+        current thread, or null.
+    */
+    PollingThread * currentThread() const;
+
     std::map<std::string, int> numTransportsByHost;
 
     std::vector<double> totalSleepTime;
@@ -264,6 +356,15 @@ private:
     /** Run a thread to handle events. */
     void runEventThread(int threadNum, int numThreads);
 
+    /** Run an event thread that polls its own epoll set. */
+    void runPollingThread(int threadNum);
+
+    /** Count a new transport and tell onTransportOpen about it. */
+    void countNewTransport(const std::shared_ptr<TransportBase> & transport);
+
+    /** Uncount a transport that was closed. */
+    void uncountTransport();
+
     /** Handle a single ePoll event */
     Epoller::HandleEventResult handleEpollEvent(epoll_event & event);
     void handleTransportEvent(const std::shared_ptr<TransportBase>
@@ -5,6 +5,7 @@
 */
 
 #include "soa/service/epoller.h"
+#include "soa/service/io_uring_poller.h"
 
 #include <sys/epoll.h>
 #include <poll.h>
@@ -22,6 +23,29 @@ namespace Datacratic {
 // Maximum number of events that we can handle
 static constexpr int MaxEvents = 1024;
 
+// Epoller whose events the current thread is handling.  Requests made from
+// within its handlers are submitted once the batch is done.
+static __thread const Epoller * handlingEpoller = nullptr;
+
+namespace {
+
+struct HandlingGuard {
+    HandlingGuard(const Epoller * epoller)
+        : previous(handlingEpoller)
+    {
+        handlingEpoller = epoller;
+    }
+
+    ~HandlingGuard()
+    {
+        handlingEpoller = previous;
+    }
+
+    const Epoller * previous;
+};
+
+} // file scope
+
 
 /*****************************************************************************/
 /* EPOLLER                                                                   */
@@ -41,15 +65,20 @@ Epoller::
 
 void
 Epoller::
-init(int maxFds, int timeout)
+init(int maxFds, int timeout, Backend backend)
 {
     //cerr << "initializing epoller at " << this << endl;
     //backtrace();
     close();
 
-    epoll_fd = epoll_create(maxFds);
-    if (epoll_fd == -1)
-        throw ML::Exception(errno, "EndpointBase epoll_create()");
+    if (backend == IO_URING && IoUringPoller::supported()) {
+        uring_.reset(new IoUringPoller(maxFds));
+    }
+    else {
+        epoll_fd = epoll_create(maxFds);
+        if (epoll_fd == -1)
+            throw ML::Exception(errno, "EndpointBase epoll_create()");
+    }
 
     timeout_ = timeout;
 }
@@ -58,6 +87,8 @@ void
 Epoller::
 close()
 {
+    uring_.reset();
+
     if (epoll_fd < 0)
         return;
     //cerr << "closing epoller at " << this << endl;
@@ -72,12 +103,17 @@ removeFd(int fd)
 {
     //cerr << Date::now().print(4) << "removed " << fd << endl;
 
-    int res = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, 0);
-    
-    if (res == -1) {
-        if (errno != EBADF)
-            throw ML::Exception("epoll_ctl DEL fd %d: %s", fd,
-                                strerror(errno));
+    if (uring_) {
+        if (!uring_->remove(fd, handlingEpoller == this))
+            throw ML::Exception("io_uring remove fd %d: not watched", fd);
+    }
+    else {
+        int res = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, 0);
+        if (res == -1) {
+            if (errno != EBADF)
+                throw ML::Exception("epoll_ctl DEL fd %d: %s", fd,
+                                    strerror(errno));
+        }
     }
 
     if (numFds_ > 0) {
@@ -112,16 +148,64 @@ handleEvents(int usToWait, int nEvents,
     if (nEvents > MaxEvents)
         nEvents = MaxEvents;
 
+    epoll_event events[nEvents];
+
+    int res = waitForEvents(events, nEvents, usToWait,
+                            beforeSleep, afterSleep);
+    if (res <= 0)
+        return res;
+
+    HandlingGuard guard(this);
+    for (unsigned i = 0;  i < res;  ++i) {
+        if (handleEvent(events[i]) == SHUTDOWN) {
+            doneHandling();
+            return -1;
+        }
+    }
+    doneHandling();
+
+    return res;
+}
+
+int
+Epoller::
+handleEventBatch(EventBuffer & buffer, const HandleBatch & handleBatch,
+                 int usToWait,
+                 const OnEvent & beforeSleep_,
+                 const OnEvent & afterSleep_)
+{
+    const OnEvent & beforeSleep
+        = beforeSleep_ ? beforeSleep_ : this->beforeSleep;
+    const OnEvent & afterSleep
+        = afterSleep_ ? afterSleep_ : this->afterSleep;
+
+    int res = waitForEvents(buffer.events(), buffer.capacity(), usToWait,
+                            beforeSleep, afterSleep);
+    if (res <= 0)
+        return res;
+
+    HandlingGuard guard(this);
+    HandleEventResult result = handleBatch(buffer.events(), res);
+    doneHandling();
+
+    return result == SHUTDOWN ? -1 : res;
+}
+
+int
+Epoller::
+waitForEvents(epoll_event * events, int nEvents, int usToWait,
+              const OnEvent & beforeSleep, const OnEvent & afterSleep)
+{
     for (;;) {
-        epoll_event events[nEvents];
-                
         if (beforeSleep)
             beforeSleep();
 
         // Do the sleep with nanosecond resolution
         // Let's hope it doesn't busy-wait
         if (usToWait != 0) {
-            pollfd fd[1] = { { epoll_fd, POLLIN, 0 } };
+            if (uring_)
+                uring_->flush();
+            pollfd fd[1] = { { selectFd(), POLLIN, 0 } };
             timespec timeout = { 0, usToWait * 1000 };
             int res = ppoll(fd, 1, &timeout, 0);
             if (res == -1 && errno == EBADF) {
@@ -134,7 +218,7 @@ handleEvents(int usToWait, int nEvents,
             if (res == 0) return 0;
         }
 
-        int res = epoll_wait(epoll_fd, events, nEvents, timeout_);
+        int res = wait(events, nEvents, timeout_);
 
         if (afterSleep)
             afterSleep();
@@ -153,13 +237,61 @@ handleEvents(int usToWait, int nEvents,
             //cerr << "nEvents = " << nEvents << endl;
             throw Exception(errno, "epoll_wait");
         }
-        nEvents = res;
-        
-        for (unsigned i = 0;  i < nEvents;  ++i) {
-            if (handleEvent(events[i]) == SHUTDOWN) return -1;
+
+        return res;
+    }
+}
+
+int
+Epoller::
+spinEvents(double maxSpinSeconds, int nEvents,
+           const HandleEvent & handleEvent_)
+{
+    if (nEvents == -1) {
+        nEvents = std::max<int>(numFds_, 1);
+    }
+
+    const HandleEvent & handleEvent
+        = handleEvent_ ? handleEvent_ : this->handleEvent;
+
+    if (nEvents <= 0)
+        throw ML::Exception("can't wait for no events");
+
+    if (nEvents > MaxEvents)
+        nEvents = MaxEvents;
+
+    epoll_event events[nEvents];
+
+    Date start = Date::now();
+    for (unsigned iter = 0;  ;  ++iter) {
+        // Never block, whatever timeout_ is
+        int res = wait(events, nEvents, 0);
+
+        if (res == -1 && errno == EINTR) continue;
+        if (res == -1 && errno == EBADF) {
+            cerr << "got bad FD" << endl;
+            return -1;
         }
-                
-        return nEvents;
+        if (res == -1)
+            throw Exception(errno, "epoll_wait");
+
+        if (res > 0) {
+            HandlingGuard guard(this);
+            for (unsigned i = 0;  i < res;  ++i) {
+                if (handleEvent(events[i]) == SHUTDOWN) {
+                    doneHandling();
+                    return -1;
+                }
+            }
+            doneHandling();
+            return res;
+        }
+
+        // Reading the clock costs about as much as an empty epoll_wait, so
+        // only do it every few iterations.
+        if (iter % 16 == 15
+            && Date::now().secondsSince(start) >= maxSpinSeconds)
+            return 0;
     }
 }
 
@@ -168,7 +300,7 @@ Epoller::
 poll() const
 {
     for (;;) {
-        pollfd fds[1] = { { epoll_fd, POLLIN, 0 } };
+        pollfd fds[1] = { { selectFd(), POLLIN, 0 } };
         int res = ::poll(fds, 1, 0);
 
         //cerr << "poll res = " << res << endl;
@@ -186,7 +318,8 @@ poll() const
 
 void
 Epoller::
-performAddFd(int fd, void * data, bool oneshot, bool restart)
+performAddFd(int fd, void * data, bool oneshot, bool restart,
+             bool edgeTriggered)
 {
     // cerr << (Date::now().print(4)
     //          + " performAddFd: epoll_fd=" + to_string(epoll_fd)
@@ -195,16 +328,31 @@ performAddFd(int fd, void * data, bool oneshot, bool restart)
     //          + " restart=" + to_string(restart)
     //          + "\n");
 
+    if (!restart) {
+        numFds_++;
+    }
+
+    if (uring_) {
+        bool defer = handlingEpoller == this;
+        if (restart)
+            uring_->restart(fd, data, defer);
+        else uring_->add(fd, data,
+                         edgeTriggered ? IoUringPoller::EDGE_TRIGGERED
+                         : oneshot ? IoUringPoller::ONE_SHOT
+                         : IoUringPoller::LEVEL_TRIGGERED,
+                         defer);
+        return;
+    }
+
     struct epoll_event event;
     event.events = EPOLLIN;
     if (oneshot) {
         event.events |= EPOLLONESHOT;
     }
-    event.data.ptr = data;
-
-    if (!restart) {
-        numFds_++;
+    if (edgeTriggered) {
+        event.events |= EPOLLET;
     }
+    event.data.ptr = data;
 
     int action = restart ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
     int res = epoll_ctl(epoll_fd, action, fd, &event);
@@ -215,6 +363,30 @@ performAddFd(int fd, void * data, bool oneshot, bool restart)
                             strerror(errno), fd, epoll_fd, oneshot, restart);
 }
 
+int
+Epoller::
+selectFd() const
+{
+    return uring_ ? uring_->fd() : epoll_fd;
+}
+
+int
+Epoller::
+wait(epoll_event * events, int nEvents, int timeout)
+{
+    if (uring_)
+        return uring_->wait(events, nEvents, timeout);
+    return epoll_wait(epoll_fd, events, nEvents, timeout);
+}
+
+void
+Epoller::
+doneHandling()
+{
+    if (uring_)
+        uring_->flush();
+}
+
 bool
 Epoller::
 processOne()
@@ -225,4 +397,23 @@ processOne()
     return poll();
 }
 
+
+/*****************************************************************************/
+/* EPOLLER EVENT BUFFER                                                      */
+/*****************************************************************************/
+
+Epoller::EventBuffer::
+EventBuffer(int capacity)
+    : capacity_(capacity)
+{
+    if (capacity <= 0)
+        throw ML::Exception("event buffer needs room for at least one event");
+    events_.reset(new epoll_event[capacity]);
+}
+
+Epoller::EventBuffer::
+~EventBuffer()
+{
+}
+
 } // namespace Datacratic
@@ -9,18 +9,27 @@
 #define __endpoint__epoller_h__
 
 #include <functional>
+#include <memory>
 #include "soa/service/async_event_source.h"
 
 struct epoll_event;
 
 namespace Datacratic {
 
+struct IoUringPoller;
+
 /*****************************************************************************/
 /* EPOLLER                                                                   */
 /*****************************************************************************/
 
 /** Basic wrapper around the epoll interface to turn it into an async event
     source.
+
+    The IO_URING backend replaces epoll with poll requests on an io_uring
+    (see IoUringPoller), which lets the re-arming of one-shot fds be
+    submitted in a single system call with the next wait instead of one
+    epoll_ctl() each.  It behaves the same for the users of the class,
+    including the epoll_event passed to the handlers.
 */
 
 struct Epoller: public AsyncEventSource {
@@ -29,7 +38,20 @@ struct Epoller: public AsyncEventSource {
 
     ~Epoller();
 
-    void init(int maxFds, int timeout = 0);
+    enum Backend {
+        EPOLL,
+        IO_URING
+    };
+
+    /** Set up the multiplexer.  IO_URING falls back to EPOLL when the
+        kernel doesn't support it; backend() tells which one is in use.
+    */
+    void init(int maxFds, int timeout = 0, Backend backend = EPOLL);
+
+    Backend backend() const
+    {
+        return uring_ ? IO_URING : EPOLL;
+    }
 
     void close();
 
@@ -55,6 +77,17 @@ struct Epoller: public AsyncEventSource {
         performAddFd(fd, data, true, true);
     }
 
+    /** Add the given fd in edge-triggered mode.  It only wakes up the loop
+        when it becomes readable and never needs to be restarted, so the
+        handler must drain it (read until EAGAIN) or it won't fire again.
+        Unlike with one-shot fds, another thread can get an event for the
+        fd while the first one is still handling it.
+    */
+    void addFdEdgeTriggered(int fd, void * data = 0)
+    {
+        performAddFd(fd, data, false, false, true);
+    }
+
     /** Remove the given fd from the multiplexer set. */
     void removeFd(int fd);
     
@@ -66,6 +99,28 @@ struct Epoller: public AsyncEventSource {
     typedef std::function<HandleEventResult (epoll_event & event)> HandleEvent;
     typedef std::function<void ()> OnEvent;
 
+    /** Handler that gets all the events returned by a wait at once, which
+        lets it drain every ready fd before anything is re-armed.
+    */
+    typedef std::function<HandleEventResult (epoll_event * events,
+                                             int numEvents)> HandleBatch;
+
+    /** Buffer receiving the events for handleEventBatch().  It is meant to
+        be allocated once by each thread that handles events and reused
+        for every call.
+    */
+    struct EventBuffer {
+        EventBuffer(int capacity);
+        ~EventBuffer();
+
+        int capacity() const { return capacity_; }
+        epoll_event * events() { return events_.get(); }
+
+    private:
+        int capacity_;
+        std::unique_ptr<epoll_event[]> events_;
+    };
+
     /** Default event handler function to use. */
     HandleEvent handleEvent;
 
@@ -88,10 +143,31 @@ struct Epoller: public AsyncEventSource {
                      const OnEvent & beforeSleep = OnEvent(),
                      const OnEvent & afterSleep = OnEvent());
 
-    virtual int selectFd() const
-    {
-        return epoll_fd;
-    }
+    /** Same as handleEvents(), but for up to buffer.capacity() events which
+        are passed to handleBatch in a single call once they are all in the
+        caller's buffer.
+
+        Returns the number of events handled or -1 if handleBatch returned
+        SHUTDOWN.
+    */
+    int handleEventBatch(EventBuffer & buffer,
+                         const HandleBatch & handleBatch,
+                         int usToWait = 0,
+                         const OnEvent & beforeSleep = OnEvent(),
+                         const OnEvent & afterSleep = OnEvent());
+
+    /** Busy-poll the epoll set without ever blocking in the kernel, for up
+        to the given number of seconds or until at least one event has
+        been handled, which avoids the cost of an eventfd and scheduler
+        wakeup at the price of a spinning CPU.
+
+        Returns the number of events handled, 0 if the time ran out, or -1
+        if a handler forced the event handler to exit.
+    */
+    int spinEvents(double maxSpinSeconds, int nEvents = -1,
+                   const HandleEvent & handleEvent = HandleEvent());
+
+    virtual int selectFd() const;
 
     virtual bool poll() const;
 
@@ -99,7 +175,20 @@ struct Epoller: public AsyncEventSource {
     
 private:
     /* Perform the fd addition and modification */
-    void performAddFd(int fd, void * data, bool oneShot, bool restart);
+    void performAddFd(int fd, void * data, bool oneShot, bool restart,
+                      bool edgeTriggered = false);
+
+    /* Sleep for up to usToWait if it isn't 0, then wait for up to nEvents
+       events.  Returns the number of events, 0 if there were none or -1 if
+       the epoll fd was closed. */
+    int waitForEvents(epoll_event * events, int nEvents, int usToWait,
+                      const OnEvent & beforeSleep, const OnEvent & afterSleep);
+
+    /* epoll_wait() on whichever backend is in use */
+    int wait(epoll_event * events, int nEvents, int timeout);
+
+    /* Called once the events returned by wait() are handled */
+    void doneHandling();
 
     /* Fd for the epoll mechanism. */
     int epoll_fd;
@@ -109,6 +198,9 @@ private:
 
     /* Number of registered file descriptors */
     size_t numFds_;
+
+    /* Replaces epoll_fd with the IO_URING backend */
+    std::unique_ptr<IoUringPoller> uring_;
 };
 
 } // namespace Datacratic
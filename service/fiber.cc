@@ -0,0 +1,329 @@
+/* fiber.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+*/
+
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "jml/arch/exception.h"
+#include "jml/utils/exc_assert.h"
+
+#include "message_loop.h"
+#include "fiber.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* FIBER SCHEDULER                                                           */
+/*****************************************************************************/
+
+struct FiberScheduler::Fiber {
+    FiberScheduler * scheduler;
+    ucontext_t context;
+
+    /* Mapping of the stack, guard page included */
+    void * stack;
+    size_t mappingSize;
+
+    FiberFn fn;
+    bool finished;
+    std::exception_ptr exception;
+};
+
+__thread FiberScheduler::Fiber * FiberScheduler::currentFiber = nullptr;
+
+FiberScheduler::
+FiberScheduler(size_t stackSize, size_t maxPooledFibers)
+    : maxPooledFibers_(maxPooledFibers),
+      wakeup_(EFD_NONBLOCK),
+      signalled_(false),
+      numFibers_(0)
+{
+    size_t pageSize = getpagesize();
+    stackSize_ = (std::max(stackSize, size_t(16384)) + pageSize - 1)
+        & ~(pageSize - 1);
+}
+
+FiberScheduler::
+~FiberScheduler()
+{
+    for (Fiber * fiber: fibers_)
+        destroyFiber(fiber);
+}
+
+FiberScheduler *
+FiberScheduler::
+current()
+{
+    return currentFiber ? currentFiber->scheduler : nullptr;
+}
+
+void
+FiberScheduler::
+sleep(double seconds)
+{
+    FiberScheduler * scheduler = current();
+    ExcCheck(scheduler, "FiberScheduler::sleep() called outside of a fiber");
+    ExcCheck(scheduler->parent_, "FiberScheduler isn't in a MessageLoop");
+
+    FiberWaiter waiter;
+    scheduler->parent_->timers().schedule(seconds, [&] (uint64_t) {
+            waiter.notify();
+        });
+    waiter.wait();
+}
+
+void
+FiberScheduler::
+spawn(FiberFn fn)
+{
+    Fiber * fiber = allocateFiber();
+    fiber->fn = std::move(fn);
+    fiber->finished = false;
+    fiber->exception = nullptr;
+
+    if (getcontext(&fiber->context) == -1)
+        throw ML::Exception(errno, "getcontext");
+    size_t pageSize = getpagesize();
+    fiber->context.uc_stack.ss_sp = (char *)fiber->stack + pageSize;
+    fiber->context.uc_stack.ss_size = fiber->mappingSize - pageSize;
+    fiber->context.uc_link = nullptr;
+
+    // makecontext() only passes ints
+    uintptr_t address = reinterpret_cast<uintptr_t>(fiber);
+    makecontext(&fiber->context, (void (*)())&FiberScheduler::trampoline, 2,
+                int(uint64_t(address) >> 32), int(address & 0xffffffff));
+
+    ++numFibers_;
+    resume(fiber);
+}
+
+void
+FiberScheduler::
+trampoline(int high, int low)
+{
+    uintptr_t address = (uint64_t(uint32_t(high)) << 32) | uint32_t(low);
+    Fiber * fiber = reinterpret_cast<Fiber *>(address);
+
+    // Nothing may unwind past the beginning of the stack
+    try {
+        fiber->fn();
+    } catch (...) {
+        fiber->exception = std::current_exception();
+    }
+
+    fiber->fn = nullptr;
+    fiber->finished = true;
+    swapcontext(&fiber->context, &fiber->scheduler->loopContext_);
+}
+
+void
+FiberScheduler::
+suspend()
+{
+    Fiber * fiber = currentFiber;
+    ExcAssert(fiber);
+    if (swapcontext(&fiber->context, &fiber->scheduler->loopContext_) == -1)
+        throw ML::Exception(errno, "swapcontext");
+}
+
+void
+FiberScheduler::
+resume(Fiber * fiber)
+{
+    bool signal;
+    {
+        Guard guard(lock_);
+        ready_.push_back(fiber);
+        signal = !signalled_;
+        signalled_ = true;
+    }
+
+    if (signal)
+        wakeup_.signal();
+}
+
+bool
+FiberScheduler::
+poll() const
+{
+    Guard guard(lock_);
+    return !ready_.empty();
+}
+
+bool
+FiberScheduler::
+processOne()
+{
+    ExcAssert(!currentFiber);
+
+    // The fd is read before the queue is taken: a fiber queued afterwards
+    // signals it again.
+    wakeup_.tryRead();
+    {
+        Guard guard(lock_);
+        running_.swap(ready_);
+        signalled_ = false;
+    }
+
+    for (size_t i = 0;  i < running_.size();  ++i) {
+        Fiber * fiber = running_[i];
+
+        currentFiber = fiber;
+        int res = swapcontext(&loopContext_, &fiber->context);
+        currentFiber = nullptr;
+        if (res == -1)
+            throw ML::Exception(errno, "swapcontext");
+
+        if (!fiber->finished)
+            continue;
+
+        std::exception_ptr exception = std::move(fiber->exception);
+        fiber->exception = nullptr;
+        --numFibers_;
+        releaseFiber(fiber);
+
+        if (exception) {
+            // The rest of the batch runs on the next call
+            {
+                Guard guard(lock_);
+                ready_.insert(ready_.begin(),
+                              running_.begin() + i + 1, running_.end());
+                signalled_ = true;
+            }
+            wakeup_.signal();
+            running_.clear();
+            std::rethrow_exception(exception);
+        }
+    }
+    running_.clear();
+
+    return poll();
+}
+
+FiberScheduler::Fiber *
+FiberScheduler::
+allocateFiber()
+{
+    {
+        Guard guard(lock_);
+        if (!pool_.empty()) {
+            Fiber * fiber = pool_.back();
+            pool_.pop_back();
+            return fiber;
+        }
+    }
+
+    size_t pageSize = getpagesize();
+    size_t mappingSize = stackSize_ + pageSize;
+    void * stack = mmap(0, mappingSize, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+        throw ML::Exception(errno, "mmap of fiber stack");
+
+    // The stack grows down, into the guard page on overflow
+    if (mprotect(stack, pageSize, PROT_NONE) == -1) {
+        int error = errno;
+        munmap(stack, mappingSize);
+        throw ML::Exception(error, "mprotect of fiber stack guard page");
+    }
+
+    Fiber * fiber = new Fiber();
+    fiber->scheduler = this;
+    fiber->stack = stack;
+    fiber->mappingSize = mappingSize;
+
+    Guard guard(lock_);
+    fibers_.insert(fiber);
+    return fiber;
+}
+
+void
+FiberScheduler::
+releaseFiber(Fiber * fiber)
+{
+    {
+        Guard guard(lock_);
+        if (pool_.size() < maxPooledFibers_) {
+            pool_.push_back(fiber);
+            return;
+        }
+        fibers_.erase(fiber);
+    }
+
+    destroyFiber(fiber);
+}
+
+void
+FiberScheduler::
+destroyFiber(Fiber * fiber)
+{
+    munmap(fiber->stack, fiber->mappingSize);
+    delete fiber;
+}
+
+
+/*****************************************************************************/
+/* FIBER WAITER                                                              */
+/*****************************************************************************/
+
+FiberWaiter::
+FiberWaiter()
+    : scheduler_(FiberScheduler::current()),
+      fiber_(FiberScheduler::currentFiber)
+{
+    ExcCheck(fiber_, "FiberWaiter created outside of a fiber");
+}
+
+void
+FiberWaiter::
+wait()
+{
+    ExcAssertEqual(FiberScheduler::currentFiber, fiber_);
+    FiberScheduler::suspend();
+}
+
+void
+FiberWaiter::
+notify()
+{
+    scheduler_->resume(fiber_);
+}
+
+
+/*****************************************************************************/
+/* FIBER JOIN                                                                */
+/*****************************************************************************/
+
+FiberJoin::
+FiberJoin(int count)
+    : count_(count), remaining_(count)
+{
+    ExcAssertGreaterEqual(count, 0);
+}
+
+void
+FiberJoin::
+done()
+{
+    int remaining = --remaining_;
+    ExcAssertGreaterEqual(remaining, 0);
+    if (remaining == 0)
+        waiter_.notify();
+}
+
+void
+FiberJoin::
+wait()
+{
+    // With a count of 0, nothing will notify the waiter
+    if (count_ > 0)
+        waiter_.wait();
+}
+
+} // namespace Datacratic
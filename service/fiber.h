@@ -0,0 +1,290 @@
+/* fiber.h                                                         -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Fibers running on a MessageLoop, which let asynchronous code wait for
+   its results instead of chaining callbacks.
+*/
+
+#pragma once
+
+#include <ucontext.h>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "jml/arch/spinlock.h"
+#include "jml/arch/wakeup_fd.h"
+
+#include "async_event_source.h"
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* FIBER SCHEDULER                                                           */
+/*****************************************************************************/
+
+/** Event source that runs fibers: functions with a stack of their own,
+    which can suspend themselves while they wait for an asynchronous
+    operation and get resumed by its callback.  A sequence of asynchronous
+    steps can then be written as straight-line code, with its state in
+    local variables, rather than as a chain of callbacks that each own a
+    copy of it.
+
+    The scheduler must be added to a MessageLoop, and all its fibers run
+    within its processOne(), on the thread of the worker that it was given
+    to.  A fiber runs until it returns or waits for something (see
+    FiberWaiter); it is never preempted.  Fibers can be spawned and
+    resumed from any thread.
+
+    Stacks are mapped with a guard page and recycled: the scheduler keeps
+    up to maxPooledFibers of them once their fiber returns, so spawning a
+    fiber normally costs no allocation beyond its function.  Code running
+    in a fiber must fit in its stack; deep recursion or large local arrays
+    will hit the guard page.
+
+    A scheduler is single threaded, even in a MessageLoop with several
+    workers: it is never put in the loop's steal set, so a fiber is always
+    resumed on the thread it started on and code running in a fiber can
+    keep using thread-local state across its waits.
+
+    A fiber must not wait from within a catch block, since the exception
+    being handled belongs to the thread rather than to the fiber.  Fibers
+    that are still suspended when the scheduler is destroyed are
+    abandoned: their stack is freed without unwinding it.
+*/
+
+struct FiberScheduler : public AsyncEventSource {
+    typedef std::function<void ()> FiberFn;
+
+    FiberScheduler(size_t stackSize = 64 * 1024,
+                   size_t maxPooledFibers = 256);
+
+    ~FiberScheduler();
+
+    /** Runs fn in a new fiber.  It starts on the next call to processOne().
+        An exception that escapes fn is rethrown by processOne().
+    */
+    void spawn(FiberFn fn);
+
+    /** Number of fibers that were spawned and haven't returned yet. */
+    size_t numFibers() const
+    {
+        return numFibers_;
+    }
+
+    /** Scheduler of the fiber running on this thread, or null outside of
+        a fiber.
+    */
+    static FiberScheduler * current();
+
+    /** Suspends the running fiber for the given number of seconds, using
+        the timer wheel of the scheduler's MessageLoop.
+    */
+    static void sleep(double seconds);
+
+    virtual int selectFd() const
+    {
+        return wakeup_.fd();
+    }
+
+    virtual bool poll() const;
+
+    virtual bool processOne();
+
+    /** Always true, so that fibers don't migrate between threads. */
+    virtual bool singleThreaded() const
+    {
+        return true;
+    }
+
+private:
+    friend struct FiberWaiter;
+
+    struct Fiber;
+
+    /* Fiber running on this thread, if any */
+    static __thread Fiber * currentFiber;
+
+    static void trampoline(int high, int low);
+
+    /* Suspends the running fiber until it's resumed */
+    static void suspend();
+
+    /* Queues the fiber to be run by the next processOne() */
+    void resume(Fiber * fiber);
+
+    Fiber * allocateFiber();
+    void releaseFiber(Fiber * fiber);
+    void destroyFiber(Fiber * fiber);
+
+    size_t stackSize_;
+    size_t maxPooledFibers_;
+
+    ML::Wakeup_Fd wakeup_;
+
+    typedef ML::Spinlock Lock;
+    typedef std::lock_guard<Lock> Guard;
+    mutable Lock lock_;
+
+    /* Fibers to run; guarded by lock_ */
+    std::vector<Fiber *> ready_;
+    bool signalled_;
+
+    /* Stacks ready to be reused and every fiber that exists; guarded by
+       lock_ */
+    std::vector<Fiber *> pool_;
+    std::unordered_set<Fiber *> fibers_;
+
+    std::atomic<size_t> numFibers_;
+
+    /* Fibers being run by processOne() and the context it runs them from;
+       only used by the thread running processOne() */
+    std::vector<Fiber *> running_;
+    ucontext_t loopContext_;
+};
+
+
+/*****************************************************************************/
+/* FIBER WAITER                                                              */
+/*****************************************************************************/
+
+/** Suspends the fiber that creates it until notify() is called, which is
+    meant to be done by the callback of an asynchronous operation, from
+    any thread.  notify() must be called exactly once; it can be called
+    before wait(), in which case wait() returns on the next round of the
+    scheduler.
+
+    notify() doesn't touch the waiter once the fiber can run, so the
+    waiter can live on the stack of the fiber even when it's notified from
+    another thread.
+*/
+
+struct FiberWaiter {
+    /** Must be created in a fiber */
+    FiberWaiter();
+
+    void wait();
+
+    void notify();
+
+private:
+    FiberScheduler * scheduler_;
+    FiberScheduler::Fiber * fiber_;
+};
+
+
+/*****************************************************************************/
+/* FIBER RESULT                                                              */
+/*****************************************************************************/
+
+/** FiberWaiter that carries the result of an asynchronous operation from
+    its callback to the fiber.  The result doesn't need to be default
+    constructible.
+*/
+
+template<typename Result>
+struct FiberResult {
+    FiberResult()
+        : isSet_(false)
+    {
+    }
+
+    ~FiberResult()
+    {
+        if (isSet_)
+            result()->~Result();
+    }
+
+    void set(Result result)
+    {
+        new (&storage_) Result(std::move(result));
+        isSet_ = true;
+        waiter_.notify();
+    }
+
+    Result get()
+    {
+        waiter_.wait();
+        return std::move(*result());
+    }
+
+private:
+    FiberWaiter waiter_;
+    bool isSet_;
+    typename std::aligned_storage<sizeof(Result),
+                                  alignof(Result)>::type storage_;
+
+    Result * result()
+    {
+        return reinterpret_cast<Result *>(&storage_);
+    }
+};
+
+/** Starts an asynchronous operation by calling start with a callback to
+    be called with its result, and suspends the fiber until it is.  For
+    example:
+
+        auto reply = awaitResult<Redis::Result>(
+                [&] (FiberCallback<Redis::Result> done) {
+                    connection.queue(command, done);
+                });
+
+    The callback only holds a pointer, so it fits in the small object
+    buffer of std::function and boost::function and doesn't allocate.
+*/
+
+template<typename Result>
+struct FiberCallback {
+    FiberCallback(FiberResult<Result> * result)
+        : result_(result)
+    {
+    }
+
+    void operator () (const Result & result) const
+    {
+        result_->set(result);
+    }
+
+private:
+    FiberResult<Result> * result_;
+};
+
+template<typename Result, typename Start>
+Result awaitResult(const Start & start)
+{
+    FiberResult<Result> result;
+    start(FiberCallback<Result>(&result));
+    return result.get();
+}
+
+
+/*****************************************************************************/
+/* FIBER JOIN                                                                */
+/*****************************************************************************/
+
+/** Waits for a fixed number of operations, typically the fibers spawned to
+    fan a request out: each of them calls done() when it finishes and the
+    fiber that spawned them calls wait().
+*/
+
+struct FiberJoin {
+    /** Must be created in a fiber */
+    FiberJoin(int count);
+
+    void done();
+
+    void wait();
+
+private:
+    int count_;
+    std::atomic<int> remaining_;
+    FiberWaiter waiter_;
+};
+
+} // namespace Datacratic
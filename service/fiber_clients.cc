@@ -0,0 +1,175 @@
+/* fiber_clients.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+*/
+
+#include <errno.h>
+
+#include "jml/utils/exc_assert.h"
+
+#include "fiber_clients.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+namespace {
+
+/* Callbacks of a request made by awaitHttp(), which live on the stack of
+   the fiber */
+struct FiberHttpCallbacks : public HttpClientCallbacks {
+    virtual void onResponseStart(const HttpRequest & rq,
+                                 const string & httpVersion, int code)
+    {
+        response.code = code;
+    }
+
+    virtual void onHeader(const HttpRequest & rq,
+                          const char * data, size_t size)
+    {
+        response.headers.append(data, size);
+    }
+
+    virtual void onData(const HttpRequest & rq,
+                        const char * data, size_t size)
+    {
+        response.body.append(data, size);
+    }
+
+    virtual void onDone(const HttpRequest & rq, HttpClientError error)
+    {
+        response.error = error;
+        result.set(move(response));
+    }
+
+    FiberHttpResponse response;
+    FiberResult<FiberHttpResponse> result;
+};
+
+} // file scope
+
+
+/*****************************************************************************/
+/* AWAITABLES                                                                */
+/*****************************************************************************/
+
+FiberHttpResponse
+awaitHttp(HttpClient & client,
+          const string & verb,
+          const string & resource,
+          const HttpRequest::Content & content,
+          const RestParams & queryParams,
+          const RestParams & headers,
+          int timeout)
+{
+    FiberHttpCallbacks callbacks;
+
+    // The request only holds the callbacks until onDone(), and the fiber
+    // doesn't return before that, so it doesn't need to own them.
+    shared_ptr<HttpClientCallbacks> unowned(shared_ptr<void>(), &callbacks);
+
+    if (!client.enqueueRequest(verb, resource, unowned, content,
+                               queryParams, headers, timeout)) {
+        FiberHttpResponse response;
+        response.error = HttpClientError::Unknown;
+        return response;
+    }
+
+    return callbacks.result.get();
+}
+
+TcpConnectionResult
+awaitConnect(TcpClient & client)
+{
+    auto connect = [&] (FiberCallback<TcpConnectionResult> done) {
+        client.connect(done);
+    };
+    return awaitResult<TcpConnectionResult>(connect);
+}
+
+AsyncWriteResult
+awaitWrite(AsyncWriterSource & source, string data)
+{
+    auto write = [&] (FiberCallback<AsyncWriteResult> done) {
+        if (!source.write(move(data), done))
+            done(AsyncWriteResult(EAGAIN, string(), 0));
+    };
+    return awaitResult<AsyncWriteResult>(write);
+}
+
+
+/*****************************************************************************/
+/* FIBER READER                                                              */
+/*****************************************************************************/
+
+FiberReader::
+FiberReader()
+    : closed_(false), waiter_(nullptr)
+{
+}
+
+void
+FiberReader::
+push(const char * data, size_t size)
+{
+    FiberWaiter * waiter;
+    {
+        Guard guard(lock_);
+        buffer_.append(data, size);
+        waiter = takeWaiter();
+    }
+
+    if (waiter)
+        waiter->notify();
+}
+
+void
+FiberReader::
+close()
+{
+    FiberWaiter * waiter;
+    {
+        Guard guard(lock_);
+        closed_ = true;
+        waiter = takeWaiter();
+    }
+
+    if (waiter)
+        waiter->notify();
+}
+
+string
+FiberReader::
+read()
+{
+    FiberWaiter waiter;
+    bool mustWait(false);
+    {
+        Guard guard(lock_);
+        ExcAssert(!waiter_);
+        if (buffer_.empty() && !closed_) {
+            waiter_ = &waiter;
+            mustWait = true;
+        }
+    }
+
+    if (mustWait)
+        waiter.wait();
+
+    Guard guard(lock_);
+    string result;
+    result.swap(buffer_);
+    return result;
+}
+
+FiberWaiter *
+FiberReader::
+takeWaiter()
+{
+    FiberWaiter * waiter = waiter_;
+    waiter_ = nullptr;
+    return waiter;
+}
+
+} // namespace Datacratic
@@ -0,0 +1,108 @@
+/* fiber_clients.h                                                 -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Operations of the HTTP and TCP clients that a fiber can wait for.
+*/
+
+#pragma once
+
+#include <string>
+
+#include "jml/arch/spinlock.h"
+
+#include "fiber.h"
+#include "http_client.h"
+#include "tcp_client.h"
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* FIBER HTTP RESPONSE                                                       */
+/*****************************************************************************/
+
+/** Response to a request made by awaitHttp(). */
+
+struct FiberHttpResponse {
+    FiberHttpResponse()
+        : error(HttpClientError::None), code(0)
+    {
+    }
+
+    /** Unknown if the request couldn't even be enqueued */
+    HttpClientError error;
+    int code;
+    std::string headers;
+    std::string body;
+};
+
+
+/*****************************************************************************/
+/* AWAITABLES                                                                */
+/*****************************************************************************/
+
+/** Performs a request with the given client and suspends the fiber until
+    the response is complete.  The callbacks of the request live on the
+    stack of the fiber, so the only allocations are those of the client.
+*/
+FiberHttpResponse
+awaitHttp(HttpClient & client,
+          const std::string & verb,
+          const std::string & resource,
+          const HttpRequest::Content & content = HttpRequest::Content(),
+          const RestParams & queryParams = RestParams(),
+          const RestParams & headers = RestParams(),
+          int timeout = -1);
+
+/** Connects the client and suspends the fiber until the connection is
+    established or has failed.
+*/
+TcpConnectionResult awaitConnect(TcpClient & client);
+
+/** Writes data to the source and suspends the fiber until it has been
+    sent.  The error of the result is EAGAIN, with nothing written, when
+    the write queue of the source is full.
+*/
+AsyncWriteResult awaitWrite(AsyncWriterSource & source, std::string data);
+
+
+/*****************************************************************************/
+/* FIBER READER                                                              */
+/*****************************************************************************/
+
+/** Buffers the data that an AsyncWriterSource, such as a TcpClient,
+    receives until a fiber reads it.  push() is meant to be called from the
+    source's OnReceivedData callback and close() from its OnClosed
+    callback; both can be called from any thread.  A single fiber at a time
+    can read.
+*/
+
+struct FiberReader {
+    FiberReader();
+
+    void push(const char * data, size_t size);
+
+    void close();
+
+    /** Returns all the data received since the last call, suspending the
+        fiber until there is some.  Returns an empty string once the reader
+        is closed and all the data was read.
+    */
+    std::string read();
+
+private:
+    typedef ML::Spinlock Lock;
+    typedef std::lock_guard<Lock> Guard;
+    Lock lock_;
+
+    std::string buffer_;
+    bool closed_;
+
+    /* Waiter of the fiber blocked in read(), if any */
+    FiberWaiter * waiter_;
+
+    /* Takes the waiter to notify; lock_ must be held */
+    FiberWaiter * takeWaiter();
+};
+
+} // namespace Datacratic
@@ -0,0 +1,44 @@
+/* fiber_redis.h                                                   -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Redis commands that a fiber can wait for.  Header only, so that the
+   services library doesn't depend on the redis one.
+*/
+
+#pragma once
+
+#include "redis.h"
+#include "fiber.h"
+
+
+namespace Datacratic {
+
+/** Queues the command on the connection and suspends the fiber until its
+    result, or its timeout, comes back.
+*/
+inline Redis::Result
+awaitRedis(Redis::AsyncConnection & connection,
+           const Redis::Command & command,
+           Redis::AsyncConnection::Timeout timeout
+               = Redis::AsyncConnection::Timeout())
+{
+    auto queue = [&] (FiberCallback<Redis::Result> done) {
+        connection.queue(command, done, timeout);
+    };
+    return awaitResult<Redis::Result>(queue);
+}
+
+/** Same as awaitRedis(), for a list of commands queued atomically. */
+inline Redis::Results
+awaitRedisMulti(Redis::AsyncConnection & connection,
+                const std::vector<Redis::Command> & commands,
+                Redis::AsyncConnection::Timeout timeout
+                    = Redis::AsyncConnection::Timeout())
+{
+    auto queue = [&] (FiberCallback<Redis::Results> done) {
+        connection.queueMulti(commands, done, timeout);
+    };
+    return awaitResult<Redis::Results>(queue);
+}
+
+} // namespace Datacratic
@@ -7,10 +7,17 @@
 #include "soa/service/http_endpoint.h"
 #include "jml/arch/cmp_xchg.h"
 #include "jml/arch/atomic_ops.h"
+#include "jml/arch/spinlock.h"
 #include "jml/utils/parse_context.h"
 #include "jml/utils/string_functions.h"
 #include "jml/utils/exc_assert.h"
+#include "jml/utils/guard.h"
+#include <atomic>
 #include <fstream>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <boost/make_shared.hpp>
 
 
@@ -20,6 +27,79 @@ using namespace ML;
 
 namespace Datacratic {
 
+namespace {
+
+void
+appendDecimal(std::string & str, uint64_t value)
+{
+    char digits[24];
+    char * p = digits + sizeof(digits);
+    do {
+        *--p = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    str.append(p, digits + sizeof(digits));
+}
+
+void
+appendStatusLine(std::string & header, int code, const std::string & status)
+{
+    header.append("HTTP/1.1 ");
+    appendDecimal(header, code);
+    header.append(" ");
+    header.append(status);
+    header.append("\r\n");
+}
+
+/* Render "Date: <IMF-fixdate>\r\n" into buffer, which must have room for
+   64 characters, and return its length.  The names aren't taken from the
+   locale, as strftime() would. */
+size_t
+renderDateHeader(char * buffer, time_t when)
+{
+    static const char * days[7] = {
+        "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+    };
+    static const char * months[12] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+    };
+
+    tm t;
+    gmtime_r(&when, &t);
+    return snprintf(buffer, 64,
+                    "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                    days[t.tm_wday], t.tm_mday, months[t.tm_mon],
+                    t.tm_year + 1900, t.tm_hour, t.tm_min, t.tm_sec);
+}
+
+/* "Date: ...\r\n" for the second dateTime, kept per thread so that
+   responses don't share a lock */
+struct DateHeaderCache {
+    time_t dateTime;
+    size_t length;
+    char header[64];
+};
+
+__thread DateHeaderCache dateHeaderCache = { 0, 0, { 0 } };
+
+/* Numbers given to threads as they first use an HttpHandlerPool, which
+   index its free lists; they aren't reused */
+std::atomic<int> numNumberedThreads(0);
+__thread int currentThreadNumber = -1;
+
+int
+threadNumber()
+{
+    if (currentThreadNumber == -1)
+        currentThreadNumber = numNumberedThreads++;
+    return currentThreadNumber;
+}
+
+std::atomic<uint64_t> numHandlerPools(0);
+
+} // file scope
+
 
 /*****************************************************************************/
 /* HTTP CONNECTION HANDLER                                                   */
@@ -27,7 +107,13 @@ namespace Datacratic {
 
 HttpConnectionHandler::
 HttpConnectionHandler()
-    : readState(INVALID), httpEndpoint(0)
+    : readState(INVALID), httpEndpoint(0),
+      maxPipelinedRequests(1), currentRequest(0),
+      overridesStringData(false),
+      firstPendingRequest(0), nextRequest(0),
+      dispatching(false), stalled(false), finished(false),
+      contentLength(0), headerFilled(false), headerText(nullptr),
+      connectionThread(-1)
 {
 }
 
@@ -36,9 +122,21 @@ HttpConnectionHandler::
 onGotTransport()
 {
     this->httpEndpoint = dynamic_cast<HttpEndpoint *>(get_endpoint());
+    if (httpEndpoint)
+        maxPipelinedRequests = httpEndpoint->maxPipelinedRequests;
+    connectionThread = threadNumber();
     
     readState = HEADER;
+    parser.reset();
     startReading();
+
+    // A request pipelined behind the previous handler's is already here.
+    // It's handled once out of associate(), as handling it can replace
+    // this handler in turn, which would otherwise nest a call for each
+    // request in the buffer.
+    if (!transport().readBuffer().empty())
+        doAsyncForThis([=] () { this->handleReadBuffer(); },
+                       "pipelinedRequest");
 }
 
 std::shared_ptr<ConnectionHandler>
@@ -55,18 +153,46 @@ void
 HttpConnectionHandler::
 handleData(const std::string & data)
 {
-   //cerr << "HttpConnectionHandler::handleData: got data <" << data << ">" << endl;
-    //httpData.write(data.c_str(), data.length());
+    // The data is kept here rather than in the read buffer, which the
+    // caller may have consumed already
+    stringData.append(data);
+    size_t used = handleRequestBytes(stringData.data(), stringData.size());
+    stringData.erase(0, used);
+
+    // What's left is the next request, which the next handler picks up
+    // from the read buffer
+    if (!stringData.empty() && readState == DONE
+        && maxPipelinedRequests <= 1) {
+        transport().readBuffer().append(stringData.data(), stringData.size());
+        stringData.clear();
+    }
+}
+
+size_t
+HttpConnectionHandler::
+handleData(const char * data, size_t size)
+{
+    if (!overridesStringData)
+        return handleRequestBytes(data, size);
 
-    if (headerText == "" && readState == HEADER)
-        firstData = Date::now();
+    // The override passes the bytes back to handleData(const std::string &)
+    handleData(string(data, size));
+    return size;
+}
+
+size_t
+HttpConnectionHandler::
+handleRequestBytes(const char * data, size_t size)
+{
+   //cerr << "HttpConnectionHandler::handleRequestBytes: got data <" << string(data, size) << ">" << endl;
+    //httpData.write(data, size);
 
     addActivity("handleData with state %d", readState);
 
 #if 0
     string dataSample;
-    dataSample.reserve(data.size() * 3 / 2);
-    for (unsigned i = 0;  i < 300 && i < data.size();  ++i) {
+    dataSample.reserve(size * 3 / 2);
+    for (unsigned i = 0;  i < 300 && i < size;  ++i) {
         if (data[i] == '\n') dataSample += "\\n";
         else if (data[i] == '\r') dataSample += "\\r";
         else if (data[i] == '\0') dataSample += "\\0";
@@ -75,62 +201,197 @@ handleData(const std::string & data)
         else dataSample += data[i];
     }
 
-    addActivity("got %d bytes of data: %s", (int)data.size(),
+    addActivity("got %d bytes of data: %s", (int)size,
                 dataSample.c_str());
 #endif
 
-    if (readState == PAYLOAD
-        || readState == CHUNK_HEADER || readState == CHUNK_BODY) {
-        handleHttpData(data);
-        return;
+    bool pipelined = maxPipelinedRequests > 1;
+    size_t consumed = 0;
+
+    {
+        // Responses to the requests dispatched here go out together
+        dispatching = pipelined;
+        Call_Guard clearDispatching([&] () { dispatching = false; });
+
+        for (;;) {
+            if (readState == DONE) {
+                // Without pipelining, the next request is for the next
+                // handler
+                if (!pipelined)
+                    break;
+                if (pendingResponses.size() >= (size_t)maxPipelinedRequests) {
+                    stalled = true;
+                    stopReading();
+                    break;
+                }
+                startRequest();
+            }
+
+            if (consumed == size)
+                break;
+
+            if (readState == HEADER && parser.bytesParsed() == 0)
+                firstData = Date::now();
+
+            size_t used = handleRequestData(data + consumed, size - consumed);
+            if (used == 0)
+                break;
+            consumed += used;
+        }
+    }
+
+    if (pipelined)
+        flushResponses();
+    else if (readState == DONE && consumed < size) {
+        // Don't read more than the next request until it's handled
+        stopReading();
+    }
+
+    return consumed;
+}
+
+size_t
+HttpConnectionHandler::
+handleRequestData(const char * data, size_t size)
+{
+    if (readState == PAYLOAD) {
+        // What's past the content length is the next request
+        size_t used = std::min<int64_t>(size, contentLength
+                                              - payload.length());
+        handleHttpData(data, used);
+        return used;
     }
+
+    if (readState == CHUNK_HEADER || readState == CHUNK_BODY
+        || readState == CHUNK_TRAILER)
+        return handleChunkData(data, size);
     
     if (readState != HEADER) {
         throw Exception("invalid read state %d handling data '%s' for %08xp",
-                        readState, data.c_str(), this);
+                        readState, string(data, size).c_str(), this);
     }
-    
-    headerText += data;
-    // The first time that we see that character sequence, it's the break
-    // between the header and the data.
-    string::size_type breakPos = headerText.find("\r\n\r\n");
-    
 
-    if (breakPos == string::npos)
-    {
-        if (headerText.size() > 16384) {
-            throw ML::Exception("HTTP header exceeds 16kb");
-        }
-        //cerr << "did not find break pos " << endl;
-        return;
-    }
-    // We got a header
+    // The header is left in the buffer until it's all there; the parser
+    // carries on from where it stopped the previous time.
     try {
-        header.parse(headerText);
+        if (!parser.feed(data, size))
+            return 0;
     } catch (...) {
         cerr << "problem parsing in state: " << status() << endl;
         throw;
     }
 
-    //cerr << "content length = " << header.contentLength << endl;
+    size_t headerLength = parser.headerLength();
+    bool isChunked = parser.isChunked();
+    contentLength = parser.contentLength();
+
+    //cerr << "content length = " << contentLength << endl;
 
-    if (header.contentLength == -1 && !header.isChunked)
-        header.contentLength = 0;
+    if (contentLength == -1 && !isChunked)
+        contentLength = 0;
     //doError("we need a Content-Length");
     
     addActivityS("header parsing OK");
 
     //cerr << "done header" << endl;
 
-    handleHttpHeader(header);
+    currentRequest = nextRequest++;
+    pendingResponses.push_back(PendingResponse());
+
+    size_t used;
+    {
+        // Once the header is consumed, the spans of the parser refer to a
+        // copy of it if the HttpHeader wasn't filled in
+        headerText = data;
+        Call_Guard keepHeader([&] () {
+                if (!headerFilled) {
+                    headerCopy.assign(data, headerLength);
+                    headerText = headerCopy.c_str();
+                }
+            });
+
+        handleHttpRequestHeader(parser, data);
+
+        payload = "";
+
+        if (isChunked) {
+            readState = CHUNK_HEADER;
+            used = handleChunkData(data + headerLength, size - headerLength);
+            return headerLength + used;
+        }
 
-    payload = "";
+        readState = PAYLOAD;
+        // Don't trust the client with more than a megabyte up front
+        payload.reserve(std::min<int64_t>(contentLength, 1 << 20));
+
+        used = std::min<int64_t>(size - headerLength, contentLength);
+        handleHttpData(data + headerLength, used);
+    }
+
+    return headerLength + used;
+}
+
+void
+HttpConnectionHandler::
+startRequest()
+{
+    readState = HEADER;
+    parser.reset();
+    headerFilled = false;
+    headerText = nullptr;
+    contentLength = 0;
+    payload.clear();
+    chunkHeader.clear();
+    chunkBody.clear();
+}
+
+void
+HttpConnectionHandler::
+reset()
+{
+    clearTransport();
+
+    startRequest();
+    readState = INVALID;
+    httpEndpoint = 0;
+    maxPipelinedRequests = 1;
+    currentRequest = 0;
+
+    pendingResponses.clear();
+    firstPendingRequest = nextRequest = 0;
+    dispatching = stalled = finished = false;
+    stringData.clear();
+    connectionThread = -1;
+
+    error.clear();
+    toWrite.clear();
+    inSend = false;
+
+    // Don't hold on to the storage of an unusually large payload
+    if (payload.capacity() > 65536)
+        std::string().swap(payload);
+}
 
-    if (header.isChunked)
-        readState = CHUNK_HEADER;
-    else readState = PAYLOAD;
+const HttpHeader &
+HttpConnectionHandler::
+httpHeader()
+{
+    if (!headerFilled) {
+        ExcAssert(headerText);
+        parser.fillHeader(headerText, header);
+        if (header.contentLength == -1 && !header.isChunked)
+            header.contentLength = 0;
+        headerFilled = true;
+    }
+    return header;
+}
 
-    handleHttpData(header.knownData);
+void
+HttpConnectionHandler::
+handleHttpRequestHeader(const HttpRequestParser & parser,
+                        const char * headerText)
+{
+    handleHttpHeader(httpHeader());
 }
 
 void
@@ -138,7 +399,7 @@ HttpConnectionHandler::
 handleHttpHeader(const HttpHeader & header)
 {
     // If the client expects a 100 continue, then oblige
-    std::string expect = header.tryGetHeader("expect");
+    std::string expect = header.tryGetHeader(HttpHeaderFields::EXPECT);
     if (!expect.empty()) {
         expect = lowercase(expect);
 
@@ -159,12 +420,12 @@ handleHttpHeader(const HttpHeader & header)
 
 void
 HttpConnectionHandler::
-handleHttpData(const std::string & data)
+handleHttpData(const char * data, size_t size)
 {
     //static const char *fName = "HttpConnectionHandler::handleHttpData:";
     //cerr << "got HTTP data in state " << readState << " with "
-    //     << data.length() << " characters" << endl;
-    //cerr << "data = [" << data << "]" << endl;
+    //     << size << " characters" << endl;
+    //cerr << "data = [" << string(data, size) << "]" << endl;
     //cerr << endl << endl << "---------------------------" << endl;
     
     if (readState == PAYLOAD) {
@@ -172,112 +433,137 @@ handleHttpData(const std::string & data)
         if (readState != PAYLOAD)
             throw Exception("invalid state: expected payload");
 
-        payload += data;
+        payload.append(data, size);
 #if 0
         cerr << "payload = " << payload << endl;
         cerr << "payload.length() = " << payload.length() << endl;
-        cerr << "header.contentLength = " << header.contentLength << endl;
+        cerr << "contentLength = " << contentLength << endl;
 #endif
-        if (payload.length() > header.contentLength) {
+        if (payload.length() > contentLength) {
             doError("extra data");
         }
     
 
-        if (payload.length() == header.contentLength) {
+        if (payload.length() == contentLength) {
             addActivityS("got HTTP payload");
-            handleHttpPayload(header, payload);
+            handleHttpPayload(httpHeader(), payload);
 
             //cerr << this << " switching to DONE" << endl;
 
             readState = DONE;
         }
     }
-    if (readState == CHUNK_HEADER || readState == CHUNK_BODY) {
-        const char * current = data.c_str();
-        const char * end = current + data.length();
+    if (readState == CHUNK_HEADER || readState == CHUNK_BODY
+        || readState == CHUNK_TRAILER)
+        handleChunkData(data, size);
+}
 
-        //cerr << "processing " << data.length() << " characters" << endl;
+size_t
+HttpConnectionHandler::
+handleChunkData(const char * data, size_t size)
+{
+    const char * current = data;
+    const char * end = current + size;
 
-        while (current != end) {
-            if (current >= end)
-                throw ML::Exception("current >= end");
+    //cerr << "processing " << size << " characters" << endl;
 
-            //cerr << (end - current) << " chars left; state "
-            //     << readState << " chunkHeader = " << chunkHeader << endl;
+    while (current != end) {
+        if (current >= end)
+            throw ML::Exception("current >= end");
 
-            if (readState == CHUNK_HEADER) {
-                while (current != end) {
-                    char c = *current++;
-                    chunkHeader += c;
-                    if (c == '\n') break;
-                }
+        //cerr << (end - current) << " chars left; state "
+        //     << readState << " chunkHeader = " << chunkHeader << endl;
 
-                //cerr << "chunkHeader now '" << chunkHeader << "'" << endl;
+        if (readState == CHUNK_TRAILER) {
+            // Trailer fields, which are ignored, up to an empty line
+            while (current != end) {
+                char c = *current++;
+                chunkHeader += c;
+                if (c == '\n') break;
+            }
 
-                // Remove an extra cr/lf if there is one
-                if (chunkHeader == "\r\n") {
-                    chunkHeader = "";
-                    continue;
-                }
+            if (chunkHeader == "\r\n") {
+                // What follows is the next request
+                chunkHeader = "";
+                readState = DONE;
+                break;
+            }
+            if (chunkHeader.find("\r\n") != string::npos)
+                chunkHeader = "";
+            continue;
+        }
 
-                //if (current == end) break;
+        if (readState == CHUNK_HEADER) {
+            while (current != end) {
+                char c = *current++;
+                chunkHeader += c;
+                if (c == '\n') break;
+            }
 
-                //cerr << "chunkHeader now '" << chunkHeader << "'" << endl;
+            //cerr << "chunkHeader now '" << chunkHeader << "'" << endl;
 
-                string::size_type pos = chunkHeader.find("\r\n");
-                if (pos == string::npos) break;
-                current += pos + 2 - chunkHeader.length();  // skip crlf
-                
-                chunkHeader.resize(pos);
+            // Remove an extra cr/lf if there is one
+            if (chunkHeader == "\r\n") {
+                chunkHeader = "";
+                continue;
+            }
 
-                // We got to the end of the chunk header... parse it
-                string::size_type lengthPos = chunkHeader.find(';');
+            //if (current == end) break;
 
-                //cerr << "chunkHeader = " << chunkHeader << endl;
-                //cerr << "lengthPos = " << lengthPos << endl;
+            //cerr << "chunkHeader now '" << chunkHeader << "'" << endl;
 
-                string lengthStr(chunkHeader, 0, lengthPos);
-                //(lengthPos == string::npos
-                //                  ? chunkHeader.length() : lengthPos));
-                //cerr << "lengthStr = " << lengthStr << endl;
+            string::size_type pos = chunkHeader.find("\r\n");
+            if (pos == string::npos) break;
+            current += pos + 2 - chunkHeader.length();  // skip crlf
 
-                char * endPtr = 0;
-                chunkSize = strtol(lengthStr.c_str(), &endPtr, 16);
+            chunkHeader.resize(pos);
 
-                //cerr << "chunkSize = " << chunkSize << endl;
+            // We got to the end of the chunk header... parse it
+            string::size_type lengthPos = chunkHeader.find(';');
 
-                if (chunkSize == 0) {
-                    //readState = DONE;
-                    //return;
-                }
+            //cerr << "chunkHeader = " << chunkHeader << endl;
+            //cerr << "lengthPos = " << lengthPos << endl;
 
-                if (*endPtr != 0)
-                    throw ML::Exception("invalid chunk length " + lengthStr);
+            string lengthStr(chunkHeader, 0, lengthPos);
+            //(lengthPos == string::npos
+            //                  ? chunkHeader.length() : lengthPos));
+            //cerr << "lengthStr = " << lengthStr << endl;
 
-                readState = CHUNK_BODY;
-                chunkBody = "";
-            }
-            if (readState == CHUNK_BODY) {
-                size_t chunkDataLeft = chunkSize - chunkBody.size();
-                size_t dataAvail = end - current;
-                size_t toRead = std::min(chunkDataLeft, dataAvail);
+            char * endPtr = 0;
+            chunkSize = strtol(lengthStr.c_str(), &endPtr, 16);
 
-                chunkBody.append(current, current + toRead);
-                current += toRead;
+            //cerr << "chunkSize = " << chunkSize << endl;
 
-                if (chunkBody.length() == chunkSize) {
+            if (*endPtr != 0)
+                throw ML::Exception("invalid chunk length " + lengthStr);
 
-                    //cerr << "got chunk " << "-------------" << endl
-                    //     << chunkBody << "--------------" << endl << endl;
+            readState = CHUNK_BODY;
+            chunkBody = "";
+        }
+        if (readState == CHUNK_BODY) {
+            size_t chunkDataLeft = chunkSize - chunkBody.size();
+            size_t dataAvail = end - current;
+            size_t toRead = std::min(chunkDataLeft, dataAvail);
 
-                    handleHttpChunk(header, chunkHeader, chunkBody);
-                    chunkBody = "";
-                    chunkHeader = "";
-                    readState = CHUNK_HEADER;
-                }
+            chunkBody.append(current, current + toRead);
+            current += toRead;
+
+            if (chunkBody.length() == chunkSize) {
+
+                //cerr << "got chunk " << "-------------" << endl
+                //     << chunkBody << "--------------" << endl << endl;
+
+                handleHttpChunk(httpHeader(), chunkHeader, chunkBody);
+                chunkBody = "";
+                chunkHeader = "";
+
+                // The last chunk is empty, and followed by the trailer
+                readState = chunkSize == 0 ? CHUNK_TRAILER : CHUNK_HEADER;
             }
         }
     }
+
+    return current - data;
 }
 
 void
@@ -328,7 +614,88 @@ putResponseOnWire(HttpResponse response,
                   std::function<void ()> onSendFinished,
                   NextAction next)
 {
-    onSendFinished = [=] ()
+    // The requests are only looked at in the handler's thread
+    if (!transport().lockedByThisThread()) {
+        auto shared = std::make_shared<HttpResponse>(std::move(response));
+        doAsyncForThis([=] ()
+                       {
+                           this->putResponseOnWire(std::move(*shared),
+                                                   onSendFinished, next);
+                       },
+                       "putResponseOnWire");
+        return;
+    }
+
+    size_t waiting = 0;
+    for (auto & pending: pendingResponses)
+        waiting += !pending.ready;
+
+    // Which of the dispatched requests this answers can't be told
+    if (waiting > 1)
+        throw ML::Exception("response without a request id while %d "
+                            "pipelined requests wait for one: use "
+                            "putResponseOnWire(request, ...)",
+                            (int)waiting);
+
+    for (size_t i = 0;  i < pendingResponses.size();  ++i) {
+        if (!pendingResponses[i].ready) {
+            putResponseOnWire(firstPendingRequest + i, std::move(response),
+                              onSendFinished, next);
+            return;
+        }
+    }
+
+    // Not the response to a request, such as one sent on an error before
+    // the header was read; it goes out straight away.
+    PendingResponse pending;
+    renderResponseHeader(response, pending.header);
+    send(std::move(pending.header), std::move(response.body), next,
+         [=] ()
+         {
+             if (!onSendFinished)
+                 this->transport().associateWhenHandlerFinished
+                     (this->makeNewHandlerShared(), "sendFinished");
+             else onSendFinished();
+         });
+}
+
+void
+HttpConnectionHandler::
+putResponseOnWire(uint64_t request,
+                  HttpResponse response,
+                  std::function<void ()> onSendFinished,
+                  NextAction next)
+{
+    if (!transport().lockedByThisThread()) {
+        auto shared = std::make_shared<HttpResponse>(std::move(response));
+        doAsyncForThis([=] ()
+                       {
+                           this->putResponseOnWire(request,
+                                                   std::move(*shared),
+                                                   onSendFinished, next);
+                       },
+                       "putResponseOnWire");
+        return;
+    }
+
+    // The connection is going away after an earlier response
+    if (finished)
+        return;
+
+    if (request < firstPendingRequest || request >= nextRequest)
+        throw ML::Exception("response to request %lld, which isn't waiting "
+                            "for one", (long long)request);
+
+    PendingResponse & pending
+        = pendingResponses[request - firstPendingRequest];
+    if (pending.ready)
+        throw ML::Exception("second response to request %lld",
+                            (long long)request);
+
+    renderResponseHeader(response, pending.header);
+    pending.body = std::move(response.body);
+    pending.next = next;
+    pending.onWriteFinished = [=] ()
         {
 #if 0
             Date finished = Date::now();
@@ -343,49 +710,223 @@ putResponseOnWire(HttpResponse response,
             }
 #endif
 
-            if (!onSendFinished)
+            if (onSendFinished)
+                onSendFinished();
+            else if (this->maxPipelinedRequests <= 1)
                 this->transport().associateWhenHandlerFinished
                     (this->makeNewHandlerShared(), "sendFinished");
-            else onSendFinished();
+            this->onResponseWritten();
         };
+    pending.ready = true;
 
-    std::string responseStr;
-    responseStr.reserve(1024 + response.body.length());
+    // While dispatching, the responses wait to be sent together
+    if (!dispatching)
+        flushResponses();
+}
 
-    responseStr.append("HTTP/1.1 ");
-    responseStr.append(to_string(response.responseCode));
-    responseStr.append(" ");
-    responseStr.append(response.responseStatus);
-    responseStr.append("\r\n");
+void
+HttpConnectionHandler::
+renderResponseHeader(const HttpResponse & response,
+                     std::string & header) const
+{
+    header.reserve(256);
+
+    if (httpEndpoint)
+        httpEndpoint->appendResponseStart(header, response.responseCode,
+                                          response.responseStatus);
+    else appendStatusLine(header, response.responseCode,
+                          response.responseStatus);
 
     if (response.contentType != "") {
-        responseStr.append("Content-Type: ");
-        responseStr.append(response.contentType);
-        responseStr.append("\r\n");
+        header.append("Content-Type: ");
+        header.append(response.contentType);
+        header.append("\r\n");
     }
 
     if (response.sendBody) {
-        responseStr.append("Content-Length: ");
-        responseStr.append(to_string(response.body.length()));
-        responseStr.append("\r\n");
-        responseStr.append("Connection: Keep-Alive\r\n");
+        header.append("Content-Length: ");
+        appendDecimal(header, response.body.length());
+        header.append("\r\n");
+        header.append("Connection: Keep-Alive\r\n");
     }
 
     for (auto & h: response.extraHeaders) {
-        responseStr.append(h.first);
-        responseStr.append(": ");
-        responseStr.append(h.second);
-        responseStr.append("\r\n");
+        header.append(h.first);
+        header.append(": ");
+        header.append(h.second);
+        header.append("\r\n");
     }
 
-    responseStr.append("\r\n");
-    responseStr.append(response.body);
+    header.append("\r\n");
+}
 
-    //cerr << "sending " << responseStr << endl;
-    
-    send(responseStr,
-         next,
-         onSendFinished);
+void
+HttpConnectionHandler::
+flushResponses()
+{
+    if (pendingResponses.empty() || !pendingResponses.front().ready)
+        return;
+
+    {
+        // Queue all of them before writing, so that they are gathered into
+        // a single write
+        bool wasInSend = inSend;
+        inSend = true;
+        Call_Guard restoreInSend([&] () { inSend = wasInSend; });
+
+        while (!pendingResponses.empty() && pendingResponses.front().ready) {
+            PendingResponse pending = std::move(pendingResponses.front());
+            pendingResponses.pop_front();
+            ++firstPendingRequest;
+
+            //cerr << "sending " << pending.header << pending.body << endl;
+
+            send(std::move(pending.header), std::move(pending.body),
+                 pending.next, pending.onWriteFinished);
+
+            if (pending.next != NEXT_CONTINUE) {
+                // Nothing can be sent after it
+                finished = true;
+                firstPendingRequest += pendingResponses.size();
+                pendingResponses.clear();
+            }
+        }
+    }
+
+    if (!inSend && !toWrite.empty()) {
+        inSend = true;
+        Call_Guard clearInSend([&] () { inSend = false; });
+        handleOutput();
+    }
+}
+
+void
+HttpConnectionHandler::
+onResponseWritten()
+{
+    if (!stalled)
+        return;
+
+    // Carry on with the requests that were left in the read buffer, once
+    // out of the handler that wrote the response
+    stalled = false;
+    doAsyncForThis([=] ()
+                   {
+                       this->startReading();
+                       this->handleReadBuffer();
+                   },
+                   "resumePipeline");
+}
+
+
+/*****************************************************************************/
+/* HTTP HANDLER POOL                                                         */
+/*****************************************************************************/
+
+struct HttpHandlerPool::FreeList {
+    /* Only contended when a handler is released by another thread than
+       its connection's */
+    ML::Spinlock lock;
+    std::vector<std::pair<const std::type_info *, HttpConnectionHandler *> >
+        handlers;
+};
+
+__thread uint64_t HttpHandlerPool::cachedPoolId_ = 0;
+__thread HttpHandlerPool::FreeList * HttpHandlerPool::cachedFreeList_
+    = nullptr;
+
+HttpHandlerPool::
+HttpHandlerPool(size_t maxHandlersPerThread)
+    : maxHandlersPerThread(maxHandlersPerThread),
+      numCreated(0), numReused(0), numReleased(0), numDestroyed(0),
+      id_(++numHandlerPools)
+{
+}
+
+HttpHandlerPool::
+~HttpHandlerPool()
+{
+    for (auto & list: freeLists_) {
+        if (!list)
+            continue;
+        for (auto & entry: list->handlers)
+            delete entry.second;
+    }
+}
+
+HttpHandlerPool::FreeList &
+HttpHandlerPool::
+freeList(int thread)
+{
+    // The calling thread's list is remembered for the last pool it used.
+    // The pool's id rather than its address is checked, as another pool
+    // may be constructed at the same address once this one is gone.
+    bool own = thread == threadNumber();
+    if (own && cachedPoolId_ == id_)
+        return *cachedFreeList_;
+
+    FreeList * result;
+    {
+        std::unique_lock<std::mutex> guard(freeListsLock_);
+        if (freeLists_.size() <= (size_t)thread)
+            freeLists_.resize(thread + 1);
+        if (!freeLists_[thread])
+            freeLists_[thread].reset(new FreeList());
+        result = freeLists_[thread].get();
+    }
+
+    if (own) {
+        cachedPoolId_ = id_;
+        cachedFreeList_ = result;
+    }
+    return *result;
+}
+
+HttpConnectionHandler *
+HttpHandlerPool::
+take(const std::type_info & type)
+{
+    FreeList & list = freeList(threadNumber());
+    std::lock_guard<ML::Spinlock> guard(list.lock);
+    auto & handlers = list.handlers;
+
+    for (int i = handlers.size() - 1;  i >= 0;  --i) {
+        if (*handlers[i].first != type)
+            continue;
+        HttpConnectionHandler * result = handlers[i].second;
+        handlers[i] = handlers.back();
+        handlers.pop_back();
+        return result;
+    }
+
+    return nullptr;
+}
+
+void
+HttpHandlerPool::
+release(HttpConnectionHandler * handler)
+{
+    // Back to the list of the connection's thread, which takes handlers
+    // from it again, whichever thread let go of it last
+    int thread = handler->connectionThread;
+    if (thread == -1)
+        thread = threadNumber();
+    FreeList & list = freeList(thread);
+
+    handler->reset();
+
+    {
+        std::lock_guard<ML::Spinlock> guard(list.lock);
+        if (list.handlers.size() < maxHandlersPerThread) {
+            list.handlers.push_back(std::make_pair(&typeid(*handler),
+                                                   handler));
+            ML::atomic_inc(numReleased);
+            return;
+        }
+    }
+
+    delete handler;
+    ML::atomic_inc(numDestroyed);
 }
 
 
@@ -394,13 +935,26 @@ putResponseOnWire(HttpResponse response,
 /*****************************************************************************/
 
 HttpEndpoint::
-HttpEndpoint(const std::string & name)
-    : PassiveEndpointT<SocketTransport>(name)
+HttpEndpoint(const std::string & name, Epoller::Backend backend)
+    : PassiveEndpointT<SocketTransport>(name),
+      sendDateHeader(false),
+      maxPipelinedRequests(1),
+      handlerPool(std::make_shared<HttpHandlerPool>()),
+      statusLines_(500)
 {
+    setPollerBackend(backend);
+
     handlerFactory = [] ()
         {
             return std::make_shared<HttpConnectionHandler>();
         };
+
+    for (int code = 100;  code < 600;  ++code) {
+        string phrase = getResponseReasonPhrase(code);
+        if (phrase.find("unknown") == 0)
+            continue;
+        appendStatusLine(statusLines_[code - 100], code, phrase);
+    }
 }
 
 HttpEndpoint::
@@ -408,6 +962,45 @@ HttpEndpoint::
 {
 }
 
+void
+HttpEndpoint::
+addResponseHeader(const std::string & name, const std::string & value)
+{
+    responseHeaders_.append(name);
+    responseHeaders_.append(": ");
+    responseHeaders_.append(value);
+    responseHeaders_.append("\r\n");
+}
+
+void
+HttpEndpoint::
+appendResponseStart(std::string & header,
+                    int code, const std::string & status) const
+{
+    // The cached line is only good if the phrase wasn't changed
+    static const size_t prefixLength = 13;  // "HTTP/1.1 200 "
+    const string * line = nullptr;
+    if (code >= 100 && code < 600 && !statusLines_[code - 100].empty())
+        line = &statusLines_[code - 100];
+    if (line
+        && line->length() == prefixLength + status.length() + 2
+        && line->compare(prefixLength, status.length(), status) == 0)
+        header.append(*line);
+    else appendStatusLine(header, code, status);
+
+    if (sendDateHeader) {
+        DateHeaderCache & cache = dateHeaderCache;
+        time_t now = time(nullptr);
+        if (now != cache.dateTime) {
+            cache.length = renderDateHeader(cache.header, now);
+            cache.dateTime = now;
+        }
+        header.append(cache.header, cache.length);
+    }
+
+    header.append(responseHeaders_);
+}
+
 template struct PassiveEndpointT<SocketTransport>;
 
 } // namespace Datacratic
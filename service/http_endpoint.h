@@ -10,6 +10,12 @@
 #include "soa/service/passive_endpoint.h"
 #include "soa/types/date.h"
 #include "http_header.h"
+#include "http_request_parser.h"
+#include "jml/arch/atomic_ops.h"
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <typeinfo>
 #include <boost/make_shared.hpp>
 #include <boost/algorithm/string.hpp>
 
@@ -88,6 +94,15 @@ struct HttpResponse {
     This will handle parsing the header, but will forward the data off
     to another slave handler.  It's the HTTP Endpoint's responsibility to
     generate a slave handler once a header is received.
+
+    Only the bytes of the current request are consumed, so the requests
+    that a client pipelines behind it stay in the read buffer.  By default
+    they are handled one at a time: the handler made once the response is
+    sent picks up the next request from the buffer.  With
+    maxPipelinedRequests above 1, this handler dispatches the requests
+    that follow without waiting, and their responses are sent in the
+    order of the requests whatever the order they are put on the wire in.
+    The ones that are ready together go out in a single write.
 */
 
 struct HttpConnectionHandler : public PassiveConnectionHandler {
@@ -100,13 +115,15 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
         PAYLOAD,       // non chunk only
         CHUNK_HEADER,  // chunk only
         CHUNK_BODY,    // chunk only
+        CHUNK_TRAILER, // chunk only, after the last chunk
         DONE
     } readState;
 
-    /** Accumulated text for the header. */
-    std::string headerText;
+    /** Parser for the header, which stays in the read buffer until it is
+        complete. */
+    HttpRequestParser parser;
 
-    /** The actual header */
+    /** The header of the current request, once httpHeader() filled it in */
     HttpHeader header;
 
     /** The payload we're accumulating. */
@@ -122,6 +139,19 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
 
     HttpEndpoint * httpEndpoint;
 
+    /** How many requests can be dispatched before the response to the
+        first of them is sent.  Above 1, the handler stays for the whole
+        connection, so the responses must go through putResponseOnWire()
+        without an onSendFinished callback that replaces it.  Taken from
+        the HttpEndpoint; defaults to 1.
+    */
+    int maxPipelinedRequests;
+
+    /** Id of the request being handled, to answer it with
+        putResponseOnWire() once the handler has returned.
+    */
+    uint64_t currentRequest;
+
     virtual void onGotTransport();
 
     /** Create a new connection handler.  Delegates to the endpoint.  This
@@ -131,10 +161,38 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
     std::shared_ptr<ConnectionHandler> makeNewHandlerShared();
 
     //virtual void handleNewConnection();
+
+    /** Consumes nothing until the whole header of a request has arrived,
+        so that it is parsed in place in the read buffer, and then the
+        payload of the request, up to its content length.
+
+        A subclass that overrides handleData(const std::string &) must set
+        overridesStringData, so that the data is passed to that overload
+        instead, each byte once.  It's handled when the override calls
+        this class's version, which copies it.
+    */
+    virtual size_t handleData(const char * data, size_t size);
     virtual void handleData(const std::string & data);
     virtual void handleError(const std::string & message);
     virtual void onCleanup();
 
+    /** The header of the current request.  It is only filled in from the
+        parser the first time it is asked for, in place, so that a reused
+        handler doesn't allocate for it.
+    */
+    const HttpHeader & httpHeader();
+
+    /** Called when the header of a request has been parsed, with the
+        parser and the header text that its spans refer to, which is only
+        valid during the call.  The default calls handleHttpHeader() with
+        httpHeader().  A handler that can work from the parser, using
+        findField() for example, overrides it to skip filling in the
+        HttpHeader; the default handleHttpPayload() and handleHttpChunk()
+        still ask for it.
+    */
+    virtual void handleHttpRequestHeader(const HttpRequestParser & parser,
+                                         const char * headerText);
+
     /** Called when the HTTP header comes through.  Default will pass it
         back to the endpoint to do something with it.
     */
@@ -144,7 +202,12 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
         concatenates them together into a payload and calls
         handleHttpPayload once done.
     */
-    virtual void handleHttpData(const std::string & data);
+    virtual void handleHttpData(const char * data, size_t size);
+
+    void handleHttpData(const std::string & data)
+    {
+        handleHttpData(data.c_str(), data.size());
+    }
 
     /** Called once the entire payload has come through.  Default will
         throw.  Will be called multiple times for chunked encoding.
@@ -165,7 +228,10 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
                        NextAction next = NEXT_CONTINUE,
                        OnWriteFinished onWriteFinished = OnWriteFinished());
 
-    /** Handle sending an HTTP response.
+    /** Handle sending an HTTP response, to the oldest request that
+        doesn't have one yet.  When several pipelined requests are waiting
+        for their response, which one it answers can't be told and this
+        throws: the response must then be sent with the request id.
 
         Calls the given callback once done.
     */
@@ -174,6 +240,180 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
                                    = std::function<void ()>(),
                                    NextAction next = NEXT_CONTINUE);
 
+    /** Return the handler to the state it was constructed in, keeping the
+        storage of its buffers, so that HttpHandlerPool can hand it out
+        again.  Called once the last reference to it is gone.  Subclasses
+        with request state of their own override it and call this one.
+    */
+    virtual void reset();
+
+    /** Send the response to the given request, which was currentRequest
+        while it was handled.  It is held until the responses to the
+        requests before it are sent.
+    */
+    void putResponseOnWire(uint64_t request,
+                           HttpResponse response,
+                           std::function<void ()> onSendFinished
+                               = std::function<void ()>(),
+                           NextAction next = NEXT_CONTINUE);
+
+protected:
+    /** Set by the subclasses that override handleData(const std::string &)
+        for the data to go through it.  Defaults to false.
+    */
+    bool overridesStringData;
+
+    /** Handle the data of the connection, which starts with what the
+        previous call didn't use, and return how much of it was used.
+        Both versions of handleData() come down to it.
+    */
+    size_t handleRequestBytes(const char * data, size_t size);
+
+private:
+    /** A response in the order of the requests, which is sent once it
+        and those before it are ready. */
+    struct PendingResponse {
+        PendingResponse()
+            : ready(false), next(NEXT_CONTINUE)
+        {
+        }
+
+        bool ready;
+        std::string header;
+        std::string body;
+        NextAction next;
+        OnWriteFinished onWriteFinished;
+    };
+
+    /* One for each request whose response isn't sent yet */
+    std::deque<PendingResponse> pendingResponses;
+    uint64_t firstPendingRequest;  // id of pendingResponses.front()
+    uint64_t nextRequest;
+
+    /* Requests are being dispatched, so responses wait to go out together */
+    bool dispatching;
+
+    /* Reading stopped at maxPipelinedRequests, until a response is sent */
+    bool stalled;
+
+    /* After a NEXT_CLOSE or NEXT_RECYCLE response, nothing else is sent */
+    bool finished;
+
+    /* Length of the body of the current request, for non chunked ones */
+    int64_t contentLength;
+
+    /* Whether header was filled in for the current request, and where the
+       parser's spans point to until it is: the read buffer while the
+       header is handled, and then headerCopy */
+    bool headerFilled;
+    const char * headerText;
+    std::string headerCopy;
+
+    /* Data passed to handleData(const std::string &) that wasn't used yet */
+    std::string stringData;
+
+    /* Number of the thread of the connection, whose HttpHandlerPool free
+       list the handler goes back to; -1 without a connection */
+    int connectionThread;
+    friend struct HttpHandlerPool;
+
+    /* Handle the data of the current request and return how much of it
+       was used */
+    size_t handleRequestData(const char * data, size_t size);
+
+    /* Parse chunked data up to the end of the body and return how much of
+       it was used */
+    size_t handleChunkData(const char * data, size_t size);
+
+    /* Reset the state to read the next request */
+    void startRequest();
+
+    void renderResponseHeader(const HttpResponse & response,
+                              std::string & header) const;
+
+    /* Send the ready responses at the front of pendingResponses */
+    void flushResponses();
+
+    /* Called once a response is written */
+    void onResponseWritten();
+};
+
+
+/*****************************************************************************/
+/* HTTP HANDLER POOL                                                         */
+/*****************************************************************************/
+
+/** Connection handlers that are reused instead of being allocated for
+    each request.
+
+    The pool keeps a free list for each thread.  A handler from get() goes
+    back to the list of the thread of its last connection once the last
+    reference to it is released, after a call to its reset(), even when
+    another thread releases it.  get() hands out one of the calling
+    thread's handlers of the right type before constructing a new one.
+    As handlers are mostly made and released by the thread of their
+    connection, the locks of the lists are rarely contended.  Each list
+    keeps at most maxHandlersPerThread handlers, and they are all deleted
+    with the pool.
+*/
+
+struct HttpHandlerPool
+    : public std::enable_shared_from_this<HttpHandlerPool> {
+
+    HttpHandlerPool(size_t maxHandlersPerThread = 64);
+
+    ~HttpHandlerPool();
+
+    /** Return a handler of the given type.  The arguments are only used
+        when a new one is constructed, so they must not vary from one call
+        to the next.
+    */
+    template<typename Handler, typename... Args>
+    std::shared_ptr<Handler> get(Args &&... args)
+    {
+        HttpConnectionHandler * handler = take(typeid(Handler));
+        if (handler)
+            ML::atomic_inc(numReused);
+        else {
+            handler = new Handler(std::forward<Args>(args)...);
+            ML::atomic_inc(numCreated);
+        }
+
+        auto pool = shared_from_this();
+        return std::shared_ptr<Handler>
+            (static_cast<Handler *>(handler),
+             [=] (Handler * released) { pool->release(released); });
+    }
+
+    size_t maxHandlersPerThread;
+
+    /** Counters for all threads. */
+    uint64_t numCreated;    // constructed by get()
+    uint64_t numReused;     // taken from a pool by get()
+    uint64_t numReleased;   // put back into a pool
+    uint64_t numDestroyed;  // deleted instead, as the pool was full
+
+private:
+    struct FreeList;
+
+    /* Handler of the given type from this thread's list, or null */
+    HttpConnectionHandler * take(const std::type_info & type);
+
+    void release(HttpConnectionHandler * handler);
+
+    /* Free list of the thread with the given number */
+    FreeList & freeList(int thread);
+
+    /* Indexed by thread number, and made on first use */
+    std::mutex freeListsLock_;
+    std::vector<std::unique_ptr<FreeList> > freeLists_;
+
+    /* Unique to each pool, unlike its address */
+    uint64_t id_;
+
+    /* The free list of the calling thread in the pool with the id */
+    static __thread uint64_t cachedPoolId_;
+    static __thread FreeList * cachedFreeList_;
 };
 
 
@@ -181,14 +421,61 @@ struct HttpConnectionHandler : public PassiveConnectionHandler {
 /* HTTP ENDPOINT                                                             */
 /*****************************************************************************/
 
-/** An endpoint that deals with HTTP. */
+/** An endpoint that deals with HTTP.
+
+    The parts of response headers that don't change from one response to
+    the next are rendered once here: the status lines of the standard
+    codes, the headers added with addResponseHeader() and the Date header,
+    which is rendered again at most once per second.
+*/
 
 struct HttpEndpoint: public PassiveEndpointT<SocketTransport> {
 
-    HttpEndpoint(const std::string & name);
+    /** The backend is that of the endpoint's epoll sets; see
+        setPollerBackend().
+    */
+    HttpEndpoint(const std::string & name,
+                 Epoller::Backend backend = Epoller::EPOLL);
 
     virtual ~HttpEndpoint();
 
+    /** Add a header to every response, such as Server.  Must be called
+        before the endpoint starts serving.
+    */
+    void addResponseHeader(const std::string & name,
+                           const std::string & value);
+
+    /** Whether responses have a Date header.  Defaults to false, which
+        leaves the responses as they always were.
+    */
+    bool sendDateHeader;
+
+    /** Number of requests of a connection that are dispatched before the
+        response to the first of them is sent.  See HttpConnectionHandler.
+        Defaults to 1, which handles them one at a time.
+    */
+    int maxPipelinedRequests;
+
+    /** Append the status line of a response with the given code and
+        reason phrase to the header, followed by the Date header and the
+        ones added with addResponseHeader().
+    */
+    void appendResponseStart(std::string & header,
+                             int code, const std::string & status) const;
+
+    /** Handlers handed out by makePooledHandler(). */
+    std::shared_ptr<HttpHandlerPool> handlerPool;
+
+    /** Make a handler of the given type from the handler pool, for
+        makeNewHandler() to use instead of allocating one per request.
+        The handler's reset() must clear all of its request state.
+    */
+    template<typename Handler, typename... Args>
+    std::shared_ptr<Handler> makePooledHandler(Args &&... args)
+    {
+        return handlerPool->get<Handler>(std::forward<Args>(args)...);
+    }
+
     typedef std::function<std::shared_ptr<ConnectionHandler> ()>
     HandlerFactory;
 
@@ -201,6 +488,14 @@ struct HttpEndpoint: public PassiveEndpointT<SocketTransport> {
             return handlerFactory();
         return std::make_shared<HttpConnectionHandler>();
     }
+
+private:
+    /* "HTTP/1.1 <code> <phrase>\r\n" for the standard codes from 100 to
+       599, indexed by code - 100, and empty for the others */
+    std::vector<std::string> statusLines_;
+
+    /* Rendered headers from addResponseHeader() */
+    std::string responseHeaders_;
 };
 
 } // namespace Datacratic
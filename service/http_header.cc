@@ -10,6 +10,9 @@
 #include "jml/db/persistent.h"
 #include "jml/utils/vector_utils.h"
 #include <boost/lexical_cast.hpp>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
 
 using namespace std;
 using namespace ML;
@@ -105,6 +108,295 @@ toBinary() const
 }
 
 
+/*****************************************************************************/
+/* HTTP HEADER FIELDS                                                        */
+/*****************************************************************************/
+
+namespace {
+
+struct KnownFieldName {
+    const char * name;
+    size_t length;
+};
+
+#define KNOWN_FIELD(name) { name, sizeof(name) - 1 }
+
+// In the same order as HttpHeaderFields::KnownField
+const KnownFieldName knownFieldNames[HttpHeaderFields::NUM_KNOWN_FIELDS] = {
+    KNOWN_FIELD("accept"),
+    KNOWN_FIELD("accept-encoding"),
+    KNOWN_FIELD("accept-language"),
+    KNOWN_FIELD("authorization"),
+    KNOWN_FIELD("cache-control"),
+    KNOWN_FIELD("connection"),
+    KNOWN_FIELD("content-encoding"),
+    KNOWN_FIELD("content-length"),
+    KNOWN_FIELD("content-type"),
+    KNOWN_FIELD("cookie"),
+    KNOWN_FIELD("date"),
+    KNOWN_FIELD("etag"),
+    KNOWN_FIELD("expect"),
+    KNOWN_FIELD("host"),
+    KNOWN_FIELD("keep-alive"),
+    KNOWN_FIELD("last-modified"),
+    KNOWN_FIELD("location"),
+    KNOWN_FIELD("referer"),
+    KNOWN_FIELD("server"),
+    KNOWN_FIELD("set-cookie"),
+    KNOWN_FIELD("transfer-encoding"),
+    KNOWN_FIELD("user-agent"),
+    KNOWN_FIELD("x-forwarded-for"),
+    KNOWN_FIELD("x-real-ip")
+};
+
+#undef KNOWN_FIELD
+
+} // file scope
+
+HttpHeaderFields::KnownField
+HttpHeaderFields::
+knownField(const char * name, size_t length)
+{
+    if (length == 0)
+        return UNKNOWN_FIELD;
+
+    // The length and the first letter leave at most one candidate, except
+    // for accept-encoding and accept-language which differ by their last
+    // letter; it is then compared as a whole.
+    char first = name[0] | 0x20;  // lowercase if it's a letter
+    KnownField candidate = UNKNOWN_FIELD;
+
+    switch (length) {
+    case 4:
+        if (first == 'd') candidate = DATE;
+        else if (first == 'e') candidate = ETAG;
+        else if (first == 'h') candidate = HOST;
+        break;
+    case 6:
+        if (first == 'a') candidate = ACCEPT;
+        else if (first == 'c') candidate = COOKIE;
+        else if (first == 'e') candidate = EXPECT;
+        else if (first == 's') candidate = SERVER;
+        break;
+    case 7:
+        if (first == 'r') candidate = REFERER;
+        break;
+    case 8:
+        if (first == 'l') candidate = LOCATION;
+        break;
+    case 9:
+        if (first == 'x') candidate = X_REAL_IP;
+        break;
+    case 10:
+        if (first == 'c') candidate = CONNECTION;
+        else if (first == 'k') candidate = KEEP_ALIVE;
+        else if (first == 's') candidate = SET_COOKIE;
+        else if (first == 'u') candidate = USER_AGENT;
+        break;
+    case 12:
+        if (first == 'c') candidate = CONTENT_TYPE;
+        break;
+    case 13:
+        if (first == 'a') candidate = AUTHORIZATION;
+        else if (first == 'c') candidate = CACHE_CONTROL;
+        else if (first == 'l') candidate = LAST_MODIFIED;
+        break;
+    case 14:
+        if (first == 'c') candidate = CONTENT_LENGTH;
+        break;
+    case 15:
+        if (first == 'a')
+            candidate = (name[14] | 0x20) == 'g'
+                ? ACCEPT_ENCODING : ACCEPT_LANGUAGE;
+        else if (first == 'x') candidate = X_FORWARDED_FOR;
+        break;
+    case 16:
+        if (first == 'c') candidate = CONTENT_ENCODING;
+        break;
+    case 17:
+        if (first == 't') candidate = TRANSFER_ENCODING;
+        break;
+    }
+
+    if (candidate != UNKNOWN_FIELD
+        && strncasecmp(knownFieldNames[candidate].name, name, length) == 0)
+        return candidate;
+    return UNKNOWN_FIELD;
+}
+
+const char *
+HttpHeaderFields::
+knownFieldName(KnownField field)
+{
+    if (field < 0 || field >= NUM_KNOWN_FIELDS)
+        throw ML::Exception("unknown header field %d", (int)field);
+    return knownFieldNames[field].name;
+}
+
+HttpHeaderFields::
+HttpHeaderFields()
+    : numFields_(0)
+{
+    std::fill(knownIndex_, knownIndex_ + NUM_KNOWN_FIELDS, -1);
+}
+
+void
+HttpHeaderFields::
+swap(HttpHeaderFields & other)
+{
+    text_.swap(other.text_);
+    std::swap(fields_, other.fields_);
+    moreFields_.swap(other.moreFields_);
+    std::swap(numFields_, other.numFields_);
+    std::swap(knownIndex_, other.knownIndex_);
+}
+
+void
+HttpHeaderFields::
+clear()
+{
+    text_.clear();
+    moreFields_.clear();
+    numFields_ = 0;
+    std::fill(knownIndex_, knownIndex_ + NUM_KNOWN_FIELDS, -1);
+}
+
+uint32_t
+HttpHeaderFields::
+store(const char * data, size_t length)
+{
+    uint32_t offset = text_.size();
+    text_.append(data, length);
+    return offset;
+}
+
+int
+HttpHeaderFields::
+findUnknown(const char * name, size_t nameLength) const
+{
+    for (size_t i = 0;  i < numFields_;  ++i) {
+        const Entry & e = entry(i);
+        if (e.known == UNKNOWN_FIELD && e.nameLength == nameLength
+            && strncasecmp(text_.c_str() + e.name, name, nameLength) == 0)
+            return i;
+    }
+    return -1;
+}
+
+void
+HttpHeaderFields::
+set(const char * name, size_t nameLength,
+    const char * value, size_t valueLength)
+{
+    KnownField known = knownField(name, nameLength);
+    int index = known == UNKNOWN_FIELD
+        ? findUnknown(name, nameLength) : knownIndex_[known];
+
+    if (index != -1) {
+        // The previous value is left unused in text_
+        Entry & e = entry(index);
+        e.value = store(value, valueLength);
+        e.valueLength = valueLength;
+        return;
+    }
+
+    Entry e;
+    e.known = known;
+    e.name = 0;
+    e.nameLength = nameLength;
+    if (known == UNKNOWN_FIELD) {
+        e.name = store(name, nameLength);
+        for (size_t i = 0;  i < nameLength;  ++i)
+            text_[e.name + i] = tolower(text_[e.name + i]);
+    }
+    else knownIndex_[known] = numFields_;
+    e.value = store(value, valueLength);
+    e.valueLength = valueLength;
+
+    if (numFields_ < MAX_INLINE_FIELDS)
+        fields_[numFields_] = e;
+    else moreFields_.push_back(e);
+    ++numFields_;
+}
+
+bool
+HttpHeaderFields::
+find(KnownField field, const char * & value, size_t & valueLength) const
+{
+    if (field < 0 || field >= NUM_KNOWN_FIELDS)
+        return false;
+    int index = knownIndex_[field];
+    if (index == -1)
+        return false;
+    const Entry & e = entry(index);
+    value = text_.c_str() + e.value;
+    valueLength = e.valueLength;
+    return true;
+}
+
+bool
+HttpHeaderFields::
+find(const char * name, size_t nameLength,
+     const char * & value, size_t & valueLength) const
+{
+    KnownField known = knownField(name, nameLength);
+    if (known != UNKNOWN_FIELD)
+        return find(known, value, valueLength);
+
+    int index = findUnknown(name, nameLength);
+    if (index == -1)
+        return false;
+    const Entry & e = entry(index);
+    value = text_.c_str() + e.value;
+    valueLength = e.valueLength;
+    return true;
+}
+
+std::pair<std::string, std::string>
+HttpHeaderFields::
+field(size_t index) const
+{
+    std::pair<std::string, std::string> result;
+    getField(index, result);
+    return result;
+}
+
+void
+HttpHeaderFields::
+getField(size_t index, std::pair<std::string, std::string> & result) const
+{
+    if (index >= numFields_)
+        throw ML::Exception("header field %d out of range", (int)index);
+    const Entry & e = entry(index);
+    const char * name = e.known == UNKNOWN_FIELD
+        ? text_.c_str() + e.name : knownFieldNames[e.known].name;
+    result.first.assign(name, e.nameLength);
+    result.second.assign(text_, e.value, e.valueLength);
+}
+
+bool
+HttpHeaderFields::
+operator == (const HttpHeaderFields & other) const
+{
+    if (numFields_ != other.numFields_)
+        return false;
+
+    for (size_t i = 0;  i < numFields_;  ++i) {
+        const Entry & e = entry(i);
+        const char * name = e.known == UNKNOWN_FIELD
+            ? text_.c_str() + e.name : knownFieldNames[e.known].name;
+        const char * otherValue;
+        size_t otherLength;
+        if (!other.find(name, e.nameLength, otherValue, otherLength)
+            || otherLength != e.valueLength
+            || memcmp(text_.c_str() + e.value, otherValue, otherLength) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+
 /*****************************************************************************/
 /* HTTP HEADER                                                               */
 /*****************************************************************************/
@@ -225,7 +517,7 @@ parse(const std::string & headerAndData, bool checkBodyLength)
             }
             else {
                 string value = context.expect_text('\r');
-                parsed.headers[name] = value;
+                parsed.headers.set(name, value);
             }
             context.expect_eol();
         }
@@ -276,10 +568,8 @@ std::ostream & operator << (std::ostream & stream, const HttpHeader & header)
         stream << "Transfer-Encoding: chunked\r\n";
     else if (header.contentLength != -1)
         stream << "Content-Length: " << header.contentLength << "\r\n";
-    for (auto it = header.headers.begin(), end = header.headers.end();
-         it != end;  ++it) {
-        stream << it->first << ": " << it->second << "\r\n";
-    }
+    for (const auto & field: header.headers)
+        stream << field.first << ": " << field.second << "\r\n";
     stream << "\r\n";
     return stream;
 }
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <string>
 #include <map>
 #include <iostream>
@@ -45,6 +46,214 @@ struct RestParams
 };
 
 
+/*****************************************************************************/
+/* HTTP HEADER FIELDS                                                        */
+/*****************************************************************************/
+
+/** The "name: value" fields of an HTTP header.
+
+    Names and values are stored back to back in a single string, and the
+    fields themselves in a flat array that only allocates once there are
+    more than MAX_INLINE_FIELDS of them.  Names are compared without
+    regard to case.  The common ones are interned as a KnownField, which
+    makes looking them up an index rather than a search.
+
+    When listed, fields come in the order they were first set with
+    lowercased names, and setting a field again replaces its value.  This
+    differs from the std::map<std::string, std::string> that HttpHeader
+    used to have, which listed them sorted by name: code that relied on
+    that order must sort them itself.
+*/
+
+struct HttpHeaderFields {
+
+    enum KnownField {
+        UNKNOWN_FIELD = -1,
+        ACCEPT,
+        ACCEPT_ENCODING,
+        ACCEPT_LANGUAGE,
+        AUTHORIZATION,
+        CACHE_CONTROL,
+        CONNECTION,
+        CONTENT_ENCODING,
+        CONTENT_LENGTH,
+        CONTENT_TYPE,
+        COOKIE,
+        DATE,
+        ETAG,
+        EXPECT,
+        HOST,
+        KEEP_ALIVE,
+        LAST_MODIFIED,
+        LOCATION,
+        REFERER,
+        SERVER,
+        SET_COOKIE,
+        TRANSFER_ENCODING,
+        USER_AGENT,
+        X_FORWARDED_FOR,
+        X_REAL_IP,
+        NUM_KNOWN_FIELDS
+    };
+
+    /** Return the known field with the given name, whatever its case, or
+        UNKNOWN_FIELD.
+    */
+    static KnownField knownField(const char * name, size_t length);
+
+    /** Lowercased name of the given known field. */
+    static const char * knownFieldName(KnownField field);
+
+    HttpHeaderFields();
+
+    void swap(HttpHeaderFields & other);
+
+    /** Set the value of a field, replacing any previous one. */
+    void set(const char * name, size_t nameLength,
+             const char * value, size_t valueLength);
+
+    void set(const std::string & name, const std::string & value)
+    {
+        set(name.c_str(), name.size(), value.c_str(), value.size());
+    }
+
+    /** Find the value of the given field, which stays valid until the
+        fields are next modified.  Returns false if it isn't set.
+    */
+    bool find(KnownField field,
+              const char * & value, size_t & valueLength) const;
+    bool find(const char * name, size_t nameLength,
+              const char * & value, size_t & valueLength) const;
+
+    bool has(const std::string & name) const
+    {
+        const char * value;
+        size_t valueLength;
+        return find(name.c_str(), name.size(), value, valueLength);
+    }
+
+    /** Make room for fields of the given total length, to avoid growing
+        the storage as they are set.
+    */
+    void reserve(size_t textLength)
+    {
+        text_.reserve(textLength);
+    }
+
+    void clear();
+
+    size_t size() const { return numFields_; }
+    bool empty() const { return numFields_ == 0; }
+
+    /** Lowercased name and value of the field at the given index. */
+    std::pair<std::string, std::string> field(size_t index) const;
+
+    /** Same as field(), into existing strings whose storage is reused. */
+    void getField(size_t index,
+                  std::pair<std::string, std::string> & result) const;
+
+    /** Iterates over the fields as pairs of name and value, like the
+        std::map that the fields used to be.  Unlike with the map, which
+        listed them sorted by name, the fields come in the order they were
+        first set.  The pair is a copy kept in the iterator, which stays
+        valid until the iterator moves and reuses its storage.
+    */
+    struct const_iterator {
+        const_iterator(const HttpHeaderFields * fields, size_t index)
+            : fields(fields), index(index), current(-1)
+        {
+        }
+
+        const std::pair<std::string, std::string> & operator * () const
+        {
+            if (current != index) {
+                fields->getField(index, field);
+                current = index;
+            }
+            return field;
+        }
+
+        const std::pair<std::string, std::string> * operator -> () const
+        {
+            return &operator * ();
+        }
+
+        const_iterator & operator ++ ()
+        {
+            ++index;
+            return *this;
+        }
+
+        bool operator == (const const_iterator & other) const
+        {
+            return index == other.index;
+        }
+
+        bool operator != (const const_iterator & other) const
+        {
+            return index != other.index;
+        }
+
+        const HttpHeaderFields * fields;
+        size_t index;
+
+    private:
+        mutable size_t current;  // index of field, or -1
+        mutable std::pair<std::string, std::string> field;
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, numFields_); }
+
+    /** Same fields with the same values, in whatever order. */
+    bool operator == (const HttpHeaderFields & other) const;
+
+    bool operator != (const HttpHeaderFields & other) const
+    {
+        return !operator == (other);
+    }
+
+    enum {
+        MAX_INLINE_FIELDS = 16
+    };
+
+private:
+    struct Entry {
+        int known;             // KnownField
+        uint32_t name;         // offset of the lowercased name if unknown
+        uint32_t nameLength;
+        uint32_t value;
+        uint32_t valueLength;
+    };
+
+    Entry & entry(size_t index)
+    {
+        return index < MAX_INLINE_FIELDS
+            ? fields_[index] : moreFields_[index - MAX_INLINE_FIELDS];
+    }
+
+    const Entry & entry(size_t index) const
+    {
+        return index < MAX_INLINE_FIELDS
+            ? fields_[index] : moreFields_[index - MAX_INLINE_FIELDS];
+    }
+
+    /* Index of the entry of the unknown field with the given name, or -1 */
+    int findUnknown(const char * name, size_t nameLength) const;
+
+    /* Append to text_ and return the offset */
+    uint32_t store(const char * data, size_t length);
+
+    std::string text_;
+    Entry fields_[MAX_INLINE_FIELDS];
+    std::vector<Entry> moreFields_;
+    size_t numFields_;
+
+    /* Index of the entry of each known field, or -1 */
+    int knownIndex_[NUM_KNOWN_FIELDS];
+};
+
+
 /*****************************************************************************/
 /* HTTP HEADER                                                               */
 /*****************************************************************************/
@@ -75,22 +284,49 @@ struct HttpHeader {
     bool isChunked;
 
     // The rest of the headers are here
-    std::map<std::string, std::string> headers;
+    HttpHeaderFields headers;
+
+    /** The header lookups below ignore the case of the key. */
+    bool hasHeader(const std::string & key) const
+    {
+        return headers.has(key);
+    }
 
     std::string getHeader(const std::string & key) const
     {
-        auto it = headers.find(key);
-        if (it == headers.end())
+        const char * value;
+        size_t length;
+        if (!headers.find(key.c_str(), key.size(), value, length))
             throw ML::Exception("couldn't find header " + key);
-        return it->second;
+        return std::string(value, length);
+    }
+
+    std::string getHeader(HttpHeaderFields::KnownField key) const
+    {
+        const char * value;
+        size_t length;
+        if (!headers.find(key, value, length))
+            throw ML::Exception("couldn't find header %s",
+                                HttpHeaderFields::knownFieldName(key));
+        return std::string(value, length);
     }
 
     std::string tryGetHeader(const std::string & key) const
     {
-        auto it = headers.find(key);
-        if (it == headers.end())
+        const char * value;
+        size_t length;
+        if (!headers.find(key.c_str(), key.size(), value, length))
+            return "";
+        return std::string(value, length);
+    }
+
+    std::string tryGetHeader(HttpHeaderFields::KnownField key) const
+    {
+        const char * value;
+        size_t length;
+        if (!headers.find(key, value, length))
             return "";
-        return it->second;
+        return std::string(value, length);
     }
 
     // If some portion of the data is known, it's put in here
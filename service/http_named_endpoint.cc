@@ -80,6 +80,13 @@ bindTcp(PortRange const & portRange, std::string host)
 {
     using namespace std;
 
+    // The handlers answer their request without its id and are replaced
+    // once they did
+    if (maxPipelinedRequests > 1)
+        throw ML::Exception("HttpNamedEndpoint can't pipeline requests: "
+                            "maxPipelinedRequests is %d",
+                            maxPipelinedRequests);
+
     // TODO: generalize this...
     if (host == "" || host == "*")
         host = "0.0.0.0";
@@ -136,7 +143,7 @@ std::shared_ptr<ConnectionHandler>
 HttpNamedEndpoint::
 makeNewHandler()
 {
-    auto res = std::make_shared<RestConnectionHandler>(this);
+    auto res = makePooledHandler<RestConnectionHandler>(this);
 
     // Allow it to get a shared pointer to itself
     res->sharedThis = res;
@@ -196,6 +203,15 @@ handleDisconnect()
     HttpConnectionHandler::handleDisconnect();
 }
 
+void
+HttpNamedEndpoint::RestConnectionHandler::
+reset()
+{
+    HttpConnectionHandler::reset();
+    sharedThis.reset();
+    isZombie = false;
+}
+
 void
 HttpNamedEndpoint::RestConnectionHandler::
 sendErrorResponse(int code, const std::string & error)
@@ -19,7 +19,12 @@ namespace Datacratic {
 /* HTTP NAMED ENDPOINT                                                       */
 /*****************************************************************************/
 
-/** A message loop-compatible endpoint for http connections. */
+/** A message loop-compatible endpoint for http connections.
+
+    Each request gets its own RestConnectionHandler, which is replaced
+    once the response is sent, so requests can't be pipelined:
+    maxPipelinedRequests must stay at 1.
+*/
 
 struct HttpNamedEndpoint : public NamedEndpoint, public HttpEndpoint {
 
@@ -73,6 +78,11 @@ struct HttpNamedEndpoint : public NamedEndpoint, public HttpEndpoint {
         */
         virtual void handleDisconnect();
 
+        /** Clears sharedThis and the zombie flag, for the handler to be
+            reused from the endpoint's handler pool.
+        */
+        virtual void reset();
+
         void sendErrorResponse(int code, const std::string & error);
 
         void sendErrorResponse(int code, const Json::Value & error);
@@ -0,0 +1,332 @@
+/* http_request_parser.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+*/
+
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+
+#include "jml/arch/exception.h"
+#include "jml/utils/exc_assert.h"
+
+#include "http_request_parser.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+namespace {
+
+bool
+equalsNoCase(const char * header, const HttpRequestParser::Span & span,
+             const char * str, size_t length)
+{
+    return span.length == length
+        && strncasecmp(span.begin(header), str, length) == 0;
+}
+
+int
+hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+string
+urlDecode(const char * begin, const char * end)
+{
+    string result;
+    result.reserve(end - begin);
+    for (const char * p = begin;  p != end;  ++p) {
+        if (*p != '%') {
+            result += *p;
+            continue;
+        }
+        int high = end - p > 2 ? hexValue(p[1]) : -1;
+        int low = end - p > 2 ? hexValue(p[2]) : -1;
+        if (high == -1 || low == -1)
+            throw ML::Exception("invalid url encoded character: "
+                                + string(p, std::min<ptrdiff_t>(end - p, 3)));
+        result += char(high * 16 + low);
+        p += 2;
+    }
+    return result;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* HTTP REQUEST PARSER                                                       */
+/*****************************************************************************/
+
+HttpRequestParser::
+HttpRequestParser(size_t maxHeaderLength)
+    : maxHeaderLength(maxHeaderLength)
+{
+    ExcAssertLess(maxHeaderLength, (size_t)UINT32_MAX);
+    reset();
+}
+
+void
+HttpRequestParser::
+reset()
+{
+    state_ = VERB;
+    pos_ = 0;
+    start_ = 0;
+    verb_ = resource_ = query_ = version_ = Span();
+    moreFields_.clear();
+    numFields_ = 0;
+    contentLength_ = -1;
+    isChunked_ = false;
+}
+
+bool
+HttpRequestParser::
+feed(const char * data, size_t size)
+{
+    if (state_ == DONE)
+        return true;
+    ExcAssertGreaterEqual(size, pos_);
+
+    size_t end = std::min(size, maxHeaderLength);
+
+    auto malformed = [&] (const char * where)
+        {
+            throw ML::Exception("malformed HTTP header: unexpected "
+                                "character %d at offset %d in %s",
+                                (int)data[pos_], (int)pos_, where);
+        };
+
+    while (pos_ < end) {
+        char c = data[pos_];
+
+        switch (state_) {
+        case VERB:
+            if (c == ' ') {
+                if (pos_ == start_)
+                    malformed("verb");
+                verb_ = Span(start_, pos_ - start_);
+                start_ = pos_ + 1;
+                state_ = RESOURCE;
+            }
+            else if (c == '\r' || c == '\n')
+                malformed("verb");
+            break;
+
+        case RESOURCE:
+            if (c == ' ' || c == '?') {
+                resource_ = Span(start_, pos_ - start_);
+                start_ = pos_ + 1;
+                state_ = c == ' ' ? VERSION : QUERY;
+            }
+            else if (c == '\r' || c == '\n')
+                malformed("resource");
+            break;
+
+        case QUERY:
+            if (c == ' ') {
+                query_ = Span(start_, pos_ - start_);
+                start_ = pos_ + 1;
+                state_ = VERSION;
+            }
+            else if (c == '\r' || c == '\n')
+                malformed("query");
+            break;
+
+        case VERSION:
+            if (c == '\r') {
+                version_ = Span(start_, pos_ - start_);
+                state_ = REQUEST_LINE_LF;
+            }
+            else if (c == '\n')
+                malformed("version");
+            break;
+
+        case REQUEST_LINE_LF:
+        case FIELD_LF:
+            if (c != '\n')
+                malformed("end of line");
+            state_ = FIELD_START;
+            break;
+
+        case FIELD_START:
+            if (c == '\r') {
+                state_ = END_LF;
+                break;
+            }
+            if (c == ':' || c == '\n')
+                malformed("field name");
+            start_ = pos_;
+            state_ = FIELD_NAME;
+            continue;  // the character is part of the name
+
+        case FIELD_NAME:
+            if (c == ':') {
+                current_.name = Span(start_, pos_ - start_);
+                state_ = FIELD_VALUE_START;
+            }
+            else if (c == '\r' || c == '\n')
+                malformed("field name");
+            break;
+
+        case FIELD_VALUE_START:
+            if (c == ' ' || c == '\t')
+                break;
+            start_ = pos_;
+            state_ = FIELD_VALUE;
+            continue;  // the character is part of the value
+
+        case FIELD_VALUE: {
+            // Values are most of the header, so skip straight to their end
+            const char * cr
+                = (const char *)memchr(data + pos_, '\r', end - pos_);
+            if (!cr) {
+                pos_ = end;
+                continue;
+            }
+            pos_ = cr - data;
+            current_.value = Span(start_, pos_ - start_);
+            addField(data);
+            state_ = FIELD_LF;
+            break;
+        }
+
+        case END_LF:
+            if (c != '\n')
+                malformed("end of header");
+            state_ = DONE;
+            ++pos_;
+            return true;
+
+        case DONE:
+            return true;
+        }
+
+        ++pos_;
+    }
+
+    if (size > maxHeaderLength)
+        throw ML::Exception("HTTP header exceeds %d bytes",
+                            (int)maxHeaderLength);
+
+    return false;
+}
+
+size_t
+HttpRequestParser::
+headerLength() const
+{
+    ExcAssertEqual(state_, DONE);
+    return pos_;
+}
+
+void
+HttpRequestParser::
+addField(const char * header)
+{
+    if (numFields_ < MAX_INLINE_FIELDS)
+        fields_[numFields_] = current_;
+    else moreFields_.push_back(current_);
+    ++numFields_;
+
+    // The fields that say how to read the body are needed in any case
+    const Span & name = current_.name;
+    const Span & value = current_.value;
+    if (equalsNoCase(header, name, "content-length", 14)) {
+        const char * p = value.begin(header);
+        const char * e = value.end(header);
+        int64_t length = 0;
+        if (p == e)
+            throw ML::Exception("invalid content-length");
+        for (;  p != e && *p != ' ' && *p != '\t';  ++p) {
+            if (*p < '0' || *p > '9' || length > INT64_MAX / 10 - 1)
+                throw ML::Exception("invalid content-length: "
+                                    + value.toString(header));
+            length = length * 10 + (*p - '0');
+        }
+        contentLength_ = length;
+    }
+    else if (equalsNoCase(header, name, "transfer-encoding", 17)) {
+        if (!equalsNoCase(header, value, "chunked", 7))
+            throw ML::Exception("unknown transfer-encoding");
+        isChunked_ = true;
+    }
+}
+
+bool
+HttpRequestParser::
+findField(const char * header, const char * name, Span & value) const
+{
+    size_t length = strlen(name);
+    for (int i = 0;  i < numFields_;  ++i) {
+        const Field & f = field(i);
+        if (equalsNoCase(header, f.name, name, length)) {
+            value = f.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+void
+HttpRequestParser::
+fillHeader(const char * header, HttpHeader & result) const
+{
+    ExcAssertEqual(state_, DONE);
+
+    // Filled in place, so that the storage of a reused header is kept
+    result.verb.assign(verb_.begin(header), verb_.length);
+    result.resource.assign(resource_.begin(header), resource_.length);
+    result.version.assign(version_.begin(header), version_.length);
+    result.queryParams.clear();
+    result.contentType.clear();
+    result.headers.clear();
+    result.knownData.clear();
+
+    // A query always follows something, so an offset of 0 means none
+    if (query_.offset != 0) {
+        const char * p = query_.begin(header);
+        const char * e = query_.end(header);
+        for (;;) {
+            const char * amp = std::find(p, e, '&');
+            const char * eq = std::find(p, amp, '=');
+            result.queryParams.emplace_back
+                (urlDecode(p, eq),
+                 eq == amp ? string() : urlDecode(eq + 1, amp));
+            if (amp == e)
+                break;
+            p = amp + 1;
+        }
+    }
+
+    // The fields are copied into a single block of storage
+    result.headers.reserve(pos_);
+
+    for (int i = 0;  i < numFields_;  ++i) {
+        const Field & f = field(i);
+        if (equalsNoCase(header, f.name, "content-length", 14)
+            || equalsNoCase(header, f.name, "transfer-encoding", 17))
+            continue;
+        if (equalsNoCase(header, f.name, "content-type", 12)) {
+            result.contentType.assign(f.value.begin(header), f.value.length);
+            continue;
+        }
+
+        result.headers.set(f.name.begin(header), f.name.length,
+                           f.value.begin(header), f.value.length);
+    }
+
+    result.contentLength = contentLength_;
+    result.isChunked = isChunked_;
+}
+
+} // namespace Datacratic
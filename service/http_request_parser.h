@@ -0,0 +1,177 @@
+/* http_request_parser.h                                          -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Incremental parser for the header of HTTP requests.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "http_header.h"
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* HTTP REQUEST PARSER                                                       */
+/*****************************************************************************/
+
+/** Parser for the header of an HTTP request that works in place, in the
+    buffer where the request is read.
+
+    Each call to feed() picks up where the previous one stopped, so a
+    header that arrives in many pieces is only looked at once.  The parts
+    of the header are recorded as offsets from its start rather than
+    copied, which means that nothing is allocated unless the request has
+    more than MAX_INLINE_FIELDS fields, and that the buffer can move
+    between calls as long as the header stays at its start.  An HttpHeader
+    is only filled in when fillHeader() is called.
+*/
+
+struct HttpRequestParser {
+
+    HttpRequestParser(size_t maxHeaderLength = 16384);
+
+    /** Part of the header, as an offset from its start. */
+    struct Span {
+        Span()
+            : offset(0), length(0)
+        {
+        }
+
+        Span(uint32_t offset, uint32_t length)
+            : offset(offset), length(length)
+        {
+        }
+
+        const char * begin(const char * header) const
+        {
+            return header + offset;
+        }
+
+        const char * end(const char * header) const
+        {
+            return header + offset + length;
+        }
+
+        std::string toString(const char * header) const
+        {
+            return std::string(header + offset, length);
+        }
+
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    /** A "name: value" line of the header. */
+    struct Field {
+        Span name;
+        Span value;
+    };
+
+    enum {
+        MAX_INLINE_FIELDS = 32
+    };
+
+    /** Forget the current header, to parse the next one. */
+    void reset();
+
+    /** Parse more of the header, which starts at data and of which size
+        bytes are available.  The bytesParsed() bytes seen by the previous
+        calls must be the same.  Returns true once the empty line that ends
+        the header was reached, after which headerLength() is where the
+        body starts.  Throws on a malformed header or one that is longer
+        than maxHeaderLength.
+    */
+    bool feed(const char * data, size_t size);
+
+    bool done() const { return state_ == DONE; }
+
+    size_t bytesParsed() const { return pos_; }
+
+    /** Length of the header, including the empty line at its end. */
+    size_t headerLength() const;
+
+    Span verb() const { return verb_; }
+
+    /** Path of the resource, without the query string. */
+    Span resource() const { return resource_; }
+
+    /** Query string, without the '?', which isn't decoded. */
+    Span query() const { return query_; }
+
+    Span version() const { return version_; }
+
+    int numFields() const { return numFields_; }
+
+    const Field & field(int index) const
+    {
+        return index < MAX_INLINE_FIELDS
+            ? fields_[index] : moreFields_[index - MAX_INLINE_FIELDS];
+    }
+
+    /** Find the value of the first field with the given name, which is
+        compared without regard to case.  Returns false if there is none.
+    */
+    bool findField(const char * header, const char * name,
+                   Span & value) const;
+
+    /** Value of the content-length field, or -1 if there is none. */
+    int64_t contentLength() const { return contentLength_; }
+
+    /** Whether the transfer-encoding is chunked. */
+    bool isChunked() const { return isChunked_; }
+
+    /** Fill in the given header from the parsed one, in the same way as
+        HttpHeader::parse() would, except for knownData which is left
+        empty.  Its fields are assigned in place, so a header that is
+        filled again keeps its storage and only allocates when a field
+        outgrows it.
+    */
+    void fillHeader(const char * header, HttpHeader & result) const;
+
+    size_t maxHeaderLength;
+
+private:
+    enum State {
+        VERB,
+        RESOURCE,
+        QUERY,
+        VERSION,
+        REQUEST_LINE_LF,
+        FIELD_START,
+        FIELD_NAME,
+        FIELD_VALUE_START,
+        FIELD_VALUE,
+        FIELD_LF,
+        END_LF,
+        DONE
+    };
+
+    State state_;
+    uint32_t pos_;
+
+    /* Where the part being parsed started */
+    uint32_t start_;
+
+    Span verb_;
+    Span resource_;
+    Span query_;
+    Span version_;
+
+    Field fields_[MAX_INLINE_FIELDS];
+    std::vector<Field> moreFields_;
+    int numFields_;
+    Field current_;
+
+    int64_t contentLength_;
+    bool isChunked_;
+
+    /* Record the field that was just parsed */
+    void addField(const char * header);
+};
+
+} // namespace Datacratic
@@ -69,12 +69,9 @@ struct HttpRestProxy {
         /** Get the given response header of the REST call. */
         std::string getHeader(const std::string & name) const
         {
-            auto it = header_.headers.find(name);
-            if (it == header_.headers.end())
-                it = header_.headers.find(ML::lowercase(name));
-            if (it == header_.headers.end())
+            if (!header_.hasHeader(name))
                 throw ML::Exception("required header " + name + " not found");
-            return it->second;
+            return header_.getHeader(name);
         }
 
         long code_;
@@ -0,0 +1,507 @@
+/* io_uring_poller.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <iostream>
+
+#if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    if defined(IORING_POLL_ADD_MULTI) && defined(IORING_FEAT_RSRC_TAGS)
+#      define HAVE_IO_URING 1
+#    endif
+#  endif
+#endif
+
+#include "jml/arch/exception.h"
+
+#include "io_uring_poller.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+/* User data of the requests whose completion is of no interest */
+const uint64_t IgnoredCompletion = 1ULL << 63;
+
+uint64_t userDataOf(int fd, uint32_t generation)
+{
+    return (uint64_t(generation) << 32) | uint32_t(fd);
+}
+
+int setup(unsigned entries, io_uring_params & params)
+{
+    return syscall(__NR_io_uring_setup, entries, &params);
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* IO URING POLLER                                                           */
+/*****************************************************************************/
+
+IoUringPoller::
+IoUringPoller(unsigned maxFds)
+    : ringFd_(-1),
+      sqRing_(MAP_FAILED), sqRingSize_(0),
+      cqRing_(MAP_FAILED), cqRingSize_(0),
+      sqes_((io_uring_sqe *)MAP_FAILED), sqesSize_(0),
+      nextGeneration_(1)
+{
+    unsigned entries = std::min(std::max(maxFds, 64U), 4096U);
+
+    // Every watched fd can complete at once, so the completion ring must
+    // hold all of them; the kernel keeps the overflow anyway if it doesn't.
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = std::min(std::max(maxFds * 2, entries * 2), 65536U);
+
+    ringFd_ = setup(entries, params);
+    if (ringFd_ == -1)
+        throw ML::Exception(errno, "io_uring_setup");
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+
+    sqRing_ = mmap(0, sqRingSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) {
+        unmap();
+        throw ML::Exception(errno, "io_uring mmap of submission ring");
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cqRing_ = sqRing_;
+    else {
+        cqRing_ = mmap(0, cqRingSize_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+        if (cqRing_ == MAP_FAILED) {
+            unmap();
+            throw ML::Exception(errno, "io_uring mmap of completion ring");
+        }
+    }
+
+    sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe *)mmap(0, sqesSize_, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_POPULATE, ringFd_,
+                                 IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) {
+        unmap();
+        throw ML::Exception(errno, "io_uring mmap of submission entries");
+    }
+
+    char * sq = (char *)sqRing_;
+    sqHead_ = (std::atomic<uint32_t> *)(sq + params.sq_off.head);
+    sqTail_ = (std::atomic<uint32_t> *)(sq + params.sq_off.tail);
+    sqMask_ = *(uint32_t *)(sq + params.sq_off.ring_mask);
+    sqEntries_ = *(uint32_t *)(sq + params.sq_off.ring_entries);
+    sqArray_ = (uint32_t *)(sq + params.sq_off.array);
+
+    char * cq = (char *)cqRing_;
+    cqHead_ = (std::atomic<uint32_t> *)(cq + params.cq_off.head);
+    cqTail_ = (std::atomic<uint32_t> *)(cq + params.cq_off.tail);
+    cqMask_ = *(uint32_t *)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+}
+
+IoUringPoller::
+~IoUringPoller()
+{
+    unmap();
+}
+
+void
+IoUringPoller::
+unmap()
+{
+    if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqesSize_);
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_)
+        munmap(cqRing_, cqRingSize_);
+    if (sqRing_ != MAP_FAILED)
+        munmap(sqRing_, sqRingSize_);
+    sqes_ = (io_uring_sqe *)MAP_FAILED;
+    cqRing_ = sqRing_ = MAP_FAILED;
+
+    if (ringFd_ != -1) {
+        int res = ::close(ringFd_);
+        if (res == -1)
+            cerr << "warning: close on io_uring: " << strerror(errno) << endl;
+        ringFd_ = -1;
+    }
+}
+
+bool
+IoUringPoller::
+supported()
+{
+    static const bool result = [] () {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        int fd = setup(4, params);
+        if (fd == -1)
+            return false;
+        ::close(fd);
+
+        // EXT_ARG (5.11) gives io_uring_enter() a timeout, NODROP (5.5)
+        // keeps the completions that overflow the ring and RSRC_TAGS
+        // comes with the multishot poll requests (5.13).
+        return (params.features & IORING_FEAT_EXT_ARG)
+            && (params.features & IORING_FEAT_NODROP)
+            && (params.features & IORING_FEAT_RSRC_TAGS);
+    } ();
+
+    return result;
+}
+
+void
+IoUringPoller::
+add(int fd, void * data, Mode mode, bool defer)
+{
+    Guard guard(lock_);
+
+    auto res = registrations_.insert({ fd, Registration() });
+    if (!res.second)
+        throw ML::Exception("io_uring: fd %d is already watched", fd);
+
+    Registration & registration = res.first->second;
+    registration.data = data;
+    registration.mode = mode;
+    registration.armed = false;
+    queuePoll(fd, registration);
+
+    if (!defer)
+        submit();
+}
+
+void
+IoUringPoller::
+restart(int fd, void * data, bool defer)
+{
+    Guard guard(lock_);
+
+    auto it = registrations_.find(fd);
+    if (it == registrations_.end())
+        throw ML::Exception("io_uring: restarting fd %d which isn't watched",
+                            fd);
+
+    Registration & registration = it->second;
+    if (registration.armed)
+        queueRemove(userDataOf(fd, registration.generation));
+    registration.data = data;
+    queuePoll(fd, registration);
+
+    if (!defer)
+        submit();
+}
+
+bool
+IoUringPoller::
+remove(int fd, bool defer)
+{
+    Guard guard(lock_);
+
+    auto it = registrations_.find(fd);
+    if (it == registrations_.end())
+        return false;
+
+    // A completion that is already in the ring won't match any
+    // registration anymore, so it gets dropped by reap().
+    if (it->second.armed)
+        queueRemove(userDataOf(fd, it->second.generation));
+    registrations_.erase(it);
+
+    if (!defer)
+        submit();
+
+    return true;
+}
+
+int
+IoUringPoller::
+wait(epoll_event * events, int maxEvents, int timeoutMs)
+{
+    uint32_t queued;
+    {
+        Guard guard(lock_);
+        queueRearms();
+        int numEvents = reap(events, maxEvents);
+        if (numEvents > 0)
+            return numEvents;
+        queued = numQueued();
+    }
+
+    // The kernel only reads the submission ring up to its tail, so the lock
+    // isn't needed to enter it and other threads can keep queueing
+    // requests.  Entering also runs the pending work that posts the
+    // completions of the poll requests, which is why it's needed even
+    // without waiting.  The kernel doesn't wait if it submits less than
+    // asked for, which happens when another thread submitted some of the
+    // requests first; the caller then gets no events, as with EINTR.
+    int res = enter(queued, timeoutMs == 0 ? 0 : 1, timeoutMs, true);
+    if (res == -1 && errno != ETIME && errno != EBUSY)
+        return -1;
+
+    Guard guard(lock_);
+    return reap(events, maxEvents);
+}
+
+void
+IoUringPoller::
+flush()
+{
+    // The level-triggered fds that fired were handled by now; without
+    // their polls, waiting on the ring fd would miss them
+    Guard guard(lock_);
+    queueRearms();
+    submit();
+}
+
+void
+IoUringPoller::
+queueRearms()
+{
+    for (int fd: rearms_) {
+        auto it = registrations_.find(fd);
+        if (it != registrations_.end() && !it->second.armed)
+            queuePoll(fd, it->second);
+    }
+    rearms_.clear();
+}
+
+void
+IoUringPoller::
+queuePoll(int fd, Registration & registration)
+{
+    registration.generation = nextGeneration_;
+    nextGeneration_ = (nextGeneration_ + 1) & 0x7fffffff;
+    if (nextGeneration_ == 0)
+        nextGeneration_ = 1;
+    registration.armed = true;
+
+    io_uring_sqe * sqe = nextSqe();
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    if (registration.mode == EDGE_TRIGGERED)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = userDataOf(fd, registration.generation);
+    pushSqe();
+}
+
+void
+IoUringPoller::
+queueRemove(uint64_t userData)
+{
+    io_uring_sqe * sqe = nextSqe();
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = userData;
+    sqe->user_data = IgnoredCompletion;
+    pushSqe();
+}
+
+io_uring_sqe *
+IoUringPoller::
+nextSqe()
+{
+    if (numQueued() >= sqEntries_) {
+        submit();
+        if (numQueued() >= sqEntries_)
+            throw ML::Exception("io_uring submission ring is full");
+    }
+
+    uint32_t tail = sqTail_->load(std::memory_order_relaxed);
+    uint32_t index = tail & sqMask_;
+    io_uring_sqe * sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray_[index] = index;
+
+    return sqe;
+}
+
+uint32_t
+IoUringPoller::
+numQueued() const
+{
+    return sqTail_->load(std::memory_order_relaxed)
+        - sqHead_->load(std::memory_order_acquire);
+}
+
+void
+IoUringPoller::
+pushSqe()
+{
+    // The kernel only looks at an entry once the tail has moved past it,
+    // and it can do so at any time since wait() enters it without the lock.
+    uint32_t tail = sqTail_->load(std::memory_order_relaxed);
+    sqTail_->store(tail + 1, std::memory_order_release);
+}
+
+int
+IoUringPoller::
+enter(unsigned toSubmit, unsigned minComplete, int timeoutMs,
+      bool getEvents)
+{
+    unsigned flags = getEvents ? IORING_ENTER_GETEVENTS : 0;
+
+    __kernel_timespec ts;
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeoutMs > 0) {
+        ts.tv_sec = timeoutMs / 1000;
+        ts.tv_nsec = (timeoutMs % 1000) * 1000000;
+        arg.ts = (uint64_t)&ts;
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    return syscall(__NR_io_uring_enter, ringFd_, toSubmit, minComplete, flags,
+                   (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                   sizeof(arg));
+}
+
+void
+IoUringPoller::
+submit()
+{
+    for (;;) {
+        uint32_t queued = numQueued();
+        if (queued == 0)
+            return;
+
+        int res = enter(queued, 0, 0, false);
+        if (res == -1 && (errno == EINTR || errno == EAGAIN))
+            continue;
+
+        // The completion ring is full: the entries stay queued until the
+        // completions are reaped.
+        if (res == -1 && errno == EBUSY)
+            return;
+        if (res == -1)
+            throw ML::Exception(errno, "io_uring_enter");
+
+        if (res == 0)
+            return;
+    }
+}
+
+int
+IoUringPoller::
+reap(epoll_event * events, int maxEvents)
+{
+    int numEvents = 0;
+    uint32_t head = cqHead_->load(std::memory_order_relaxed);
+    uint32_t tail = cqTail_->load(std::memory_order_acquire);
+
+    for (;  head != tail && numEvents < maxEvents;  ++head) {
+        const io_uring_cqe & cqe = cqes_[head & cqMask_];
+        if (cqe.user_data & IgnoredCompletion)
+            continue;
+
+        int fd = int(uint32_t(cqe.user_data));
+        uint32_t generation = cqe.user_data >> 32;
+
+        // Completions of fds that were removed or restarted since
+        auto it = registrations_.find(fd);
+        if (it == registrations_.end()
+            || it->second.generation != generation)
+            continue;
+        if (cqe.res == -ECANCELED)
+            continue;
+
+        Registration & registration = it->second;
+        epoll_event & event = events[numEvents++];
+        event.events = cqe.res >= 0 ? cqe.res : EPOLLERR;
+        event.data.ptr = registration.data;
+
+        // A multishot request stays armed until a completion comes without
+        // the MORE flag, which the kernel does when it can't keep it.
+        if (registration.mode == EDGE_TRIGGERED
+            && (cqe.flags & IORING_CQE_F_MORE))
+            continue;
+
+        registration.armed = false;
+        if (registration.mode != ONE_SHOT)
+            rearms_.push_back(fd);
+    }
+
+    cqHead_->store(head, std::memory_order_release);
+    return numEvents;
+}
+
+#else // HAVE_IO_URING
+
+/* Kernel headers without io_uring: the Epoller always uses epoll. */
+
+IoUringPoller::
+IoUringPoller(unsigned maxFds)
+{
+    throw ML::Exception("io_uring isn't supported by this build");
+}
+
+IoUringPoller::
+~IoUringPoller()
+{
+}
+
+bool
+IoUringPoller::
+supported()
+{
+    return false;
+}
+
+void
+IoUringPoller::
+add(int fd, void * data, Mode mode, bool defer)
+{
+}
+
+void
+IoUringPoller::
+restart(int fd, void * data, bool defer)
+{
+}
+
+bool
+IoUringPoller::
+remove(int fd, bool defer)
+{
+    return false;
+}
+
+int
+IoUringPoller::
+wait(epoll_event * events, int maxEvents, int timeoutMs)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void
+IoUringPoller::
+flush()
+{
+}
+
+#endif // HAVE_IO_URING
+
+} // namespace Datacratic
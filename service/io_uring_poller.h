@@ -0,0 +1,183 @@
+/* io_uring_poller.h                                               -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Readiness notification through io_uring poll requests, used as a
+   backend of the Epoller.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "jml/arch/spinlock.h"
+
+struct epoll_event;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* IO URING POLLER                                                           */
+/*****************************************************************************/
+
+/** Set of fds watched through an io_uring, with the semantics of an epoll
+    set restricted to what the Epoller uses: fds wait for EPOLLIN and are
+    level-triggered, one-shot or edge-triggered.
+
+    Each fd has a poll request in flight while it is armed.  When it
+    completes, the fd is reported like epoll_wait() would; a one-shot fd
+    then waits for restart() while a level-triggered one gets a new poll
+    request, which the kernel completes right away if the fd is still
+    ready.  Requests are queued in the submission ring and only submitted
+    by the next call to flush() or wait(), so that all the re-arms of a
+    batch of events and the wait for the next batch cost one system call,
+    where epoll costs one epoll_ctl() per one-shot event.  Level-triggered
+    fds are only re-armed by the next flush() or wait(), once their events
+    have been handled, so that an fd that was drained doesn't fire again.
+    Edge-triggered fds use a multishot poll request, which stays armed and
+    completes each time the fd gets new data, so they need no re-arm at
+    all.  When events are already waiting in the completion ring, wait()
+    doesn't enter the kernel at all.
+
+    Unlike with epoll, closing an fd doesn't stop the poll request, which
+    keeps the file open: fds must be removed before they are closed.
+
+    Any thread can add, restart and remove fds and wait for events.
+    Requests that are deferred must eventually be flushed, otherwise a
+    thread blocked in wait() won't see the fds that they concern.
+*/
+
+struct IoUringPoller {
+    /** The ring has room for the given number of requests in flight; the
+        submission ring is sized accordingly.
+    */
+    IoUringPoller(unsigned maxFds);
+
+    ~IoUringPoller();
+
+    /** Whether the running kernel has what the poller needs, which is
+        Linux 5.13 or later.  The result is computed once.
+    */
+    static bool supported();
+
+    /** Fd of the ring, which is readable when there are events. */
+    int fd() const
+    {
+        return ringFd_;
+    }
+
+    enum Mode {
+        LEVEL_TRIGGERED,
+        ONE_SHOT,
+        EDGE_TRIGGERED
+    };
+
+    /** Starts watching the fd.  If defer is true, the request is only
+        queued.  Throws if the fd is already watched.
+    */
+    void add(int fd, void * data, Mode mode, bool defer);
+
+    /** Re-arms a one-shot fd that fired, with the given data. */
+    void restart(int fd, void * data, bool defer);
+
+    /** Stops watching the fd.  Returns false if it wasn't watched. */
+    bool remove(int fd, bool defer);
+
+    /** Submits the queued requests, waits for up to timeoutMs for at least
+        one event (-1 waits forever and 0 doesn't wait) and stores up to
+        maxEvents of them.  Returns the number of events stored, or -1
+        with errno set like epoll_wait().
+    */
+    int wait(epoll_event * events, int maxEvents, int timeoutMs);
+
+    /** Re-arms the level-triggered fds that fired since the last wait()
+        and submits the queued requests, so that the ring fd becomes
+        readable when any of the fds is ready.  Called once the events
+        are handled, before waiting on the ring fd.
+    */
+    void flush();
+
+private:
+    struct Registration {
+        void * data;
+        Mode mode;
+        bool armed;
+        uint32_t generation;
+    };
+
+    int ringFd_;
+
+    /* Mappings of the rings */
+    void * sqRing_;
+    size_t sqRingSize_;
+    void * cqRing_;
+    size_t cqRingSize_;
+    io_uring_sqe * sqes_;
+    size_t sqesSize_;
+
+    /* Shared with the kernel */
+    std::atomic<uint32_t> * sqHead_;
+    std::atomic<uint32_t> * sqTail_;
+    uint32_t sqMask_;
+    uint32_t sqEntries_;
+    uint32_t * sqArray_;
+    std::atomic<uint32_t> * cqHead_;
+    std::atomic<uint32_t> * cqTail_;
+    uint32_t cqMask_;
+    io_uring_cqe * cqes_;
+
+    /* Guards the rings and the registrations; never held in the kernel
+       while waiting */
+    typedef ML::Spinlock Lock;
+    typedef std::lock_guard<Lock> Guard;
+    Lock lock_;
+
+    std::unordered_map<int, Registration> registrations_;
+    uint32_t nextGeneration_;
+
+    /* Level-triggered fds that fired, and edge-triggered ones whose
+       multishot request ended, which need to be re-armed */
+    std::vector<int> rearms_;
+
+    /* Queues the poll requests of rearms_ */
+    void queueRearms();
+
+    /* Queues a poll request for the registered fd */
+    void queuePoll(int fd, Registration & registration);
+
+    /* Queues the removal of the poll request with the given user data */
+    void queueRemove(uint64_t userData);
+
+    /* Next free submission entry, submitting the queued ones if the ring is
+       full; lock_ must be held */
+    io_uring_sqe * nextSqe();
+
+    /* Number of entries of the submission ring that the kernel hasn't
+       consumed yet; lock_ must be held */
+    uint32_t numQueued() const;
+
+    /* Makes the entry returned by nextSqe() visible to the kernel once it
+       is filled in; lock_ must be held */
+    void pushSqe();
+
+    /* Calls io_uring_enter(), returning -1 with errno set on error */
+    int enter(unsigned toSubmit, unsigned minComplete, int timeoutMs,
+              bool getEvents);
+
+    /* Submits the requests that the kernel hasn't consumed from the
+       submission ring yet; lock_ must be held */
+    void submit();
+
+    /* Moves up to maxEvents completions to events; lock_ must be held */
+    int reap(epoll_event * events, int maxEvents);
+
+    void unmap();
+};
+
+} // namespace Datacratic
@@ -74,8 +74,11 @@ addMessageLoop(const string& name, const MessageLoop* loop)
 {
     // acts as a private member variable for sampleFn.
     double lastTimeSlept = 0.0;
+    SourceSamples lastSources;
 
     auto sampleFn = [=] (double elapsedTime) mutable {
+        recordSources(name, loop->sourceStats(), lastSources, elapsedTime);
+
         double timeSlept = loop->totalSleepSeconds();
         double delta = std::min(timeSlept - lastTimeSlept, 1.0);
         lastTimeSlept = timeSlept;
@@ -86,6 +89,52 @@ addMessageLoop(const string& name, const MessageLoop* loop)
     addCallback(name, sampleFn);
 }
 
+void
+LoopMonitor::
+recordSources(const string& name,
+              const vector<MessageLoopSourceStats>& sources,
+              SourceSamples& last,
+              double elapsedTime)
+{
+    // Sources can share a name, in which case they're reported together.
+    SourceSamples current;
+    for (const auto& source : sources) {
+        auto& sample = current[source.name];
+        sample.name = source.name;
+        sample.numCalls += source.numCalls;
+        sample.busySeconds += source.busySeconds;
+        sample.numBudgetExhausted += source.numBudgetExhausted;
+        for (int i = 0; i < LatencyHistogram::NumBuckets; ++i)
+            sample.wakeupLags.counts[i] += source.wakeupLags.counts[i];
+    }
+
+    for (const auto& entry : current) {
+        const auto& sample = entry.second;
+        const auto& prev = last[entry.first];
+        string prefix = name + ".sources." + entry.first;
+
+        // Removing a source can make the totals go down.
+        double busy = std::max(sample.busySeconds - prev.busySeconds, 0.0);
+        recordLevel(busy / elapsedTime, prefix + ".load");
+
+        uint64_t exhausted
+            = sample.numBudgetExhausted > prev.numBudgetExhausted
+            ? sample.numBudgetExhausted - prev.numBudgetExhausted : 0;
+        recordLevel(exhausted / elapsedTime, prefix + ".budgetExhausted");
+
+        LatencyHistogram lags;
+        for (int i = 0; i < LatencyHistogram::NumBuckets; ++i) {
+            uint64_t count = sample.wakeupLags.counts[i];
+            uint64_t prevCount = prev.wakeupLags.counts[i];
+            lags.counts[i] = count > prevCount ? count - prevCount : 0;
+        }
+        if (lags.count() > 0)
+            recordLevel(lags.quantile(0.99), prefix + ".wakeupLag99");
+    }
+
+    last = std::move(current);
+}
+
 void
 LoopMonitor::
 addCallback(const string& name, const SampleLoadFn& cb)
@@ -46,6 +46,12 @@ struct LoopMonitor : public ServiceBase, public MessageLoop
 
     /** Adds a sampling function for a MessageLoop which will be called every
         updatePeriod. Thread-safe.
+
+        The busy fraction of each source of the loop is also recorded as the
+        "<name>.sources.<source>.load" level, along with the 99th percentile
+        of its wakeup lag in seconds as "<name>.sources.<source>.wakeupLag99"
+        when it was signalled during the period. This tells which source is
+        responsible when a loop saturates.
      */
     void addMessageLoop(const std::string& name, const MessageLoop* loop);
 
@@ -89,6 +95,17 @@ private:
 
     void doLoops(uint64_t numTimeouts);
 
+    typedef std::map<std::string, MessageLoopSourceStats> SourceSamples;
+
+    /** Records the load, the rate at which they use up their budget and
+        the wakeup lag of the sources of a loop since the last sample,
+        which is replaced by the current one.
+     */
+    void recordSources(const std::string& name,
+                       const std::vector<MessageLoopSourceStats>& sources,
+                       SourceSamples& last,
+                       double elapsedTime);
+
     double updatePeriod;
 
     mutable ML::Spinlock lock;
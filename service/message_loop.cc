@@ -5,8 +5,10 @@
 */
 
 #include <thread>
+#include <algorithm>
 #include <time.h>
 #include <limits.h>
+#include <math.h>
 #include <sys/epoll.h>
 
 #include "jml/arch/exception.h"
@@ -33,18 +35,137 @@ Logging::Category MessageLoopLogs::trace("Message Loop Trace", print);
 
 typedef MessageLoopLogs Logs;
 
+/*****************************************************************************/
+/* LATENCY HISTOGRAM                                                         */
+/*****************************************************************************/
+
+LatencyHistogram::
+LatencyHistogram()
+{
+    std::fill(counts, counts + NumBuckets, 0);
+}
+
+uint64_t
+LatencyHistogram::
+count() const
+{
+    uint64_t result = 0;
+    for (int i = 0;  i < NumBuckets;  ++i)
+        result += counts[i];
+    return result;
+}
+
+double
+LatencyHistogram::
+quantile(double q) const
+{
+    uint64_t total = count();
+    if (total == 0)
+        return 0.0;
+
+    uint64_t rank = std::max<uint64_t>(ceil(q * total), 1);
+    uint64_t seen = 0;
+    int i = 0;
+    for (;  i < NumBuckets - 1;  ++i) {
+        seen += counts[i];
+        if (seen >= rank)
+            break;
+    }
+
+    return (2ULL << i) * 0.000000001;
+}
+
+
+/*****************************************************************************/
+/* MESSAGE LOOP SOURCE RECORDER                                              */
+/*****************************************************************************/
+
+MessageLoop::SourceRecorder::
+SourceRecorder(const std::string & name, AsyncEventSource * source,
+               int priority)
+    : name(name), source(source), priority(priority),
+      numCalls(0), busyNanos(0), budgetExhausted(0)
+{
+    for (int i = 0;  i < LatencyHistogram::NumBuckets;  ++i) {
+        callTimes[i] = 0;
+        wakeupLags[i] = 0;
+    }
+}
+
+MessageLoopSourceStats
+MessageLoop::SourceRecorder::
+stats() const
+{
+    MessageLoopSourceStats result;
+    result.name = name;
+    result.priority = priority;
+    result.numCalls = numCalls.load(std::memory_order_relaxed);
+    result.busySeconds
+        = busyNanos.load(std::memory_order_relaxed) * 0.000000001;
+    result.numBudgetExhausted
+        = budgetExhausted.load(std::memory_order_relaxed);
+    for (int i = 0;  i < LatencyHistogram::NumBuckets;  ++i) {
+        result.callTimes.counts[i]
+            = callTimes[i].load(std::memory_order_relaxed);
+        result.wakeupLags.counts[i]
+            = wakeupLags[i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+
+/*****************************************************************************/
+/* MESSAGE LOOP WORKER                                                       */
+/*****************************************************************************/
+
+MessageLoop::Worker::
+Worker(MessageLoop * loop, int index)
+    : index(index),
+      epoller(loop),
+      rounds(0),
+      stolenEvents(16),
+      actions([=] () { loop->handleWorkerActions(*this); }),
+      actionsRecorder("_actions", &actions),
+      numSources(0),
+      needsPoll(false),
+      totalSleepTime(0.0),
+      spinBudget(0.0),
+      totalSpinTime(0.0)
+{
+    if (index == 0)
+        return;
+
+    ownEpoller.reset(new Epoller());
+    ownEpoller->init(16384, 0, loop->backend_);
+    ownEpoller->handleEvent = std::bind(&MessageLoop::handleEpollEvent,
+                                        loop, std::ref(*this),
+                                        std::placeholders::_1);
+    epoller = ownEpoller.get();
+    epoller->addFd(actions.selectFd(), &actionsRecorder);
+}
+
+
 /*****************************************************************************/
 /* MESSAGE LOOP                                                              */
 /*****************************************************************************/
 
+constexpr int MessageLoop::TimersPriority;
+
 MessageLoop::
-MessageLoop(int numThreads, double maxAddedLatency, int epollTimeout)
+MessageLoop(int numThreads, double maxAddedLatency, int epollTimeout,
+            Backend backend)
     : sourceActions_([&] () { handleSourceActions(); }),
+      sourceActionsRecorder_("_sourceActions", &sourceActions_),
+      stealSetRecorder_("_stealSet", &stealSet_),
       numThreadsCreated(0),
+      numSubordinateThreads(0),
       shutdown_(true),
-      totalSleepTime_(0.0)
+      totalSleepTime_(0.0),
+      maxSpinTime_(0.0),
+      budgetCalls_(1),
+      budgetNanos_(0)
 {
-    init(numThreads, maxAddedLatency, epollTimeout);
+    init(numThreads, maxAddedLatency, epollTimeout, backend);
 }
 
 MessageLoop::
@@ -55,7 +176,8 @@ MessageLoop::
 
 void
 MessageLoop::
-init(int numThreads, double maxAddedLatency, int epollTimeout)
+init(int numThreads, double maxAddedLatency, int epollTimeout,
+     Backend backend)
 {
     // std::cerr << "msgloop init: " << this << "\n";
     if (maxAddedLatency == 0 && epollTimeout != -1)
@@ -63,21 +185,38 @@ init(int numThreads, double maxAddedLatency, int epollTimeout)
             << "MessageLoop with maxAddedLatency of zero and "
             << "epollTeimout != -1 will busy wait" << endl;
     
-    // See the comments on processOne below for more details on this assertion.
-    ExcAssertEqual(numThreads, 1);
+    ExcAssertGreaterEqual(numThreads, 1);
 
-    Epoller::init(16384, epollTimeout);
+    Epoller::init(16384, epollTimeout, backend);
     maxAddedLatency_ = maxAddedLatency;
-    handleEvent = std::bind(&MessageLoop::handleEpollEvent,
-                            this,
-                            std::placeholders::_1);
+    backend_ = backend;
+    handleEvent = [=] (epoll_event & event) {
+        return this->handleEpollEvent(*workers_[0], event);
+    };
 
     /* Our source action queue is a source in itself, which enables us to
        handle source operations from the same epoll mechanism as the rest.
 
        Adding a special source named "_shutdown" triggers shutdown-related
        events, without requiring the use of an additional signal fd. */
-    addFd(sourceActions_.selectFd(), &sourceActions_);
+    addFd(sourceActions_.selectFd(), &sourceActionsRecorder_);
+
+    workers_.clear();
+    for (int i = 0;  i < numThreads;  ++i)
+        workers_.emplace_back(new Worker(this, i));
+
+    /* The steal set is itself polled by every worker, so whichever one is
+       idle picks up the events of the sources that aren't single threaded. */
+    stealSet_.close();
+    if (numThreads > 1) {
+        stealSet_.init(16384, 0, backend);
+        for (auto & worker: workers_)
+            worker->epoller->addFd(stealSet_.selectFd(), &stealSetRecorder_);
+    }
+
+    /* All the periodic jobs share the timer wheel's timerfd. */
+    if (!timers_.parent_)
+        addSource("_timers", timers_, TimersPriority);
 
     debug_ = false;
 }
@@ -94,8 +233,13 @@ start(const OnStop & onStop)
     //cerr << "starting thread from " << this << endl;
     //ML::backtrace();
 
+    for (unsigned i = 1;  i < workers_.size();  ++i) {
+        Worker * worker = workers_[i].get();
+        threads.emplace_back([=] () { this->runWorkerThread(*worker); });
+    }
+
     auto runfn = [&, onStop] () {
-        this->runWorkerThread();
+        this->runWorkerThread(*workers_[0]);
         if (onStop) onStop();
     };
 
@@ -114,7 +258,13 @@ startSync()
     ++numThreadsCreated;
 
     shutdown_ = false;
-    runWorkerThread();
+
+    for (unsigned i = 1;  i < workers_.size();  ++i) {
+        Worker * worker = workers_[i].get();
+        threads.emplace_back([=] () { this->runWorkerThread(*worker); });
+    }
+
+    runWorkerThread(*workers_[0]);
 }
     
 void
@@ -131,6 +281,11 @@ shutdown()
     // we will get the addSource event to wake us up).
     ML::futex_wake(shutdown_);
     addSource("_shutdown", nullptr);
+    for (unsigned i = 1;  i < workers_.size();  ++i) {
+        SourceEntry entry("_shutdown", nullptr, 0);
+        workers_[i]->actions.push_back(SourceAction(SourceAction::ADD,
+                                                    move(entry)));
+    }
 
     for (auto & t: threads)
         t.join();
@@ -178,9 +333,24 @@ addPeriodic(const std::string & name,
             std::function<void (uint64_t)> toRun,
             int priority)
 {
-    auto newPeriodic
-        = make_shared<PeriodicEventSource>(timePeriodSeconds, toRun);
-    return addSource(name, newPeriodic, priority);
+    timersFor(priority).schedulePeriodic(timePeriodSeconds, toRun, name);
+    return true;
+}
+
+TimerWheel &
+MessageLoop::
+timersFor(int priority)
+{
+    if (priority == TimersPriority)
+        return timers_;
+
+    Guard guard(timersLock_);
+    auto & timers = priorityTimers_[priority];
+    if (!timers) {
+        timers = std::make_shared<TimerWheel>();
+        addSource("_timers" + to_string(priority), timers, priority);
+    }
+    return *timers;
 }
 
 bool
@@ -223,28 +393,70 @@ startSubordinateThread(const SubordinateThreadFn & thread)
 {
     Guard guard(threadsLock);
     int64_t id = 0;
-    threads.emplace_back(std::bind(thread, std::ref(shutdown_), id));
+    int threadIndex = workers_.size() + numSubordinateThreads++;
+    ThreadPlacement placement = placement_;
+    threads.emplace_back([=] () {
+            placement.tryApply(threadIndex);
+            thread(shutdown_, id);
+        });
 }
 
 void
 MessageLoop::
-runWorkerThread()
+runWorkerThread(Worker & worker)
 {
+    // Before the loop allocates anything, so that it's local to our node;
+    // the worker itself was built by the thread that called init()
+    placement_.tryApply(worker.index);
+
     Date lastCheck = Date::now();
 
     ML::Duty_Cycle_Timer duty;
 
+    bool & workerNeedsPoll
+        = worker.index == 0 ? needsPoll : worker.needsPoll;
+    double & totalSleepTime
+        = worker.index == 0 ? totalSleepTime_ : worker.totalSleepTime;
+    const std::vector<SourceEntry> & sources = worker.sources;
+
     while (!shutdown_) {
         Date start = Date::now();
 
         if (debug_) {
-            cerr << "handling events from " << sources.size()
-                 << " sources with needsPoll " << needsPoll << endl;
+            cerr << "worker " << worker.index
+                 << " handling events from " << sources.size()
+                 << " sources with needsPoll " << workerNeedsPoll << endl;
             for (unsigned i = 0;  i < sources.size();  ++i)
                 cerr << sources[i].name << " " << sources[i].source->needsPoll << endl;
         }
 
-        if (!needsPoll) {
+        // Maximum number of events to handle in handleEvents.
+        int maxEventsToHandle = 512;
+
+        // In busy-poll mode, we first spin on the epoll set for the
+        // worker's current budget.  Finding something makes the budget grow
+        // back towards maxSpinTime_, while spinning in vain halves it until
+        // the worker stops spinning altogether.
+        bool spinHit = false;
+        if (!workerNeedsPoll && worker.spinBudget > 0) {
+            Date spinStart = Date::now();
+            int res = worker.epoller->spinEvents(worker.spinBudget,
+                                                 maxEventsToHandle);
+            worker.totalSpinTime += Date::now().secondsSince(spinStart);
+
+            spinHit = res != 0;
+            if (spinHit) {
+                worker.spinBudget = std::min(worker.spinBudget * 2,
+                                             maxSpinTime_);
+            }
+            else {
+                worker.spinBudget /= 2;
+                if (worker.spinBudget < maxSpinTime_ / 64)
+                    worker.spinBudget = 0.0;
+            }
+        }
+
+        if (!workerNeedsPoll && !spinHit) {
             Date beforeSleepTime;
 
             // Now we've processed what we can, let's allow a sleep
@@ -257,20 +469,24 @@ runWorkerThread()
             auto afterSleep = [&] ()
                 {
                     double delta  = Date::now().secondsSince(beforeSleepTime);
-                    totalSleepTime_ += delta;
+                    totalSleepTime += delta;
                     duty.notifyAfterSleep();
                 };
 
-            // Maximum number of events to handle in handleEvents.
-            int maxEventsToHandle = 512;
-
             // First time, we sleep for up to one second waiting for events to come
             // in to the event loop, and handle as many as we can until we hit the
             // limit or we're idle.
-            int res JML_UNUSED = handleEvents(999999 /* microseconds */, maxEventsToHandle,
-                                              nullptr, beforeSleep, afterSleep);
+            int res
+                = worker.epoller->handleEvents(999999 /* microseconds */,
+                                               maxEventsToHandle,
+                                               nullptr, beforeSleep, afterSleep);
             //cerr << "handleEvents returned " << res << endl;
 
+            // Activity after the worker stopped spinning: give spinning
+            // another chance with a small budget.
+            if (res > 0 && maxSpinTime_ > 0 && worker.spinBudget == 0)
+                worker.spinBudget = maxSpinTime_ / 32;
+
 #if 0
             while (res != 0) {
                 if (shutdown_)
@@ -287,7 +503,7 @@ runWorkerThread()
             return;
 
         // Do any outstanding work now
-        while (processOne())
+        while (worker.index == 0 ? processOne() : processWorker(worker))
             if (shutdown_)
                 return;
 
@@ -304,9 +520,10 @@ runWorkerThread()
         double sleepTime = maxAddedLatency_ - elapsed;
 
         duty.notifyBeforeSleep();
-        if (sleepTime > 0) {
+        // Busy-polling loops trade CPU for latency and don't add any.
+        if (sleepTime > 0 && maxSpinTime_ == 0) {
             ML::futex_wait(shutdown_, 0, sleepTime);
-            totalSleepTime_ += sleepTime;
+            totalSleepTime += sleepTime;
         }
         duty.notifyAfterSleep();
         
@@ -322,7 +539,7 @@ runWorkerThread()
 
 Epoller::HandleEventResult
 MessageLoop::
-handleEpollEvent(epoll_event & event)
+handleEpollEvent(Worker & worker, epoll_event & event)
 {
     bool debug = false;
 
@@ -340,21 +557,21 @@ handleEpollEvent(epoll_event & event)
              << endl;
     }
     
-    AsyncEventSource * source
-        = reinterpret_cast<AsyncEventSource *>(event.data.ptr);
-    
-    if (debug) {
-        ExcAssert(source->poll());
-        cerr << "message loop " << this << " with parent " << parent_
-             << " handing source " << ML::type_name(*source) << " poll result "
-             << Epoller::poll() << endl;
-    }
+    SourceRecorder * recorder
+        = reinterpret_cast<SourceRecorder *>(event.data.ptr);
 
-    int res = source->processOne();
+    if (recorder == &stealSetRecorder_) {
+        processStolen(worker);
+        return Epoller::DONE;
+    }
 
+    // The source gets its turn in the processWorker() that follows, in
+    // priority order rather than in the order of the events.
     if (debug) {
-        cerr << "source " << ML::type_name(*source) << " had processOne() result " << res << endl;
-        cerr << "poll() is now " << Epoller::poll() << endl;
+        AsyncEventSource * source = recorder->source;
+        cerr << "message loop " << this << " with parent " << parent_
+             << " has an event for source " << ML::type_name(*source)
+             << " poll result " << Epoller::poll() << endl;
     }
 
     return Epoller::DONE;
@@ -382,28 +599,124 @@ processAddSource(const SourceEntry & entry)
     if (entry.name == "_shutdown")
         return;
 
+    // Give the source to the worker with the least sources
+    auto fewerSources = [] (const std::unique_ptr<Worker> & w1,
+                            const std::unique_ptr<Worker> & w2)
+        {
+            return w1->numSources < w2->numSources;
+        };
+    Worker & worker = **min_element(workers_.begin(), workers_.end(),
+                                    fewerSources);
+
+    sourceWorkers_[entry.source.get()] = worker.index;
+    ++worker.numSources;
+
+    if (worker.index == 0) {
+        addToWorker(worker, entry);
+        return;
+    }
+
+    SourceEntry workerEntry = entry;
+    worker.actions.push_back(SourceAction(SourceAction::ADD,
+                                          move(workerEntry)));
+}
+
+void
+MessageLoop::
+processRemoveSource(const SourceEntry & rmEntry)
+{
+    auto it = sourceWorkers_.find(rmEntry.source.get());
+    ExcCheck(it != sourceWorkers_.end(), "couldn't remove source");
+
+    Worker & worker = *workers_[it->second];
+    sourceWorkers_.erase(it);
+    --worker.numSources;
+
+    if (worker.index == 0) {
+        removeFromWorker(worker, rmEntry);
+        return;
+    }
+
+    SourceEntry workerEntry = rmEntry;
+    worker.actions.push_back(SourceAction(SourceAction::REMOVE,
+                                          move(workerEntry)));
+}
+
+void
+MessageLoop::
+handleWorkerActions(Worker & worker)
+{
+    vector<SourceAction> actions = worker.actions.pop_front(0);
+    for (auto & action: actions) {
+        if (action.entry_.name == "_shutdown")
+            continue;
+        if (action.action_ == SourceAction::ADD) {
+            addToWorker(worker, action.entry_);
+        }
+        else if (action.action_ == SourceAction::REMOVE) {
+            removeFromWorker(worker, action.entry_);
+        }
+    }
+}
+
+void
+MessageLoop::
+addToWorker(Worker & worker, const SourceEntry & entry)
+{
     // cerr << "processAddSource: " << entry.source.get()
     //      << " (" << ML::type_name(*entry.source) << ")"
     //      << " needsPoll: " << entry.source->needsPoll
     //      << " in msg loop: " << this
     //      << " needsPoll: " << needsPoll
     //      << endl;
+    SourceEntry newEntry = entry;
+    newEntry.recorder = std::make_shared<SourceRecorder>(entry.name,
+                                                         entry.source.get(),
+                                                         entry.priority);
+    {
+        Guard guard(recordersLock_);
+        recorders_[entry.source.get()] = newEntry.recorder;
+    }
+
     int fd = entry.source->selectFd();
-    if (fd != -1)
-        addFd(fd, entry.source.get());
+    if (fd != -1) {
+        if (workers_.size() > 1 && !entry.source->singleThreaded()) {
+            newEntry.stealable
+                = std::make_shared<StealableSource>(entry.source,
+                                                    newEntry.recorder);
+
+            Guard guard(stealLock_);
+            stealables_[fd] = newEntry.stealable;
+            stealSet_.addFdOneShot(fd, (void *)(intptr_t)fd);
+        }
+        else worker.epoller->addFd(fd, newEntry.recorder.get());
+    }
 
-    if (!needsPoll && entry.source->needsPoll) {
-        needsPoll = true;
-        if (parent_) parent_->checkNeedsPoll();
+    if (worker.index == 0) {
+        if (!needsPoll && entry.source->needsPoll) {
+            needsPoll = true;
+            if (parent_) parent_->checkNeedsPoll();
+        }
     }
+    else if (entry.source->needsPoll)
+        worker.needsPoll = true;
 
     if (debug_) entry.source->debug(true);
-    sources.push_back(entry);
 
-    if (needsPoll) {
+    // After the sources of the same priority, so that it comes last in its
+    // class
+    auto higherPriority = [] (const SourceEntry & e1, const SourceEntry & e2)
+        {
+            return e1.priority > e2.priority;
+        };
+    auto pos = upper_bound(worker.sources.begin(), worker.sources.end(),
+                           newEntry, higherPriority);
+    worker.sources.insert(pos, newEntry);
+
+    if (entry.source->needsPoll) {
         string pollingSources;
         
-        for (auto & s: sources) {
+        for (auto & s: worker.sources) {
             if (s.source->needsPoll) {
                 if (!pollingSources.empty())
                     pollingSources += ", ";
@@ -425,42 +738,143 @@ processAddSource(const SourceEntry & entry)
 
 void
 MessageLoop::
-processRemoveSource(const SourceEntry & rmEntry)
+removeFromWorker(Worker & worker, const SourceEntry & rmEntry)
 {
     auto pred = [&] (const SourceEntry & entry) {
         return entry.source.get() == rmEntry.source.get();
     };
-    auto it = find_if(sources.begin(), sources.end(), pred);
+    auto it = find_if(worker.sources.begin(), worker.sources.end(), pred);
 
-    ExcCheck(it != sources.end(), "couldn't remove source");
+    ExcCheck(it != worker.sources.end(), "couldn't remove source");
 
     SourceEntry entry = *it;
-    sources.erase(it);
+    worker.sources.erase(it);
+
+    {
+        Guard guard(recordersLock_);
+        recorders_.erase(entry.source.get());
+    }
 
     entry.source->parent_ = nullptr;
     int fd = entry.source->selectFd();
     if (fd == -1) return;
-    removeFd(fd);
+
+    if (entry.stealable) {
+        // Wait for the workers that are still processing it; processOne()
+        // never blocks so this won't be long.  They re-arm the fd when done
+        // so it can only be removed from the steal set afterwards.
+        entry.stealable->removed = true;
+        while (entry.stealable->busy)
+            std::this_thread::yield();
+
+        Guard guard(stealLock_);
+        stealables_.erase(fd);
+        stealSet_.removeFd(fd);
+    }
+    else worker.epoller->removeFd(fd);
 
     // Make sure that our and our parent's value of needsPoll is up to date
     bool sourceNeedsPoll = entry.source->needsPoll;
-    if (needsPoll && sourceNeedsPoll) {
-        bool oldNeedsPoll = needsPoll;
-        checkNeedsPoll();
-        if (oldNeedsPoll != needsPoll && parent_)
-            parent_->checkNeedsPoll();
+    if (worker.index == 0) {
+        if (needsPoll && sourceNeedsPoll) {
+            bool oldNeedsPoll = needsPoll;
+            checkNeedsPoll();
+            if (oldNeedsPoll != needsPoll && parent_)
+                parent_->checkNeedsPoll();
+        }
+    }
+    else if (sourceNeedsPoll) {
+        worker.needsPoll = false;
+        for (auto & s: worker.sources)
+            worker.needsPoll = worker.needsPoll || s.source->needsPoll;
     }
 
     entry.source->connectionState_ = AsyncEventSource::DISCONNECTED;
     ML::futex_wake(entry.source->connectionState_);
 }
 
+void
+MessageLoop::
+processStolen(Worker & worker)
+{
+    typedef std::pair<int, std::shared_ptr<StealableSource> > Stolen;
+
+    auto handleStolen = [&] (epoll_event * events, int numEvents)
+        {
+            std::vector<Stolen> & stolen = worker.stolen;
+            {
+                Guard guard(stealLock_);
+                for (int i = 0;  i < numEvents;  ++i) {
+                    int fd = reinterpret_cast<intptr_t>(events[i].data.ptr);
+                    auto it = stealables_.find(fd);
+                    if (it != stealables_.end())
+                        stolen.emplace_back(fd, it->second);
+                }
+            }
+
+            auto higherPriority = [] (const Stolen & s1, const Stolen & s2)
+                {
+                    return s1.second->recorder->priority
+                        > s2.second->recorder->priority;
+                };
+            std::stable_sort(stolen.begin(), stolen.end(), higherPriority);
+
+            // Sources that still have something to do after their turn
+            // get another one, as in processWorker(), since their fd may
+            // not fire again for what's left.
+            size_t numStolen = stolen.size();
+            while (numStolen > 0) {
+                size_t numMore = 0;
+                for (size_t i = 0;  i < numStolen;  ++i) {
+                    int fd = stolen[i].first;
+                    StealableSource & stealable = *stolen[i].second;
+
+                    // removeFromWorker() sets removed before waiting on
+                    // busy, so either it waits for us or we see that it's
+                    // gone.
+                    ++stealable.busy;
+                    if (!stealable.removed) {
+                        bool more;
+                        try {
+                            more = runTurn(*stealable.recorder);
+                        } catch (...) {
+                            --stealable.busy;
+                            // Don't lose the events of the rest of the
+                            // batch, nor of the ones kept for another turn
+                            for (size_t j = 0;  j < numStolen;  ++j) {
+                                if (j >= numMore && j <= i)
+                                    continue;
+                                stealSet_.restartFdOneShot(
+                                        stolen[j].first,
+                                        (void *)(intptr_t)stolen[j].first);
+                            }
+                            stolen.clear();
+                            throw;
+                        }
+
+                        if (more && !shutdown_)
+                            stolen[numMore++] = stolen[i];
+                        else stealSet_.restartFdOneShot(
+                                fd, (void *)(intptr_t)fd);
+                    }
+                    --stealable.busy;
+                }
+                numStolen = numMore;
+            }
+
+            stolen.clear();
+            return Epoller::DONE;
+        };
+
+    stealSet_.handleEventBatch(worker.stolenEvents, handleStolen);
+}
+
 bool
 MessageLoop::
 poll() const
 {
     if (needsPoll) {
-        for (auto & s: sources)
+        for (auto & s: workers_[0]->sources)
             if (s.source->poll())
                 return true;
         return false;
@@ -468,15 +882,13 @@ poll() const
     else return Epoller::poll();
 }
 
-/** This function assumes that it's called by only a single thread. This
-    contradicts the AsyncEventSource documentation for processOne. If
-    multi-threading is ever required then accesses to the sources array will
-    need to be synchronized in some way.
-
-    Note, that this synchronization mechanism should not hold a lock while
-    calling a child's processOne() function. This can easily lead to
-    deadlocks. This is the main reason for the existence of the sources queues.
+/** This function processes the sources of worker 0 and must only be called
+    by a single thread. Each worker's sources array is only ever touched by
+    that worker's thread, which is why additions and removals go through the
+    source action queues.
 
+    Note, that no lock should be held while calling a child's processOne()
+    function. This can easily lead to deadlocks.
  */
 bool
 MessageLoop::
@@ -487,26 +899,171 @@ processOne()
     // NOTE: this is required for some buggy sources that don't have a reliable FD to
     // sleep on.  It shouldn't be substantially less efficient.
     if (needsPoll || true) {
-        more = sourceActions_.processOne();
+        more = processWorker(*workers_[0]);
+    }
+    else more = Epoller::processOne();
+
+    return more;
+}
 
-        for (unsigned i = 0;  i < sources.size();  ++i) {
+bool
+MessageLoop::
+processWorker(Worker & worker)
+{
+    bool more = worker.index == 0
+        ? sourceActions_.processOne()
+        : worker.actions.processOne();
+
+    const std::vector<SourceEntry> & sources = worker.sources;
+    uint64_t round = worker.rounds++;
+
+    for (size_t begin = 0, end;  begin < sources.size();  begin = end) {
+        int priority = sources[begin].priority;
+        for (end = begin + 1;
+             end < sources.size() && sources[end].priority == priority;
+             ++end)
+            ;
+
+        size_t classSize = end - begin;
+        bool classHasMore = false;
+        for (size_t i = 0;  i < classSize;  ++i) {
+            const SourceEntry & entry
+                = sources[begin + (round + i) % classSize];
             try {
-                bool hasMore = sources[i].source->processOne();
+                bool hasMore = runTurn(*entry.recorder);
                 if (debug_)
-                    cerr << "source " << sources[i].name << " has " << hasMore << endl;
-                more = more || hasMore;
+                    cerr << "source " << entry.name << " has " << hasMore << endl;
+                classHasMore = classHasMore || hasMore;
             } catch (...) {
-                cerr << "exception processing source " << sources[i].name
+                cerr << "exception processing source " << entry.name
                      << endl;
                 throw;
             }
         }
+
+        // The lower classes wait until this one is done
+        if (classHasMore)
+            return true;
     }
-    else more = Epoller::processOne();
 
     return more;
 }
 
+bool
+MessageLoop::
+runSource(SourceRecorder & recorder)
+{
+    uint64_t start = monotonicNanos();
+
+    uint64_t signalled = recorder.source->takeSignalTime();
+    if (signalled) {
+        uint64_t lag = start > signalled ? start - signalled : 0;
+        int bucket = LatencyHistogram::bucketOf(lag);
+        recorder.wakeupLags[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    bool more = recorder.source->processOne();
+
+    uint64_t elapsed = monotonicNanos() - start;
+    int bucket = LatencyHistogram::bucketOf(elapsed);
+    recorder.callTimes[bucket].fetch_add(1, std::memory_order_relaxed);
+    recorder.busyNanos.fetch_add(elapsed, std::memory_order_relaxed);
+    recorder.numCalls.fetch_add(1, std::memory_order_relaxed);
+
+    return more;
+}
+
+bool
+MessageLoop::
+runTurn(SourceRecorder & recorder)
+{
+    uint64_t start = budgetNanos_ ? monotonicNanos() : 0;
+
+    for (int numCalls = 1;;  ++numCalls) {
+        if (!runSource(recorder))
+            return false;
+
+        if (numCalls >= budgetCalls_
+            || (budgetNanos_ && monotonicNanos() - start >= budgetNanos_)) {
+            recorder.budgetExhausted.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+}
+
+std::vector<MessageLoopSourceStats>
+MessageLoop::
+sourceStats() const
+{
+    std::vector<MessageLoopSourceStats> result;
+
+    Guard guard(recordersLock_);
+    result.reserve(recorders_.size());
+    for (auto & entry: recorders_)
+        result.push_back(entry.second->stats());
+
+    return result;
+}
+
+double
+MessageLoop::
+totalSleepSeconds() const
+{
+    double total = totalSleepTime_;
+    for (unsigned i = 1;  i < workers_.size();  ++i)
+        total += workers_[i]->totalSleepTime;
+    return total / std::max<size_t>(workers_.size(), 1);
+}
+
+double
+MessageLoop::
+totalSpinSeconds() const
+{
+    double total = 0.0;
+    for (auto & worker: workers_)
+        total += worker->totalSpinTime;
+    return total / std::max<size_t>(workers_.size(), 1);
+}
+
+void
+MessageLoop::
+setThreadPlacement(const ThreadPlacement & placement)
+{
+    if (numThreadsCreated)
+        throw ML::Exception("thread placement must be set before the loop "
+                            "is started");
+    placement.validate();
+    placement_ = placement;
+}
+
+void
+MessageLoop::
+setBusyPoll(double maxSpinSeconds)
+{
+    if (numThreadsCreated)
+        throw ML::Exception("busy-polling must be set up before the loop "
+                            "is started");
+    ExcAssertGreaterEqual(maxSpinSeconds, 0.0);
+
+    maxSpinTime_ = maxSpinSeconds;
+    for (auto & worker: workers_)
+        worker->spinBudget = maxSpinSeconds;
+}
+
+void
+MessageLoop::
+setSourceBudget(int maxCalls, double maxSeconds)
+{
+    if (numThreadsCreated)
+        throw ML::Exception("the source budget must be set before the loop "
+                            "is started");
+    ExcAssertGreaterEqual(maxCalls, 1);
+    ExcAssertGreaterEqual(maxSeconds, 0.0);
+
+    budgetCalls_ = maxCalls;
+    budgetNanos_ = maxSeconds * 1000000000.0;
+}
+
 void
 MessageLoop::
 debug(bool debugOn)
@@ -518,6 +1075,8 @@ void
 MessageLoop::
 checkNeedsPoll()
 {
+    const std::vector<SourceEntry> & sources = workers_[0]->sources;
+
     bool newNeedsPoll = false;
     for (unsigned i = 0;  i < sources.size() && !newNeedsPoll;  ++i)
         newNeedsPoll = sources[i].source->needsPoll;
@@ -7,8 +7,15 @@
 
 #pragma once
 
+#include <algorithm>
 #include <thread>
 #include <functional>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "jml/arch/wakeup_fd.h"
 #include "jml/arch/spinlock.h"
@@ -16,6 +23,8 @@
 #include "epoller.h"
 #include "async_event_source.h"
 #include "typed_message_channel.h"
+#include "timer_wheel.h"
+#include "thread_placement.h"
 #include "logs.h"
 
 namespace Datacratic {
@@ -32,19 +41,125 @@ struct MessageLoopLogs
     static Logging::Category trace;
 };
 
+/*****************************************************************************/
+/* LATENCY HISTOGRAM                                                         */
+/*****************************************************************************/
+
+/** Histogram of durations with one bucket per power of two: bucket i counts
+    the durations of 2^i to 2^(i+1) nanoseconds and the last one everything
+    from about 34 seconds up.  Coarse, but recording a duration only costs
+    a bit scan and an increment.
+*/
+struct LatencyHistogram {
+    static constexpr int NumBuckets = 36;
+
+    LatencyHistogram();
+
+    static int bucketOf(uint64_t nanos)
+    {
+        if (nanos == 0)
+            return 0;
+        return std::min(63 - __builtin_clzll(nanos), NumBuckets - 1);
+    }
+
+    void record(uint64_t nanos)
+    {
+        counts[bucketOf(nanos)] += 1;
+    }
+
+    /** Number of durations recorded */
+    uint64_t count() const;
+
+    /** Upper bound, in seconds, of the bucket holding the given quantile
+        (between 0 and 1) of the durations; 0 if the histogram is empty.
+    */
+    double quantile(double q) const;
+
+    uint64_t counts[NumBuckets];
+};
+
+
+/*****************************************************************************/
+/* MESSAGE LOOP SOURCE STATS                                                 */
+/*****************************************************************************/
+
+/** What a source of a MessageLoop has cost it so far; see
+    MessageLoop::sourceStats().
+*/
+struct MessageLoopSourceStats {
+    MessageLoopSourceStats()
+        : priority(0), numCalls(0), busySeconds(0.0), numBudgetExhausted(0)
+    {
+    }
+
+    std::string name;
+
+    /** Priority the source was added with */
+    int priority;
+
+    /** Number of calls to the source's processOne() */
+    uint64_t numCalls;
+
+    /** Total time spent in processOne() */
+    double busySeconds;
+
+    /** Number of turns at the end of which the source still had work to
+        do but had used up its budget; see MessageLoop::setSourceBudget().
+        A source that keeps hitting its budget is saturating the loop.
+    */
+    uint64_t numBudgetExhausted;
+
+    /** Duration of the processOne() calls */
+    LatencyHistogram callTimes;
+
+    /** Time between the source's fd being signalled and the loop calling
+        processOne(), for the sources that implement takeSignalTime().
+    */
+    LatencyHistogram wakeupLags;
+};
+
+
 /*****************************************************************************/
 /* MESSAGE LOOP                                                              */
 /*****************************************************************************/
 
+/** Loop that runs the AsyncEventSources that are added to it.
+
+    The sources are spread over numThreads worker threads.  A source whose
+    singleThreaded() is true is only ever processed by the worker it was
+    assigned to.  When there is more than one thread, the events of the
+    other sources go through a shared one-shot epoll set from which any
+    worker that isn't busy can steal them; their assigned worker still
+    handles their addition, removal and polling.
+
+    Worker 0 is the thread that runs start() or startSync() and its sources
+    are registered in the loop's own epoll set.  Since the other workers
+    only run once the loop is started, a loop that is polled by a parent
+    loop should only have one thread.
+
+    Each worker runs its sources by strict priority classes: the sources
+    with the highest priority take their turn first, and a class only
+    gets its turn once all the classes above it have run out of work, so
+    that a busy source can't delay the timers or the control sources of a
+    higher class.  Within a class, every source gets one turn per round,
+    bounded by the budget of setSourceBudget(), and the round starts from
+    a different source every time so that none of them is favoured.  The
+    sources of the steal set are likewise run by decreasing priority
+    within each batch of events.
+*/
+
 struct MessageLoop : public Epoller {
     typedef std::function<void ()> OnStop;
 
     MessageLoop(int numThreads = 1, double maxAddedLatency = 0.0005,
-                int epollTimeout = 0);
+                int epollTimeout = 0, Backend backend = EPOLL);
     ~MessageLoop();
 
+    /** The backend is used by the epoll sets of all the workers and by the
+        steal set; see Epoller::Backend.
+    */
     void init(int numThreads = 1, double maxAddedLatency = 0.0005,
-              int epollTimeout = 0);
+              int epollTimeout = 0, Backend backend = EPOLL);
 
     void start(const OnStop & onStop = OnStop());
 
@@ -52,8 +167,16 @@ struct MessageLoop : public Epoller {
     
     void shutdown();
 
+    /** Priority of the loop's timer wheel, which runs the periodic jobs.
+        It is above the default priority of the sources so that timers
+        don't miss their deadline behind a busy source.
+    */
+    static constexpr int TimersPriority = 1;
+
     /** Add the given source of asynchronous wakeups with the given
-        callback to be run when they trigger.
+        callback to be run when they trigger.  Sources with a higher
+        priority run first and the ones with a lower priority only run
+        when they have nothing left to do.
 
         Note that this function call will not take effect immediately. All work
         is deferred to the main message loop thread.
@@ -81,10 +204,12 @@ struct MessageLoop : public Epoller {
         since the last call; this is useful to know if something has
         got behind.  It will normally be 1.
 
-        Note that this function call will not take effect immediately. All work
-        is deferred to the main message loop thread.
+        The jobs of each priority run off a timer wheel of their own,
+        which is the loop's timers() for TimersPriority, so they don't
+        cost a timerfd each.  The name identifies the job in the error
+        logged if it throws.
 
-        Returns true if the request was successfully enqueued, false otherwise.
+        Returns true if the job was successfully scheduled, false otherwise.
     */
     bool addPeriodic(const std::string & name,
                      double timePeriodSeconds,
@@ -128,19 +253,119 @@ struct MessageLoop : public Epoller {
 
     /** Total number of seconds that this message loop has spent sleeping.
         Can be polled regularly to determine the duty cycle of the loop.
+        With more than one thread, this is the average over the threads.
+     */
+    double totalSleepSeconds() const;
+
+    /** Timer wheel of the loop, which can be used to schedule one-shot and
+        periodic timers that run within the loop.
+    */
+    TimerWheel & timers() { return timers_; }
+
+    /** Set where the threads of the loop run.  Worker i is placed as
+        thread i of the policy and subordinate threads come after the
+        workers.  With startSync(), worker 0 is the calling thread, which
+        gets pinned as well.  Must be called before the loop is started.
+    */
+    void setThreadPlacement(const ThreadPlacement & placement);
+
+    /** Enable busy-polling: when it runs out of work, each thread first
+        polls its epoll set without blocking for up to maxSpinSeconds
+        before going to sleep in the kernel, which saves the wakeup latency
+        of the eventfd and scheduler.  The budget adapts to the traffic:
+        it is halved every time a spin finds nothing, down to no spinning
+        at all when the loop is idle, and doubled back up to
+        maxSpinSeconds every time it does.  The loop also stops adding
+        latency to batch up work (see maxAddedLatency).
+
+        0 disables busy-polling, which is the default.  Must be called
+        before the loop is started.
+    */
+    void setBusyPoll(double maxSpinSeconds);
+
+    /** Set how much work each source can do per turn: its processOne() is
+        called again for as long as it returns true, up to maxCalls times
+        and until the calls have taken maxSeconds (0 for no time limit).
+        The default is a single call per turn.  A processOne() call is
+        never interrupted, so sources that can do a lot of work in a
+        single call should bound it themselves (see
+        TypedMessageSink::setBatchLimits()).  Must be called before the
+        loop is started.
+    */
+    void setSourceBudget(int maxCalls, double maxSeconds = 0.0);
+
+    /** Total number of seconds that this message loop has spent spinning
+        in busy-poll mode, averaged over the threads like
+        totalSleepSeconds().
      */
-    double totalSleepSeconds() const { return totalSleepTime_; }
+    double totalSpinSeconds() const;
+
+    /** Number of worker threads that run the sources. */
+    int numThreads() const { return workers_.size(); }
+
+    /** Call count, busy time, budget usage and latency histograms of each
+        source of the loop since it was added, including the loop's timer
+        wheel.  Only
+        the sources whose addition was processed by the loop are included.
+        The instrumentation is always on; it costs two clock reads and a
+        few relaxed atomic increments per processOne() call.
+    */
+    std::vector<MessageLoopSourceStats> sourceStats() const;
 
     void debug(bool debugOn);
     
 private:
-    void runWorkerThread();
+    struct Worker;
+
+    void runWorkerThread(Worker & worker);
     
     void wakeupMainThread();
 
     typedef ML::Spinlock Lock;
     typedef std::lock_guard<Lock> Guard;
 
+    /* Instrumentation of a source.  The epoll sets of the loop point to the
+       recorder of each fd rather than to its source, so that an event leads
+       to its recorder without a lookup; the loop's internal queues and its
+       steal set have recorders too but they aren't reported.  Counters are
+       atomic since the sources that aren't single threaded can be processed
+       by several workers at once. */
+    struct SourceRecorder
+    {
+        SourceRecorder(const std::string & name, AsyncEventSource * source,
+                       int priority = 0);
+
+        std::string name;
+        AsyncEventSource * source;
+        int priority;
+
+        std::atomic<uint64_t> numCalls;
+        std::atomic<uint64_t> busyNanos;
+        std::atomic<uint64_t> budgetExhausted;
+        std::atomic<uint64_t> callTimes[LatencyHistogram::NumBuckets];
+        std::atomic<uint64_t> wakeupLags[LatencyHistogram::NumBuckets];
+
+        MessageLoopSourceStats stats() const;
+    };
+
+    /* Source that can be processed by workers other than its own */
+    struct StealableSource
+    {
+        StealableSource(std::shared_ptr<AsyncEventSource> source,
+                        std::shared_ptr<SourceRecorder> recorder)
+            : source(source), recorder(recorder), busy(0), removed(false)
+        {}
+
+        std::shared_ptr<AsyncEventSource> source;
+        std::shared_ptr<SourceRecorder> recorder;
+
+        /* Number of workers currently processing the source */
+        std::atomic<int> busy;
+
+        /* Set when the source is being removed from the loop */
+        std::atomic<bool> removed;
+    };
+
     struct SourceEntry
     {
         SourceEntry() = default;
@@ -153,9 +378,13 @@ private:
         std::string name;
         std::shared_ptr<AsyncEventSource> source;
         int priority;
-    };
 
-    std::vector<SourceEntry> sources;
+        /* Set when the source's events go through the steal set */
+        std::shared_ptr<StealableSource> stealable;
+
+        /* Set once the source is added to its worker */
+        std::shared_ptr<SourceRecorder> recorder;
+    };
 
     /* Addition/removal action to perform on an event source */
     struct SourceAction {
@@ -175,10 +404,84 @@ private:
 
     /* Queue of source actions to perform */
     TypedMessageQueue<SourceAction> sourceActions_;
+    SourceRecorder sourceActionsRecorder_;
     // ML::Wakeup_Fd queueFd;
 
+    /* A thread of the loop and the sources it is responsible for. Worker 0
+       uses the loop's own epoll set and sourceActions_; the other workers
+       have their own epoll set and get their source actions from worker 0
+       through their actions queue. */
+    struct Worker
+    {
+        Worker(MessageLoop * loop, int index);
+
+        int index;
+        Epoller * epoller;
+        std::unique_ptr<Epoller> ownEpoller;
+
+        /* Sorted by decreasing priority */
+        std::vector<SourceEntry> sources;
+
+        /* Number of rounds over the sources, which rotates the source that
+           starts each priority class */
+        uint64_t rounds;
+
+        /* Events of the steal set and their sources, reused by every call
+           to processStolen() */
+        Epoller::EventBuffer stolenEvents;
+        std::vector<std::pair<int, std::shared_ptr<StealableSource> > >
+            stolen;
+        TypedMessageQueue<SourceAction> actions;
+        SourceRecorder actionsRecorder;
+
+        /* Number of sources assigned to the worker; updated by worker 0 */
+        std::atomic<size_t> numSources;
+
+        /* needsPoll of the worker; the loop's for worker 0 */
+        bool needsPoll;
+
+        /* Number of secs spent sleeping; totalSleepTime_ for worker 0 */
+        double totalSleepTime;
+
+        /* Number of secs the worker currently spins for in busy-poll mode
+           and total number of secs spent spinning */
+        double spinBudget;
+        double totalSpinTime;
+    };
+
+    std::vector<std::unique_ptr<Worker> > workers_;
+
+    /* Worker of each source; only used by worker 0 */
+    std::map<AsyncEventSource *, int> sourceWorkers_;
+
+    /* One-shot epoll set holding the fds of the sources that any worker
+       can process, indexed by fd in stealables_. Only used with more than
+       one worker. */
+    Epoller stealSet_;
+    SourceRecorder stealSetRecorder_;
+    Lock stealLock_;
+    std::unordered_map<int, std::shared_ptr<StealableSource> > stealables_;
+
+    /* Recorders of the sources that were added to a worker */
+    mutable Lock recordersLock_;
+    std::map<AsyncEventSource *, std::shared_ptr<SourceRecorder> > recorders_;
+
+    /* Runs the periodic jobs and the timers of the loop */
+    TimerWheel timers_;
+
+    /* Wheels of the periodic jobs of priorities other than TimersPriority,
+       which are sources of the loop */
+    Lock timersLock_;
+    std::map<int, std::shared_ptr<TimerWheel> > priorityTimers_;
+
+    /* Wheel that runs the periodic jobs of the given priority */
+    TimerWheel & timersFor(int priority);
+
+    ThreadPlacement placement_;
+
     Lock threadsLock;
     int numThreadsCreated;
+    int numSubordinateThreads;
     std::vector<std::thread> threads;
     
     /** Global flag to shutdown. */
@@ -195,10 +498,44 @@ private:
     */
     double maxAddedLatency_;
 
-    Epoller::HandleEventResult handleEpollEvent(epoll_event & event);
+    /* Backend of the epoll sets of the loop */
+    Backend backend_;
+
+    /** Maximum number of seconds spent busy-polling before sleeping; 0 when
+        busy-polling is disabled.
+    */
+    double maxSpinTime_;
+
+    /** Maximum number of processOne() calls and of nanoseconds (0 for no
+        limit) of a turn of a source.
+    */
+    int budgetCalls_;
+    uint64_t budgetNanos_;
+
+    Epoller::HandleEventResult handleEpollEvent(Worker & worker,
+                                                epoll_event & event);
     void handleSourceActions();
     void processAddSource(const SourceEntry & entry);
     void processRemoveSource(const SourceEntry & entry);
+
+    void handleWorkerActions(Worker & worker);
+    void addToWorker(Worker & worker, const SourceEntry & entry);
+    void removeFromWorker(Worker & worker, const SourceEntry & entry);
+
+    /* Give a turn to the sources of the worker, by priority class, up to
+       the first class which still has more to do; returns true if it
+       has or if the worker's actions do. */
+    bool processWorker(Worker & worker);
+
+    /* Call processOne() on the recorder's source, recording the call. */
+    bool runSource(SourceRecorder & recorder);
+
+    /* Give the recorder's source a turn, running it for up to its budget;
+       returns true if it still has more to do. */
+    bool runTurn(SourceRecorder & recorder);
+
+    /* Process the ready events of the steal set. */
+    void processStolen(Worker & worker);
 };
 
 } // namespace Datacratic
@@ -55,6 +55,64 @@ init(PortRange const & portRange, const std::string & hostname, int num_threads,
 /* ACCEPTOR FOR SOCKETTRANSPORT                                              */
 /*****************************************************************************/
 
+namespace {
+
+struct NameEntry {
+    NameEntry(const string & name)
+        : name_(name), date_(Date::now())
+        {}
+
+    string name_;
+    Date date_;
+};
+
+typedef unordered_map<string, NameEntry> NameCache;
+
+/* Name of the peer, looked up through the cache if nameLookup is set */
+string
+peerNameOf(const ACE_INET_Addr & peerAddr, bool nameLookup,
+           NameCache & addr2Name)
+{
+    string peerName = peerAddr.get_host_addr();
+    if (nameLookup) {
+        auto it = addr2Name.find(peerName);
+        if (it == addr2Name.end()) {
+            string addr = peerName;
+            peerName = peerAddr.get_host_name();
+            addr2Name.insert({addr, NameEntry(peerName)});
+        }
+        else {
+            peerName = it->second.name_;
+        }
+    }
+
+    if (peerName == "<unknown>")
+        peerName = peerAddr.get_host_addr();
+
+    /* cleanup name entries older than 5 seconds */
+    Date now = Date::now();
+    auto it = addr2Name.begin();
+    while (it != addr2Name.end()) {
+        const NameEntry & entry = it->second;
+        if (entry.date_.plusSeconds(5) < now) {
+            it = addr2Name.erase(it);
+        }
+        else {
+            it++;
+        }
+    }
+
+    return peerName;
+}
+
+/* Connections accepted by an event thread before it serves its other
+   fds */
+enum {
+    MAX_ACCEPTS_PER_EVENT = 64
+};
+
+} // file scope
+
 AcceptorT<SocketTransport>::
 AcceptorT()
     : fd(-1), endpoint(0), listening_(false)
@@ -92,6 +150,17 @@ listen(PortRange const & portRange,
         throw Exception("error setsockopt SO_REUSEADDR: %s", strerror(errno));
     }
 
+    // The sockets of the other event threads bind to the same port
+    if (endpoint->pollsPerThread()) {
+        res = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &tr, sizeof(int));
+        if (res == -1) {
+            close(fd);
+            fd = -1;
+            throw Exception("error setsockopt SO_REUSEPORT: %s",
+                            strerror(errno));
+        }
+    }
+
     const char * hostNameToUse
         = (hostname == "*" ? "0.0.0.0" : hostname.c_str());
 
@@ -144,19 +213,138 @@ listen(PortRange const & portRange,
         addr.set(&inAddr, inAddrLen);
     }
 
+    shutdown = false;
+
+    if (endpoint->pollsPerThread()) {
+        acceptInEventThreads(backlog);
+        listening_ = true;
+        ML::futex_wake(listening_);
+        return port;
+    }
+
     listening_ = true;
     ML::futex_wake(listening_);
 
-    shutdown = false;
-
     acceptThread.reset(new boost::thread([=] () { this->runAcceptThread(); }));
     return port;
 }
 
+void
+AcceptorT<SocketTransport>::
+acceptInEventThreads(int backlog)
+{
+    int numThreads = endpoint->numPollingThreads();
+    if (numThreads == 0) {
+        close(fd);
+        fd = -1;
+        throw Exception("listen: the endpoint must be spun up before "
+                        "listening when it polls per thread");
+    }
+
+    threadFds.push_back(fd);
+
+    try {
+        for (int i = 1;  i < numThreads;  ++i) {
+            int threadFd = socket(AF_INET, SOCK_STREAM, 0);
+            if (threadFd == -1)
+                throw Exception(errno, "socket");
+            threadFds.push_back(threadFd);
+
+            int tr = 1;
+            int res = setsockopt(threadFd, SOL_SOCKET, SO_REUSEADDR,
+                                 &tr, sizeof(int));
+            if (res == -1)
+                throw Exception(errno, "setsockopt SO_REUSEADDR");
+            res = setsockopt(threadFd, SOL_SOCKET, SO_REUSEPORT,
+                             &tr, sizeof(int));
+            if (res == -1)
+                throw Exception(errno, "setsockopt SO_REUSEPORT");
+
+            res = ::bind(threadFd,
+                         reinterpret_cast<sockaddr *>(addr.get_addr()),
+                         addr.get_addr_size());
+            if (res == -1)
+                throw Exception(errno, format("bind to port %d", port()));
+
+            res = ::listen(threadFd, backlog);
+            if (res == -1)
+                throw Exception(errno, "listen");
+        }
+
+        for (int i = 0;  i < numThreads;  ++i) {
+            int res = fcntl(threadFds[i], F_SETFL, O_NONBLOCK);
+            if (res != 0)
+                throw Exception(errno, "fcntl");
+
+            auto addr2Name = std::make_shared<NameCache>();
+            auto onAcceptReady = [=] (int threadFd)
+                {
+                    for (int j = 0;  j < MAX_ACCEPTS_PER_EVENT;  ++j) {
+                        sockaddr_in addr;
+                        socklen_t addr_len = sizeof(addr);
+                        int res = accept(threadFd, (sockaddr *)&addr,
+                                         &addr_len);
+                        if (res == -1 && errno == EINTR)
+                            continue;
+                        if (res == -1 && errno == EWOULDBLOCK)
+                            return;
+                        if (res == -1) {
+                            endpoint->acceptError(format("accept: %s",
+                                                         strerror(errno)));
+                            return;
+                        }
+
+                        ACE_INET_Addr peerAddr(&addr, addr_len);
+                        this->newConnection(res, peerAddr,
+                                            peerNameOf(peerAddr, nameLookup,
+                                                       *addr2Name));
+                    }
+                };
+            endpoint->startAccepting(i, threadFds[i], onAcceptReady);
+        }
+    } catch (...) {
+        closePeer();
+        throw;
+    }
+}
+
+void
+AcceptorT<SocketTransport>::
+newConnection(int connectionFd, const ACE_INET_Addr & peerAddr,
+              const std::string & peerName)
+{
+#if 0
+    ptime now = second_clock::universal_time();
+
+    cerr << boost::this_thread::get_id() << ":"<<to_iso_extended_string(now) << ":accept succeeded from "
+         << peerAddr.get_host_addr() << ":" << peerAddr.get_port_number()
+         << " (" << peerAddr.get_host_name() << ")"
+         << " for endpoint " << endpoint->name() << " res = " << connectionFd
+         << " pointer " << endpoint << endl;
+#endif
+    std::shared_ptr<SocketTransport> newTransport
+        (new SocketTransport(this->endpoint));
+
+    newTransport->peer_ = ACE_SOCK_Stream(connectionFd);
+    newTransport->peerName_ = peerName;
+    endpoint->associateHandler(newTransport);
+}
+
 void
 AcceptorT<SocketTransport>::
 closePeer()
 {
+    if (!threadFds.empty()) {
+        for (unsigned i = 0;  i < threadFds.size();  ++i) {
+            if ((int)i < endpoint->numPollingThreads())
+                endpoint->stopAccepting(i);
+            close(threadFds[i]);
+        }
+        threadFds.clear();
+        fd = -1;
+        return;
+    }
+
     if (!acceptThread) return;
     shutdown = true;
 
@@ -189,21 +377,14 @@ port() const
     return addr.get_port_number();
 }
 
-struct NameEntry {
-    NameEntry(const string & name)
-        : name_(name), date_(Date::now())
-        {}
-
-    string name_;
-    Date date_;
-};
-
 void
 AcceptorT<SocketTransport>::
 runAcceptThread()
 {
     //static const char *fName = "AcceptorT<SocketTransport>::runAcceptThread:";
-    unordered_map<string,NameEntry> addr2Name;
+    endpoint->threadPlacement().tryApply(-1);
+
+    NameCache addr2Name;
 
     int res = fcntl(fd, F_SETFL, O_NONBLOCK);
     if (res != 0) {
@@ -263,50 +444,7 @@ runAcceptThread()
 #endif
 
         ACE_INET_Addr addr2(&addr, addr_len);
-
-#if 0
-        ptime now = second_clock::universal_time();
-
-        cerr << boost::this_thread::get_id() << ":"<<to_iso_extended_string(now) << ":accept succeeded from "
-             << addr2.get_host_addr() << ":" << addr2.get_port_number()
-             << " (" << addr2.get_host_name() << ")"
-             << " for endpoint " << endpoint->name() << " res = " << res
-             << " pointer " << endpoint << endl;
-#endif
-        std::shared_ptr<SocketTransport> newTransport
-            (new SocketTransport(this->endpoint));
-
-        newTransport->peer_ = ACE_SOCK_Stream(res);
-        string peerName = addr2.get_host_addr();
-        if (nameLookup) {
-            auto it = addr2Name.find(peerName);
-            if (it == addr2Name.end()) {
-                string addr = peerName;
-                peerName = addr2.get_host_name();
-                addr2Name.insert({addr, NameEntry(peerName)});
-            }
-            else {
-                peerName = it->second.name_;
-            }
-        }
-
-        if (peerName == "<unknown>")
-            peerName = addr2.get_host_addr();
-        newTransport->peerName_ = peerName;
-        endpoint->associateHandler(newTransport);
-
-        /* cleanup name entries older than 5 seconds */
-        Date now = Date::now();
-        auto it = addr2Name.begin();
-        while (it != addr2Name.end()) {
-            const NameEntry & entry = it->second;
-            if (entry.date_.plusSeconds(5) < now) {
-                it = addr2Name.erase(it);
-            }
-            else {
-                it++;
-            }
-        }
+        newConnection(res, addr2, peerNameOf(addr2, nameLookup, addr2Name));
     }
 }
 
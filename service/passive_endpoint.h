@@ -72,6 +72,11 @@ struct PassiveEndpoint: public EndpointBase {
 
         If threads is zero, then nothing will actually be done until a
         thread calls useThisThread() to do work.
+
+        If pollPerThread() was set, each of the threads accepts the
+        connections of its own listening socket, all of them bound to the
+        same port with SO_REUSEPORT so that the kernel spreads the incoming
+        connections between them.
     */
     int init(PortRange const & portRange = PortRange(), const std::string & hostname = "localhost",
              int threads = 1, bool synchronous = true, bool nameLookup=true,
@@ -214,10 +219,23 @@ struct AcceptorT<SocketTransport> : public Acceptor {
     void waitListening() const;
 
 protected:
+    /** Open a listening socket for each event thread of an endpoint that
+        polls per thread, and accept the connections in those threads
+        instead of the accept thread.
+    */
+    void acceptInEventThreads(int backlog);
+
+    /** Create the transport for an accepted connection and pass it to the
+        endpoint.
+    */
+    void newConnection(int connectionFd, const ACE_INET_Addr & peerAddr,
+                       const std::string & peerName);
+
     std::shared_ptr<boost::thread> acceptThread;
     ML::Wakeup_Fd wakeup;
     ACE_INET_Addr addr;
     int fd;
+    std::vector<int> threadFds; // listening socket of each event thread
     PassiveEndpoint * endpoint;
     int listening_; // whether the socket is listening
     bool nameLookup;
@@ -212,10 +212,9 @@ struct S3Api : public AwsApi {
 
         std::string getHeader(const std::string & name) const
         {
-            auto it = header_.headers.find(name);
-            if (it == header_.headers.end())
+            if (!header_.hasHeader(name))
                 throw ML::Exception("required header " + name + " not found");
-            return it->second;
+            return header_.getHeader(name);
         }
 
         long code_;
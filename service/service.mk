@@ -41,10 +41,15 @@ LIBSERVICES_SOURCES := \
 	passive_endpoint.cc \
 	chunked_http_endpoint.cc \
 	epoller.cc \
+	io_uring_poller.cc \
 	http_header.cc \
+	http_request_parser.cc \
 	port_range_service.cc \
 	service_base.cc \
 	message_loop.cc \
+	timer_wheel.cc \
+	thread_placement.cc \
+	fiber.cc \
 	loop_monitor.cc \
 	named_endpoint.cc \
 	zookeeper_configuration_service.cc \
@@ -62,6 +67,7 @@ LIBSERVICES_SOURCES := \
 	zookeeper.cc \
 	http_client.cc \
 	http_client_v1.cc \
+	fiber_clients.cc \
 	http_rest_proxy.cc \
 	xml_helpers.cc \
 	nprobe.cc \
@@ -0,0 +1,303 @@
+/* epoller_test.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Tests for the Epoller and its backends.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/wakeup_fd.h"
+#include "jml/utils/testing/watchdog.h"
+
+#include "soa/service/epoller.h"
+#include "soa/types/date.h"
+#include "soa/service/io_uring_poller.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+vector<Epoller::Backend> backends()
+{
+    vector<Epoller::Backend> result = { Epoller::EPOLL };
+    if (IoUringPoller::supported())
+        result.push_back(Epoller::IO_URING);
+    else cerr << "io_uring isn't supported: only testing epoll" << endl;
+    return result;
+}
+
+/* Handles the ready events, returning the data of each of them */
+vector<void *> handle(Epoller & epoller, int nEvents = -1, int usToWait = 0)
+{
+    vector<void *> result;
+    auto onEvent = [&] (epoll_event & event) {
+        result.push_back(event.data.ptr);
+        return Epoller::DONE;
+    };
+    epoller.handleEvents(usToWait, nEvents, onEvent);
+    return result;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_level_triggered )
+{
+    ML::Watchdog wd(10);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(16, 0, backend);
+        BOOST_CHECK_EQUAL(epoller.backend(), backend);
+
+        ML::Wakeup_Fd wakeup(EFD_NONBLOCK);
+        int data;
+        epoller.addFd(wakeup.fd(), &data);
+
+        BOOST_CHECK(handle(epoller).empty());
+        BOOST_CHECK(!epoller.poll());
+
+        wakeup.signal();
+        BOOST_CHECK(epoller.poll());
+
+        /* the fd keeps firing until it is read */
+        for (int i = 0;  i < 3;  ++i) {
+            auto ready = handle(epoller);
+            BOOST_REQUIRE_EQUAL(ready.size(), 1);
+            BOOST_CHECK_EQUAL(ready[0], &data);
+        }
+
+        wakeup.read();
+        BOOST_CHECK(handle(epoller).empty());
+
+        epoller.removeFd(wakeup.fd());
+        wakeup.signal();
+        BOOST_CHECK(handle(epoller).empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_one_shot )
+{
+    ML::Watchdog wd(10);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(16, 0, backend);
+
+        ML::Wakeup_Fd wakeup(EFD_NONBLOCK);
+        int data1, data2;
+        epoller.addFdOneShot(wakeup.fd(), &data1);
+
+        wakeup.signal();
+        auto ready = handle(epoller);
+        BOOST_REQUIRE_EQUAL(ready.size(), 1);
+        BOOST_CHECK_EQUAL(ready[0], &data1);
+
+        /* still readable, but not rearmed */
+        BOOST_CHECK(handle(epoller).empty());
+
+        epoller.restartFdOneShot(wakeup.fd(), &data2);
+        ready = handle(epoller);
+        BOOST_REQUIRE_EQUAL(ready.size(), 1);
+        BOOST_CHECK_EQUAL(ready[0], &data2);
+
+        /* restarting from the handler, as the endpoints do */
+        int numEvents(0);
+        auto onEvent = [&] (epoll_event & event) {
+            numEvents++;
+            epoller.restartFdOneShot(wakeup.fd(), event.data.ptr);
+            return Epoller::DONE;
+        };
+        epoller.restartFdOneShot(wakeup.fd(), &data1);
+        for (int i = 0;  i < 5;  ++i)
+            epoller.handleEvents(0, -1, onEvent);
+        BOOST_CHECK_EQUAL(numEvents, 5);
+
+        epoller.removeFd(wakeup.fd());
+        BOOST_CHECK(handle(epoller).empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_many_fds )
+{
+    ML::Watchdog wd(10);
+    const int numFds(100);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(numFds, 0, backend);
+
+        vector<unique_ptr<ML::Wakeup_Fd> > wakeups;
+        for (int i = 0;  i < numFds;  ++i) {
+            wakeups.emplace_back(new ML::Wakeup_Fd(EFD_NONBLOCK));
+            epoller.addFdOneShot(wakeups.back()->fd(), wakeups.back().get());
+        }
+
+        for (int i = 0;  i < numFds;  i += 2)
+            wakeups[i]->signal();
+
+        /* events are returned by batches of at most nEvents */
+        vector<void *> ready;
+        for (;;) {
+            auto batch = handle(epoller, 8);
+            BOOST_CHECK_LE(batch.size(), 8);
+            if (batch.empty())
+                break;
+            ready.insert(ready.end(), batch.begin(), batch.end());
+        }
+        BOOST_CHECK_EQUAL(ready.size(), numFds / 2);
+
+        for (auto & wakeup: wakeups)
+            epoller.removeFd(wakeup->fd());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_blocking_wait )
+{
+    ML::Watchdog wd(10);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(16, 100, backend);
+
+        ML::Wakeup_Fd wakeup(EFD_NONBLOCK);
+        epoller.addFd(wakeup.fd());
+
+        /* times out */
+        BOOST_CHECK(handle(epoller).empty());
+
+        std::thread signaller([&] () {
+                ::usleep(10000);
+                wakeup.signal();
+            });
+        BOOST_CHECK_EQUAL(handle(epoller).size(), 1);
+        signaller.join();
+
+        epoller.removeFd(wakeup.fd());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_level_triggered_sleeping )
+{
+    ML::Watchdog wd(10);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(16, 0, backend);
+
+        ML::Wakeup_Fd wakeup(EFD_NONBLOCK);
+        int data;
+        epoller.addFd(wakeup.fd(), &data);
+
+        /* the fd must be watched again once handled, when the next wait
+           sleeps on the epoller's fd rather than polling it */
+        for (int i = 0;  i < 2;  ++i) {
+            wakeup.signal();
+            Date before = Date::now();
+            auto ready = handle(epoller, -1, 900000);
+            BOOST_REQUIRE_EQUAL(ready.size(), 1);
+            BOOST_CHECK_EQUAL(ready[0], &data);
+            BOOST_CHECK_LT(Date::now().secondsSince(before), 0.5);
+
+            /* still readable for a loop that nests this one */
+            BOOST_CHECK(epoller.poll());
+            wakeup.read();
+        }
+
+        epoller.removeFd(wakeup.fd());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_edge_triggered )
+{
+    ML::Watchdog wd(10);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(16, 0, backend);
+
+        ML::Wakeup_Fd wakeup(EFD_NONBLOCK);
+        int data;
+        epoller.addFdEdgeTriggered(wakeup.fd(), &data);
+
+        BOOST_CHECK(handle(epoller).empty());
+
+        /* fires once per new write, even when the fd isn't drained */
+        for (int i = 0;  i < 3;  ++i) {
+            wakeup.signal();
+            auto ready = handle(epoller);
+            BOOST_REQUIRE_EQUAL(ready.size(), 1);
+            BOOST_CHECK_EQUAL(ready[0], &data);
+            BOOST_CHECK(handle(epoller).empty());
+        }
+
+        wakeup.read();
+        BOOST_CHECK(handle(epoller).empty());
+
+        epoller.removeFd(wakeup.fd());
+        wakeup.signal();
+        BOOST_CHECK(handle(epoller).empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_event_batch )
+{
+    ML::Watchdog wd(10);
+    const int numFds(100);
+
+    for (auto backend: backends()) {
+        Epoller epoller;
+        epoller.init(numFds, 0, backend);
+
+        vector<unique_ptr<ML::Wakeup_Fd> > wakeups;
+        for (int i = 0;  i < numFds;  ++i) {
+            wakeups.emplace_back(new ML::Wakeup_Fd(EFD_NONBLOCK));
+            epoller.addFdEdgeTriggered(wakeups.back()->fd(),
+                                       wakeups.back().get());
+        }
+
+        for (int i = 0;  i < numFds;  i += 2)
+            wakeups[i]->signal();
+
+        /* the whole batch is handed over at once, and the fds are drained
+           by the handler */
+        Epoller::EventBuffer buffer(16);
+        int numBatches(0), numEvents(0);
+        auto onBatch = [&] (epoll_event * events, int n) {
+            BOOST_CHECK_LE(n, buffer.capacity());
+            BOOST_CHECK_EQUAL(events, buffer.events());
+            numBatches++;
+            for (int i = 0;  i < n;  ++i) {
+                auto wakeup = (ML::Wakeup_Fd *)events[i].data.ptr;
+                BOOST_CHECK(wakeup->tryRead());
+                numEvents++;
+            }
+            return Epoller::DONE;
+        };
+        while (epoller.handleEventBatch(buffer, onBatch) > 0)
+            ;
+        BOOST_CHECK_EQUAL(numEvents, numFds / 2);
+        BOOST_CHECK_GE(numBatches, numFds / 2 / buffer.capacity());
+
+        auto onShutdown = [&] (epoll_event * events, int n) {
+            return Epoller::SHUTDOWN;
+        };
+        wakeups[0]->signal();
+        BOOST_CHECK_EQUAL(epoller.handleEventBatch(buffer, onShutdown), -1);
+
+        for (auto & wakeup: wakeups)
+            epoller.removeFd(wakeup->fd());
+    }
+}
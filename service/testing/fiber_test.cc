@@ -0,0 +1,349 @@
+/* fiber_test.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Tests for the fibers.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/timers.h"
+#include "jml/utils/guard.h"
+#include "jml/utils/testing/watchdog.h"
+
+#include "soa/service/message_loop.h"
+#include "soa/service/fiber.h"
+#include "soa/service/fiber_clients.h"
+
+#include "test_http_services.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+/* The scheduler is driven by hand: each processOne() runs the fibers that
+ * are ready. */
+BOOST_AUTO_TEST_CASE( test_fiber_scheduling )
+{
+    ML::Watchdog wd(10);
+
+    FiberScheduler fibers;
+    BOOST_CHECK(!fibers.poll());
+    BOOST_CHECK(FiberScheduler::current() == nullptr);
+
+    string trace;
+    FiberWaiter * waiter(nullptr);
+    fibers.spawn([&] () {
+            BOOST_CHECK(FiberScheduler::current() == &fibers);
+            trace += "a1 ";
+            FiberWaiter myWaiter;
+            waiter = &myWaiter;
+            myWaiter.wait();
+            trace += "a2 ";
+        });
+    fibers.spawn([&] () {
+            trace += "b ";
+        });
+    BOOST_CHECK_EQUAL(fibers.numFibers(), 2);
+    BOOST_CHECK(fibers.poll());
+
+    BOOST_CHECK(!fibers.processOne());
+    BOOST_CHECK_EQUAL(trace, "a1 b ");
+    BOOST_CHECK_EQUAL(fibers.numFibers(), 1);
+
+    /* nothing happens until the waiter is notified */
+    BOOST_CHECK(!fibers.processOne());
+    BOOST_CHECK_EQUAL(trace, "a1 b ");
+
+    waiter->notify();
+    BOOST_CHECK(fibers.poll());
+    BOOST_CHECK(!fibers.processOne());
+    BOOST_CHECK_EQUAL(trace, "a1 b a2 ");
+    BOOST_CHECK_EQUAL(fibers.numFibers(), 0);
+
+    /* stacks are reused */
+    int numRuns(0);
+    for (int i = 0;  i < 1000;  ++i) {
+        fibers.spawn([&] () { numRuns++; });
+        fibers.processOne();
+    }
+    BOOST_CHECK_EQUAL(numRuns, 1000);
+    BOOST_CHECK_EQUAL(fibers.numFibers(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_fiber_exception )
+{
+    ML::Watchdog wd(10);
+
+    FiberScheduler fibers;
+    bool otherRan(false);
+    fibers.spawn([&] () { throw std::runtime_error("fiber error"); });
+    fibers.spawn([&] () { otherRan = true; });
+
+    /* the exception comes out of processOne() and the other fiber runs on
+       the next call */
+    BOOST_CHECK_THROW(fibers.processOne(), std::runtime_error);
+    BOOST_CHECK(!otherRan);
+    BOOST_CHECK(fibers.poll());
+    fibers.processOne();
+    BOOST_CHECK(otherRan);
+    BOOST_CHECK_EQUAL(fibers.numFibers(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_fiber_fan_out )
+{
+    ML::Watchdog wd(10);
+    const int numRequests(20);
+
+    MessageLoop loop;
+    FiberScheduler fibers;
+    loop.addSource("fibers", fibers);
+    loop.start();
+    fibers.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    std::atomic<bool> finished(false);
+    vector<int> results(numRequests);
+
+    fibers.spawn([&] () {
+            /* each request is a fiber of its own, and they sleep
+               concurrently */
+            FiberJoin join(numRequests);
+            for (int i = 0;  i < numRequests;  ++i) {
+                fibers.spawn([&, i] () {
+                        FiberScheduler::sleep(0.01 * (i % 5));
+                        results[i] = i;
+                        join.done();
+                    });
+            }
+            join.wait();
+            finished = true;
+        });
+
+    ML::Timer timer;
+    while (!finished)
+        ML::sleep(0.001);
+    double elapsed = timer.elapsed_wall();
+    cerr << "fan-out took " << elapsed << endl;
+    BOOST_CHECK_LT(elapsed, 0.04 * numRequests / 2);
+
+    for (int i = 0;  i < numRequests;  ++i)
+        BOOST_CHECK_EQUAL(results[i], i);
+
+    loop.removeSourceSync(&fibers);
+    BOOST_CHECK_EQUAL(fibers.numFibers(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_fiber_reader )
+{
+    ML::Watchdog wd(10);
+
+    MessageLoop loop;
+    FiberScheduler fibers;
+    loop.addSource("fibers", fibers);
+    loop.start();
+    fibers.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    FiberReader reader;
+    std::atomic<bool> finished(false);
+    string received;
+    int numReads(0);
+    fibers.spawn([&] () {
+            for (;;) {
+                string data = reader.read();
+                if (data.empty())
+                    break;
+                received += data;
+                numReads++;
+            }
+            finished = true;
+        });
+
+    /* data comes from another thread, as it would from a client */
+    std::thread writer([&] () {
+            for (int i = 0;  i < 100;  ++i) {
+                string chunk = to_string(i) + " ";
+                reader.push(chunk.c_str(), chunk.size());
+                if (i % 10 == 0)
+                    ML::sleep(0.001);
+            }
+            reader.close();
+        });
+    writer.join();
+
+    while (!finished)
+        ML::sleep(0.001);
+
+    string expected;
+    for (int i = 0;  i < 100;  ++i)
+        expected += to_string(i) + " ";
+    BOOST_CHECK_EQUAL(received, expected);
+    BOOST_CHECK_GE(numReads, 1);
+
+    loop.removeSourceSync(&fibers);
+}
+
+/* A fiber is resumed on the thread it started on, even when the loop has
+ * several workers. */
+BOOST_AUTO_TEST_CASE( test_fiber_no_migration )
+{
+    ML::Watchdog wd(10);
+
+    MessageLoop loop(4);
+    FiberScheduler fibers;
+    BOOST_CHECK(fibers.singleThreaded());
+    loop.addSource("fibers", fibers);
+    loop.start();
+    fibers.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    std::atomic<bool> finished(false);
+    int numMigrations(0);
+    fibers.spawn([&] () {
+            std::thread::id thread = std::this_thread::get_id();
+            for (int i = 0;  i < 20;  ++i) {
+                FiberScheduler::sleep(0.001);
+                if (std::this_thread::get_id() != thread)
+                    numMigrations++;
+            }
+            finished = true;
+        });
+
+    while (!finished)
+        ML::sleep(0.001);
+    BOOST_CHECK_EQUAL(numMigrations, 0);
+
+    loop.removeSourceSync(&fibers);
+}
+
+BOOST_AUTO_TEST_CASE( test_fiber_await_http )
+{
+    ML::Watchdog wd(10);
+
+    auto proxies = make_shared<ServiceProxies>();
+    HttpGetService service(proxies);
+    service.addResponse("GET", "/hello", 200, "hello from the service");
+    service.start();
+    service.waitListening();
+
+    MessageLoop loop;
+    FiberScheduler fibers;
+    loop.addSource("fibers", fibers);
+    HttpClient client("http://127.0.0.1:" + to_string(service.port()), 4);
+    loop.addSource("client", client);
+    loop.start();
+    fibers.waitConnectionState(AsyncEventSource::CONNECTED);
+    client.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    std::atomic<bool> finished(false);
+    FiberHttpResponse response, missing;
+    fibers.spawn([&] () {
+            response = awaitHttp(client, "GET", "/hello");
+            missing = awaitHttp(client, "GET", "/missing");
+            finished = true;
+        });
+
+    while (!finished)
+        ML::sleep(0.001);
+
+    BOOST_CHECK_EQUAL(response.error, HttpClientError::None);
+    BOOST_CHECK_EQUAL(response.code, 200);
+    BOOST_CHECK_EQUAL(response.body, "hello from the service");
+    BOOST_CHECK_EQUAL(missing.error, HttpClientError::None);
+    BOOST_CHECK_EQUAL(missing.code, 404);
+
+    loop.removeSourceSync(&client);
+    loop.removeSourceSync(&fibers);
+}
+
+/* awaitConnect() and awaitWrite() against a loopback echo server */
+BOOST_AUTO_TEST_CASE( test_fiber_await_connect_write )
+{
+    ML::Watchdog wd(10);
+
+    int listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    BOOST_REQUIRE_NE(listenFd, -1);
+    ML::Call_Guard closeListen([&] () { close(listenFd); });
+
+    struct sockaddr_in addr
+        = { AF_INET, 0, { htonl(INADDR_LOOPBACK) } };
+    socklen_t addrLen(sizeof(addr));
+    BOOST_REQUIRE_EQUAL(::bind(listenFd,
+                               reinterpret_cast<const sockaddr *>(&addr),
+                               sizeof(addr)), 0);
+    BOOST_REQUIRE_EQUAL(listen(listenFd, 1), 0);
+    BOOST_REQUIRE_EQUAL(getsockname(listenFd,
+                                    reinterpret_cast<sockaddr *>(&addr),
+                                    &addrLen), 0);
+
+    std::thread echo([&] () {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd == -1)
+                return;
+            char buf[4096];
+            ssize_t res;
+            while ((res = read(fd, buf, sizeof(buf))) > 0)
+                if (write(fd, buf, res) != res)
+                    break;
+            close(fd);
+        });
+
+    FiberReader reader;
+    auto onReceivedData = [&] (const char * data, size_t size) {
+        reader.push(data, size);
+    };
+    auto onClosed = [&] (bool fromPeer, const vector<string> & msgs) {
+        reader.close();
+    };
+
+    MessageLoop loop;
+    FiberScheduler fibers;
+    loop.addSource("fibers", fibers);
+    TcpClient client(onClosed, onReceivedData);
+    client.init("127.0.0.1", ntohs(addr.sin_port));
+    loop.addSource("client", client);
+    loop.start();
+    fibers.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    std::atomic<bool> finished(false);
+    TcpConnectionCode connectCode(ConnectionFailure);
+    AsyncWriteResult writeResult(EINVAL, string(), 0);
+    string echoed;
+    fibers.spawn([&] () {
+            connectCode = awaitConnect(client).code;
+            if (connectCode == Success) {
+                writeResult = awaitWrite(client, "ping");
+                while (echoed.size() < 4) {
+                    string data = reader.read();
+                    if (data.empty())
+                        break;
+                    echoed += data;
+                }
+            }
+            finished = true;
+        });
+
+    while (!finished)
+        ML::sleep(0.001);
+
+    BOOST_CHECK_EQUAL(connectCode, Success);
+    BOOST_CHECK_EQUAL(writeResult.error, 0);
+    BOOST_CHECK_EQUAL(writeResult.writtenSize, 4);
+    BOOST_CHECK_EQUAL(echoed, "ping");
+
+    client.requestClose();
+    loop.removeSourceSync(&client);
+    loop.removeSourceSync(&fibers);
+    echo.join();
+}
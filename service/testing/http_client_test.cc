@@ -24,7 +24,7 @@ using namespace Datacratic;
 /* helpers functions used in tests */
 namespace {
 
-typedef tuple<HttpClientError, int, string> ClientResponse;
+typedef tuple<HttpClientError, int, string, string> ClientResponse;
 
 #define CALL_MEMBER_FN(object, pointer)  ((object)->*(pointer))
 
@@ -50,6 +50,7 @@ doRequest(MessageLoop& loop, const string &baseUrl, const string& resource,
         body_ = move(body);
         HttpClientError & errorCode = get<0>(response);
         errorCode = error;
+        get<3>(response) = move(headers);
         done = true;
         ML::futex_wake(done);
     };
@@ -118,6 +119,7 @@ doUploadRequest(MessageLoop & loop,
         body_ = move(body);
         HttpClientError & errorCode = get<0>(response);
         errorCode = error;
+        get<3>(response) = move(headers);
         done = true;
         ML::futex_wake(done);
     };
@@ -154,6 +156,7 @@ BOOST_AUTO_TEST_CASE( test_http_client_get )
     ML::Watchdog watchdog(10);
     auto proxies = make_shared<ServiceProxies>();
     HttpGetService service(proxies);
+    service.sendDateHeader = true;
 
     service.addResponse("GET", "/coucou", 200, "coucou");
     service.start();
@@ -216,6 +219,11 @@ BOOST_AUTO_TEST_CASE( test_http_client_get )
         BOOST_CHECK_EQUAL(get<0>(resp), HttpClientError::None);
         BOOST_CHECK_EQUAL(get<1>(resp), 200);
         BOOST_CHECK_EQUAL(get<2>(resp), "coucou");
+
+        /* the response header has the length and the date */
+        const string & headers = get<3>(resp);
+        BOOST_CHECK_NE(headers.find("Content-Length: 6\r\n"), string::npos);
+        BOOST_CHECK_NE(headers.find("Date: "), string::npos);
     }
 
     /* headers and cookies */
@@ -1,9 +1,12 @@
 #define BOOST_TEST_MAIN
 #define BOOST_TEST_DYN_LINK
 
+#include <algorithm>
 #include <string>
 #include <boost/test/unit_test.hpp>
+#include "jml/arch/exception.h"
 #include "soa/service/http_header.h"
+#include "soa/service/http_request_parser.h"
 
 using namespace std;
 
@@ -115,3 +118,172 @@ BOOST_AUTO_TEST_CASE(test_http_header_query_parser_g6)
     BOOST_CHECK_EQUAL(parser.queryParams[2].second, "=");
     BOOST_CHECK_EQUAL(parser.queryParams[3].second, "");
 }
+
+
+/* incremental parser */
+
+namespace {
+
+const std::string request
+    = "POST /bid?foo=bar&x=%41b HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Content-Type: application/json\r\n"
+      "X-Openrtb-Version:   2.2\r\n"
+      "Content-Length: 11\r\n"
+      "\r\n"
+      "{\"id\":\"1\"}\n";
+
+void checkSameHeader(const Datacratic::HttpHeader & header,
+                     const Datacratic::HttpHeader & expected)
+{
+    BOOST_CHECK_EQUAL(header.verb, expected.verb);
+    BOOST_CHECK_EQUAL(header.resource, expected.resource);
+    BOOST_CHECK_EQUAL(header.version, expected.version);
+    BOOST_CHECK_EQUAL(header.contentType, expected.contentType);
+    BOOST_CHECK_EQUAL(header.contentLength, expected.contentLength);
+    BOOST_CHECK_EQUAL(header.isChunked, expected.isChunked);
+    BOOST_CHECK(header.headers == expected.headers);
+    BOOST_CHECK_EQUAL(header.queryParams.size(), expected.queryParams.size());
+    for (unsigned i = 0;  i < header.queryParams.size();  ++i) {
+        BOOST_CHECK_EQUAL(header.queryParams[i].first,
+                          expected.queryParams[i].first);
+        BOOST_CHECK_EQUAL(header.queryParams[i].second,
+                          expected.queryParams[i].second);
+    }
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(test_http_request_parser_same_as_header)
+{
+    Datacratic::HttpHeader expected;
+    expected.parse(request);
+
+    /* one byte at a time must give the same result as all at once */
+    for (size_t step: { request.size(), (size_t)1, (size_t)7 }) {
+        Datacratic::HttpRequestParser parser;
+        size_t available = 0;
+        bool done = false;
+        while (!done && available < request.size()) {
+            available = std::min(available + step, request.size());
+            done = parser.feed(request.c_str(), available);
+        }
+        BOOST_CHECK(done);
+        BOOST_CHECK_EQUAL(parser.headerLength(), request.size() - 11);
+        BOOST_CHECK_EQUAL(parser.contentLength(), 11);
+
+        Datacratic::HttpRequestParser::Span value;
+        BOOST_CHECK(parser.findField(request.c_str(), "x-openrtb-version",
+                                     value));
+        BOOST_CHECK_EQUAL(value.toString(request.c_str()), "2.2");
+        BOOST_CHECK(!parser.findField(request.c_str(), "cookie", value));
+
+        Datacratic::HttpHeader header;
+        parser.fillHeader(request.c_str(), header);
+        checkSameHeader(header, expected);
+        BOOST_CHECK_EQUAL(header.getHeader("host"), "localhost");
+        BOOST_CHECK_EQUAL(header.queryParams.getValue("x"), "Ab");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_http_request_parser_many_fields)
+{
+    std::string text = "GET / HTTP/1.1\r\n";
+    for (int i = 0;  i < 100;  ++i)
+        text += "X-Field-" + std::to_string(i) + ": "
+            + std::to_string(i) + "\r\n";
+    text += "\r\n";
+
+    Datacratic::HttpRequestParser parser;
+    BOOST_CHECK(parser.feed(text.c_str(), text.size()));
+    BOOST_CHECK_EQUAL(parser.numFields(), 100);
+    BOOST_CHECK_EQUAL(parser.field(99).value.toString(text.c_str()), "99");
+
+    Datacratic::HttpHeader header;
+    parser.fillHeader(text.c_str(), header);
+    BOOST_CHECK_EQUAL(header.getHeader("x-field-50"), "50");
+    BOOST_CHECK_EQUAL(header.contentLength, -1);
+}
+
+BOOST_AUTO_TEST_CASE(test_http_request_parser_errors)
+{
+    auto parses = [] (const std::string & text, size_t maxLength = 16384)
+        {
+            Datacratic::HttpRequestParser parser(maxLength);
+            return parser.feed(text.c_str(), text.size());
+        };
+
+    BOOST_CHECK(!parses("GET / HTTP/1.1\r\nHost: x\r\n"));
+    BOOST_CHECK_THROW(parses("GET /\r\n\r\n"), ML::Exception);
+    BOOST_CHECK_THROW(parses("GET / HTTP/1.1\r\nHost\r\n\r\n"),
+                      ML::Exception);
+    BOOST_CHECK_THROW(parses("GET / HTTP/1.1\r\nContent-Length: x\r\n\r\n"),
+                      ML::Exception);
+    BOOST_CHECK_THROW(parses("GET / HTTP/1.1\r\n"
+                             "Transfer-Encoding: gzip\r\n\r\n"),
+                      ML::Exception);
+    BOOST_CHECK_THROW(parses("GET / HTTP/1.1\r\n"
+                             "X-Long: " + std::string(100, 'x'), 64),
+                      ML::Exception);
+}
+
+
+/* header fields */
+
+BOOST_AUTO_TEST_CASE(test_http_header_fields)
+{
+    using Datacratic::HttpHeaderFields;
+
+    HttpHeaderFields fields;
+    fields.set("Host", "a");
+    fields.set("X-Custom", "1");
+    fields.set("HOST", "b");
+    fields.set("x-custom", "2");
+    for (int i = 0;  i < 40;  ++i)
+        fields.set("X-Field-" + std::to_string(i), std::to_string(i));
+    BOOST_CHECK_EQUAL(fields.size(), 42);
+
+    /* lookups ignore case, and known names are interned */
+    BOOST_CHECK_EQUAL(HttpHeaderFields::knownField("X-Forwarded-For", 15),
+                      HttpHeaderFields::X_FORWARDED_FOR);
+    BOOST_CHECK_EQUAL(HttpHeaderFields::knownField("x-custom", 8),
+                      HttpHeaderFields::UNKNOWN_FIELD);
+    BOOST_CHECK_EQUAL(HttpHeaderFields::knownField("Accept-Encodinx", 15),
+                      HttpHeaderFields::UNKNOWN_FIELD);
+    for (int i = 0;  i < HttpHeaderFields::NUM_KNOWN_FIELDS;  ++i) {
+        auto field = HttpHeaderFields::KnownField(i);
+        std::string name = HttpHeaderFields::knownFieldName(field);
+        BOOST_CHECK_EQUAL(HttpHeaderFields::knownField(name.c_str(),
+                                                       name.size()),
+                          field);
+        for (char & c: name)
+            c = toupper(c);
+        BOOST_CHECK_EQUAL(HttpHeaderFields::knownField(name.c_str(),
+                                                       name.size()),
+                          field);
+    }
+
+    Datacratic::HttpHeader header;
+    header.headers = fields;
+    BOOST_CHECK_EQUAL(header.getHeader(HttpHeaderFields::HOST), "b");
+    BOOST_CHECK_EQUAL(header.getHeader("hOsT"), "b");
+    BOOST_CHECK_EQUAL(header.getHeader("X-CUSTOM"), "2");
+    BOOST_CHECK_EQUAL(header.getHeader("x-field-39"), "39");
+    BOOST_CHECK_EQUAL(header.tryGetHeader("x-field-40"), "");
+    BOOST_CHECK_THROW(header.getHeader(HttpHeaderFields::COOKIE),
+                      ML::Exception);
+
+    /* listed in order with lowercased names */
+    auto it = fields.begin();
+    BOOST_CHECK_EQUAL((*it).first, "host");
+    BOOST_CHECK_EQUAL((*it).second, "b");
+    ++it;
+    BOOST_CHECK_EQUAL(it->first, "x-custom");
+    BOOST_CHECK_EQUAL(it->second, "2");
+
+    HttpHeaderFields other;
+    BOOST_CHECK(other != fields);
+    other.swap(header.headers);
+    BOOST_CHECK(other == fields);
+    BOOST_CHECK(header.headers.empty());
+}
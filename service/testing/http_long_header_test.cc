@@ -39,6 +39,7 @@ BOOST_AUTO_TEST_CASE( test_accept_speed )
         TestHandler(string & error)
             : bytesDone(0), error(error)
         {
+            overridesStringData = true;
         }
 
         int bytesDone;
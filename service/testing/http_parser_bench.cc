@@ -0,0 +1,97 @@
+/* http_parser_bench
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Compares HttpHeader::parse() with HttpRequestParser, for requests that
+   arrive whole and in small fragments.
+*/
+
+#include <iostream>
+#include <string>
+
+#include "jml/arch/timers.h"
+#include "soa/service/http_header.h"
+#include "soa/service/http_request_parser.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+const string request
+    = "POST /auctions?exchange=test&format=json HTTP/1.1\r\n"
+      "Host: bidder.example.com:9950\r\n"
+      "User-Agent: exchange-client/2.1\r\n"
+      "Accept: */*\r\n"
+      "Accept-Encoding: gzip, deflate\r\n"
+      "Content-Type: application/json\r\n"
+      "X-Openrtb-Version: 2.2\r\n"
+      "Connection: Keep-Alive\r\n"
+      "Content-Length: 2\r\n"
+      "\r\n"
+      "{}";
+
+void report(const string & name, int numRequests, const ML::Timer & timer)
+{
+    double elapsed = timer.elapsed_wall();
+    cerr << name << ": " << numRequests / elapsed << " requests/s, "
+         << elapsed * 1e9 / numRequests << "ns/request" << endl;
+}
+
+/* What the connection handler did before: accumulate the header text and
+   look for the end of the header from its start after each fragment */
+void benchHttpHeader(int numRequests, size_t fragmentSize)
+{
+    ML::Timer timer;
+    for (int i = 0;  i < numRequests;  ++i) {
+        string headerText;
+        for (size_t start = 0;  start < request.size();
+             start += fragmentSize) {
+            headerText.append(request, start, fragmentSize);
+            auto pos = headerText.find("\r\n\r\n");
+            if (pos != string::npos) {
+                headerText.resize(pos + 4);
+                break;
+            }
+        }
+        HttpHeader header;
+        header.parse(headerText);
+    }
+    report("HttpHeader::parse, fragments of "
+           + to_string(fragmentSize), numRequests, timer);
+}
+
+void benchRequestParser(int numRequests, size_t fragmentSize,
+                        bool fill)
+{
+    HttpRequestParser parser;
+    HttpHeader header;
+    ML::Timer timer;
+    for (int i = 0;  i < numRequests;  ++i) {
+        parser.reset();
+        size_t available = 0;
+        while (!parser.feed(request.c_str(), available))
+            available = std::min(available + fragmentSize, request.size());
+        if (fill)
+            parser.fillHeader(request.c_str(), header);
+    }
+    report(string("HttpRequestParser") + (fill ? " + fillHeader" : "")
+           + ", fragments of " + to_string(fragmentSize),
+           numRequests, timer);
+}
+
+} // file scope
+
+
+int main(int argc, char ** argv)
+{
+    int numRequests = argc > 1 ? stoi(argv[1]) : 1000000;
+
+    for (size_t fragmentSize: { request.size(), (size_t)16 }) {
+        benchHttpHeader(numRequests, fragmentSize);
+        benchRequestParser(numRequests, fragmentSize, false);
+        benchRequestParser(numRequests, fragmentSize, true);
+    }
+
+    return 0;
+}
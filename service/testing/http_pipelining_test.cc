@@ -0,0 +1,269 @@
+/* http_pipelining_test.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Test that requests pipelined on one connection are answered in order,
+   and that the handlers are reused.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "jml/utils/guard.h"
+#include "jml/utils/testing/watchdog.h"
+#include "soa/service/service_base.h"
+
+#include "test_http_services.h"
+
+using namespace std;
+using namespace ML;
+using namespace Datacratic;
+
+
+namespace {
+
+/* Write the requests in a single write and return everything received until
+   the last response is in */
+string
+pipeline(int port, const string & requests, const string & lastBody)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s == -1)
+        throw ML::Exception(errno, "socket");
+    Call_Guard closeSocket([&] () { close(s); });
+
+    struct sockaddr_in addr
+        = { AF_INET, htons(port), { htonl(INADDR_LOOPBACK) } };
+    if (connect(s, reinterpret_cast<const sockaddr *>(&addr),
+                sizeof(addr)) == -1)
+        throw ML::Exception(errno, "connect");
+
+    if (write(s, requests.c_str(), requests.size())
+        != (ssize_t)requests.size())
+        throw ML::Exception(errno, "write");
+
+    string received;
+    while (received.find(lastBody) == string::npos) {
+        char buf[4096];
+        ssize_t res = read(s, buf, sizeof(buf));
+        if (res == -1)
+            throw ML::Exception(errno, "read");
+        if (res == 0)
+            break;
+        received.append(buf, res);
+    }
+
+    return received;
+}
+
+void
+testPipelining(int maxPipelinedRequests,
+               Epoller::Backend backend = Epoller::EPOLL)
+{
+    Watchdog watchdog(10.0);
+
+    auto proxies = make_shared<ServiceProxies>();
+    HttpGetService service(proxies);
+    service.setPollerBackend(backend);
+    service.maxPipelinedRequests = maxPipelinedRequests;
+    service.addResponse("GET", "/first", 200, "body-of-first");
+    service.addResponse("GET", "/second", 200, "body-of-second");
+    service.addResponse("GET", "/third", 200, "body-of-third");
+    service.start();
+
+    string requests;
+    for (string resource: { "/first", "/second", "/third" })
+        requests += "GET " + resource + " HTTP/1.1\r\n"
+                    "Host: localhost\r\n"
+                    "\r\n";
+
+    string received = pipeline(service.port(), requests, "body-of-third");
+
+    size_t first = received.find("body-of-first");
+    size_t second = received.find("body-of-second");
+    size_t third = received.find("body-of-third");
+    BOOST_CHECK_NE(first, string::npos);
+    BOOST_CHECK_NE(second, string::npos);
+    BOOST_CHECK_NE(third, string::npos);
+    BOOST_CHECK_LT(first, second);
+    BOOST_CHECK_LT(second, third);
+    BOOST_CHECK_EQUAL(service.numReqs.load(), 3);
+
+    // One handler per request, which come back from the handler pool
+    if (maxPipelinedRequests == 1)
+        BOOST_CHECK_GT(service.handlerPool->numReused, 0U);
+}
+
+/* Keeps the requests of its connection and leaves them to be answered by
+   another thread once the three of them are in */
+struct DeferredHandler : public HttpConnectionHandler {
+    DeferredHandler(std::atomic<DeferredHandler *> & ready)
+        : ready(ready)
+    {
+    }
+
+    virtual void handleHttpPayload(const HttpHeader & header,
+                                   const string & payload)
+    {
+        requests.push_back(make_pair(currentRequest, header.resource));
+        if (requests.size() == 3)
+            ready = this;
+    }
+
+    std::atomic<DeferredHandler *> & ready;
+    vector<pair<uint64_t, string> > requests;
+};
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_pipelining_one_handler_per_request )
+{
+    testPipelining(1);
+}
+
+BOOST_AUTO_TEST_CASE( test_pipelining_dispatched_together )
+{
+    testPipelining(2);
+    testPipelining(16);
+}
+
+BOOST_AUTO_TEST_CASE( test_pipelining_answered_out_of_order )
+{
+    Watchdog watchdog(10.0);
+
+    std::atomic<DeferredHandler *> ready(nullptr);
+
+    HttpEndpoint endpoint("deferred");
+    endpoint.maxPipelinedRequests = 16;
+    endpoint.handlerFactory = [&] ()
+        {
+            return std::make_shared<DeferredHandler>(ready);
+        };
+    int port = endpoint.init(PortRange(), "127.0.0.1", 1);
+    Call_Guard shutdownEndpoint([&] () { endpoint.shutdown(); });
+
+    /* the last request is answered first, from another thread */
+    std::thread answerer([&] ()
+        {
+            while (!ready)
+                ::usleep(1000);
+            DeferredHandler * handler = ready;
+            auto requests = handler->requests;
+            for (auto it = requests.rbegin();  it != requests.rend();  ++it) {
+                handler->putResponseOnWire
+                    (it->first,
+                     HttpResponse(200, "text/plain",
+                                  "body-of-" + it->second.substr(1)));
+                ::usleep(10000);
+            }
+        });
+
+    string requests;
+    for (string resource: { "/first", "/second", "/third" })
+        requests += "GET " + resource + " HTTP/1.1\r\n"
+                    "Host: localhost\r\n"
+                    "\r\n";
+
+    string received = pipeline(port, requests, "body-of-third");
+    answerer.join();
+
+    /* the first request's answer was the last to be ready, so the others
+       waited for it */
+    size_t first = received.find("body-of-first");
+    size_t second = received.find("body-of-second");
+    size_t third = received.find("body-of-third");
+    BOOST_CHECK_NE(first, string::npos);
+    BOOST_CHECK_NE(second, string::npos);
+    BOOST_CHECK_NE(third, string::npos);
+    BOOST_CHECK_LT(first, second);
+    BOOST_CHECK_LT(second, third);
+}
+
+BOOST_AUTO_TEST_CASE( test_pipelining_io_uring )
+{
+    /* falls back to epoll where io_uring isn't supported */
+    testPipelining(1, Epoller::IO_URING);
+    testPipelining(16, Epoller::IO_URING);
+}
+
+BOOST_AUTO_TEST_CASE( test_pipelining_after_chunked_request )
+{
+    Watchdog watchdog(10.0);
+
+    auto proxies = make_shared<ServiceProxies>();
+    HttpGetService service(proxies);
+    service.addResponse("GET", "/first", 200, "body-of-first");
+    service.addResponse("GET", "/second", 200, "body-of-second");
+    service.start();
+
+    /* the empty last chunk of the first request is its payload; the second
+       request must be left for the next handler */
+    string requests
+        = "GET /first HTTP/1.1\r\n"
+          "Host: localhost\r\n"
+          "Transfer-Encoding: chunked\r\n"
+          "\r\n"
+          "0\r\n"
+          "\r\n"
+          "GET /second HTTP/1.1\r\n"
+          "Host: localhost\r\n"
+          "\r\n";
+
+    string received = pipeline(service.port(), requests, "body-of-second");
+
+    size_t first = received.find("body-of-first");
+    size_t second = received.find("body-of-second");
+    BOOST_CHECK_NE(first, string::npos);
+    BOOST_CHECK_NE(second, string::npos);
+    BOOST_CHECK_LT(first, second);
+    BOOST_CHECK_EQUAL(service.numReqs.load(), 2);
+}
+
+BOOST_AUTO_TEST_CASE( test_pipelining_many_requests )
+{
+    Watchdog watchdog(30.0);
+
+    auto proxies = make_shared<ServiceProxies>();
+    HttpGetService service(proxies);
+    service.addResponse("GET", "/first", 200, "body-of-first");
+    service.addResponse("GET", "/last", 200, "body-of-last");
+    service.start();
+
+    /* each request is picked up from the read buffer by a new handler,
+       which mustn't nest in the previous one's call stack */
+    int numRequests = 1000;
+    string requests;
+    for (int i = 0;  i < numRequests;  ++i)
+        requests += string("GET ")
+            + (i == numRequests - 1 ? "/last" : "/first")
+            + " HTTP/1.1\r\n"
+              "Host: localhost\r\n"
+              "\r\n";
+
+    string received = pipeline(service.port(), requests, "body-of-last");
+
+    BOOST_CHECK_NE(received.find("body-of-last"), string::npos);
+    BOOST_CHECK_EQUAL(service.numReqs.load(), numRequests);
+}
+
+BOOST_AUTO_TEST_CASE( test_handler_pool_lists_per_pool )
+{
+    /* a pool made where a previous one was mustn't hand out the handlers
+       that the previous one deleted */
+    for (int i = 0;  i < 3;  ++i) {
+        auto pool = make_shared<HttpHandlerPool>();
+        pool->get<HttpConnectionHandler>().reset();
+        auto handler = pool->get<HttpConnectionHandler>();
+        BOOST_CHECK_EQUAL(pool->numCreated, 1U);
+        BOOST_CHECK_EQUAL(pool->numReused, 1U);
+        BOOST_CHECK_EQUAL(pool->numReleased, 1U);
+    }
+}
@@ -89,6 +89,48 @@ BOOST_AUTO_TEST_CASE( test_message_channel )
     }
 }
 
+BOOST_AUTO_TEST_CASE( test_message_channel_batches )
+{
+    ML::Watchdog watchdog(10.0);
+
+    TypedMessageSink<int> sink(1000);
+    sink.setBatchLimits(64, 0.001);
+
+    const int numPushThreads(2);
+    const int numMessages(100000);
+
+    std::atomic<int> numReceived(0);
+    sink.onBatch = [&] (std::vector<int> & messages)
+        {
+            BOOST_REQUIRE_LE(messages.size(), 64);
+            numReceived += messages.size();
+        };
+
+    auto pushThread = [&] ()
+        {
+            for (unsigned i = 0;  i < numMessages;  ++i)
+                sink.push(i);
+        };
+
+    std::vector<std::thread> pushThreads;
+    for (unsigned i = 0;  i < numPushThreads;  ++i)
+        pushThreads.emplace_back(pushThread);
+
+    while (numReceived < numPushThreads * numMessages)
+        sink.processOne();
+
+    for (auto & t: pushThreads)
+        t.join();
+
+    BOOST_CHECK(!sink.processOne());
+
+    const MessageBatchStats & stats = sink.batchStats();
+    cerr << "batches: " << stats.numBatches
+         << "; average size: " << stats.averageBatchSize() << endl;
+    BOOST_CHECK_EQUAL(stats.numMessages, numPushThreads * numMessages);
+    BOOST_CHECK_LE(stats.maxBatchSize, 64);
+}
+
 namespace Datacratic {
 
 BOOST_AUTO_TEST_CASE( test_typed_message_queue )
@@ -102,51 +144,119 @@ BOOST_AUTO_TEST_CASE( test_typed_message_queue )
         TypedMessageQueue<string> queue(onNotify, 5);
 
         /* testing constructor */
-        BOOST_CHECK_EQUAL(queue.maxMessages_, 5);
-        BOOST_CHECK_EQUAL(queue.pending_, false);
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 0);
+        BOOST_CHECK_EQUAL(queue.maxMessages_.load(), 5);
+        BOOST_CHECK_EQUAL(queue.pending_.load(), false);
+        BOOST_CHECK_EQUAL(queue.size(), 0);
 
         /* push */
         queue.push_back("first message");
-        BOOST_CHECK_EQUAL(queue.pending_, true);
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 1);
-        BOOST_CHECK_EQUAL(queue.queue_.front(), "first message");
+        BOOST_CHECK_EQUAL(queue.pending_.load(), true);
+        BOOST_CHECK_EQUAL(queue.size(), 1);
         BOOST_CHECK_EQUAL(numNotifications, 0);
 
         /* process one */
         queue.processOne();
         /* only "pop_front" affects "pending_" */
-        BOOST_CHECK_EQUAL(queue.pending_, true);
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 1);
+        BOOST_CHECK_EQUAL(queue.pending_.load(), true);
+        BOOST_CHECK_EQUAL(queue.size(), 1);
         BOOST_CHECK_EQUAL(numNotifications, 1);
 
-        queue.queue_.pop();
         queue.processOne();
-        /* only "pop_front" affects "pending_" */
-        BOOST_CHECK_EQUAL(queue.pending_, true);
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 0);
+        BOOST_CHECK_EQUAL(queue.pending_.load(), true);
         BOOST_CHECK_EQUAL(numNotifications, 2);
 
         /* pop front 1: a single element */
-        queue.queue_.emplace("first message");
         auto msgs = queue.pop_front(1);
         BOOST_CHECK_EQUAL(msgs.size(), 1);
         BOOST_CHECK_EQUAL(msgs[0], "first message");
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 0);
+        BOOST_CHECK_EQUAL(queue.size(), 0);
+        BOOST_CHECK_EQUAL(queue.pending_.load(), false);
 
         /* pop front 2: too many elements requested */
-        queue.queue_.emplace("blabla 1");
-        queue.queue_.emplace("blabla 2");
+        queue.push_back("blabla 1");
+        queue.push_back("blabla 2");
         msgs = queue.pop_front(10);
         BOOST_CHECK_EQUAL(msgs.size(), 2);
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 0);
+        BOOST_CHECK_EQUAL(msgs[0], "blabla 1");
+        BOOST_CHECK_EQUAL(queue.size(), 0);
 
         /* pop front 3: all elements requested */
-        queue.queue_.emplace("blabla 1");
-        queue.queue_.emplace("blabla 2");
+        queue.push_back("blabla 1");
+        queue.push_back("blabla 2");
         msgs = queue.pop_front(0);
         BOOST_CHECK_EQUAL(msgs.size(), 2);
-        BOOST_CHECK_EQUAL(queue.queue_.size(), 0);
+        BOOST_CHECK_EQUAL(queue.size(), 0);
+
+        /* pop front 4: into a caller-owned vector */
+        queue.push_back("blabla 1");
+        queue.push_back("blabla 2");
+        msgs.clear();
+        BOOST_CHECK_EQUAL(queue.pop_front(msgs, 1), 1);
+        BOOST_CHECK_EQUAL(queue.pop_front(msgs, 0), 1);
+        BOOST_CHECK_EQUAL(msgs.size(), 2);
+        BOOST_CHECK_EQUAL(msgs[1], "blabla 2");
+
+        /* pop front 5: into a caller-owned array, with messages pushed
+           between two pops remaining in order */
+        queue.push_back("blabla 1");
+        queue.push_back("blabla 2");
+        string buffer[2];
+        BOOST_CHECK_EQUAL(queue.pop_front(buffer, 1), 1);
+        queue.push_back("blabla 3");
+        BOOST_CHECK_EQUAL(queue.pop_front(buffer, 2), 2);
+        BOOST_CHECK_EQUAL(buffer[0], "blabla 2");
+        BOOST_CHECK_EQUAL(buffer[1], "blabla 3");
+
+        /* bound */
+        for (int i = 0; i < 5; i++) {
+            BOOST_CHECK(queue.push_back("message " + to_string(i)));
+        }
+        BOOST_CHECK(!queue.push_back("one too many"));
+        queue.setMaxMessages(6);
+        BOOST_CHECK(queue.push_back("not too many anymore"));
+        BOOST_CHECK_EQUAL(queue.pop_front(0).size(), 6);
+    }
+
+    /* batch consumption */
+    {
+        TypedMessageQueue<string> queue;
+        vector<size_t> batchSizes;
+        queue.setOnBatch([&] (vector<string> & msgs) {
+                batchSizes.push_back(msgs.size());
+            }, 2);
+
+        for (int i = 0; i < 5; i++) {
+            queue.push_back("message " + to_string(i));
+        }
+
+        /* a single batch per invocation, after which the queue signals
+           itself since it is not empty */
+        queue.processOne();
+        BOOST_CHECK_EQUAL(batchSizes.size(), 1);
+        BOOST_CHECK_EQUAL(queue.size(), 3);
+        BOOST_CHECK_EQUAL(queue.pending_.load(), true);
+        BOOST_CHECK(queue.wakeup_.tryRead());
+
+        queue.processOne();
+        queue.processOne();
+        BOOST_CHECK_EQUAL(batchSizes.size(), 3);
+        BOOST_CHECK_EQUAL(batchSizes[2], 1);
+        BOOST_CHECK_EQUAL(queue.pending_.load(), false);
+        BOOST_CHECK(!queue.wakeup_.tryRead());
+
+        BOOST_CHECK_EQUAL(queue.batchStats().numMessages, 5);
+        BOOST_CHECK_EQUAL(queue.batchStats().maxBatchSize, 2);
+    }
+
+    /* nodes are recycled from one message to the next */
+    {
+        TypedMessageQueue<string> queue;
+        for (int i = 0; i < 1000; i++) {
+            queue.push_back("message " + to_string(i));
+            queue.push_back("message " + to_string(i));
+            BOOST_CHECK_EQUAL(queue.pop_front(0).size(), 2);
+        }
+        BOOST_CHECK_LE(queue.nodesAllocated(), 2);
     }
 
     /* multiple producers and a MessageLoop */
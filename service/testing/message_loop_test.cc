@@ -2,6 +2,9 @@
 #define BOOST_TEST_DYN_LINK
 
 #include <iostream>
+#include <atomic>
+#include <mutex>
+#include <set>
 
 #include <boost/test/unit_test.hpp>
 
@@ -102,3 +105,306 @@ BOOST_AUTO_TEST_CASE( test_addSource_after_before_start )
         }
     }
 }
+
+/* This test ensures that the sources of a multi-threaded loop are spread
+ * over its threads and that single threaded sources are only ever processed
+ * by one of them. */
+BOOST_AUTO_TEST_CASE( test_multi_threaded_loop )
+{
+    ML::Watchdog wd(30);
+    const int numSources(16);
+    const int numMessages(1000);
+
+    MessageLoop loop(4);
+    BOOST_CHECK_EQUAL(loop.numThreads(), 4);
+
+    typedef shared_ptr<TypedMessageSink<int> > TestSource;
+    vector<TestSource> sources;
+    vector<set<std::thread::id> > sourceThreads(numSources);
+    set<std::thread::id> allThreads;
+    std::mutex threadsLock;
+    std::atomic<int> numReceived(0);
+
+    for (int i = 0; i < numSources; i++) {
+        TestSource source(new TypedMessageSink<int>(numMessages));
+        source->onEvent = [&, i] (int && message) {
+            std::unique_lock<std::mutex> guard(threadsLock);
+            sourceThreads[i].insert(this_thread::get_id());
+            allThreads.insert(this_thread::get_id());
+            numReceived++;
+        };
+        sources.push_back(source);
+        loop.addSource("source", source);
+    }
+
+    /* a source that any of the threads can process */
+    std::atomic<int> numTimeouts(0);
+    auto periodic = make_shared<PeriodicEventSource>(
+            0.01, [&] (uint64_t) { numTimeouts++; }, false);
+    loop.addSource("periodic", periodic);
+
+    loop.start();
+
+    for (auto & source: sources) {
+        source->waitConnectionState(AsyncEventSource::CONNECTED);
+    }
+    periodic->waitConnectionState(AsyncEventSource::CONNECTED);
+
+    for (int i = 0; i < numMessages; i++) {
+        for (auto & source: sources) {
+            source->push(i);
+        }
+    }
+
+    while (numReceived < numSources * numMessages) {
+        ML::sleep(0.01);
+    }
+    while (numTimeouts < 10) {
+        ML::sleep(0.01);
+    }
+
+    for (auto & threads: sourceThreads) {
+        BOOST_CHECK_EQUAL(threads.size(), 1);
+    }
+    BOOST_CHECK_EQUAL(allThreads.size(), 4);
+
+    /* cleanup */
+    for (auto & source: sources) {
+        loop.removeSource(source.get());
+    }
+    loop.removeSource(periodic.get());
+    for (auto & source: sources) {
+        source->waitConnectionState(AsyncEventSource::DISCONNECTED);
+    }
+    periodic->waitConnectionState(AsyncEventSource::DISCONNECTED);
+}
+
+/* This test ensures that a busy-polling loop processes its messages and
+ * stops spinning once it is idle. */
+BOOST_AUTO_TEST_CASE( test_busy_poll )
+{
+    ML::Watchdog wd(30);
+    const int numMessages(1000);
+
+    MessageLoop loop;
+    loop.setBusyPoll(0.001);
+
+    TypedMessageSink<int> source(numMessages);
+    std::atomic<int> numReceived(0);
+    source.onEvent = [&] (int && message) {
+        numReceived++;
+    };
+    loop.addSource("source", source);
+    loop.start();
+    source.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    for (int i = 0; i < numMessages; i++) {
+        source.push(i);
+        if (i % 10 == 0) {
+            ML::sleep(0.0001);
+        }
+    }
+    while (numReceived < numMessages) {
+        ML::sleep(0.01);
+    }
+
+    double spinSeconds = loop.totalSpinSeconds();
+    cerr << "spin: " << spinSeconds
+         << " sleep: " << loop.totalSleepSeconds() << endl;
+    BOOST_CHECK_GT(spinSeconds, 0.0);
+
+    /* once idle, the loop gives up spinning after a handful of attempts */
+    ML::sleep(1.0);
+    double idleSpinSeconds = loop.totalSpinSeconds() - spinSeconds;
+    cerr << "idle spin: " << idleSpinSeconds << endl;
+    BOOST_CHECK_LT(idleSpinSeconds, 0.01);
+
+    loop.removeSourceSync(&source);
+}
+
+BOOST_AUTO_TEST_CASE( test_source_stats )
+{
+    ML::Watchdog wd(30);
+    const int numMessages(100);
+
+    MessageLoop loop;
+
+    TypedMessageSink<int> source(numMessages);
+    std::atomic<int> numReceived(0);
+    source.onEvent = [&] (int && message) {
+        ML::sleep(0.0001);
+        numReceived++;
+    };
+    loop.addSource("source", source);
+    loop.start();
+    source.waitConnectionState(AsyncEventSource::CONNECTED);
+
+    for (int i = 0; i < numMessages; i++) {
+        source.push(i);
+        ML::sleep(0.001);
+    }
+    while (numReceived < numMessages) {
+        ML::sleep(0.01);
+    }
+
+    MessageLoopSourceStats stats;
+    bool foundTimers(false);
+    for (auto & sourceStats: loop.sourceStats()) {
+        if (sourceStats.name == "source") {
+            stats = sourceStats;
+        }
+        foundTimers = foundTimers || sourceStats.name == "_timers";
+    }
+    BOOST_CHECK(foundTimers);
+
+    cerr << "calls: " << stats.numCalls
+         << " busy: " << stats.busySeconds
+         << " median call: " << stats.callTimes.quantile(0.5)
+         << " wakeups: " << stats.wakeupLags.count()
+         << " p99 lag: " << stats.wakeupLags.quantile(0.99) << endl;
+
+    BOOST_CHECK_GE(stats.numCalls, numMessages / 2);
+    BOOST_CHECK_EQUAL(stats.callTimes.count(), stats.numCalls);
+    BOOST_CHECK_GE(stats.busySeconds, numMessages * 0.0001);
+    BOOST_CHECK_GT(stats.wakeupLags.count(), 0);
+    BOOST_CHECK_LE(stats.wakeupLags.count(), numMessages);
+    BOOST_CHECK_GT(stats.wakeupLags.quantile(0.99), 0.0);
+
+    loop.removeSourceSync(&source);
+    for (auto & sourceStats: loop.sourceStats()) {
+        BOOST_CHECK_NE(sourceStats.name, "source");
+    }
+}
+
+/* Periodic jobs run off a timer wheel of their priority, which shows up in
+ * the stats of the sources. */
+BOOST_AUTO_TEST_CASE( test_periodic_priority )
+{
+    ML::Watchdog wd(30);
+
+    MessageLoop loop;
+    loop.start();
+
+    std::atomic<int> numDefault(0), numLow(0);
+    loop.addPeriodic("default", 0.01, [&] (uint64_t) { ++numDefault; },
+                     MessageLoop::TimersPriority);
+    loop.addPeriodic("low", 0.01, [&] (uint64_t) { ++numLow; }, -1);
+
+    while (numDefault < 3 || numLow < 3) {
+        ML::sleep(0.01);
+    }
+
+    bool foundLow(false);
+    for (auto & sourceStats: loop.sourceStats()) {
+        foundLow = foundLow || sourceStats.name == "_timers-1";
+    }
+    BOOST_CHECK(foundLow);
+}
+
+/* The loop isn't started in this test: its sources are run by calling
+ * processOne(), one round at a time. */
+BOOST_AUTO_TEST_CASE( test_priority_scheduling )
+{
+    ML::Watchdog wd(30);
+
+    MessageLoop loop;
+
+    string handled;
+    auto makeSource = [&] (const string & name) {
+        auto source = make_shared<TypedMessageSink<int> >(100);
+        source->onEvent = [&, name] (int && message) {
+            handled += name + " ";
+        };
+        return source;
+    };
+    auto low1 = makeSource("low1");
+    auto low2 = makeSource("low2");
+    auto high = makeSource("high");
+    loop.addSource("low1", low1);
+    loop.addSource("low2", low2);
+    loop.addSource("high", high, 5);
+    loop.processOne();
+    BOOST_CHECK(high->connectionState_ == AsyncEventSource::CONNECTED);
+
+    for (int i = 0;  i < 4;  ++i) {
+        low1->push(i);
+        low2->push(i);
+    }
+    high->push(0);
+    high->push(1);
+
+    /* the lower class waits until the higher one has no more to do */
+    handled.clear();
+    BOOST_CHECK(loop.processOne());
+    BOOST_CHECK_EQUAL(handled, "high ");
+
+    handled.clear();
+    BOOST_CHECK(loop.processOne());
+    BOOST_CHECK_EQUAL(handled.substr(0, 5), "high ");
+    BOOST_CHECK_EQUAL(handled.size(), 15);
+
+    /* within a class, each source gets a turn and they take turns at
+       being first */
+    set<string> firsts;
+    for (int i = 0;  i < 3;  ++i) {
+        handled.clear();
+        loop.processOne();
+        BOOST_CHECK_EQUAL(handled.size(), 10);
+        firsts.insert(handled.substr(0, 5));
+    }
+    BOOST_CHECK_EQUAL(firsts.size(), 2);
+
+    /* work for a higher class preempts the lower one on the next round */
+    for (int i = 0;  i < 4;  ++i)
+        low1->push(i);
+    high->push(2);
+    handled.clear();
+    loop.processOne();
+    BOOST_CHECK_EQUAL(handled, "high low1 ");
+    while (loop.processOne())
+        ;
+
+    for (auto & stats: loop.sourceStats()) {
+        if (stats.name == "high")
+            BOOST_CHECK_EQUAL(stats.priority, 5);
+        else if (stats.name == "_timers")
+            BOOST_CHECK_EQUAL(stats.priority, MessageLoop::TimersPriority);
+        else if (stats.name == "low1") {
+            BOOST_CHECK_EQUAL(stats.priority, 0);
+            BOOST_CHECK_GT(stats.numBudgetExhausted, 0);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_source_budget )
+{
+    ML::Watchdog wd(30);
+
+    MessageLoop loop;
+    loop.setSourceBudget(4);
+
+    TypedMessageSink<int> source(100);
+    int numReceived(0);
+    source.onEvent = [&] (int && message) {
+        numReceived++;
+    };
+    loop.addSource("source", source);
+    loop.processOne();
+
+    for (int i = 0;  i < 10;  ++i)
+        source.push(i);
+
+    /* 4 calls per turn, handling one message each */
+    BOOST_CHECK(loop.processOne());
+    BOOST_CHECK_EQUAL(numReceived, 4);
+    BOOST_CHECK(loop.processOne());
+    BOOST_CHECK_EQUAL(numReceived, 8);
+    BOOST_CHECK(!loop.processOne());
+    BOOST_CHECK_EQUAL(numReceived, 10);
+
+    for (auto & stats: loop.sourceStats()) {
+        if (stats.name == "source") {
+            BOOST_CHECK_EQUAL(stats.numBudgetExhausted, 2);
+        }
+    }
+}
@@ -2,6 +2,7 @@ $(eval $(call library,mongo_tmp_server,mongo_temporary_server.cc, services))
 
 $(eval $(call test,epoll_test,services,boost))
 $(eval $(call test,epoll_wait_test,services,boost manual))
+$(eval $(call test,epoller_test,services,boost))
 
 $(eval $(call test,named_endpoint_test,services,boost manual))
 $(eval $(call test,zmq_named_pub_sub_test,services,boost manual))
@@ -31,9 +32,12 @@ $(eval $(call test,endpoint_periodic_test,endpoint,boost))
 $(eval $(call test,endpoint_closed_connection_test,endpoint,boost))
 $(eval $(call test,http_long_header_test,endpoint,boost manual))
 $(eval $(call test,http_header_test,endpoint,boost manual))
+$(eval $(call program,http_parser_bench,services))
 $(eval $(call test,service_proxies_test,endpoint,boost manual))
 
 $(eval $(call test,message_loop_test,services,boost))
+$(eval $(call test,timer_wheel_test,services,boost))
+$(eval $(call test,thread_placement_test,services,boost))
 
 $(eval $(call program,runner_test_helper,utils))
 $(eval $(call test,runner_test,services,boost))
@@ -52,6 +56,8 @@ $(eval $(call program,async_writer_bench,services))
 $(eval $(call test,nsq_client_test,cloud,boost manual))
 
 $(eval $(call test,http_client_test,services test_services,boost))
+$(eval $(call test,http_pipelining_test,services test_services,boost))
+$(eval $(call test,fiber_test,services test_services,boost))
 $(eval $(call test,http_client_bench,boost_program_options services test_services,boost manual))
 
 $(eval $(call test,logs_test,services,boost))
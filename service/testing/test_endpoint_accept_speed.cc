@@ -27,18 +27,19 @@ using namespace std;
 using namespace ML;
 using namespace Datacratic;
 
-void runAcceptSpeedTest()
+void runAcceptSpeedTest(bool pollPerThread = false, int numThreads = 1)
 {
     string connectionError;
 
     PassiveEndpointT<SocketTransport> acceptor("acceptor");
+    acceptor.pollPerThread(pollPerThread);
     
     acceptor.onMakeNewHandler = [&] ()
         {
             return ML::make_std_sp(new PongConnectionHandler(connectionError));
         };
     
-    int port = acceptor.init();
+    int port = acceptor.init(PortRange(), "localhost", numThreads);
 
     cerr << "port = " << port << endl;
 
@@ -99,6 +100,11 @@ void runAcceptSpeedTest()
 
     BOOST_CHECK_EQUAL(acceptor.numConnections(), nconnections);
 
+    int numByHost = 0;
+    for (const auto & it: acceptor.numConnectionsByHost())
+        numByHost += it.second;
+    BOOST_CHECK_EQUAL(numByHost, nconnections);
+
     acceptor.closePeer();
 
     for (unsigned i = 0;  i < sockets.size();  ++i) {
@@ -128,3 +134,20 @@ BOOST_AUTO_TEST_CASE( test_accept_speed )
     BOOST_CHECK_EQUAL(ConnectionHandler::created,
                       ConnectionHandler::destroyed);
 }
+
+/* Each event thread accepts on its own SO_REUSEPORT socket and serves the
+   connections in its own epoll set. */
+BOOST_AUTO_TEST_CASE( test_accept_speed_poll_per_thread )
+{
+    BOOST_REQUIRE_EQUAL(TransportBase::created, TransportBase::destroyed);
+    BOOST_REQUIRE_EQUAL(ConnectionHandler::created,
+                        ConnectionHandler::destroyed);
+
+    Watchdog watchdog(50.0);
+
+    runAcceptSpeedTest(true, 4);
+
+    BOOST_CHECK_EQUAL(TransportBase::created, TransportBase::destroyed);
+    BOOST_CHECK_EQUAL(ConnectionHandler::created,
+                      ConnectionHandler::destroyed);
+}
@@ -30,7 +30,7 @@ shared_ptr<ConnectionHandler>
 HttpService::
 makeNewHandler()
 {
-    return make_shared<HttpTestConnHandler>();
+    return makePooledHandler<HttpTestConnHandler>();
 }
 
 void
@@ -0,0 +1,119 @@
+/* thread_placement_test.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Tests for the thread placement policies.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <sched.h>
+#include <thread>
+
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "soa/service/thread_placement.h"
+#include "soa/service/message_loop.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+vector<int> currentCpus()
+{
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    int res = sched_getaffinity(0, sizeof(cpuset), &cpuset);
+    BOOST_REQUIRE_EQUAL(res, 0);
+
+    vector<int> result;
+    for (int cpu = 0;  cpu < CPU_SETSIZE;  ++cpu)
+        if (CPU_ISSET(cpu, &cpuset))
+            result.push_back(cpu);
+    return result;
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_parse_cpu_list )
+{
+    BOOST_CHECK(ThreadPlacement::parseCpuList("").empty());
+    BOOST_CHECK_EQUAL(ThreadPlacement::parseCpuList("3").size(), 1);
+
+    vector<int> expected = { 0, 1, 2, 3, 8, 10, 11 };
+    vector<int> cpus = ThreadPlacement::parseCpuList("0-3,8,10-11\n");
+    BOOST_CHECK_EQUAL_COLLECTIONS(cpus.begin(), cpus.end(),
+                                  expected.begin(), expected.end());
+}
+
+BOOST_AUTO_TEST_CASE( test_policies )
+{
+    vector<int> online = ThreadPlacement::onlineCpus();
+    BOOST_REQUIRE(!online.empty());
+
+    ThreadPlacement none;
+    BOOST_CHECK(none.cpusFor(0).empty());
+
+    auto perCore = ThreadPlacement::onePerCore();
+    BOOST_CHECK_LE(perCore.cpus.size(), online.size());
+    BOOST_CHECK_EQUAL(perCore.cpusFor(0).size(), 1);
+    BOOST_CHECK_EQUAL(perCore.cpusFor(perCore.cpus.size())[0],
+                      perCore.cpusFor(0)[0]);
+    BOOST_CHECK_EQUAL(perCore.cpusFor(-1).size(), perCore.cpus.size());
+
+    auto set = ThreadPlacement::cpuSet({ online.back() });
+    BOOST_CHECK_EQUAL(set.cpusFor(5).size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_invalid_policies )
+{
+    BOOST_CHECK_THROW(ThreadPlacement::cpuSet({ -1 }), ML::Exception);
+    BOOST_CHECK_THROW(ThreadPlacement::cpuSet({ CPU_SETSIZE }), ML::Exception);
+    BOOST_CHECK_THROW(ThreadPlacement::onePerCore({ CPU_SETSIZE + 1 }),
+                      ML::Exception);
+    BOOST_CHECK_THROW(ThreadPlacement::numaNode(-1), ML::Exception);
+
+    /* a policy built by hand is checked before the threads start */
+    ThreadPlacement placement;
+    placement.mode = ThreadPlacement::CPU_SET;
+    placement.cpus = { CPU_SETSIZE };
+    MessageLoop loop;
+    BOOST_CHECK_THROW(loop.setThreadPlacement(placement), ML::Exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_apply )
+{
+    vector<int> online = ThreadPlacement::onlineCpus();
+    int cpu = online.back();
+
+    std::thread thread([&] () {
+            ThreadPlacement::cpuSet({ cpu }).apply(0);
+            vector<int> cpus = currentCpus();
+            BOOST_CHECK_EQUAL(cpus.size(), 1);
+            BOOST_CHECK_EQUAL(cpus[0], cpu);
+        });
+    thread.join();
+
+    /* the workers of a loop */
+    MessageLoop loop;
+    loop.setThreadPlacement(ThreadPlacement::cpuSet({ cpu }));
+
+    vector<int> loopCpus;
+    TypedMessageSink<int> source(1);
+    source.onEvent = [&] (int && message) {
+        loopCpus = currentCpus();
+    };
+    loop.addSource("source", source);
+    loop.start();
+    source.push(1);
+    while (loopCpus.empty()) {
+        std::this_thread::yield();
+    }
+    BOOST_CHECK_EQUAL(loopCpus.size(), 1);
+    BOOST_CHECK_EQUAL(loopCpus[0], cpu);
+    loop.shutdown();
+}
@@ -0,0 +1,181 @@
+/* timer_wheel_test.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Tests for the timer wheel.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <poll.h>
+#include <atomic>
+#include <iostream>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/timers.h"
+#include "jml/utils/testing/watchdog.h"
+
+#include "soa/service/timer_wheel.h"
+#include "soa/service/message_loop.h"
+
+using namespace std;
+using namespace Datacratic;
+
+
+namespace {
+
+/* Runs the wheel the way a message loop would, for the given duration. */
+void runWheel(TimerWheel & wheel, double seconds)
+{
+    ML::Timer timer;
+    while (timer.elapsed_wall() < seconds) {
+        pollfd fd = { wheel.selectFd(), POLLIN, 0 };
+        int res = ::poll(&fd, 1, 10);
+        BOOST_REQUIRE_NE(res, -1);
+        if (res == 1)
+            wheel.processOne();
+    }
+}
+
+} // file scope
+
+
+BOOST_AUTO_TEST_CASE( test_one_shot_and_cancel )
+{
+    ML::Watchdog wd(10);
+    TimerWheel wheel;
+
+    vector<int> fired;
+    wheel.schedule(0.05, [&] (uint64_t count) {
+            BOOST_CHECK_EQUAL(count, 1);
+            fired.push_back(2);
+        });
+    wheel.schedule(0.01, [&] (uint64_t) { fired.push_back(1); });
+
+    /* far enough to sit in an upper level of the wheel */
+    wheel.schedule(0.3, [&] (uint64_t) { fired.push_back(3); });
+
+    auto cancelled = wheel.schedule(0.02, [&] (uint64_t) {
+            fired.push_back(-1);
+        });
+    BOOST_CHECK_EQUAL(wheel.size(), 4);
+    BOOST_CHECK(wheel.cancel(cancelled));
+    BOOST_CHECK(!wheel.cancel(cancelled));
+
+    runWheel(wheel, 0.5);
+
+    BOOST_CHECK_EQUAL(fired.size(), 3);
+    BOOST_CHECK_EQUAL(fired[0], 1);
+    BOOST_CHECK_EQUAL(fired[1], 2);
+    BOOST_CHECK_EQUAL(fired[2], 3);
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_periodic )
+{
+    ML::Watchdog wd(10);
+    TimerWheel wheel;
+
+    uint64_t numTicks(0);
+    auto id = wheel.schedulePeriodic(0.01, [&] (uint64_t count) {
+            numTicks += count;
+        });
+
+    runWheel(wheel, 0.2);
+    cerr << "ticks after 0.2s: " << numTicks << endl;
+    BOOST_CHECK_GE(numTicks, 15);
+    BOOST_CHECK_LE(numTicks, 21);
+
+    /* when the wheel isn't processed, missed periods are reported through
+       the count */
+    uint64_t lastCount(0);
+    wheel.cancel(id);
+    wheel.schedulePeriodic(0.01, [&] (uint64_t count) { lastCount = count; });
+    ML::sleep(0.1);
+    pollfd fd = { wheel.selectFd(), POLLIN, 0 };
+    BOOST_CHECK_EQUAL(::poll(&fd, 1, 0), 1);
+    wheel.processOne();
+    BOOST_CHECK_GE(lastCount, 9);
+}
+
+BOOST_AUTO_TEST_CASE( test_cancel_from_callback )
+{
+    ML::Watchdog wd(10);
+    TimerWheel wheel;
+
+    int numCalls(0);
+    TimerWheel::TimerId id;
+    id = wheel.schedulePeriodic(0.01, [&] (uint64_t) {
+            numCalls++;
+            if (numCalls == 3)
+                wheel.cancel(id);
+        });
+
+    runWheel(wheel, 0.1);
+    BOOST_CHECK_EQUAL(numCalls, 3);
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_throwing_callback )
+{
+    ML::Watchdog wd(10);
+    TimerWheel wheel;
+
+    uint64_t numTicks(0);
+    wheel.schedulePeriodic(0.01, [&] (uint64_t count) {
+            numTicks += count;
+        });
+
+    /* expires with the one that throws, and must still fire once */
+    int numFired(0);
+    wheel.schedule(0.02, [&] (uint64_t) { numFired++; });
+    wheel.schedule(0.02, [&] (uint64_t) {
+            throw ML::Exception("timer that throws");
+        });
+
+    int numThrown(0);
+    ML::Timer timer;
+    while (timer.elapsed_wall() < 0.2) {
+        pollfd fd = { wheel.selectFd(), POLLIN, 0 };
+        int res = ::poll(&fd, 1, 50);
+        BOOST_REQUIRE_NE(res, -1);
+        /* the wheel stays armed after a callback threw */
+        BOOST_REQUIRE_EQUAL(res, 1);
+        try {
+            wheel.processOne();
+        } catch (const ML::Exception &) {
+            numThrown++;
+        }
+    }
+
+    cerr << "ticks after 0.2s: " << numTicks << endl;
+    BOOST_CHECK_EQUAL(numThrown, 1);
+    BOOST_CHECK_EQUAL(numFired, 1);
+    BOOST_CHECK_GE(numTicks, 15);
+    BOOST_CHECK_EQUAL(wheel.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE( test_message_loop_periodic )
+{
+    ML::Watchdog wd(10);
+    MessageLoop loop;
+
+    std::atomic<int> numTicks(0);
+    for (int i = 0;  i < 100;  ++i)
+        loop.addPeriodic("periodic", 0.01,
+                         [&] (uint64_t count) { numTicks += count; });
+
+    std::atomic<int> numOneShots(0);
+    loop.timers().schedule(0.05, [&] (uint64_t) { numOneShots++; });
+
+    loop.start();
+    ML::sleep(0.2);
+    loop.shutdown();
+
+    cerr << "ticks: " << numTicks << endl;
+    BOOST_CHECK_GE(numTicks, 100 * 15);
+    BOOST_CHECK_EQUAL(numOneShots, 1);
+}
@@ -0,0 +1,227 @@
+/* thread_placement.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <set>
+
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+
+#include "thread_placement.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+namespace {
+
+string readFirstLine(const string & filename)
+{
+    ifstream stream(filename);
+    string line;
+    if (!stream || !getline(stream, line))
+        throw ML::Exception("couldn't read " + filename);
+    return line;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* THREAD PLACEMENT                                                          */
+/*****************************************************************************/
+
+ThreadPlacement
+ThreadPlacement::
+cpuSet(const std::vector<int> & cpus)
+{
+    if (cpus.empty())
+        throw ML::Exception("thread placement needs at least one CPU");
+
+    ThreadPlacement result;
+    result.mode = CPU_SET;
+    result.cpus = cpus;
+    result.validate();
+    return result;
+}
+
+ThreadPlacement
+ThreadPlacement::
+onePerCore(const std::vector<int> & cpus)
+{
+    std::vector<int> candidates = cpus.empty() ? onlineCpus() : cpus;
+
+    // Keep the first hyperthread of each core
+    std::set<int> seen;
+    ThreadPlacement result;
+    result.mode = ONE_PER_CORE;
+    for (int cpu: candidates) {
+        std::vector<int> siblings;
+        try {
+            siblings = parseCpuList(readFirstLine(ML::format(
+                    "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+                    cpu)));
+        } catch (const std::exception & exc) {
+            siblings = { cpu };
+        }
+        int core = *std::min_element(siblings.begin(), siblings.end());
+        if (seen.insert(core).second)
+            result.cpus.push_back(cpu);
+    }
+
+    if (result.cpus.empty())
+        throw ML::Exception("thread placement needs at least one CPU");
+
+    result.validate();
+    return result;
+}
+
+ThreadPlacement
+ThreadPlacement::
+numaNode(int node)
+{
+    if (node < 0)
+        throw ML::Exception("invalid NUMA node %d", node);
+
+    ThreadPlacement result;
+    result.mode = NUMA_NODE;
+    result.node = node;
+    result.cpus = nodeCpus(node);
+
+    if (result.cpus.empty())
+        throw ML::Exception("NUMA node %d has no CPU", node);
+
+    result.validate();
+    return result;
+}
+
+void
+ThreadPlacement::
+validate() const
+{
+    if (mode == NONE)
+        return;
+
+    if (mode == NUMA_NODE && node < 0)
+        throw ML::Exception("invalid NUMA node %d", node);
+    if (cpus.empty())
+        throw ML::Exception("thread placement needs at least one CPU");
+
+    std::vector<int> online = onlineCpus();
+    for (int cpu: cpus) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            throw ML::Exception("invalid CPU %d", cpu);
+        if (std::find(online.begin(), online.end(), cpu) == online.end())
+            throw ML::Exception("CPU %d is not online", cpu);
+    }
+}
+
+std::vector<int>
+ThreadPlacement::
+cpusFor(int threadIndex) const
+{
+    switch (mode) {
+    case NONE:
+        return {};
+    case ONE_PER_CORE:
+        if (threadIndex >= 0)
+            return { cpus[threadIndex % cpus.size()] };
+        return cpus;
+    case CPU_SET:
+    case NUMA_NODE:
+        return cpus;
+    }
+
+    throw ML::Exception("unknown thread placement mode %d", mode);
+}
+
+void
+ThreadPlacement::
+apply(int threadIndex) const
+{
+    std::vector<int> allowed = cpusFor(threadIndex);
+    if (allowed.empty())
+        return;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    for (int cpu: allowed) {
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            throw ML::Exception("invalid CPU %d", cpu);
+        CPU_SET(cpu, &cpuset);
+    }
+
+    int res = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (res != 0)
+        throw ML::Exception(res, "pthread_setaffinity_np");
+}
+
+bool
+ThreadPlacement::
+tryApply(int threadIndex) const
+{
+    try {
+        apply(threadIndex);
+        return true;
+    } catch (const std::exception & exc) {
+        cerr << "thread " << threadIndex << " could not be placed: "
+             << exc.what() << endl;
+        return false;
+    }
+}
+
+std::vector<int>
+ThreadPlacement::
+onlineCpus()
+{
+    return parseCpuList(readFirstLine("/sys/devices/system/cpu/online"));
+}
+
+std::vector<int>
+ThreadPlacement::
+nodeCpus(int node)
+{
+    return parseCpuList(readFirstLine(
+            ML::format("/sys/devices/system/node/node%d/cpulist", node)));
+}
+
+std::vector<int>
+ThreadPlacement::
+parseCpuList(const std::string & list)
+{
+    std::vector<int> result;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == string::npos)
+            end = list.size();
+
+        string range = list.substr(pos, end - pos);
+        pos = end + 1;
+        if (range.empty() || range == "\n")
+            continue;
+
+        size_t dash = range.find('-');
+        try {
+            int first = stoi(range.substr(0, dash));
+            int last = dash == string::npos
+                ? first : stoi(range.substr(dash + 1));
+            for (int cpu = first;  cpu <= last;  ++cpu)
+                result.push_back(cpu);
+        } catch (const std::exception & exc) {
+            throw ML::Exception("invalid cpu list: '" + list + "'");
+        }
+    }
+
+    return result;
+}
+
+} // namespace Datacratic
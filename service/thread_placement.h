@@ -0,0 +1,110 @@
+/* thread_placement.h                                              -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Policies that pin event threads to CPUs and NUMA nodes.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* THREAD PLACEMENT                                                          */
+/*****************************************************************************/
+
+/** Where the threads of a group (the workers of a MessageLoop, the event
+    threads of an endpoint...) are allowed to run.
+
+    - none() leaves the threads wherever the scheduler wants, which is the
+      default;
+    - cpuSet() lets every thread run on any of the given CPUs;
+    - onePerCore() pins each thread to its own physical core, skipping the
+      hyperthread siblings, and wraps around when there are more threads
+      than cores;
+    - numaNode() keeps the threads on the CPUs of a NUMA node.
+
+    apply() must be called by the thread itself, as it only affects the
+    calling thread. Linux places a page on the node of the CPU that first
+    touches it, so only the memory the thread allocates itself once it is
+    pinned is local to its node; the state built for it beforehand by the
+    thread that created it (the workers of a message loop, the polling
+    threads of an endpoint, their epoll sets and queues) stays wherever
+    that thread allocated it.
+*/
+
+struct ThreadPlacement {
+    enum Mode {
+        NONE,
+        CPU_SET,
+        ONE_PER_CORE,
+        NUMA_NODE
+    };
+
+    ThreadPlacement()
+        : mode(NONE), node(-1)
+    {
+    }
+
+    static ThreadPlacement none()
+    {
+        return ThreadPlacement();
+    }
+
+    static ThreadPlacement cpuSet(const std::vector<int> & cpus);
+
+    /** With no CPUs given, all the online CPUs are used. */
+    static ThreadPlacement onePerCore(const std::vector<int> & cpus
+                                      = std::vector<int>());
+
+    static ThreadPlacement numaNode(int node);
+
+    /** CPUs the thread with the given index within its group can run on;
+        an empty result means no restriction.  A negative index stands for
+        a thread that belongs to the group without being one of its
+        numbered threads (an accept thread, for example), which is allowed
+        on all the CPUs of the policy.
+    */
+    std::vector<int> cpusFor(int threadIndex) const;
+
+    /** Throw if the policy names a CPU that isn't online (or that a
+        cpu_set_t can't hold) or a negative NUMA node.  The factories and
+        the setThreadPlacement() methods call it, so that a bad policy is
+        rejected before any thread is started.
+    */
+    void validate() const;
+
+    /** Pin the calling thread according to the policy.  Throws if the
+        affinity can't be set.
+    */
+    void apply(int threadIndex) const;
+
+    /** Same as apply(), for the entry point of a thread: a failure is
+        logged and the thread keeps running where it is, rather than
+        having the exception terminate the process.  Returns whether the
+        thread was pinned.
+    */
+    bool tryApply(int threadIndex) const;
+
+    Mode mode;
+
+    /** CPUs of the policy; for ONE_PER_CORE, one CPU per physical core */
+    std::vector<int> cpus;
+
+    /** Node for NUMA_NODE */
+    int node;
+
+    /** Online CPUs of the machine */
+    static std::vector<int> onlineCpus();
+
+    /** CPUs of the given NUMA node */
+    static std::vector<int> nodeCpus(int node);
+
+    /** Parse a list in the kernel's cpulist format, like "0-3,8,10-11" */
+    static std::vector<int> parseCpuList(const std::string & list);
+};
+
+} // namespace Datacratic
@@ -0,0 +1,427 @@
+/* timer_wheel.cc
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+*/
+
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+#include <exception>
+#include <iostream>
+
+#include "jml/arch/exception.h"
+#include "jml/utils/exc_assert.h"
+#include "jml/utils/guard.h"
+
+#include "timer_wheel.h"
+
+using namespace std;
+
+
+namespace Datacratic {
+
+namespace {
+
+const uint64_t NoTick = (uint64_t)-1;
+
+double monotonicSeconds()
+{
+    timespec ts;
+    int res = clock_gettime(CLOCK_MONOTONIC, &ts);
+    if (res == -1)
+        throw ML::Exception(errno, "clock_gettime");
+    return ts.tv_sec + ts.tv_nsec * 0.000000001;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* TIMER WHEEL                                                               */
+/*****************************************************************************/
+
+TimerWheel::
+TimerWheel(double resolutionSeconds)
+    : timerFd(-1),
+      resolution_(resolutionSeconds),
+      start_(monotonicSeconds()),
+      now_(0),
+      armedTick_(NoTick),
+      nextId_(1)
+{
+    ExcAssertGreater(resolutionSeconds, 0.0);
+
+    for (int level = 0;  level < NumLevels;  ++level)
+        for (int slot = 0;  slot < NumSlots;  ++slot)
+            slots_[level][slot] = nullptr;
+
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerFd == -1)
+        throw ML::Exception(errno, "timerfd_create");
+}
+
+TimerWheel::
+~TimerWheel()
+{
+    int res = close(timerFd);
+    if (res == -1)
+        cerr << "warning: close on timerfd: " << strerror(errno) << endl;
+}
+
+TimerWheel::TimerId
+TimerWheel::
+schedule(double delaySeconds, const OnTimeout & onTimeout,
+         const std::string & name)
+{
+    return add(delaySeconds, 0.0, onTimeout, name);
+}
+
+TimerWheel::TimerId
+TimerWheel::
+schedulePeriodic(double periodSeconds, const OnTimeout & onTimeout,
+                 const std::string & name)
+{
+    ExcAssertGreater(periodSeconds, 0.0);
+    return add(periodSeconds, periodSeconds, onTimeout, name);
+}
+
+bool
+TimerWheel::
+cancel(TimerId id)
+{
+    Guard guard(lock_);
+
+    auto it = timers_.find(id);
+    if (it == timers_.end())
+        return false;
+
+    Timer * timer = it->second.get();
+    timer->cancelled = true;
+    if (timer->list)
+        unlink(timer);
+    timers_.erase(it);
+
+    return true;
+}
+
+size_t
+TimerWheel::
+size() const
+{
+    Guard guard(lock_);
+    return timers_.size();
+}
+
+int
+TimerWheel::
+selectFd() const
+{
+    return timerFd;
+}
+
+bool
+TimerWheel::
+processOne()
+{
+    uint64_t numWakeups = 0;
+    for (;;) {
+        int res = read(timerFd, &numWakeups, 8);
+        if (res == -1 && errno == EINTR) continue;
+        if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (res == -1)
+            throw ML::Exception(errno, "timerfd read");
+        else if (res != 8)
+            throw ML::Exception("timerfd read: wrong number of bytes: %d",
+                                res);
+        break;
+    }
+
+    double nowSeconds = elapsed();
+    uint64_t target = nowSeconds / resolution_;
+
+    // Taken out of expired_ so that a callback that throws can't leave
+    // timers behind to be fired again by the next call
+    std::vector<Expired> expired;
+
+    {
+        Guard guard(lock_);
+
+        // The timer is one-shot: whatever it was armed for has fired.
+        armedTick_ = NoTick;
+        if (target >= now_)
+            advance(target, nowSeconds);
+        expired.swap(expired_);
+    }
+
+    // Whatever the callbacks do, the timer must be armed again, or none of
+    // the remaining timers would ever fire.
+    auto rearm = [&] () {
+        expired.clear();
+        Guard guard(lock_);
+        if (expired_.empty())
+            expired_.swap(expired);
+        arm(nextEventTick(true));
+    };
+    ML::Call_Guard rearmGuard(rearm);
+
+    // Callbacks run without the lock so that they can schedule and cancel
+    // timers. One that throws doesn't stop the others from firing; the
+    // first exception is rethrown once they all ran.
+    std::exception_ptr error;
+    for (Expired & entry: expired) {
+        if (entry.timer->cancelled)
+            continue;
+        try {
+            entry.timer->onTimeout(entry.count);
+        } catch (const std::exception & exc) {
+            cerr << "timer " << entry.timer->name << " threw: "
+                 << exc.what() << endl;
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+
+    rearmGuard.clear();
+    rearm();
+
+    if (error)
+        std::rethrow_exception(error);
+
+    return false;
+}
+
+double
+TimerWheel::
+elapsed() const
+{
+    return monotonicSeconds() - start_;
+}
+
+TimerWheel::TimerId
+TimerWheel::
+add(double delaySeconds, double periodSeconds, const OnTimeout & onTimeout,
+    const std::string & name)
+{
+    auto timer = make_shared<Timer>();
+    timer->period = periodSeconds;
+    timer->onTimeout = onTimeout;
+    timer->name = name;
+    timer->due = elapsed() + std::max(delaySeconds, 0.0);
+
+    Guard guard(lock_);
+
+    timer->id = nextId_++;
+    timer->expiry = std::max<uint64_t>(ceil(timer->due / resolution_), now_);
+    insert(timer.get());
+    timers_[timer->id] = timer;
+
+    if (timer->expiry < armedTick_)
+        arm(timer->expiry);
+
+    return timer->id;
+}
+
+void
+TimerWheel::
+insert(Timer * timer)
+{
+    ExcAssertGreaterEqual(timer->expiry, now_);
+
+    uint64_t expiry = timer->expiry;
+    uint64_t delta = expiry - now_;
+
+    // Timers beyond the reach of the wheel wait in the last slot of the top
+    // level and get redistributed from there when it cascades.
+    if (delta >= MaxDelta) {
+        delta = MaxDelta - 1;
+        expiry = now_ + delta;
+    }
+
+    int level = 0;
+    while (level < NumLevels - 1
+           && delta >= (1ULL << (SlotBits * (level + 1))))
+        ++level;
+
+    Timer ** list = &slots_[level][(expiry >> (SlotBits * level)) & SlotMask];
+
+    timer->list = list;
+    timer->prev = nullptr;
+    timer->next = *list;
+    if (*list)
+        (*list)->prev = timer;
+    *list = timer;
+}
+
+void
+TimerWheel::
+unlink(Timer * timer)
+{
+    if (timer->prev)
+        timer->prev->next = timer->next;
+    else *timer->list = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    timer->list = nullptr;
+    timer->prev = timer->next = nullptr;
+}
+
+void
+TimerWheel::
+expire(Timer * timer, double nowSeconds)
+{
+    auto it = timers_.find(timer->id);
+    ExcAssert(it != timers_.end());
+
+    Expired expired;
+    expired.timer = it->second;
+    expired.count = 1;
+
+    if (timer->period == 0.0) {
+        timers_.erase(it);
+    }
+    else {
+        // Periods that were missed are reported through the count rather
+        // than by firing the timer several times in a row.
+        if (nowSeconds > timer->due)
+            expired.count += uint64_t((nowSeconds - timer->due) / timer->period);
+        timer->due += expired.count * timer->period;
+        timer->expiry = std::max<uint64_t>(ceil(timer->due / resolution_),
+                                           now_ + 1);
+        insert(timer);
+    }
+
+    expired_.emplace_back(std::move(expired));
+}
+
+void
+TimerWheel::
+cascade(int level, uint64_t slot)
+{
+    Timer * timer = slots_[level][slot];
+    slots_[level][slot] = nullptr;
+
+    while (timer) {
+        Timer * next = timer->next;
+        insert(timer);
+        timer = next;
+    }
+}
+
+void
+TimerWheel::
+advance(uint64_t target, double nowSeconds)
+{
+    while (now_ <= target) {
+        // Skip the ticks where nothing happens, which can be a lot of them
+        // after the loop was idle.
+        uint64_t next = nextEventTick();
+        if (next > target) {
+            now_ = target + 1;
+            break;
+        }
+        now_ = std::max(now_, next);
+
+        uint64_t index = now_ & SlotMask;
+        if (index == 0) {
+            for (int level = 1;  level < NumLevels;  ++level) {
+                uint64_t slot = (now_ >> (SlotBits * level)) & SlotMask;
+                cascade(level, slot);
+                if (slot != 0)
+                    break;
+            }
+        }
+
+        Timer * timer = slots_[0][index];
+        slots_[0][index] = nullptr;
+
+        while (timer) {
+            Timer * next = timer->next;
+            timer->list = nullptr;
+            timer->prev = timer->next = nullptr;
+            expire(timer, nowSeconds);
+            timer = next;
+        }
+
+        ++now_;
+    }
+}
+
+uint64_t
+TimerWheel::
+nextEventTick(bool exact) const
+{
+    if (timers_.empty())
+        return NoTick;
+
+    // Timers of level 0 are all due within the next NumSlots ticks, so the
+    // first busy slot gives the exact tick.
+    uint64_t result = NoTick;
+    for (uint64_t i = 0;  i < NumSlots;  ++i) {
+        if (slots_[0][(now_ + i) & SlotMask]) {
+            result = now_ + i;
+            break;
+        }
+    }
+
+    // The first busy slot of each upper level needs to cascade before any
+    // of its timers can fire.  If now_ starts a block of the level, its
+    // slot for that block has yet to cascade.
+    for (int level = 1;  level < NumLevels;  ++level) {
+        int shift = SlotBits * level;
+        uint64_t block = now_ >> shift;
+        uint64_t first = (now_ & ((1ULL << shift) - 1)) == 0 ? 0 : 1;
+
+        for (uint64_t k = first;  k <= NumSlots;  ++k) {
+            Timer * timer = slots_[level][(block + k) & SlotMask];
+            if (!timer)
+                continue;
+
+            uint64_t tick = (block + k) << shift;
+            if (exact && tick < result) {
+                // Nothing fires at the cascade itself so there's no need to
+                // wake up before the earliest timer of the slot.
+                tick = NoTick;
+                for (;  timer;  timer = timer->next)
+                    tick = std::min(tick, timer->expiry);
+            }
+            result = std::min(result, tick);
+            break;
+        }
+    }
+
+    return result;
+}
+
+void
+TimerWheel::
+arm(uint64_t tick)
+{
+    if (tick == armedTick_)
+        return;
+
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+
+    if (tick != NoTick) {
+        double when = start_ + tick * resolution_;
+        spec.it_value.tv_sec = when;
+        spec.it_value.tv_nsec = (when - spec.it_value.tv_sec) * 1000000000;
+
+        // A zero value would disarm the timer
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    int res = timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, 0);
+    if (res == -1)
+        throw ML::Exception(errno, "timerfd_settime");
+
+    armedTick_ = tick;
+}
+
+} // namespace Datacratic
@@ -0,0 +1,184 @@
+/* timer_wheel.h                                                   -*- C++ -*-
+   Copyright (c) 2015 Datacratic.  All rights reserved.
+
+   Event source running any number of timers off a single timerfd.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "jml/arch/spinlock.h"
+
+#include "async_event_source.h"
+
+
+namespace Datacratic {
+
+/*****************************************************************************/
+/* TIMER WHEEL                                                               */
+/*****************************************************************************/
+
+/** Event source that runs one-shot and periodic timers from a hierarchical
+    timing wheel, so that all of them share one timerfd and one epoll
+    registration.
+
+    Time is cut in ticks of the given resolution.  The wheel has four levels
+    of 64 slots each: level 0 holds the timers due within the next 64 ticks,
+    level 1 those due within the next 64^2 ticks and so on.  Whenever level
+    0 wraps around, the next slot of level 1 is redistributed over the lower
+    levels, and so on up.  Scheduling and cancelling a timer are O(1), and
+    the timerfd is only armed for the next tick where there is something to
+    do.
+
+    As with PeriodicEventSource, the callback of a periodic timer gets the
+    number of periods that have elapsed since its last call, which is
+    normally 1 but will be more if the loop has fallen behind.  One-shot
+    timers always get 1.
+
+    schedule() and cancel() can be called from any thread, including from
+    within a callback.  Cancelling a timer from another thread than the one
+    processing the wheel may let it fire one last time if it was already
+    due.
+*/
+
+struct TimerWheel : public AsyncEventSource {
+    typedef std::function<void (uint64_t)> OnTimeout;
+    typedef uint64_t TimerId;
+
+    TimerWheel(double resolutionSeconds = 0.001);
+
+    ~TimerWheel();
+
+    /** Calls onTimeout once in delaySeconds.  Returns an id that can be
+        passed to cancel().  The name identifies the timer in the error
+        logged if onTimeout throws.
+    */
+    TimerId schedule(double delaySeconds, const OnTimeout & onTimeout,
+                     const std::string & name = "");
+
+    /** Calls onTimeout every periodSeconds, the first time being one period
+        from now.  Returns an id that can be passed to cancel().
+    */
+    TimerId schedulePeriodic(double periodSeconds,
+                             const OnTimeout & onTimeout,
+                             const std::string & name = "");
+
+    /** Stops the timer.  Returns false if the timer doesn't exist anymore,
+        which includes one-shot timers that have already fired.
+    */
+    bool cancel(TimerId id);
+
+    /** Number of timers currently scheduled. */
+    size_t size() const;
+
+    double resolution() const
+    {
+        return resolution_;
+    }
+
+    virtual int selectFd() const;
+
+    virtual bool processOne();
+
+private:
+    static constexpr int SlotBits = 6;
+    static constexpr int NumSlots = 1 << SlotBits;
+    static constexpr uint64_t SlotMask = NumSlots - 1;
+    static constexpr int NumLevels = 4;
+
+    /// Number of ticks covered by the whole wheel
+    static constexpr uint64_t MaxDelta = 1ULL << (SlotBits * NumLevels);
+
+    struct Timer {
+        Timer()
+            : id(0), expiry(0), due(0.0), period(0.0), cancelled(false),
+              list(nullptr), prev(nullptr), next(nullptr)
+        {
+        }
+
+        TimerId id;
+        uint64_t expiry;      ///< Tick at which the timer fires
+        double due;           ///< Exact time at which it's due
+        double period;        ///< Zero for one-shot timers
+        std::atomic<bool> cancelled;
+        OnTimeout onTimeout;
+        std::string name;
+
+        /// Links within the slot's list; list is the slot's head
+        Timer ** list;
+        Timer * prev;
+        Timer * next;
+    };
+
+    /// A timer that expired, with the count to pass to its callback
+    struct Expired {
+        std::shared_ptr<Timer> timer;
+        uint64_t count;
+    };
+
+    int timerFd;
+    double resolution_;
+
+    /// Monotonic time at tick 0
+    double start_;
+
+    /// Next tick to be processed
+    uint64_t now_;
+
+    /// Tick for which the timerfd is armed; -1 if it isn't
+    uint64_t armedTick_;
+
+    TimerId nextId_;
+
+    /// Heads of the intrusive list of each slot
+    Timer * slots_[NumLevels][NumSlots];
+
+    /// Owns the timers; indexed by id to make cancel() O(1)
+    std::unordered_map<TimerId, std::shared_ptr<Timer> > timers_;
+
+    /// Reused by processOne() to avoid allocating at each call
+    std::vector<Expired> expired_;
+
+    typedef ML::Spinlock Lock;
+    typedef std::lock_guard<Lock> Guard;
+    mutable Lock lock_;
+
+    /** Seconds elapsed since tick 0 */
+    double elapsed() const;
+
+    TimerId add(double delaySeconds, double periodSeconds,
+                const OnTimeout & onTimeout, const std::string & name);
+
+    /** Links the timer in the slot matching its expiry. */
+    void insert(Timer * timer);
+    void unlink(Timer * timer);
+
+    /** Moves the timer to expired_ and reschedules it if it's periodic. */
+    void expire(Timer * timer, double nowSeconds);
+
+    /** Redistributes the timers of the given slot over the lower levels. */
+    void cascade(int level, uint64_t slot);
+
+    /** Processes every tick up to and including target, moving the timers
+        that expire into expired_.
+    */
+    void advance(uint64_t target, double nowSeconds);
+
+    /** Earliest tick at which there is something to do, be it a cascade
+        or a timer firing; -1 if the wheel is empty.  If exact is true,
+        cascades are skipped and the result is the tick of the next timer
+        to fire, at the cost of walking the list of an upper level slot.
+    */
+    uint64_t nextEventTick(bool exact = false) const;
+
+    /** Arms the timerfd for the given tick or disarms it for -1. */
+    void arm(uint64_t tick);
+};
+
+} // namespace Datacratic
@@ -17,6 +17,7 @@
 #include "jml/utils/environment.h"
 #include <iostream>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/timerfd.h>
 #include <sys/eventfd.h>
 #include <poll.h>
@@ -33,6 +34,33 @@ boost::function<void (const char *, float)> onLatencyEvent;
 ML::Env_Option<bool> DEBUG_TRANSPORTS("DEBUG_TRANSPORTS", false);
 
 
+/*****************************************************************************/
+/* READ BUFFER                                                               */
+/*****************************************************************************/
+
+char *
+ReadBuffer::
+reserve(size_t minSpace)
+{
+    if (storage_.size() - end_ >= minSpace)
+        return storage_.data() + end_;
+
+    // Move what's left to the front before growing
+    size_t dataSize = size();
+    if (begin_ != 0) {
+        std::copy(storage_.begin() + begin_, storage_.begin() + end_,
+                  storage_.begin());
+        begin_ = 0;
+        end_ = dataSize;
+    }
+
+    if (storage_.size() - end_ < minSpace)
+        storage_.resize(std::max(storage_.size() * 2, end_ + minSpace));
+
+    return storage_.data() + end_;
+}
+
+
 /*****************************************************************************/
 /* TRANSPORT BASE                                                            */
 /*****************************************************************************/
@@ -302,6 +330,18 @@ handleAsync(const boost::function<void ()> & callback, const char * name,
     return endEventHandler(name, guard);
 }
 
+ssize_t
+TransportBase::
+sendv(const iovec * iov, int iovcnt, int flags)
+{
+    for (int i = 0;  i < iovcnt;  ++i) {
+        if (iov[i].iov_len != 0)
+            return send((const char *)iov[i].iov_base, iov[i].iov_len,
+                        flags);
+    }
+    return 0;
+}
+
 void
 TransportBase::
 associate(std::shared_ptr<ConnectionHandler> newSlave)
@@ -322,6 +362,7 @@ associate(std::shared_ptr<ConnectionHandler> newSlave)
 
     slave_ = newSlave;
     slave().setTransport(this);
+    slave_->self_ = slave_;
 
     auto finishAssociate = [=] ()
         {
@@ -1016,6 +1057,17 @@ send(const char * buf, size_t len, int flags)
     return peer().send(buf, len, flags);
 }
    
+ssize_t
+SocketTransport::
+sendv(const iovec * iov, int iovcnt, int flags)
+{
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<iovec *>(iov);
+    msg.msg_iovlen = iovcnt;
+    return ::sendmsg(getHandle(), &msg, flags);
+}
+
 ssize_t
 SocketTransport::
 recv(char * buf, size_t buf_size, int flags)
@@ -24,6 +24,8 @@
 #include "soa/jsoncpp/json.h"
 #include <boost/type_traits/is_convertible.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <sys/uio.h>
+#include <vector>
 
 namespace Datacratic {
 
@@ -33,6 +35,69 @@ struct EndpointBase;
 
 extern boost::function<void (const char *, float)> onLatencyEvent;
 
+
+/*****************************************************************************/
+/* READ BUFFER                                                               */
+/*****************************************************************************/
+
+/** Buffer that a connection reads into.  It keeps its memory for the life
+    of the connection, so that reading only allocates until it has grown
+    to the size of the largest burst, and holds on to the data that the
+    connection handler didn't consume yet.
+*/
+
+struct ReadBuffer {
+    ReadBuffer()
+        : begin_(0), end_(0)
+    {
+    }
+
+    /** Data that wasn't consumed yet. */
+    const char * data() const { return storage_.data() + begin_; }
+    size_t size() const { return end_ - begin_; }
+    bool empty() const { return begin_ == end_; }
+
+    /** Return room for at least minSpace bytes after the data, compacting
+        or growing the storage as needed.  commit() then adds what was
+        written there to the data.
+    */
+    char * reserve(size_t minSpace);
+
+    void commit(size_t numBytes)
+    {
+        if (numBytes > storage_.size() - end_)
+            throw ML::Exception("ReadBuffer::commit(): past the storage");
+        end_ += numBytes;
+    }
+
+    void append(const char * data, size_t size)
+    {
+        std::copy(data, data + size, reserve(size));
+        commit(size);
+    }
+
+    /** Drop the given number of bytes from the start of the data. */
+    void consume(size_t numBytes)
+    {
+        if (numBytes > size())
+            throw ML::Exception("ReadBuffer::consume(): past the data");
+        begin_ += numBytes;
+        if (begin_ == end_)
+            begin_ = end_ = 0;
+    }
+
+    void clear()
+    {
+        begin_ = end_ = 0;
+    }
+
+private:
+    std::vector<char> storage_;
+    size_t begin_;
+    size_t end_;
+};
+
+
 /*****************************************************************************/
 /* TRANSPORT BASE                                                            */
 /*****************************************************************************/
@@ -61,6 +126,12 @@ struct TransportBase : public std::enable_shared_from_this<TransportBase> {
     virtual ssize_t send(const char * buf, size_t len, int flags) = 0;
     virtual ssize_t recv(char * buf, size_t buf_size, int flags) = 0;
 
+    /** Send several buffers in a single call, like sendmsg().  The default
+        sends the first one that isn't empty, for the transports that
+        can't gather.
+    */
+    virtual ssize_t sendv(const iovec * iov, int iovcnt, int flags);
+
     // closeWhenHandlerFinished() should be used in almost all cases instead
     // of this, except when writing test code, in which case asyncClose()
     // should be called instead.
@@ -70,6 +141,12 @@ struct TransportBase : public std::enable_shared_from_this<TransportBase> {
     
     EndpointBase * get_endpoint() { return endpoint_; }
 
+    /** Buffer that the connection handlers read into.  It belongs to the
+        connection, so the data that one handler doesn't consume is kept
+        for the next one.
+    */
+    ReadBuffer & readBuffer() { return readBuffer_; }
+
     /** Recycles the current transport with the endpoint, disassociating
         the connection handler in the process.
 
@@ -462,6 +539,7 @@ public:
 private:
     std::shared_ptr<ConnectionHandler> slave_;
     EndpointBase * endpoint_;
+    ReadBuffer readBuffer_;
 
     /** If this is non-null, the connection handler will be changed to this
         once the current handler is finished.
@@ -602,6 +680,7 @@ struct SocketTransport
     virtual std::string getPeerName() const { return peerName_; }
 
     virtual ssize_t send(const char * buf, size_t len, int flags);
+    virtual ssize_t sendv(const iovec * iov, int iovcnt, int flags);
     virtual ssize_t recv(char * buf, size_t buf_size, int flags);
     virtual int closePeer();
 
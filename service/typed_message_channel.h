@@ -8,8 +8,16 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <queue>
 #include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <boost/thread/tss.hpp>
 
 #include "jml/utils/ring_buffer.h"
 #include "jml/arch/wakeup_fd.h"
@@ -23,21 +31,88 @@ struct TypedMessageChannel {
     ML::RingBufferSRMW<Message> buf;
 };
 
+
+/*****************************************************************************
+ * MESSAGE BATCH STATS                                                       *
+ *****************************************************************************/
+
+/* Sizes of the batches of messages drained by a consumer. The counters are
+ * updated by the consuming thread only, so reading them from another thread
+ * gives approximate values. */
+struct MessageBatchStats
+{
+    MessageBatchStats()
+        : numBatches(0), numMessages(0), maxBatchSize(0)
+    {
+    }
+
+    uint64_t numBatches;
+    uint64_t numMessages;
+    uint64_t maxBatchSize;
+
+    double averageBatchSize() const
+    {
+        return numBatches ? double(numMessages) / numBatches : 0.0;
+    }
+
+    void record(size_t batchSize)
+    {
+        numBatches++;
+        numMessages += batchSize;
+        if (batchSize > maxBatchSize) {
+            maxBatchSize = batchSize;
+        }
+    }
+};
+
+
+/*****************************************************************************
+ * TYPED MESSAGE SINK                                                        *
+ *****************************************************************************/
+
+/* A bounded multiple writer/single reader message channel which is also an
+ * event source. Messages are handled either one by one through "onEvent" or,
+ * when "onBatch" is set, in batches of up to "maxBatchSize" messages.
+ *
+ * Producers only signal the eventfd when the consumer isn't already known to
+ * be awake, so that a burst of messages costs a single wakeup. */
 template<typename Message>
 struct TypedMessageSink: public AsyncEventSource {
+    typedef std::function<void (std::vector<Message> & messages)> OnBatch;
 
     TypedMessageSink(size_t bufferSize)
-        : wakeup(EFD_NONBLOCK), buf(bufferSize)
+        : wakeup(EFD_NONBLOCK), buf(bufferSize),
+          signalled_(false), signalTime_(0),
+          maxBatchSize_(1), maxBatchSeconds_(0.0)
     {
     }
 
     std::function<void (Message && message)> onEvent;
 
+    /* When set, used instead of "onEvent". The callback may move the
+     * messages out of the vector but must not keep a reference to it. */
+    OnBatch onBatch;
+
+    /* "maxBatchSize": maximum number of messages popped before calling
+     * "onBatch", or before returning when using "onEvent"
+     * "maxBatchSeconds": time after which processOne returns when there are
+     * still messages to process; with 0, it handles a single batch */
+    void setBatchLimits(size_t maxBatchSize, double maxBatchSeconds = 0.0)
+    {
+        maxBatchSize_ = std::max<size_t>(maxBatchSize, 1);
+        maxBatchSeconds_ = maxBatchSeconds;
+    }
+
+    const MessageBatchStats & batchStats() const
+    {
+        return batchStats_;
+    }
+
     template<typename MessageT>
     void push(MessageT&& message)
     {
         buf.push(std::forward<MessageT>(message));
-        wakeup.signal();
+        signal();
     }
 
     template<typename MessageT>
@@ -45,7 +120,7 @@ struct TypedMessageSink: public AsyncEventSource {
     {
         bool pushed = buf.tryPush(std::forward<MessageT>(message));
         if (pushed)
-            wakeup.signal();
+            signal();
 
         return pushed;
     }
@@ -63,26 +138,107 @@ struct TypedMessageSink: public AsyncEventSource {
 
     virtual bool processOne()
     {
-        // Try to do one
-        Message msg;
-        if (!buf.tryPop(msg))
-            return false;
-        onEvent(std::move(msg));
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start;
+        if (maxBatchSeconds_ > 0) {
+            start = Clock::now();
+        }
+
+        for (;;) {
+            size_t numPopped = processBatch();
+            if (numPopped == 0) {
+                break;
+            }
+            batchStats_.record(numPopped);
+
+            // Are there more waiting for us?
+            if (buf.couldPop()) {
+                if (maxBatchSeconds_ <= 0
+                    || (std::chrono::duration<double>(Clock::now() - start)
+                        .count() >= maxBatchSeconds_)) {
+                    return true;
+                }
+                continue;
+            }
+            break;
+        }
 
-        // Are there more waiting for us?
-        if (buf.couldPop())
-            return true;
-        
         // Warning: race condition... that's why we need the couldPop from
-        // the next instruction to be accurate
+        // the next instruction to be accurate. Producers that push after
+        // signalled_ is cleared will signal again.
         wakeup.tryRead();
+        signalled_ = false;
 
         return buf.couldPop();
     }
+
+    virtual uint64_t takeSignalTime()
+    {
+        return signalTime_.exchange(0);
+    }
+
     uint64_t size() const { return buf.ring.size() ; }
 private:
     ML::Wakeup_Fd wakeup;
     ML::RingBufferSRMW<Message> buf;
+
+    /* set when the eventfd was signalled and the consumer hasn't emptied the
+     * buffer since */
+    std::atomic<bool> signalled_;
+
+    /* time of the signal that set "signalled_" */
+    std::atomic<uint64_t> signalTime_;
+
+    size_t maxBatchSize_;
+    double maxBatchSeconds_;
+
+    /* reused between batches */
+    std::vector<Message> batch_;
+
+    MessageBatchStats batchStats_;
+
+    void signal()
+    {
+        if (signalled_.load()) {
+            return;
+        }
+
+        /* the time is recorded before "signalled_" is set so that a consumer
+         * that sees the signal also sees its time; it is only recorded if
+         * the consumer has taken the previous one */
+        uint64_t noTime(0);
+        signalTime_.compare_exchange_strong(noTime, monotonicNanos());
+        if (!signalled_.exchange(true)) {
+            wakeup.signal();
+        }
+    }
+
+    /* pops and handles up to maxBatchSize_ messages, returning how many
+     * there were */
+    size_t processBatch()
+    {
+        size_t numPopped(0);
+        Message msg;
+
+        if (onBatch) {
+            batch_.clear();
+            while (numPopped < maxBatchSize_ && buf.tryPop(msg)) {
+                batch_.emplace_back(std::move(msg));
+                numPopped++;
+            }
+            if (numPopped > 0) {
+                onBatch(batch_);
+            }
+        }
+        else {
+            while (numPopped < maxBatchSize_ && buf.tryPop(msg)) {
+                onEvent(std::move(msg));
+                numPopped++;
+            }
+        }
+
+        return numPopped;
+    }
 };
 
 
@@ -92,9 +248,20 @@ private:
 
 class test_typed_message_queue;
 
-/* A multiple writer/consumer thread-safe message queue similar to the above
- * but only optionally bounded. When bounded, the advantage over the above is
- * that the limit can be dynamically adjusted. */
+/* A multiple writer thread-safe message queue similar to the above but only
+ * optionally bounded. When bounded, the advantage over the above is that the
+ * limit can be dynamically adjusted.
+ *
+ * Producers never take a lock: each message is pushed onto a lock-free
+ * stack of nodes which the consumer detaches in one exchange and reverses
+ * into its own FIFO list. Consumers are serialized with a mutex that
+ * producers never touch, so a single consumer never waits for it.
+ *
+ * Nodes are recycled rather than freed: the consumer returns them to the
+ * queue in one exchange per batch, and a producer that runs out takes all
+ * of the returned ones into a cache of its own thread, shared by the
+ * queues of the same message type. Once the queue has reached its working
+ * size, messages go through without allocating. */
 template<typename Message>
 struct TypedMessageQueue: public AsyncEventSource
 {
@@ -108,16 +275,29 @@ struct TypedMessageQueue: public AsyncEventSource
      * consume the queue using "pop_front". */
     typedef std::function<void ()> OnNotify;
 
+    /* Type of callback invoked with the messages popped from the queue when
+     * batch consumption is enabled via "setOnBatch". */
+    typedef std::function<void (std::vector<Message> & messages)> OnBatch;
+
     /* "onNotify": callback used when one or more messages are reported in the
      * queue
      * "maxMessages": maximum size of the queue, 0 for unlimited */
     TypedMessageQueue(const OnNotify & onNotify = nullptr, size_t maxMessages = 0)
-        : maxMessages_(maxMessages),
-          wakeup_(EFD_NONBLOCK | EFD_CLOEXEC), pending_(false),
-          onNotify_(onNotify)
+        : maxMessages_(maxMessages), size_(0), pushed_(nullptr),
+          head_(nullptr), tail_(nullptr),
+          wakeup_(EFD_NONBLOCK | EFD_CLOEXEC), pending_(false), signalTime_(0),
+          returned_(nullptr), nodesAllocated_(0),
+          onNotify_(onNotify), maxBatchSize_(0), maxBatchSeconds_(0.0)
     {
     }
 
+    ~TypedMessageQueue()
+    {
+        destroyNodes(pushed_.exchange(nullptr));
+        destroyNodes(head_);
+        freeNodes(returned_.exchange(nullptr));
+    }
+
     /* AsyncEventSource interface */
     virtual int selectFd() const
     {
@@ -127,11 +307,21 @@ struct TypedMessageQueue: public AsyncEventSource
     virtual bool processOne()
     {
         while (wakeup_.tryRead());
-        onNotify();
+        if (onBatch_) {
+            processBatches();
+        }
+        else {
+            onNotify();
+        }
         
         return false;
     }
 
+    virtual uint64_t takeSignalTime()
+    {
+        return signalTime_.exchange(0);
+    }
+
     virtual void onNotify()
     {
         if (onNotify_) {
@@ -139,6 +329,24 @@ struct TypedMessageQueue: public AsyncEventSource
         }
     }
 
+    /* Consume the queue in batches instead of invoking "onNotify": each
+     * invocation of processOne pops up to "maxBatchSize" messages at a time
+     * (0 for all of them) and passes them to "onBatch", until the queue is
+     * empty or "maxBatchSeconds" have elapsed (0 for a single batch). The
+     * callback may move the messages out of the vector. */
+    void setOnBatch(const OnBatch & onBatch,
+                    size_t maxBatchSize = 0, double maxBatchSeconds = 0.0)
+    {
+        onBatch_ = onBatch;
+        maxBatchSize_ = maxBatchSize;
+        maxBatchSeconds_ = maxBatchSeconds;
+    }
+
+    const MessageBatchStats & batchStats() const
+    {
+        return batchStats_;
+    }
+
     /* reset the maximum number of messages */
     void setMaxMessages(size_t count)
     {
@@ -148,16 +356,38 @@ struct TypedMessageQueue: public AsyncEventSource
     /* push message into the queue */
     bool push_back(Message message)
     {
-        Guard guard(queueLock_);
-
-        if (maxMessages_ > 0 && queue_.size() >= maxMessages_) {
-            return false;
+        /* reserve our place first so that the bound is never exceeded */
+        size_t maxMessages = maxMessages_;
+        if (maxMessages > 0) {
+            size_t size = size_.load();
+            do {
+                if (size >= maxMessages) {
+                    return false;
+                }
+            } while (!size_.compare_exchange_weak(size, size + 1));
+        }
+        else {
+            size_++;
         }
 
-        queue_.emplace(std::move(message));
-        if (!pending_) {
-            pending_ = true;
-            wakeup_.signal();
+        Node * node;
+        try {
+            node = allocNode();
+            new (&node->storage) Message(std::move(message));
+        } catch (...) {
+            size_--;
+            throw;
+        }
+        node->next = pushed_.load(std::memory_order_relaxed);
+        while (!pushed_.compare_exchange_weak(node->next, node));
+
+        if (!pending_.load()) {
+            /* recorded before "pending_" is set, as in TypedMessageSink */
+            uint64_t noTime(0);
+            signalTime_.compare_exchange_strong(noTime, monotonicNanos());
+            if (!pending_.exchange(true)) {
+                wakeup_.signal();
+            }
         }
 
         return true;
@@ -167,47 +397,291 @@ struct TypedMessageQueue: public AsyncEventSource
     std::vector<Message> pop_front(size_t number)
     {
         std::vector<Message> messages;
-        Guard guard(queueLock_);
-
-        size_t queueSize = queue_.size();
-        if (number == 0 || number > queueSize) {
-            number = queueSize;
-        }
-        messages.reserve(number);
+        pop_front(messages, number);
+        return messages;
+    }
 
-        for (size_t i = 0; i < number; i++) {
-            messages.emplace_back(std::move(queue_.front()));
-            queue_.pop();
-        }
+    /* appends up to "number" messages from the queue to "messages", or all
+     * of them if 0, and returns how many were appended */
+    size_t pop_front(std::vector<Message> & messages, size_t number)
+    {
+        return popNodes(number, [&] (Message && message) {
+                messages.emplace_back(std::move(message));
+            });
+    }
 
-        if (queue_.size() == 0) {
-            pending_ = false;
+    /* moves up to "capacity" messages from the queue into "buffer" and
+     * returns how many there were */
+    size_t pop_front(Message * buffer, size_t capacity)
+    {
+        if (capacity == 0) {
+            return 0;
         }
-
-        return messages;
+        return popNodes(capacity, [&] (Message && message) {
+                *buffer++ = std::move(message);
+            });
     }
 
-    /* number of messages present in the queue */
+    /* number of messages present in the queue, including those being
+     * pushed */
     uint64_t size()
         const
     {
-        return queue_.size();
+        return size_;
+    }
+
+    /* number of nodes that were allocated rather than recycled by the
+     * producers of this queue */
+    uint64_t nodesAllocated()
+        const
+    {
+        return nodesAllocated_;
     }
 
 private:
+    /* storage for a message, which is only constructed while the node is
+     * in the queue */
+    struct Node {
+        typename std::aligned_storage<sizeof(Message),
+                                      alignof(Message)>::type storage;
+        Node * next;
+
+        Message & message()
+        {
+            return *reinterpret_cast<Message *>(&storage);
+        }
+    };
+
+    /* nodes cached by a producer thread */
+    struct NodeCache {
+        NodeCache()
+            : head(nullptr)
+        {
+        }
+
+        ~NodeCache()
+        {
+            freeNodes(head);
+        }
+
+        Node * head;
+    };
+
+    static boost::thread_specific_ptr<NodeCache> & nodeCache()
+    {
+        static boost::thread_specific_ptr<NodeCache> cache;
+        return cache;
+    }
+
+    std::atomic<size_t> maxMessages_;
+
+    /* number of messages pushed and not yet popped */
+    std::atomic<size_t> size_;
+
+    /* stack of the nodes pushed since the consumer last looked, most recent
+     * first */
+    std::atomic<Node *> pushed_;
+
+    /* nodes taken from "pushed_" by the consumer, oldest first */
     typedef std::mutex Mutex;
     typedef std::unique_lock<Mutex> Guard;
-    Mutex queueLock_;
-    std::queue<Message> queue_;
-    size_t maxMessages_;
+    Mutex consumerLock_;
+    Node * head_;
+    Node * tail_;
 
     ML::Wakeup_Fd wakeup_;
 
     /* notifications are pending */
-    bool pending_;
+    std::atomic<bool> pending_;
+
+    /* time of the signal that set "pending_" */
+    std::atomic<uint64_t> signalTime_;
+
+    /* nodes freed by the consumer, waiting to be taken by a producer */
+    std::atomic<Node *> returned_;
+    std::atomic<uint64_t> nodesAllocated_;
 
     /* callback */
     OnNotify onNotify_;
+
+    /* batch consumption */
+    OnBatch onBatch_;
+    size_t maxBatchSize_;
+    double maxBatchSeconds_;
+    std::vector<Message> batch_;
+    MessageBatchStats batchStats_;
+
+    static void freeNodes(Node * node)
+    {
+        while (node) {
+            Node * next = node->next;
+            delete node;
+            node = next;
+        }
+    }
+
+    /* frees nodes whose message is constructed */
+    static void destroyNodes(Node * node)
+    {
+        while (node) {
+            Node * next = node->next;
+            node->message().~Message();
+            delete node;
+            node = next;
+        }
+    }
+
+    /* returns a node from the calling thread's cache, refilling it from the
+     * nodes returned by the consumer before allocating a new one */
+    Node * allocNode()
+    {
+        NodeCache * cache = nodeCache().get();
+        if (!cache) {
+            cache = new NodeCache();
+            nodeCache().reset(cache);
+        }
+
+        if (!cache->head) {
+            /* taking the whole list is immune to ABA, unlike popping a
+             * single node */
+            cache->head = returned_.exchange(nullptr);
+            if (!cache->head) {
+                nodesAllocated_++;
+                return new Node();
+            }
+        }
+
+        Node * node = cache->head;
+        cache->head = node->next;
+        return node;
+    }
+
+    /* gives the list of nodes from first to last back to the producers */
+    void returnNodes(Node * first, Node * last)
+    {
+        last->next = returned_.load(std::memory_order_relaxed);
+        while (!returned_.compare_exchange_weak(last->next, first));
+    }
+
+    /* moves the pushed nodes at the end of the consumer list; must be
+     * called with consumerLock_ held */
+    void takePushed()
+    {
+        Node * node = pushed_.exchange(nullptr);
+        if (!node) {
+            return;
+        }
+
+        /* reverse the stack into FIFO order */
+        Node * first = nullptr;
+        Node * last = node;
+        while (node) {
+            Node * next = node->next;
+            node->next = first;
+            first = node;
+            node = next;
+        }
+
+        if (tail_) {
+            tail_->next = first;
+        }
+        else {
+            head_ = first;
+        }
+        tail_ = last;
+    }
+
+    /* passes up to "number" messages (all of them if 0) to onMessage */
+    template<typename OnMessage>
+    size_t popNodes(size_t number, const OnMessage & onMessage)
+    {
+        Guard guard(consumerLock_);
+
+        size_t numPopped(0);
+        Node * freed(nullptr);
+        Node * lastFreed(nullptr);
+        while (number == 0 || numPopped < number) {
+            if (!head_) {
+                takePushed();
+                if (!head_) {
+                    break;
+                }
+            }
+
+            Node * node = head_;
+            head_ = node->next;
+            if (!head_) {
+                tail_ = nullptr;
+            }
+
+            /* the node is kept even if the callback throws */
+            node->next = freed;
+            freed = node;
+            if (!lastFreed) {
+                lastFreed = node;
+            }
+
+            Message & message = node->message();
+            try {
+                onMessage(std::move(message));
+            } catch (...) {
+                message.~Message();
+                returnNodes(freed, lastFreed);
+                size_ -= numPopped + 1;
+                throw;
+            }
+            message.~Message();
+            numPopped++;
+        }
+        size_ -= numPopped;
+
+        if (freed) {
+            returnNodes(freed, lastFreed);
+        }
+
+        if (!head_ && !pushed_.load()) {
+            pending_ = false;
+
+            /* a producer that pushed before "pending_" was cleared may not
+             * have signalled */
+            if (pushed_.load() && !pending_.exchange(true)) {
+                wakeup_.signal();
+            }
+        }
+
+        return numPopped;
+    }
+
+    void processBatches()
+    {
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point start;
+        if (maxBatchSeconds_ > 0) {
+            start = Clock::now();
+        }
+
+        for (;;) {
+            batch_.clear();
+            size_t numPopped = pop_front(batch_, maxBatchSize_);
+            if (numPopped == 0) {
+                return;
+            }
+            batchStats_.record(numPopped);
+            onBatch_(batch_);
+
+            if (maxBatchSeconds_ <= 0
+                || (std::chrono::duration<double>(Clock::now() - start)
+                    .count() >= maxBatchSeconds_)) {
+                break;
+            }
+        }
+
+        /* "pending_" is only cleared once the queue is empty, so producers
+         * won't signal us again: do it ourselves if we stopped early */
+        if (pending_) {
+            wakeup_.signal();
+        }
+    }
 };
 
 } // namespace Datacratic
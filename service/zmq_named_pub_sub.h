@@ -52,6 +52,7 @@ struct ZmqNamedPublisher: public MessageLoop {
                 //cerr << "popped message to publish" << endl;
                 publishEndpoint.sendMessage(std::move(message));
             };
+        publishQueue.setBatchLimits(256, 0.0005);
 
         // Called when there is a new subscription.
         // The first byte is 1 (subscription) or 0 (unsubscription).